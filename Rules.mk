@@ -27,6 +27,10 @@ else ifeq ($(logfile),y)
 FLAGS += -DLOGFILE=1
 endif
 
+ifeq ($(profile),y)
+FLAGS += -DPROFILE=1
+endif
+
 ifeq ($(quickdisk),y)
 FLAGS += -DQUICKDISK=1
 floppy=n
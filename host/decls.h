@@ -0,0 +1,54 @@
+/*
+ * decls.h
+ * 
+ * Host build: Pull in the firmware headers as inc/decls.h does, but with
+ * host versions of the core intrinsics and peripheral registers.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include "types.h"
+#include "stm32f10x_regs.h"
+#include "stm32f10x.h" /* host/stm32f10x.h */
+#include "intrinsics.h" /* host/intrinsics.h */
+
+#include "time.h"
+#include "../src/fatfs/ff.h"
+#include "util.h"
+#include "list.h"
+#include "cache.h"
+#include "da.h"
+#include "hxc.h"
+#include "cancellation.h"
+#include "spi.h"
+#include "timer.h"
+#include "profile.h"
+#include "thread.h"
+#include "dma_copy.h"
+#include "fs.h"
+#include "fs_async.h"
+#include "journal.h"
+#include "ring_io.h"
+#include "floppy.h"
+#include "volume.h"
+#include "config.h"
+
+#include "host.h"
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
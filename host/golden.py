@@ -0,0 +1,167 @@
+# golden.py
+#
+# Golden flux suite for the host build of the image handlers (host/ffsim).
+#
+# Reference images are built in host/img/. Each is swept through its handler
+# by ffsim: every track is read for a revolution, written back, and read
+# again. The per-track flux digests must match host/golden/<image>.txt, each
+# readback must match its read, and the written-back image file must be
+# unchanged. D-A volumes are read only. Time per track is reported.
+#
+#  python3 golden.py [--update] [image...]
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys,os,re,struct,random,shutil,subprocess,time,argparse
+
+HOST = os.path.dirname(os.path.abspath(__file__))
+SCRIPTS = os.path.join(HOST, "..", "scripts")
+IMG = os.path.join(HOST, "img")
+GOLDEN = os.path.join(HOST, "golden")
+IMG_CFG = os.path.join(GOLDEN, "IMG.CFG")
+
+# Reproducible image contents: seeded by image name.
+def data(name, size):
+  return random.Random(name).randbytes(size)
+
+def script(name, *args):
+  subprocess.run([sys.executable, os.path.join(SCRIPTS, name)]
+                 + list(args), check=True, stdout=subprocess.DEVNULL)
+
+def mk_raw(size):
+  def mk(path):
+    with open(path, "wb") as f:
+      f.write(data(os.path.basename(path), size))
+  return mk
+
+def mk_hfe(*args):
+  def mk(path):
+    script("mk_hfe.py", *args, path)
+  return mk
+
+def mk_hfx(path):
+  hfe = path + ".hfe"
+  script("mk_hfe.py", hfe)
+  script("hfe_to_hfx.py", hfe, path)
+  os.remove(hfe)
+
+def mk_qd(path):
+  script("mk_qd.py", path)
+
+# Extended DSK: CPC data format, 40 cylinders, 1 side, 9 x 512-byte sectors
+# with IDs 0xc1-0xc9. Checked by scripts/edsk.py, which parses every track.
+def mk_edsk(path):
+  cyls, secs, n = 40, 9, 2
+  trk_sz = 256 + secs * (128 << n)
+  dat = data(os.path.basename(path), cyls * secs * (128 << n))
+  out = struct.pack("<34s14sBBH", b"EXTENDED CPC DSK File\r\nDisk-Info\r\n",
+                    b"golden.py", cyls, 1, 0)
+  out += bytes([trk_sz // 256] * cyls)
+  out += bytes(256 - len(out))
+  for c in range(cyls):
+    tib = struct.pack("<12s4xBB2xBBBB", b"Track-Info\r\n", c, 0, n, secs,
+                      0x4e, 0xe5)
+    for s in range(secs):
+      tib += struct.pack("<BBBBBBH", c, 0, 0xc1 + s, n, 0, 0, 128 << n)
+    out += tib + bytes(256 - len(tib))
+    out += dat[c * secs * (128 << n):(c+1) * secs * (128 << n)]
+  with open(path, "wb") as f:
+    f.write(out)
+  subprocess.run([sys.executable, os.path.join(SCRIPTS, "edsk.py"), path],
+                 check=True, stdout=subprocess.DEVNULL)
+
+# (image, generator, ffsim binary, ffsim mode options)
+IMAGES = [
+  ("blank.hfe",               mk_hfe(),                 "ffsim",    []),
+  ("hd.hfe",                  mk_hfe("--rate", "500"),  "ffsim",    []),
+  ("blank.hfx",               mk_hfx,                   "ffsim",    []),
+  ("dd.adf",                  mk_raw(901120),           "ffsim",    []),
+  ("hd.adf",                  mk_raw(1802240),          "ffsim",    []),
+  ("dd.img",                  mk_raw(737280),           "ffsim",    []),
+  ("hd.img",                  mk_raw(1474560),          "ffsim",    []),
+  ("dd.st",                   mk_raw(737280),           "ffsim",    []),
+  ("sd.ssd",                  mk_raw(204800),           "ffsim",    []),
+  # IMG.CFG tags: See golden/IMG.CFG.
+  ("fm.fm40.img",             mk_raw(102400),           "ffsim",    []),
+  ("kaypro.kaypro-dsdd40.img", mk_raw(409600),          "ffsim",    []),
+  ("flex.flex.img",           mk_raw(733184),           "ffsim",    []),
+  ("cpc.dsk",                 mk_edsk,                  "ffsim",    []),
+  ("blank.qd",                mk_qd,                    "ffsim-qd", []),
+  ("volume.img",              mk_raw(262144),           "ffsim",    ["-a"]),
+]
+
+DIGEST = re.compile(r"^\d+\.\d ")
+
+# Seconds allowed for one image's sweep.
+TIMEOUT = 120
+
+def sweep(name, mk, ffsim, opts, update):
+  path = os.path.join(IMG, name)
+  if not os.path.exists(path):
+    mk(path)
+  write = "-a" not in opts
+  # The copy keeps the name's extension and IMG.CFG tag.
+  work = os.path.join(IMG, "work-" + name)
+  shutil.copyfile(path, work)
+  cmd = [os.path.join(HOST, ffsim), "-d", "-c", IMG_CFG] + opts
+  if write:
+    cmd.append("-w")
+  t = time.perf_counter()
+  try:
+    r = subprocess.run(cmd + [work], stdout=subprocess.PIPE, text=True,
+                       timeout=TIMEOUT)
+  except subprocess.TimeoutExpired as e:
+    r = subprocess.CompletedProcess(cmd, None, e.stdout or "")
+  t = time.perf_counter() - t
+  out = [l for l in r.stdout.splitlines() if DIGEST.match(l)]
+  errs = []
+  if r.returncode is None:
+    errs.append("ffsim timed out")
+  elif r.returncode != 0:
+    errs += [l for l in r.stdout.splitlines() if l.startswith("***")]
+    errs.append("ffsim exited %d" % r.returncode)
+  if write and not errs:
+    with open(path, "rb") as a, open(work, "rb") as b:
+      if a.read() != b.read():
+        errs.append("image changed by write-back")
+  os.remove(work)
+  golden = os.path.join(GOLDEN, name + ".txt")
+  if update and not errs:
+    with open(golden, "w") as f:
+      f.write("\n".join(out) + "\n")
+  elif not os.path.exists(golden):
+    errs.append("no golden file")
+  else:
+    with open(golden) as f:
+      ref = f.read().splitlines()
+    bad = [a.split()[0] for a, b in zip(out, ref) if a != b]
+    if len(out) != len(ref):
+      errs.append("%u tracks, golden has %u" % (len(out), len(ref)))
+    if bad:
+      errs.append("%u tracks differ from golden, first %s"
+                  % (len(bad), bad[0]))
+  nr = max(len(out), 1)
+  print("%-26s %4u tracks %8.1f us/track  %s"
+        % (name, len(out), t * 1e6 / nr, "; ".join(errs) or "OK"))
+  return not errs
+
+def main(argv):
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("--update", action="store_true",
+                      help="rewrite the golden files")
+  parser.add_argument("images", nargs="*", help="images to sweep (all)")
+  args = parser.parse_args(argv[1:])
+
+  os.makedirs(IMG, exist_ok=True)
+  ok = True
+  for (name, mk, ffsim, opts) in IMAGES:
+    if not args.images or name in args.images:
+      ok = sweep(name, mk, ffsim, opts, args.update) and ok
+  return 0 if ok else 1
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv))
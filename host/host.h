@@ -0,0 +1,52 @@
+/*
+ * host.h
+ *
+ * Host build: Services of the host OS, in host/os.c. That file is built
+ * without the firmware headers, whose libc prototypes and time_t differ from
+ * the host's, so this interface sticks to plain C types.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Monotonic time in nanoseconds, and the CPU cycle counter (TSC on x86,
+ * else nanoseconds). */
+uint64_t host_ns(void);
+uint64_t host_cycles(void);
+
+/* Memory below 4GB: The firmware casts pointers to uint32_t. */
+void *host_alloc_low(size_t sz);
+
+/* Files. host_open() returns a descriptor, or -1. Others return bytes
+ * transferred, or -1 on error. */
+int host_open(const char *path, int write);
+int host_close(int fd);
+int64_t host_filesize(int fd);
+int host_pread(int fd, void *buf, unsigned int n, uint64_t ofs);
+int host_pwrite(int fd, const void *buf, unsigned int n, uint64_t ofs);
+int host_ftruncate(int fd, uint64_t sz);
+
+/* Console output, and exit. */
+int host_printf(const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+int host_vprintf(const char *format, va_list ap)
+    __attribute__ ((format (printf, 1, 0)));
+void host_exit(int code) __attribute__((noreturn));
+
+/* host/sim.c */
+int sim_main(int argc, char **argv);
+
+/* host/stubs.c: Path of the IMG.CFG file offered to the handlers, if any. */
+extern const char *host_img_cfg;
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,135 @@
+/*
+ * os.c
+ *
+ * Host build: Services of the host OS. Built against the host's libc
+ * headers only: See host/host.h.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "host.h"
+
+uint64_t host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint64_t host_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return host_ns();
+#endif
+}
+
+void *host_alloc_low(size_t sz)
+{
+    void *p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if ((p == MAP_FAILED) || ((uintptr_t)p + sz > 0xffffffffu)) {
+        fprintf(stderr, "Cannot allocate %zu bytes below 4GB\n", sz);
+        exit(1);
+    }
+    return p;
+}
+
+int host_open(const char *path, int write)
+{
+    return open(path, write ? O_RDWR : O_RDONLY);
+}
+
+int host_close(int fd)
+{
+    return close(fd);
+}
+
+int64_t host_filesize(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) ? -1 : st.st_size;
+}
+
+int host_pread(int fd, void *buf, unsigned int n, uint64_t ofs)
+{
+    return pread(fd, buf, n, ofs);
+}
+
+int host_pwrite(int fd, const void *buf, unsigned int n, uint64_t ofs)
+{
+    return pwrite(fd, buf, n, ofs);
+}
+
+int host_ftruncate(int fd, uint64_t sz)
+{
+    return ftruncate(fd, sz);
+}
+
+int host_vprintf(const char *format, va_list ap)
+{
+    return vprintf(format, ap);
+}
+
+int host_printf(const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vprintf(format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+void host_illegal(const char *file, int line)
+{
+    fflush(stdout);
+    fprintf(stderr, "*** Illegal at %s:%d\n", file, line);
+    abort();
+}
+
+void host_exit(int code)
+{
+    fflush(stdout);
+    exit(code);
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    rc = sim_main(argc, argv);
+    fflush(stdout);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
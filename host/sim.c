@@ -0,0 +1,547 @@
+/*
+ * sim.c
+ *
+ * Host build: Sweep an image file through its handler, as the floppy
+ * emulation would, and report flux throughput and RAM use.
+ *
+ * Each track is read for one revolution: read_track() and rdata_flux() are
+ * called in turns, and the async I/O queue runs in between. With -w the
+ * revolution is then decoded back into bitcells, as by IRQ_wdata_dma(),
+ * written to the track, and read once more. The image file is modified!
+ * With -a the image is a volume, served by the D-A handler on its two
+ * cylinders.
+ *
+ * The firmware's clock follows the flux (see host/stubs.c). Costs are host
+ * CPU time, and host cycles (TSC) which do not model the Cortex-M3: They
+ * serve to compare one build of the flux paths with another.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Buffer profiles, as floppy_generic.c. */
+static const struct buf_profile {
+    uint8_t ram_kb;
+    bool_t async;
+    uint8_t write_bc_kb;
+    uint16_t rdata_len;
+    uint8_t nr_writes;
+} buf_profiles[] = {
+    { 64, FALSE, 32, 1024, 32 },
+    { 64, TRUE,   8, 2048,  8 },
+    {  0, FALSE,  8, 1024,  8 },
+    {  0, TRUE,   4, 1024,  8 },
+};
+#define WDATA_RING_LEN 1024
+
+/* SRAM below the arena: .data, .bss and stacks (scripts/stm32f10x.ld.S).
+ * An estimate: The host's 64-bit structures are larger than the target's. */
+#define RAM_STATIC_KB 12
+
+/* Calls without progress before a sweep is declared stalled. Each stalled
+ * call lets STALL_US of flux time pass. */
+#define STALL_MAX 100000
+#define STALL_US 10
+
+/* Flux within this time of the index is not digested: a handler's first
+ * clock bit after a track seek may follow stale buffer contents. */
+#define DIGEST_GUARD_US 64
+
+/* Flux samples captured per revolution, for write-back. */
+#define CAPTURE_MAX (1u << 20)
+
+#define ARENA_PAINT 0xa5
+
+void host_arena_setup(void *p, uint32_t sz);
+extern char *host_region_lo[ARENA_nr], *host_region_hi[ARENA_nr];
+void host_volume_open(const char *path);
+void host_path_to_slot(struct slot *slot, const char *path);
+extern time_t host_time;
+
+static const char *const region_name[ARENA_nr] = {
+    [ARENA_misc]    = "misc",
+    [ARENA_dma]     = "dma",
+    [ARENA_image]   = "image",
+    [ARENA_ring]    = "ring",
+    [ARENA_journal] = "journal",
+    [ARENA_buf]     = "buf",
+    [ARENA_dirents] = "dirents",
+    [ARENA_cache]   = "cache"
+};
+
+/* Host time and cycles spent in one of the image paths. */
+struct cost {
+    uint32_t calls;
+    uint64_t units, ns, cycles;
+};
+
+static struct {
+    const char *path;
+    bool_t write, digest, verbose, da;
+    char *arena;
+    uint32_t arena_sz;
+    const struct buf_profile *prof;
+    struct image *im;
+    uint16_t *rdata, *capture;
+    uint32_t nr_capture;
+    uint32_t time_rem;
+    struct cost read_track, rdata_flux, setup_track, write_track, wdata_dma;
+    uint32_t nr_tracks, nr_mismatch;
+} sim;
+
+/* Let @ticks (SYSCLK) of flux time pass. */
+static void flux_time(uint32_t ticks)
+{
+    sim.time_rem += ticks;
+    host_time += sim.time_rem / (SYSCLK_MHZ / TIME_MHZ);
+    sim.time_rem %= SYSCLK_MHZ / TIME_MHZ;
+}
+
+static uint64_t cost_start_ns, cost_start_cycles;
+
+static void cost_start(void)
+{
+    cost_start_ns = host_ns();
+    cost_start_cycles = host_cycles();
+}
+
+static void cost_end(struct cost *c, uint32_t units)
+{
+    c->cycles += host_cycles() - cost_start_cycles;
+    c->ns += host_ns() - cost_start_ns;
+    c->units += units;
+    c->calls++;
+}
+
+static void die(const char *msg, unsigned int track)
+{
+    host_printf("*** %s: track %u.%u: %s\n",
+                sim.path, track >> 1, track & 1, msg);
+    host_exit(1);
+}
+
+static const struct buf_profile *buf_profile_find(bool_t async)
+{
+    const struct buf_profile *p = buf_profiles;
+    while ((p->ram_kb > ram_kb) || (p->async != async))
+        p++;
+    return p;
+}
+
+/* Allocate buffers and open the image, as floppy_mount(). */
+static void mount(struct slot *slot)
+{
+    struct image *im;
+    uint16_t state_sz = image_state_size(slot);
+    bool_t async = FALSE, retry;
+
+    do {
+        retry = FALSE;
+        sim.prof = buf_profile_find(async);
+
+        arena_init();
+
+        arena_region(ARENA_dma);
+        sim.rdata = arena_alloc(sim.prof->rdata_len * sizeof(uint16_t));
+        (void)arena_alloc(WDATA_RING_LEN * sizeof(uint16_t));
+
+        arena_region(ARENA_image);
+        im = arena_alloc(image_size(state_sz));
+        memset(im, 0, image_size(state_sz));
+        im->state_sz = state_sz;
+
+        im->bufs.nr_writes = sim.prof->nr_writes;
+        im->bufs.write = arena_alloc(sim.prof->nr_writes
+                                     * sizeof(struct write));
+        im->write_bc_window = ~0;
+
+        arena_region(ARENA_ring);
+        im->bufs.write_bc.len = sim.prof->write_bc_kb * 1024;
+        im->bufs.write_bc.p = arena_alloc(im->bufs.write_bc.len);
+        im->bufs.read_bc.len = im->bufs.write_bc.len / 2;
+        im->bufs.read_bc.p = (char *)im->bufs.write_bc.p
+            + im->bufs.read_bc.len;
+
+        /* The journal is not built, but its memory is set aside as on the
+         * target, to leave the same staging buffer. */
+        arena_region(ARENA_journal);
+        if (ff_cfg.write_journal && (ram_kb >= 64))
+            (void)arena_alloc(JOURNAL_MEM_SZ);
+
+        arena_region(ARENA_buf);
+        im->bufs.write_data.len = arena_avail();
+        im->bufs.write_data.p = arena_alloc(im->bufs.write_data.len);
+        im->bufs.read_data = im->bufs.write_data;
+
+#if defined(QUICKDISK)
+        image_open(im, slot, NULL, FALSE);
+#else
+        if (!image_open(im, slot, NULL, sim.da)) {
+            state_sz = IMAGE_STATE_MAX;
+            retry = TRUE;
+            continue;
+        }
+#endif
+        if (async != im->disk_handler->async) {
+            async = im->disk_handler->async;
+            retry = TRUE;
+        }
+    } while (retry);
+
+    sim.im = im;
+}
+
+/* Feed @nr captured samples to the write bitcell buffer, as
+ * IRQ_wdata_dma(), stopping short of unconsumed bitcells. Returns the
+ * number of samples taken. */
+static uint32_t wdata_decode(struct image *im, const uint16_t *flux,
+                             uint32_t nr, uint16_t *p_prev)
+{
+    uint16_t prev = *p_prev, curr, next;
+    uint16_t cell = im->write_bc_ticks, window = cell + (cell >> 1);
+    uint32_t *bc_buf = im->bufs.write_bc.p;
+    uint32_t bc_dat = im->write_bc_window, bc_prod = im->bufs.write_bc.prod;
+    uint32_t bc_bufmask = (im->bufs.write_bc.len / 4) - 1;
+    uint32_t bc_space = im->bufs.write_bc.len * 8 - 1024;
+    unsigned int sync = im->sync, zeros, n, k;
+    uint32_t i;
+
+    for (i = 0; i < nr; i++) {
+        if ((bc_prod - im->bufs.write_bc.cons) >= bc_space)
+            break;
+        next = prev + flux[i] + 1;
+        curr = next - prev;
+        prev = next;
+        zeros = (curr > window) ? (curr - window - 1) / cell + 1 : 0;
+        for (n = zeros; n != 0; n -= k) {
+            k = min_t(unsigned int, n, 32 - (bc_prod & 31));
+            bc_dat = (k < 32) ? bc_dat << k : 0;
+            bc_prod += k;
+            if (!(bc_prod&31))
+                bc_buf[((bc_prod-1) / 32) & bc_bufmask] = htobe32(bc_dat);
+        }
+        bc_dat = (bc_dat << 1) | 1;
+        bc_prod++;
+        switch (sync) {
+        case SYNC_fm:
+            if ((zeros <= 1) && ((bc_dat & 0xffffd555) == 0x55555015))
+                bc_prod = (bc_prod - 31) | 31;
+            break;
+        case SYNC_mfm:
+            if ((zeros == 2) && (bc_dat == 0x44894489))
+                bc_prod &= ~31;
+            break;
+        }
+        if (!(bc_prod&31))
+            bc_buf[((bc_prod-1) / 32) & bc_bufmask] = htobe32(bc_dat);
+    }
+
+    if (bc_prod & 31)
+        bc_buf[(bc_prod / 32) & bc_bufmask] = htobe32(bc_dat << (-bc_prod&31));
+
+    im->write_bc_window = bc_dat;
+    im->bufs.write_bc.prod = bc_prod;
+    *p_prev = prev;
+
+    return i;
+}
+
+/* Read one revolution of @track. Returns its digest. */
+static uint32_t read_rev(uint16_t track, bool_t capture)
+{
+    struct image *im = sim.im;
+    uint32_t pos = 0, rev, ticks = 0, nr_ticks, hash = 2166136261u;
+    uint16_t *tbuf = sim.rdata, nr;
+    unsigned int i, stall = 0;
+
+    cost_start();
+    image_setup_track(im, track, &pos);
+    cost_end(&sim.setup_track, 0);
+
+    rev = im->stk_per_rev * (SYSCLK_MHZ / STK_MHZ);
+    sim.nr_capture = 0;
+
+    while (ticks < rev) {
+        thread_yield();
+        cost_start();
+        image_read_track(im);
+        cost_end(&sim.read_track, 0);
+        cost_start();
+        nr = image_rdata_flux(im, tbuf, sim.prof->rdata_len);
+        cost_end(&sim.rdata_flux, nr);
+        if (nr == 0) {
+            if (++stall >= STALL_MAX)
+                die("read stalled", track);
+            flux_time(sysclk_us(STALL_US));
+            continue;
+        }
+        stall = 0;
+        for (i = nr_ticks = 0; i < nr; i++)
+            nr_ticks += tbuf[i] + 1;
+        flux_time(nr_ticks);
+        for (i = 0; (i < nr) && (ticks < rev); i++) {
+            if (ticks >= sysclk_us(DIGEST_GUARD_US))
+                hash = (hash ^ tbuf[i]) * 16777619u;
+            ticks += tbuf[i] + 1;
+            if (capture && (sim.nr_capture < CAPTURE_MAX))
+                sim.capture[sim.nr_capture++] = tbuf[i];
+        }
+    }
+
+    return hash;
+}
+
+/* Write the captured revolution to @track from the index, as
+ * dma_wr_handle(). */
+static void write_rev(uint16_t track)
+{
+    struct image *im = sim.im;
+    struct write *write = get_write(im, im->wr_prod);
+    uint32_t i = 0, n, nr_ticks;
+    uint16_t prev = 0;
+    unsigned int stall = 0;
+
+    write->start = 0;
+    write->track = track;
+
+    cost_start();
+    image_setup_track(im, track, NULL);
+    cost_end(&sim.setup_track, 0);
+
+    for (;;) {
+        cost_start();
+        n = wdata_decode(im, &sim.capture[i], sim.nr_capture - i, &prev);
+        cost_end(&sim.wdata_dma, n);
+        for (nr_ticks = 0; n != 0; n--)
+            nr_ticks += sim.capture[i++] + 1;
+        flux_time(nr_ticks);
+        if (i == sim.nr_capture)
+            break;
+        cost_start();
+        image_write_track(im);
+        cost_end(&sim.write_track, 0);
+        thread_yield();
+        if (nr_ticks != 0)
+            stall = 0;
+        else if (++stall >= STALL_MAX)
+            die("write stalled", track);
+        else
+            flux_time(sysclk_us(STALL_US));
+    }
+
+    /* End of write: wdata_stop(), then the tail of IRQ_wdata_dma(). */
+    im->wr_prod++;
+    write->bc_end = im->bufs.write_bc.prod;
+    im->wr_bc++;
+    im->bufs.write_bc.prod = (im->bufs.write_bc.prod + 31) & ~31;
+    im->write_bc_window = ~0;
+
+    for (stall = 0; ; stall++) {
+        bool_t done;
+        cost_start();
+        done = image_write_track(im);
+        cost_end(&sim.write_track, 0);
+        if (done)
+            break;
+        thread_yield();
+        if (stall >= STALL_MAX)
+            die("write flush stalled", track);
+        flux_time(sysclk_us(STALL_US));
+    }
+
+    im->bufs.write_data.cons = 0;
+    im->bufs.write_data.prod = 0;
+    im->bufs.write_bc.cons = (write->bc_end + 31) & ~31;
+    if (!im->track_handler->async)
+        F_sync(&im->fp);
+    im->wr_cons++;
+    im->bufs.write_bc.cons = im->bufs.write_bc.prod = 0;
+}
+
+static void sweep_track(uint16_t track)
+{
+    uint32_t hash, rb_hash = 0;
+    uint32_t nr = 0;
+
+    hash = read_rev(track, sim.write);
+    if (sim.write) {
+        nr = sim.nr_capture;
+        write_rev(track);
+        rb_hash = read_rev(track, FALSE);
+        if (rb_hash != hash)
+            sim.nr_mismatch++;
+    }
+
+    if (sim.digest) {
+        if (sim.write)
+            host_printf("%u.%u %08x %08x%s\n", track >> 1, track & 1,
+                        hash, rb_hash, (rb_hash != hash) ? " MISMATCH" : "");
+        else
+            host_printf("%u.%u %08x\n", track >> 1, track & 1, hash);
+    } else if (sim.verbose) {
+        host_printf("%u.%u: %08x", track >> 1, track & 1, hash);
+        if (sim.write)
+            host_printf(" readback %08x (%u samples)%s", rb_hash, nr,
+                        (rb_hash != hash) ? " MISMATCH" : "");
+        host_printf("\n");
+    }
+
+    sim.nr_tracks++;
+}
+
+static void print_cost(const char *name, const struct cost *c,
+                       const char *unit)
+{
+    if (c->calls == 0)
+        return;
+    host_printf("  %-12s %8u calls %8.1f us/call", name, c->calls,
+                (double)c->ns / 1000 / c->calls);
+    if (c->units != 0)
+        host_printf("  %10llu %ss %6.2f cycles/%s %7.2f M%ss/s",
+                    (unsigned long long)c->units, unit,
+                    (double)c->cycles / c->units, unit,
+                    (double)c->units * 1000 / c->ns, unit);
+    host_printf("\n");
+}
+
+/* Highest byte of each arena region changed from the paint. */
+static void print_ram(void)
+{
+    unsigned int r;
+    uint32_t hw = 0;
+    char *p;
+
+    host_printf("RAM: %u kB board, arena %u bytes\n", ram_kb, sim.arena_sz);
+    for (r = 0; r < ARENA_nr; r++) {
+        if (host_region_lo[r] == NULL)
+            continue;
+        for (p = host_region_hi[r]; p > host_region_lo[r]; p--)
+            if (p[-1] != (char)ARENA_PAINT)
+                break;
+        host_printf("  %-8s %6u bytes, high-water %6u\n", region_name[r],
+                    (uint32_t)(host_region_hi[r] - host_region_lo[r]),
+                    (uint32_t)(p - host_region_lo[r]));
+        hw = max_t(uint32_t, hw, p - sim.arena);
+    }
+    host_printf("  high-water %u bytes\n", hw);
+}
+
+static void usage(void)
+{
+    host_printf("usage: ffsim [options] <image>\n"
+#if !defined(QUICKDISK)
+                "  -a         D-A mode: the image is the volume (read only)\n"
+#endif
+                "  -c <file>  IMG.CFG file\n"
+                "  -m <kB>    board RAM (default 64)\n"
+                "  -d         print only per-track flux digests\n"
+                "  -v         print per-track digests with the report\n"
+                "  -w         write each track back, then read it again "
+                "(modifies the image)\n");
+    host_exit(1);
+}
+
+int sim_main(int argc, char **argv)
+{
+    static struct slot slot;
+    uint16_t track;
+    uint64_t t;
+    int i;
+
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        switch (argv[i][1]) {
+#if !defined(QUICKDISK)
+        case 'a':
+            sim.da = TRUE;
+            break;
+#endif
+        case 'c':
+            if (++i == argc)
+                usage();
+            host_img_cfg = argv[i];
+            break;
+        case 'm':
+            if (++i == argc)
+                usage();
+            ram_kb = strtol(argv[i], NULL, 10);
+            break;
+        case 'd':
+            sim.digest = TRUE;
+            break;
+        case 'v':
+            sim.verbose = TRUE;
+            break;
+        case 'w':
+            sim.write = TRUE;
+            break;
+        default:
+            usage();
+        }
+    }
+    if ((i != argc - 1) || (ram_kb <= RAM_STATIC_KB)
+        || (sim.da && sim.write))
+        usage();
+    sim.path = argv[i];
+
+    ff_cfg = dfl_ff_cfg;
+
+    host_path_to_slot(&slot, sim.path);
+
+    sim.arena_sz = (ram_kb - RAM_STATIC_KB) * 1024;
+    sim.arena = host_alloc_low(sim.arena_sz);
+    memset(sim.arena, ARENA_PAINT, sim.arena_sz);
+    host_arena_setup(sim.arena, sim.arena_sz);
+    sim.capture = host_alloc_low(CAPTURE_MAX * sizeof(uint16_t));
+
+    if (sim.da)
+        host_volume_open(sim.path);
+    mount(&slot);
+
+    t = host_ns();
+    if (sim.da) {
+        sweep_track(DA_SD_FM_CYL * 2);
+        sweep_track(DA_DD_MFM_CYL * 2);
+    } else {
+        for (track = 0; track < sim.im->nr_cyls * 2; track++)
+            if ((track & 1) < sim.im->nr_sides)
+                sweep_track(track);
+    }
+    image_sync(sim.im);
+    thread_yield();
+    t = host_ns() - t;
+
+    if (sim.digest)
+        return sim.nr_mismatch ? 1 : 0;
+
+    if (sim.da)
+        host_printf("%s: D-A", sim.path);
+    else
+        host_printf("%s: %u cyls, %u sides", sim.path,
+                    sim.im->nr_cyls, sim.im->nr_sides);
+    host_printf(", %s, %u tracks in %llu ms\n",
+                sim.im->disk_handler->async ? "async" : "sync",
+                sim.nr_tracks, (unsigned long long)(t / 1000000));
+    print_cost("setup_track", &sim.setup_track, NULL);
+    print_cost("read_track", &sim.read_track, NULL);
+    print_cost("rdata_flux", &sim.rdata_flux, "sample");
+    print_cost("wdata_dma", &sim.wdata_dma, "sample");
+    print_cost("write_track", &sim.write_track, NULL);
+    if (sim.write)
+        host_printf("  readback: %u/%u tracks match\n",
+                    sim.nr_tracks - sim.nr_mismatch, sim.nr_tracks);
+    print_ram();
+
+    return sim.nr_mismatch ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,78 @@
+/*
+ * stm32f10x.h
+ * 
+ * Host build: Core and peripheral registers. Those which the image handlers
+ * touch are backed by plain memory, defined in host/stubs.c.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* C pointer types */
+#define STK volatile struct stk * const
+#define DCB volatile struct dcb * const
+#define DWT volatile struct dwt * const
+#define NVIC volatile struct nvic * const
+#define CRC volatile struct crc * const
+#define GPIO volatile struct gpio * const
+#define SPI volatile struct spi * const
+
+/* C-accessible registers. */
+extern struct stk host_stk;
+extern struct dcb host_dcb;
+extern struct dwt host_dwt;
+extern struct nvic host_nvic;
+extern struct crc host_crc;
+static STK stk = &host_stk;
+static DCB dcb = &host_dcb;
+static DWT dwt = &host_dwt;
+static NVIC nvic = &host_nvic;
+static CRC crc_unit = &host_crc;
+
+/* System */
+extern bool_t is_artery_mcu;
+
+/* Clocks */
+#define SYSCLK_MHZ 72
+#define SYSCLK     (SYSCLK_MHZ * 1000000)
+#define sysclk_ns(x) (((x) * SYSCLK_MHZ) / 1000)
+#define sysclk_us(x) ((x) * SYSCLK_MHZ)
+#define sysclk_ms(x) ((x) * SYSCLK_MHZ * 1000)
+#define sysclk_stk(x) ((x) * (SYSCLK_MHZ / STK_MHZ))
+
+/* SysTick Timer */
+#define STK_MHZ    (SYSCLK_MHZ / 8)
+void delay_ticks(unsigned int ticks);
+void delay_ns(unsigned int ns);
+void delay_us(unsigned int us);
+void delay_ms(unsigned int ms);
+
+#define stk_us(x) ((x) * STK_MHZ)
+#define stk_ms(x) stk_us((x) * 1000)
+#define stk_sysclk(x) ((x) / (SYSCLK_MHZ / STK_MHZ))
+
+/* NVIC: There are no interrupts. Pending state is recorded, and ignored. */
+#define IRQx_enable(x) (nvic->iser[(x)>>5] = 1u<<((x)&31))
+#define IRQx_disable(x) (nvic->icer[(x)>>5] = 1u<<((x)&31))
+#define IRQx_is_enabled(x) ((nvic->iser[(x)>>5]>>((x)&31))&1)
+#define IRQx_set_pending(x) (nvic->ispr[(x)>>5] = 1u<<((x)&31))
+#define IRQx_clear_pending(x) (nvic->icpr[(x)>>5] = 1u<<((x)&31))
+#define IRQx_is_pending(x) ((nvic->ispr[(x)>>5]>>((x)&31))&1)
+#define IRQx_set_prio(x,y) (nvic->ipr[x] = (y) << 4)
+#define IRQx_get_prio(x) (nvic->ipr[x] >> 4)
+
+#define FLASH_PAGE_SIZE 2048
+extern unsigned int flash_page_size;
+extern unsigned int ram_kb;
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
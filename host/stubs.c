@@ -0,0 +1,535 @@
+/*
+ * stubs.c
+ *
+ * Host build: The firmware services which the image handlers call, backed
+ * by host files. There is one thread and there are no interrupts: A thread
+ * which would block on I/O instead runs the async queue to completion.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include "../src/fatfs/diskio.h"
+
+/* Peripheral registers, as plain memory. */
+struct stk host_stk;
+struct dcb host_dcb;
+struct dwt host_dwt;
+struct nvic host_nvic;
+struct crc host_crc;
+
+bool_t is_artery_mcu;
+unsigned int flash_page_size = FLASH_PAGE_SIZE;
+unsigned int ram_kb = 64;
+uint8_t display_type = DT_NONE;
+const char fw_ver[] = FW_VER;
+
+struct ff_cfg ff_cfg;
+const struct ff_cfg dfl_ff_cfg = {
+    .version = FFCFG_VERSION,
+    .size = sizeof(struct ff_cfg),
+#define x(n,o,v) .o = v,
+#include "ff_cfg_defaults.h"
+#undef x
+};
+
+const char *host_img_cfg;
+
+/*
+ * Time and threads
+ */
+
+/* Time is flux time: host/sim.c advances the clock as flux is read and
+ * written, and I/O takes none. So runs are repeatable. */
+time_t host_time;
+
+time_t time_now(void)
+{
+    return host_time;
+}
+
+/* The I/O thread runs whenever another thread would yield or wait. */
+static void io_thread(void)
+{
+    static bool_t running;
+    if (running)
+        return;
+    running = TRUE;
+    F_async_drain();
+    running = FALSE;
+}
+
+void thread_yield(void)
+{
+    io_thread();
+}
+
+void thread_wait(struct waitq *wq)
+{
+    io_thread();
+}
+
+void thread_wake_all(struct waitq *wq)
+{
+}
+
+/*
+ * Console
+ */
+
+#if !defined(NDEBUG) || defined(LOGFILE)
+int vprintk(const char *format, va_list ap)
+{
+    return host_vprintf(format, ap);
+}
+
+int printk(const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vprintk(format, ap);
+    va_end(ap);
+
+    return n;
+}
+#endif
+
+void lcd_write(int col, int row, int min, const char *str)
+{
+}
+
+bool_t led_7seg_write_string(const char *p)
+{
+    return TRUE;
+}
+
+int led_7seg_nr_digits(void)
+{
+    return 3;
+}
+
+/*
+ * Arena: One block of memory below 4GB, accounted to regions as in
+ * src/arena.c. Each region's extent is recorded for host/sim.c's RAM report.
+ */
+
+static char *heap_bot, *heap_p, *heap_top;
+static uint8_t region;
+static uint32_t region_sz[ARENA_nr];
+char *host_region_lo[ARENA_nr], *host_region_hi[ARENA_nr];
+
+void host_arena_setup(void *p, uint32_t sz)
+{
+    heap_bot = p;
+    heap_top = heap_bot + sz;
+}
+
+void *arena_alloc(uint32_t sz)
+{
+    void *p = heap_p;
+    sz = (sz + 3) & ~3;
+    heap_p += sz;
+    if (heap_p > heap_top) {
+        host_printf("*** Arena overflow: %u bytes\n", arena_total());
+        host_exit(1);
+    }
+    region_sz[region] += sz;
+    if (!host_region_lo[region])
+        host_region_lo[region] = p;
+    host_region_hi[region] = heap_p;
+    return p;
+}
+
+void arena_region(unsigned int r)
+{
+    region = r;
+}
+
+void arena_note(unsigned int r, uint32_t sz)
+{
+    region_sz[r] = sz;
+}
+
+void *arena_mark(void)
+{
+    return heap_p;
+}
+
+void arena_release(void *mark)
+{
+    region_sz[region] -= heap_p - (char *)mark;
+    heap_p = mark;
+}
+
+void arena_report(void)
+{
+}
+
+uint32_t arena_total(void)
+{
+    return heap_top - heap_bot;
+}
+
+uint32_t arena_avail(void)
+{
+    return heap_top - heap_p;
+}
+
+void arena_init(void)
+{
+    heap_p = heap_bot;
+    region = ARENA_misc;
+    memset(region_sz, 0, sizeof(region_sz));
+    memset(host_region_lo, 0, sizeof(host_region_lo));
+    memset(host_region_hi, 0, sizeof(host_region_hi));
+}
+
+/*
+ * FatFS: A FIL is a host file. The descriptor is kept in obj.id, and no
+ * cluster table is ever built, so all I/O goes through F_read/F_write.
+ */
+
+static FATFS host_fs;
+
+static FRESULT host_fopen(FIL *fp, const char *path, BYTE mode)
+{
+    int fd = host_open(path, !!(mode & FA_WRITE));
+    int64_t sz;
+
+    memset(fp, 0, sizeof(*fp));
+    if (fd < 0)
+        return FR_NO_FILE;
+    sz = host_filesize(fd);
+    fp->obj.fs = &host_fs;
+    fp->obj.id = fd;
+    fp->obj.sclust = sz ? 2 : 0;
+    fp->obj.objsize = sz;
+    fp->flag = mode;
+    return FR_OK;
+}
+
+/* As fatfs_to_slot() in src/main.c: The name loses its extension, which
+ * becomes the type. The handlers find any IMG.CFG tag in what remains. */
+void host_path_to_slot(struct slot *slot, const char *path)
+{
+    char *dot;
+    unsigned int i;
+
+    memset(slot, 0, sizeof(*slot));
+    snprintf(slot->name, sizeof(slot->name), "%s", path);
+    if ((dot = strrchr(slot->name, '.')) != NULL) {
+        snprintf(slot->type, sizeof(slot->type), "%s", dot+1);
+        for (i = 0; i < sizeof(slot->type); i++)
+            slot->type[i] = tolower(slot->type[i]);
+        *dot = '\0';
+    }
+}
+
+/* The type is lower case, and the host's names are not case insensitive as
+ * FAT's are: Try the extension in either case. */
+void fatfs_from_slot(FIL *file, const struct slot *slot, BYTE mode)
+{
+    char path[sizeof(slot->name) + sizeof(slot->type) + 2], *p;
+    FRESULT fr;
+
+    snprintf(path, sizeof(path), "%s%s%.*s", slot->name,
+             slot->type[0] ? "." : "", (int)sizeof(slot->type), slot->type);
+    fr = host_fopen(file, path, mode);
+    if (fr && slot->type[0]) {
+        for (p = path + strlen(slot->name) + 1; *p; p++)
+            *p = toupper(*p);
+        fr = host_fopen(file, path, mode);
+    }
+    if (fr)
+        F_die(fr);
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode)
+{
+    return host_fopen(fp, path, mode);
+}
+
+FRESULT f_close(FIL *fp)
+{
+    host_close(fp->obj.id);
+    fp->obj.fs = NULL;
+    return FR_OK;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br)
+{
+    int n = host_pread(fp->obj.id, buff, btr, fp->fptr);
+    if (n < 0)
+        return FR_DISK_ERR;
+    fp->fptr += n;
+    if (br)
+        *br = n;
+    return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw)
+{
+    int n;
+    if (!(fp->flag & FA_WRITE))
+        return FR_DENIED;
+    n = host_pwrite(fp->obj.id, buff, btw, fp->fptr);
+    if (n < 0)
+        return FR_DISK_ERR;
+    fp->fptr += n;
+    fp->obj.objsize = max_t(FSIZE_t, fp->obj.objsize, fp->fptr);
+    if (bw)
+        *bw = n;
+    return FR_OK;
+}
+
+/* As FatFS: Seeking beyond the end of a writable file extends it. */
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs)
+{
+    if (ofs > fp->obj.objsize) {
+        if (!(fp->flag & FA_WRITE))
+            ofs = fp->obj.objsize;
+        else if (host_ftruncate(fp->obj.id, ofs))
+            return FR_DISK_ERR;
+        else
+            fp->obj.objsize = ofs;
+    }
+    fp->fptr = ofs;
+    return FR_OK;
+}
+
+FRESULT f_expand(FIL *fp, FSIZE_t fsz, BYTE opt)
+{
+    if (!(fp->flag & FA_WRITE))
+        return FR_DENIED;
+    if (host_ftruncate(fp->obj.id, fsz))
+        return FR_DISK_ERR;
+    fp->obj.objsize = fsz;
+    return FR_OK;
+}
+
+FRESULT f_unlink(const TCHAR *path)
+{
+    return FR_DENIED;
+}
+
+FRESULT flashfloppy_count_free(FATFS *fs, UINT nr_secs)
+{
+    return FR_OK;
+}
+
+void F_die(FRESULT fr)
+{
+    host_printf("*** FatFS error %d\n", fr);
+    host_exit(2);
+}
+
+void F_close(FIL *fp)
+{
+    (void)f_close(fp);
+}
+
+/* As src/fs.c: A short read without @br is padded with zeroes. */
+void F_read(FIL *fp, void *buff, UINT btr, UINT *br)
+{
+    UINT _br = 0;
+    FRESULT fr = f_read(fp, buff, btr, &_br);
+    if (br != NULL)
+        *br = _br;
+    else if (_br < btr)
+        memset((char *)buff + _br, 0, btr - _br);
+    if (fr)
+        F_die(fr);
+}
+
+void F_write(FIL *fp, const void *buff, UINT btw, UINT *bw)
+{
+    FRESULT fr = f_write(fp, buff, btw, bw);
+    if (fr)
+        F_die(fr);
+}
+
+void F_sync(FIL *fp)
+{
+}
+
+void F_lseek(FIL *fp, FSIZE_t ofs)
+{
+    FRESULT fr = f_lseek(fp, ofs);
+    if (fr)
+        F_die(fr);
+}
+
+/* No volume lies beneath the files, except in D-A mode (host/sim.c -a),
+ * where one host file is the volume. It is read only. */
+static int volume_fd = -1;
+
+void host_volume_open(const char *path)
+{
+    int64_t sz;
+
+    if ((volume_fd = host_open(path, FALSE)) < 0)
+        F_die(FR_NO_FILE);
+    sz = host_filesize(volume_fd);
+    host_fs.csize = 1;
+    host_fs.database = 0;
+    host_fs.n_fatent = sz / 512 + 2;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+{
+    if (volume_fd < 0)
+        return RES_PARERR;
+    if (host_pread(volume_fd, buff, count * 512, (uint64_t)sector * 512)
+        != count * 512)
+        return RES_ERROR;
+    return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+{
+    return (volume_fd < 0) ? RES_PARERR : RES_WRPRT;
+}
+
+/* Host writes are already in the file: A sync has nothing to do. */
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    return (cmd == CTRL_SYNC) ? RES_OK : RES_PARERR;
+}
+
+bool_t volume_readonly(void)
+{
+    return FALSE;
+}
+
+void volume_cache_init(void *start, void *end)
+{
+}
+
+void volume_cache_destroy(void)
+{
+}
+
+void cache_get_stats(struct cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+/* No write journal: Writes go straight to the image file. */
+bool_t journal_write_async(FIL *fp, FSIZE_t ofs, const void *buf,
+                           unsigned int nr, FOP *fop)
+{
+    return FALSE;
+}
+
+bool_t journal_read_async(FIL *fp, FSIZE_t ofs, void *buf,
+                          unsigned int *nr, FOP *fop)
+{
+    return FALSE;
+}
+
+void journal_replay(void)
+{
+}
+
+/*
+ * Mass-storage slots and IMG.CFG
+ */
+
+bool_t get_img_cfg(struct slot *slot)
+{
+    if (host_img_cfg == NULL)
+        return FALSE;
+    host_path_to_slot(slot, host_img_cfg);
+    return TRUE;
+}
+
+bool_t get_img_cfg_index(struct slot *slot)
+{
+    return FALSE;
+}
+
+uint16_t get_slot_nr(void)
+{
+    return 0;
+}
+
+bool_t set_slot_nr(uint16_t slot_nr)
+{
+    return FALSE;
+}
+
+void set_slot_name(const char *name)
+{
+}
+
+void floppy_set_cyl(uint8_t unit, uint8_t cyl)
+{
+}
+
+void floppy_get_flux_stats(struct flux_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+/*
+ * DMA copies are plain copies, complete at once.
+ */
+
+void dma_copy_start(void *dest, const void *src, size_t n)
+{
+    memcpy(dest, src, n);
+}
+
+void dma_copy_to_reg(volatile uint32_t *reg, const void *src, size_t n)
+{
+    const uint32_t *p = src;
+    for (n /= 4; n != 0; n--)
+        *reg = *p++;
+}
+
+bool_t dma_copy_busy(void)
+{
+    return FALSE;
+}
+
+void dma_copy_wait(void)
+{
+}
+
+/*
+ * Library routines not in the host's libc.
+ */
+
+void memcpy_fast(void *dest, const void *src, size_t n)
+{
+    memcpy(dest, src, n);
+}
+
+void memset_fast(void *s, int c, size_t n)
+{
+    memset(s, c, n);
+}
+
+int strcmp_ci(const char *s1, const char *s2)
+{
+    char c1, c2;
+    do {
+        c1 = tolower(*s1++);
+        c2 = tolower(*s2++);
+    } while (c1 && (c1 == c2));
+    return c1 - c2;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
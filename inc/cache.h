@@ -24,12 +24,44 @@ void cache_update(struct cache *c, uint32_t id, const void *dat);
 void cache_update_N(struct cache *c, uint32_t id,
                     const void *dat, unsigned int N);
 
+/* Insert @N items (@id..@id+@N-1) freshly read from storage into @dat. Dirty
+ * items are not overwritten: instead their cached data is copied into @dat. */
+void cache_fill_N(struct cache *c, uint32_t id, void *dat, unsigned int N);
+
+/* Update item @id with data @dat, and mark it dirty until written back by
+ * cache_writeback(). Returns FALSE, without updating, if too many items are
+ * already dirty. */
+#define CACHE_MAX_DIRTY 8
+bool_t cache_write(struct cache *c, uint32_t id, const void *dat);
+
+/* Pass each dirty item to @write, in the order the items were last modified.
+ * Stops at the first failed write. Returns TRUE if no item remains dirty. */
+bool_t cache_writeback(struct cache *c,
+                       bool_t (*write)(uint32_t id, const void *dat));
+
+/* Copy up to @N clean items into @id[] and @dat, most recently used first:
+ * protected items, then probationary. Returns the number of items copied. */
+unsigned int cache_export(struct cache *c, uint32_t *id,
+                          void *dat, unsigned int N);
+
+/* Counters since the most recent cache_init(). Remain valid after the cache
+ * memory is reused. */
+struct cache_stats {
+    uint32_t hits, misses;
+    uint32_t evictions; /* In-use items replaced by a new item */
+};
+void cache_get_stats(struct cache_stats *stats);
+
 #else
 
 #define cache_init(a,b,c) NULL
 #define cache_lookup(a,b) NULL
 #define cache_update(a,b,c) ((void)0)
 #define cache_update_N(a,b,c,d) ((void)0)
+#define cache_fill_N(a,b,c,d) ((void)0)
+#define cache_write(a,b,c) FALSE
+#define cache_writeback(a,b) ((void)(b), TRUE)
+#define cache_export(a,b,c,d) 0
 
 #endif
 
@@ -18,6 +18,7 @@ struct opts {
     const struct opt *opts;
     char *arg;
     int argmax;
+    FSIZE_t ofs; /* File offset of the option or section last returned */
 };
 
 int get_next_opt(struct opts *opts);
@@ -162,15 +163,32 @@ struct packed ff_cfg {
 #define WDRAIN_realtime 1
 #define WDRAIN_eot      2
     uint8_t write_drain;
+    bool_t track_cache;
+    uint8_t read_ahead;
+    bool_t metadata_write_back;
+    bool_t write_journal;
+    uint16_t image_sync_ms;
+    uint8_t read_batch_ms;
 };
 
 extern struct ff_cfg ff_cfg;
 extern const struct ff_cfg dfl_ff_cfg;
 
-void flash_ff_cfg_update(void *scratch);
+/* Identifies the FF.CFG file from which a configuration was parsed. */
+struct ff_cfg_src {
+    uint32_t clust, size, mtime;
+    uint8_t flags; /* Defined by the parser */
+    uint8_t _pad[3];
+};
+
+void flash_ff_cfg_update(void *scratch, const struct ff_cfg_src *src);
 void flash_ff_cfg_erase(void);
 void flash_ff_cfg_read(void);
 
+/* Is ff_cfg as Flashed, and parsed from FF.CFG file @src? If so, returns TRUE
+ * and fills in @src->flags. */
+bool_t flash_ff_cfg_src_match(struct ff_cfg_src *src);
+
 /*
  * Local variables:
  * mode: C
@@ -29,6 +29,48 @@ struct packed da_status_sector {
     uint8_t SD_CD;
     uint8_t nr_sec;
     uint16_t current_index;
+    /* Recent average rate of writes to mass storage, in kB/s. */
+    uint16_t write_kb_per_sec;
+};
+
+/* Direct-Access Mode: Telemetry block, at DA_TELEMETRY_OFF in the status
+ * sector, for host tools to monitor drive health. Little endian. Check sig
+ * and ver: later versions only ever append fields, and @len bytes are valid.
+ * Counts are since the image was mounted; times are in microseconds. */
+#define DA_TELEMETRY_OFF 64
+#define DA_TELEMETRY_SIG 0x4d54 /* "TM" */
+#define DA_TELEMETRY_VER 1
+struct packed da_telemetry {
+    uint16_t sig;
+    uint8_t ver;
+    uint8_t len; /* Bytes, including this header */
+    /* Flux generation: See struct flux_stats. */
+    uint32_t underruns;
+    uint32_t index_skips;
+    uint32_t late_index;
+    uint32_t missed_writes;
+    uint16_t max_writes;
+    uint16_t rsvd;
+    /* Prefetch latency histogram: Buckets bounded above by 1, 2, 5, 10, 20,
+     * 50 and 100ms, then anything slower. */
+    uint32_t prefetch[8];
+    /* Async I/O queue: Peak depth, reordered ops, and longest queued time
+     * of reads and of deferred (write/sync) ops. */
+    uint16_t async_max_depth;
+    uint16_t async_overtakes;
+    uint32_t async_max_wait_us[2];
+    /* Volume sector cache. */
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+    uint32_t cache_evictions;
+    /* Direct-access writes to mass storage: Longest write and flush. */
+    uint32_t write_max_us;
+    uint32_t sync_max_us;
+    /* IRQ handler cycles: RDATA DMA, WDATA DMA and timer. Calls, then
+     * min/avg/max cycles per call. Only in profile=y builds, else zero. */
+    struct packed {
+        uint32_t nr, min, avg, max;
+    } isr[3];
 };
 
 /* Direct-Access Mode: Sent to us in sector 0 of direct-access track. */
@@ -30,9 +30,12 @@
 #include "cancellation.h"
 #include "spi.h"
 #include "timer.h"
+#include "profile.h"
 #include "thread.h"
+#include "dma_copy.h"
 #include "fs.h"
 #include "fs_async.h"
+#include "journal.h"
 #include "ring_io.h"
 #include "floppy.h"
 #include "volume.h"
@@ -0,0 +1,41 @@
+/*
+ * dma_copy.h
+ * 
+ * Background memory-to-memory copies on a spare DMA channel.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Largest copy the channel can make in one go. */
+#define DMA_COPY_MAX (0xffffu * 4)
+
+void dma_copy_init(void);
+
+/* Start copying @n bytes from @src to @dest in the background. Pointers must
+ * be word aligned, and @n a non-zero multiple of 4 up to DMA_COPY_MAX. Only
+ * one copy is in flight at a time: the previous must have completed. */
+void dma_copy_start(void *dest, const void *src, size_t n);
+
+/* As dma_copy_start(), but write every word to the register at @reg (eg. a
+ * peripheral data register) rather than to successive addresses. */
+void dma_copy_to_reg(volatile uint32_t *reg, const void *src, size_t n);
+
+/* Is a copy still in flight? */
+bool_t dma_copy_busy(void);
+
+/* Block the calling thread until the copy in flight, if any, completes.
+ * Other threads run meanwhile. */
+void dma_copy_wait(void);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
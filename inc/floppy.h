@@ -39,6 +39,14 @@ struct image_buf {
     uint32_t prod, cons;
 };
 
+/* A write, from WGATE assertion until it is written out by the handler. */
+struct write {
+    uint32_t start; /* Ticks past index when current write started */
+    uint32_t bc_end; /* Final bitcell buffer index */
+    uint16_t dma_end; /* Final DMA buffer index */
+    uint16_t track; /* Track written to */
+};
+
 struct image_bufs {
     /* Buffering for bitcells being written to disk. */
     struct image_buf write_bc;
@@ -48,6 +56,9 @@ struct image_bufs {
     struct image_buf write_data;
     /* Read buffer for track data to be used for generating flux pattern. */
     struct image_buf read_data;
+    /* Pipeline of writes queued for processing. Power of two entries. */
+    struct write *write;
+    uint16_t nr_writes;
 };
 
 struct adf_image {
@@ -67,27 +78,43 @@ struct adf_image {
     bool_t ring_io_inited;
 };
 
+#define MAX_CUSTOM_PULSES 34 /* 33+1 for minor track misalignment */
+
 struct hfe_image {
     struct ring_io ring_io;
     uint16_t tlut_base;
+    /* Track list, read in full at mount, or NULL if it would not fit. */
+    void *tlut;
     uint16_t trk_pos, trk_len;
-    bool_t is_v3, double_step, fresh_seek;
+    bool_t is_v3, is_hfx, double_step, fresh_seek;
     uint8_t next_index_pulses_pos;
+    uint32_t index_pulses[MAX_CUSTOM_PULSES]; /* See im->index_pulses */
+    /* V3 opcodes of the current cylinder, found by prescan. */
+    struct hfe_op *ops; /* HFE_MAX_OPS per side */
+    uint8_t nr_ops[2];
+    uint8_t next_op;
+    uint32_t dfl_ticks_per_cell; /* From the disk header */
+    /* HFX: Both sides of the current cylinder, and whether the ring's shadow
+     * holds side 1, so that a head change needs no I/O. */
+    struct {
+        uint16_t len;
+        uint32_t ticks_per_cell;
+    } hfx_side[2];
+    bool_t hfx_shadow;
 };
 
 struct qd_image {
+    struct ring_io ring_io;
     uint16_t tb;
     uint32_t trk_off;
-    uint32_t trk_pos, trk_len;
+    uint32_t trk_len;
     uint32_t win_start, win_end;
+    /* Bytes in flight to the bitcell ring by background DMA copy. */
+    uint32_t copy_len;
     struct {
         uint32_t start;
         bool_t wrapped;
     } write;
-    struct {
-        uint32_t off, len;
-        bool_t dirty;
-    } write_batch;
 };
 
 struct raw_sec {
@@ -124,16 +151,36 @@ struct img_image {
     /* If not NULL, replaces the default method for finding sector data. 
      * Sector data is at trk_off + file_sec_offsets[i]. */
     uint32_t *file_sec_offsets;
+    /* Otherwise, sector data is at trk_off + sec_offsets[i], computed for
+     * each track as it is seeked. */
+    uint32_t *sec_offsets;
     /* Delay start of track this many bitcells past index. */
     uint32_t track_delay_bc;
     uint16_t gap_4;
     uint8_t shadow;
+    /* The whole image is buffered in the ring, for the life of the mount. */
+    bool_t resident;
+    /* Offset of track data within its ring_io window. */
+    uint32_t trk_ring_off;
+    /* On-disk offset and length of each side of the current cylinder. */
+    uint32_t cyl_trk_off[2], cyl_trk_len[2];
     uint16_t trash_bc; /* Number of bitcells to throw away. */
     uint32_t idx_sz, idam_sz;
     uint16_t dam_sz_pre, dam_sz_post;
+    /* Data-field CRC of each sector of the current track (NULL if no room).
+     * crc_sec is the sector whose CRC is being accumulated from its DAM. */
+    uint16_t *sec_crc;
+    uint32_t sec_crc_valid[256/32];
+    int16_t crc_sec;
+    /* Pre-encoded ID field bitcells of each sector (NULL if no room). */
+    uint16_t *idam_bc;
     void *heap_bottom;
     struct image_buf track_data;
     struct ring_io ring_io;
+    /* Next batch of sector data to encode: Up to two spans of the track_data
+     * ring, or the staging buffer in read_data if process_data() applies. */
+    uint8_t *batch_p[2];
+    uint16_t batch_len[2];
 };
 
 struct dsk_image {
@@ -148,6 +195,18 @@ struct dsk_image {
     uint32_t idx_sz, idam_sz;
     uint16_t dam_sz_pre, dam_sz_post;
     uint8_t rev;
+    /* Data-field CRC of each sector of the current track. */
+    int8_t crc_sec;
+    uint32_t sec_crc_valid;
+    uint16_t sec_crc[29];
+    /* Track Info Block cache, in the read-data buffer. */
+    uint16_t tib_cache_len, tib_cache_used;
+    uint16_t track_sz; /* Standard DSK only */
+    /* Data of the current track, streamed through ring_io. The window starts
+     * trk_ring_off bytes before the first sector, at a block boundary. */
+    struct image_buf track_data;
+    struct ring_io ring_io;
+    uint32_t trk_len, trk_ring_off;
 };
 
 struct directaccess {
@@ -156,18 +215,28 @@ struct directaccess {
     uint16_t trk_sec;
     uint16_t idx_sz, idam_sz, dam_sz;
     uint16_t trash_bc; /* Number of bitcells to throw away. */
-    uint8_t *rd_buf;
+    uint8_t *rd_buf; /* Status and name sectors */
+    uint8_t *rd_p; /* Sector being encoded */
+    /* Read-ahead ring of ra_secs sectors, holding LBAs [ra_lo, ra_hi). LBA n
+     * is in slot n % ra_secs. read_op is reading ra_cnt sectors at ra_hi. */
+    uint8_t *ra_buf;
+    uint16_t ra_secs, ra_cnt;
+    LBA_t ra_lo, ra_hi;
+    LBA_t ra_lim; /* End of the FAT volume: No speculative reads beyond. */
+    bool_t ra_discard; /* Window is stale: Restart it. */
+    bool_t ra_seq; /* Host is stepping sequentially through the volume. */
     FOP read_op;
     struct image_buf write_buffer;
     LBA_t *write_offsets; /* Disk offset of each 512 byte buffer segment */
     FOP write_op;
     uint8_t write_cnt;
     uint8_t sync_state;
-    bool_t read_op_started;
+    time_t write_start; /* When write_op was issued */
+    time_t write_last; /* When a sector was last queued */
+    uint32_t write_us, write_secs; /* Decaying totals, for write rate */
+    uint32_t write_max_us, sync_max_us; /* Reported in telemetry */
 };
 
-#define MAX_CUSTOM_PULSES 34 /* 33+1 for minor track misalignment */
-
 struct image {
     /* Handler for currently-selected type of disk image. */
     const struct image_handler *disk_handler;
@@ -183,22 +252,18 @@ struct image {
     uint8_t index_pulses_ver; /* Changed when pulses or length changed. */
     uint8_t index_pulses_len;
     /* Alternative index pulse locations, in ticks. When non-empty, disables
-     * regular index pulse. */
-    uint32_t index_pulses[MAX_CUSTOM_PULSES];
+     * regular index pulse. Held in the handler state that provides them. */
+    const uint32_t *index_pulses;
 
     /* Data buffers. */
     struct image_bufs bufs;
 
-    struct write {
-        uint32_t start; /* Ticks past index when current write started */
-        uint32_t bc_end; /* Final bitcell buffer index */
-        uint16_t dma_end; /* Final DMA buffer index */
-        uint16_t track; /* Track written to */
-    } write[8];
+    /* Indexes into bufs.write[]. */
     uint16_t wr_cons, wr_bc, wr_prod;
 
     /* Info about current track. */
     uint16_t cur_track;
+    int8_t step_dir; /* Most recent head step: +1 inward, -1 outward */
     uint16_t write_bc_ticks; /* Nr SYSCLK ticks per bitcell in write stream */
     uint32_t ticks_per_cell; /* Nr 'ticks' per bitcell in read stream. */
     uint32_t tracklen_bc, cur_bc; /* Track length and cursor, in bitcells */
@@ -209,6 +274,29 @@ struct image {
     uint32_t stk_per_rev; /* Nr STK ticks per revolution. */
     enum { SYNC_none=0, SYNC_fm, SYNC_mfm } sync;
 
+    /* Pre-rendered bitcells of the current track. Replayed on every
+     * revolution in place of re-encoding the track. */
+    struct track_render {
+        uint16_t *p; /* NULL if no render buffer */
+        uint16_t len, pos; /* 16-bit words */
+#define RENDER_invalid   0
+#define RENDER_capturing 1
+#define RENDER_valid     2
+        uint8_t state;
+    } render;
+
+    /* Which of a handler's probes opened the image. Set by image_open() from
+     * its probe cache (0 if not known), and updated by handlers with several
+     * probes, so that a cache hit can skip those which failed. */
+    uint8_t probe;
+
+    struct slot *slot;
+
+    /* Bytes allocated for the handler state below. */
+    uint16_t state_sz;
+
+    /* Handler state. Must come last: only as much as the handler needs is
+     * allocated (see image_state_size()). */
     union {
         struct adf_image adf;
         struct hfe_image hfe;
@@ -217,13 +305,15 @@ struct image {
         struct dsk_image dsk;
         struct directaccess da;
     };
-
-    struct slot *slot;
 };
 
+/* Size of an image structure with @state_sz bytes of handler state. */
+#define IMAGE_STATE_MAX (sizeof(struct image) - offsetof(struct image, adf))
+#define image_size(state_sz) (offsetof(struct image, adf) + (state_sz))
+
 static inline struct write *get_write(struct image *im, uint16_t idx)
 {
-    return &im->write[idx & (ARRAY_SIZE(im->write) - 1)];
+    return &im->bufs.write[idx & (im->bufs.nr_writes - 1)];
 }
 
 struct image_handler {
@@ -235,6 +325,9 @@ struct image_handler {
     uint16_t (*rdata_flux)(struct image *im, uint16_t *tbuf, uint16_t nr);
     bool_t (*write_track)(struct image *im);
     void (*sync)(struct image *im);
+    /* Optional: Speculatively read cylinder @cyl, predicted to be the target
+     * of a seek in progress. Called repeatedly until the seek completes. */
+    void (*prefetch)(struct image *im, int cyl);
 
     bool_t async;
 };
@@ -248,10 +341,24 @@ extern const struct image_type {
 /* Is given file valid to open as an image? */
 bool_t image_valid(FILINFO *fp);
 
-/* Open specified image file on mass storage device. */
-void image_open(struct image *im, struct slot *slot, DWORD *cltbl,
+/* Bytes of handler state to allocate for opening @slot: enough for the
+ * handler expected to open it. */
+uint16_t image_state_size(struct slot *slot);
+
+/* Open specified image file on mass storage device. Returns FALSE if the
+ * image can be opened only with IMAGE_STATE_MAX bytes of handler state. */
+bool_t image_open(struct image *im, struct slot *slot, DWORD *cltbl,
         bool_t da_mode);
 
+/* Bring the index of IMG.CFG (@cfg, modified at @mtime) up to date in the
+ * current folder, using @idx as a file handle and @buf as scratch space.
+ * Returns TRUE if @idx describes a valid index. */
+#define IMG_CFG_INDEX_NAME "IMGCFG.IDX"
+bool_t img_cfg_index(FIL *cfg, uint32_t mtime, FIL *idx, char *buf, int len);
+
+/* Forget how images were opened (eg. on volume or config change). */
+void image_probe_cache_flush(void);
+
 /* Returns TRUE if opened in Direct Access mode. */
 bool_t image_in_da_mode(struct image *im);
 
@@ -271,7 +378,8 @@ bool_t image_read_track(struct image *im);
 
 /* Generate flux timings for the RDATA timer and output pin. */
 uint16_t image_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr);
-uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr);
+ramfunc uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf,
+                               uint16_t nr);
 
 /* Write track data from memory to mass storage. Returns TRUE if processing
  * was completed for the write at the tail of the pipeline. */
@@ -281,9 +389,25 @@ bool_t image_write_track(struct image *im);
  * processing may be interrupted, like before floppy_cancel(). */
 void image_sync(struct image *im);
 
+/* Speculatively read cylinder @cyl while the host is mid-seek. */
+void image_prefetch(struct image *im, int cyl);
+
 /* Rotational position of last-generated flux (SYSCLK ticks past index). */
 uint32_t image_ticks_since_index(struct image *im);
 
+/* Pre-rendered track bitcells. Handlers which encode a track from scratch
+ * every revolution can capture one full revolution of the read_bc ring, and
+ * then replay it until the track is next written or sought away from. */
+void track_render_init(struct image *im, void *p, unsigned int len);
+void track_render_invalidate(struct image *im);
+/* Capture bitcells emitted from @bc_prod up to bufs.read_bc.prod. */
+void track_render_capture(struct image *im, uint32_t bc_prod,
+                          bool_t track_start);
+/* Set replay position, in bitcells from start of track. FALSE if no valid
+ * rendering is available. */
+bool_t track_render_seek(struct image *im, uint32_t bc);
+bool_t track_render_replay(struct image *im);
+
 /* MFM conversion. */
 extern const uint16_t mfmtab[];
 static inline uint16_t bintomfm(uint8_t x) { return mfmtab[x]; }
@@ -291,12 +415,42 @@ uint8_t mfmtobin(uint16_t x);
 void mfm_to_bin(const void *in, void *out, unsigned int nr);
 void mfm_ring_to_bin(const uint16_t *ring, unsigned int mask,
                      unsigned int idx, void *out, unsigned int nr);
+/* MFM-encode @nr bytes to big-endian bitcells at @out, clocked against
+ * previous MFM word @pr. */
+void mfm_encode(uint16_t *out, uint16_t pr, const void *in, unsigned int nr);
+/* MFM-encode @nr bytes into @ring at @idx, clocked against previous MFM word
+ * @pr, and fold the same bytes into @crc in one pass. Returns the new CRC. */
+ramfunc uint16_t mfm_ring_encode_crc(uint16_t *ring, unsigned int mask,
+                                     unsigned int idx, uint16_t pr,
+                                     const void *in, unsigned int nr,
+                                     uint16_t crc);
+/* Fill @nr words of @ring from @idx with big-endian bitcell word @x. */
+void bc_ring_fill(uint16_t *ring, unsigned int mask, unsigned int idx,
+                  uint16_t x, unsigned int nr);
+/* Fill @nr words of @ring from @idx with MFM word @x (eg. a gap byte from
+ * mfmtab[], or a sync mark), clocked against previous MFM word @pr at the
+ * start of the run and against itself thereafter. Returns the new previous
+ * MFM word. */
+uint16_t mfm_ring_fill(uint16_t *ring, unsigned int mask, unsigned int idx,
+                       uint16_t pr, uint16_t x, unsigned int nr);
 #define MFM_DAM_CRC  0xe295 /* 0xa1, 0xa1, 0xa1, 0xfb */
 #define FM_DAM_CRC   0xbf84 /* 0xfb */
 
-/* FM conversion. */
+/* FM conversion. Data bits are interleaved with clock bits, which are all
+ * set except in the sync marks. */
+#define bintofm(x) (mfmtab[(uint8_t)(x)] | 0xaaaa)
 #define FM_SYNC_CLK 0xc7
-uint16_t fm_sync(uint8_t dat, uint8_t clk);
+#define FM_IAM  0xf77a /* 0xfc, clock 0xd7 */
+#define FM_IDAM 0xf57e /* 0xfe, clock 0xc7 */
+#define FM_DAM  0xf56f /* 0xfb, clock 0xc7 */
+/* Fill @nr words of @ring from @idx with FM-encoded byte @b. */
+#define fm_ring_fill(ring, mask, idx, b, nr) \
+    bc_ring_fill(ring, mask, idx, bintofm(b), nr)
+/* FM-encode @nr bytes into @ring at @idx, and fold the same bytes into @crc in
+ * one pass. Returns the new CRC. */
+ramfunc uint16_t fm_ring_encode_crc(uint16_t *ring, unsigned int mask,
+                                    unsigned int idx, const void *in,
+                                    unsigned int nr, uint16_t crc);
 
 /* External API. */
 void floppy_init(void);
@@ -305,12 +459,26 @@ void floppy_insert(unsigned int unit, struct slot *slot);
 void floppy_sync(void);
 void floppy_cancel(void);
 bool_t floppy_handle(void); /* TRUE -> re-read config file */
+bool_t floppy_idle(void); /* TRUE -> floppy_handle() awaits an IRQ */
 void floppy_set_cyl(uint8_t unit, uint8_t cyl);
 struct track_info {
     uint8_t cyl, side:1, sel:1, writing:1, in_da_mode:1;
 };
 void floppy_get_track(struct track_info *ti);
 void floppy_set_fintf_mode(void);
+/* Per-image flux statistics, since the image was mounted. Prefetch latencies
+ * are counted in buckets bounded above by 1, 2, 5, 10, 20, 50 and 100ms, and
+ * a final bucket for anything slower. */
+#define FLUX_PREFETCH_BUCKETS 8
+struct flux_stats {
+    uint32_t prefetch[FLUX_PREFETCH_BUCKETS];
+    uint32_t underruns; /* RDATA DMA overtook the flux producer */
+    uint32_t skips; /* Index re-synced because prefetch was too slow */
+    uint32_t lates; /* Index re-synced because flux started late */
+    uint32_t missed_writes; /* Write pipeline full at WGATE */
+    uint16_t max_writes; /* Peak occupancy of the write pipeline */
+};
+void floppy_get_flux_stats(struct flux_stats *stats);
 static inline bool_t in_da_mode(struct image *im, unsigned int cyl)
 {
     return cyl >= max_t(unsigned int, DA_FIRST_CYL, im->nr_cyls);
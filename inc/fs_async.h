@@ -16,12 +16,21 @@ typedef int FOP;
 
 FOP F_lseek_async(FIL *fp, FSIZE_t ofs);
 FOP F_read_async(FIL *fp, void *buff, UINT btr, UINT *br);
+/* Read @btr bytes (a multiple of 512) at offset @ofs in @fp, bypassing FatFS:
+ * The caller has determined that the data is at @sector on the volume. Like
+ * F_read_async(), the read is ordered behind queued writes to @fp which it
+ * overlaps. The file position is unaffected. */
+FOP F_read_lba_async(FIL *fp, FSIZE_t ofs, LBA_t sector,
+                     void *buff, UINT btr);
 FOP F_write_async(FIL *fp, const void *buff, UINT btw, UINT *bw);
 FOP F_sync_async(FIL *fp);
 FOP disk_read_async(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count);
 FOP disk_write_async(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count);
 /* If res == NULL, then it will F_die() if result of ioctl != RES_OK. */
 FOP disk_ioctl_async(BYTE pdrv, BYTE cmd, void* buff, DRESULT *res);
+/* Scan up to @nr_secs more sectors of the FAT of @fs, towards a count of its
+ * free clusters (fs->free_clst). */
+FOP F_count_free_async(FATFS *fs, UINT nr_secs);
 
 /* Returns TRUE if oper has completed or is cancelled. */
 bool_t F_async_isdone(FOP oper);
@@ -38,9 +47,26 @@ void F_async_cancel(FOP oper);
  * immediately. */
 void F_async_cancel_all(void);
 
+/* Call cb(oper, arg) when oper completes, from the I/O thread. Immediately if
+ * oper is already done. Not called if oper is cancelled. The callback must be
+ * brief, and must not wait on I/O. */
+void F_async_whendone(FOP oper, void (*cb)(FOP oper, void *arg), void *arg);
+
 /* Return a completed or cancelled op. Can be used as a "fake" op that is safe
  * to wait or be cancelled. */
 FOP F_async_get_completed_op(void);
 
-/* Executes async operations until none remain.  */
+/* Executes async operations until none remain. The caller may then
+ * F_async_sleep() until more are queued. Reads run ahead of queued
+ * writes and syncs, unless they overlap a queued write. */
 void F_async_drain(void);
+
+/* Blocks until async operations are queued. */
+void F_async_sleep(void);
+
+struct f_async_stats {
+    uint16_t max_depth;    /* Most ops ever queued at once */
+    uint16_t nr_overtakes; /* Ops run ahead of an older queued op */
+    uint32_t max_wait_us[2]; /* Longest queued time: reads, deferred ops */
+};
+void F_async_get_stats(struct f_async_stats *stats);
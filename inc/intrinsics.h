@@ -23,6 +23,10 @@ struct exception_frame {
 #define packed __attribute((packed))
 #define always_inline __inline__ __attribute__((always_inline))
 #define noinline __attribute__((noinline))
+/* Execute from SRAM, free of flash wait states. The code is copied in at
+ * startup along with .data. Calls between SRAM and flash are beyond BL range,
+ * so callers use a long call. */
+#define ramfunc __attribute__((section(".ramfunc"), long_call))
 
 #define likely(x)     __builtin_expect(!!(x),1)
 #define unlikely(x)   __builtin_expect(!!(x),0)
@@ -32,6 +36,9 @@ struct exception_frame {
 #define barrier() asm volatile ("" ::: "memory")
 #define cpu_sync() asm volatile("dsb; isb" ::: "memory")
 #define cpu_relax() asm volatile ("nop" ::: "memory")
+/* Sleep until an event: any IRQ becoming pending (with SCB_SCR_SEVONPEND)
+ * since the last cpu_wfe() ends the sleep at once. */
+#define cpu_wfe() asm volatile ("wfe" ::: "memory")
 
 #define sv_call(imm) asm volatile ( "svc %0" : : "i" (imm) )
 
@@ -0,0 +1,48 @@
+/*
+ * journal.h
+ * 
+ * Sequential write journal for image files.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Memory required by the journal, to be provided to journal_init(). */
+#define JOURNAL_MEM_SZ (512 + 2048)
+
+/* Journal writes to image file @fp, using @mem (JOURNAL_MEM_SZ bytes) for
+ * the in-RAM index and replay buffer. The journal file is created in the
+ * current folder, using @scratch as temporary space for its FIL. If @fp or
+ * @mem is NULL then the journal is disabled. */
+void journal_init(FIL *fp, void *mem, FIL *scratch);
+
+/* Append @nr sectors at offset @ofs in @fp to the journal, returning the op
+ * in @fop. Returns FALSE if the caller must write directly to @fp instead. */
+bool_t journal_write_async(FIL *fp, FSIZE_t ofs, const void *buf,
+                           unsigned int nr, FOP *fop);
+
+/* Read up to *@nr sectors at offset @ofs in @fp from the journal, returning
+ * the op in @fop. Returns FALSE if the caller must read directly from @fp
+ * instead. Either way, *@nr is reduced to the sectors that may be handled
+ * in the one operation. */
+bool_t journal_read_async(FIL *fp, FSIZE_t ofs, void *buf,
+                          unsigned int *nr, FOP *fop);
+
+/* Copy journaled data into the image file, a little at a time. Call when the
+ * image is otherwise idle. */
+void journal_replay(void);
+
+/* Copy all journaled data into the image file, and sync it. */
+void journal_sync(void);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,69 @@
+/*
+ * profile.h
+ * 
+ * Cycle-count profiling of IRQ handlers and image handler hooks. Only built
+ * with profile=y.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Profiled code paths. */
+enum {
+    PROF_rdata_dma,   /* IRQ_rdata_dma() */
+    PROF_wdata_dma,   /* IRQ_wdata_dma() */
+    PROF_timer,       /* IRQ_timer() */
+    PROF_read_track,  /* track_handler->read_track() */
+    PROF_rdata_flux,  /* track_handler->rdata_flux() */
+    PROF_write_track, /* track_handler->write_track() */
+    PROF_nr
+};
+
+/* Statistics of a profiled path. All zero in builds without profile=y. */
+struct profile_stat {
+    uint32_t nr, min, avg, max; /* Calls, and cycles per call */
+};
+
+#if defined(PROFILE)
+
+/* Start the DWT cycle counter and clear all statistics. */
+void profile_init(void);
+
+/* Bracket a profiled call: profile_end() accounts the cycles elapsed since
+ * the matching profile_start() to path @id. profile_end_n() also accounts
+ * @n units of work (eg. flux samples) done by the call. Safe to call from
+ * any priority level same or lower than TIMER_IRQ_PRI. */
+#define profile_start() (dwt->cyccnt)
+void profile_end_n(unsigned int id, uint32_t start, uint32_t n);
+#define profile_end(id, start) profile_end_n(id, start, 0)
+
+/* Snapshot of path @id's statistics, without clearing them. */
+void profile_get(unsigned int id, struct profile_stat *stat);
+
+/* Log min/avg/max cycles and call counts per path, then clear them. Paths
+ * which account units of work also log cycles per unit, and units per
+ * millisecond since the previous report. */
+void profile_report(void);
+
+#else /* !PROFILE */
+
+#define profile_init() ((void)0)
+#define profile_start() 0
+#define profile_end_n(id, start, n) ((void)(start), (void)(n))
+#define profile_end(id, start) ((void)(start))
+#define profile_report() ((void)0)
+#define profile_get(id, stat) memset(stat, 0, sizeof(struct profile_stat))
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
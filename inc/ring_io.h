@@ -25,17 +25,35 @@
 
 #define RING_IO_MAX_RING_LEN (64 * 1024)
 
+/* Clean sectors between dirty sectors are rewritten, up to this many in a row,
+ * so that the dirty sectors can be written in a single command. */
+#define RING_IO_WRITE_GAP_SECS 4
+
+/* Default write_defer_ms: Long enough to span a write-verify revolution or
+ * two, or the passes of a track formatter. */
+#define RING_IO_WRITE_DEFER_MS 500
+
 struct ring_io {
     /* Options. Safe to change at any time. */
     uint8_t batch_secs, trailing_secs;
+    /* Written sectors are dirty only if passed to ring_io_changed(). */
+    bool_t explicit_changes;
+    /* Hold off write-back of a fully-buffered ring until no sector has been
+     * written for this long, so that rewrites of a sector are merged. */
+    uint16_t write_defer_ms;
 
     /* Internals. */
     FIL *fp;
     struct image_buf *read_data;
     FOP fop;
     void (*fop_cb)(struct ring_io*);
+    bool_t fop_done; /* Set from the I/O thread when fop completes. */
+    time_t fop_start; /* When fop was queued. */
+    uint32_t fop_us; /* Set with fop_done: Time from queue to completion. */
     uint32_t unread_bitfield[(RING_IO_MAX_RING_LEN/512+31)/32];
     uint32_t dirty_bitfield[(RING_IO_MAX_RING_LEN/512+31)/32];
+    uint32_t changed_bitfield[(RING_IO_MAX_RING_LEN/512+31)/32];
+    time_t write_last; /* When a sector was last written, per write_defer_ms */
     FSIZE_t f_off;
     FSIZE_t f_shadow_off;
     uint32_t f_len;
@@ -45,17 +63,70 @@ struct ring_io {
     uint32_t wd_cons; /* Internal cursor of oldest write. Sector aligned. */
     uint32_t wd_prod; /* Internal cursor that follows rd->cons. */
     uint32_t rd_valid; /* Cursor of oldest valid read data. */
+    uint32_t pre_pos, pre_len; /* Preloaded region, per ring_io_preload */
     bool_t sync_needed:1;
     bool_t writing:1; /* The caller is writing, per ring_io_seek. */
     bool_t shadow_active:1; /* The caller is using shadow ring, per ring_io_seek. */
     bool_t disable_reading:1; /* Inhibit read ops in the I/O scheduler. */
+    bool_t durable:1; /* ring_io_sync(): Sync the file without deferral. */
+
+    /* Write-back statistics, reported and reset as each sync completes. */
+    struct {
+        uint32_t secs, gap_secs, cmds;
+    } wr;
+
+    /* Speculative prefetch into spare buffer space beyond the ring(s). This
+     * state persists across ring_io_init(). */
+    struct ring_io_prefetch {
+        FSIZE_t off, req_off; /* File offset of active/requested region */
+        uint32_t len, req_len; /* Length of active/requested region */
+        uint32_t done; /* Bytes of active region read so far */
+        uint32_t base; /* Offset of prefetch buffer within read_data */
+        uint16_t hits, misses;
+    } pf;
+
+    /* Read batch adapted to the measured cost of reads. Reads of up to
+     * batch_secs << shift sectors are issued. Each doubling of the batch is
+     * kept only if it cuts the cost per sector by an eighth or more. This
+     * state persists across ring_io_init(). */
+#define RING_IO_TUNE_LEVELS 4
+    struct ring_io_tune {
+        uint8_t shift;
+        uint8_t nr; /* Reads timed at the current shift */
+        uint16_t us_per_sec[RING_IO_TUNE_LEVELS]; /* Averages, 0 = unknown */
+    } tune;
+
+    /* File sync owed by a completed write-back. Syncs are coalesced across
+     * tracks, and issued once no sector has been written for
+     * ff_cfg.image_sync_ms, on deselect, or by ring_io_sync(). This state
+     * persists across ring_io_init(). */
+    struct ring_io_meta {
+        time_t last; /* When a sector was last written or written back */
+        bool_t owed;
+    } meta;
 };
 
+/* batch_secs is the minimum read batch, used whenever the consumer is close
+ * to running out of data. ring_io increases the batch beyond this if the
+ * storage device has a high per-command overhead. */
+
+/* Default batch_secs for a ring consumed at one byte of file per @byte_ticks
+ * system ticks: Enough to stream for ff_cfg.read_batch_ms, and at least two
+ * sectors. */
+uint8_t ring_io_batch_secs(uint32_t byte_ticks);
+
 /* shadow_off != ~0 maintains a second parallel ring of the same size that
  * tracks the primary ring. */
 void ring_io_init(struct ring_io *rio, FIL *fp, struct image_buf *read_data,
         FSIZE_t off, FSIZE_t shadow_off, uint16_t sec_len);
+/* Write back all dirty sectors and sync the file, including any sync deferred
+ * by an earlier write-back. */
 void ring_io_sync(struct ring_io *rio);
+/* Write back all dirty sectors, eg. before moving the ring to another track.
+ * The file sync is deferred, to coalesce it with later write-backs. */
+void ring_io_writeback(struct ring_io *rio);
+/* The drive is deselected: Issue any deferred file sync now. */
+void ring_io_sync_hint(void);
 /* Stop all I/O activity and wait for outstanding I/O to complete. */
 void ring_io_shutdown(struct ring_io *rio);
 /* Seek ring to 'pos' in file; read_data.cons and .prod will be adjusted. If
@@ -67,6 +138,21 @@ void ring_io_seek(
         struct ring_io *rio, uint32_t pos, bool_t writing, bool_t shadow);
 void ring_io_progress(struct ring_io *rio);
 void ring_io_flush(struct ring_io *rio);
+/* Mark the sector holding 'idx' as modified by the writer. Only needed if
+ * explicit_changes is set: other written sectors are then not written back. */
+void ring_io_changed(struct ring_io *rio, uint32_t idx);
+/* Request speculative read of the given file region while the ring is
+ * otherwise idle. Prefetched data is used to satisfy the next ring_io_init() of
+ * an overlapping region. The request takes effect on the first ring_io_seek()
+ * after any ring_io_init(), so that a previously-prefetched region can be
+ * claimed first. Repeating the request of the active region has no effect. */
+void ring_io_prefetch(struct ring_io *rio, FSIZE_t off, uint32_t len);
+
+/* The first @len bytes of the read buffer already hold the file region at
+ * @pos (relative to the ring_io_init offset, and sector aligned). If the first
+ * ring_io_seek() after ring_io_init() lands within the region then the ring
+ * starts there, and the region is not read again. Primary ring only. */
+void ring_io_preload(struct ring_io *rio, uint32_t pos, uint32_t len);
 
 /* Find position in ring buffer. Sectors are guaranteed to be contiguous
  * (non-wrapping); it is safe to compute this idx only once per sector. */
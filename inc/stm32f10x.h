@@ -12,6 +12,8 @@
 /* C pointer types */
 #define STK volatile struct stk * const
 #define SCB volatile struct scb * const
+#define DCB volatile struct dcb * const
+#define DWT volatile struct dwt * const
 #define NVIC volatile struct nvic * const
 #define FLASH volatile struct flash * const
 #define PWR volatile struct pwr * const
@@ -21,6 +23,7 @@
 #define AFIO volatile struct afio * const
 #define EXTI volatile struct exti * const
 #define DMA volatile struct dma * const
+#define CRC volatile struct crc * const
 #define TIM volatile struct tim * const
 #define SPI volatile struct spi * const
 #define I2C volatile struct i2c * const
@@ -30,6 +33,8 @@
 /* C-accessible registers. */
 static STK stk = (struct stk *)STK_BASE;
 static SCB scb = (struct scb *)SCB_BASE;
+static DCB dcb = (struct dcb *)DCB_BASE;
+static DWT dwt = (struct dwt *)DWT_BASE;
 static NVIC nvic = (struct nvic *)NVIC_BASE;
 static FLASH flash = (struct flash *)FLASH_BASE;
 static PWR pwr = (struct pwr *)PWR_BASE;
@@ -46,6 +51,7 @@ static AFIO afio = (struct afio *)AFIO_BASE;
 static EXTI exti = (struct exti *)EXTI_BASE;
 static DMA dma1 = (struct dma *)DMA1_BASE;
 static DMA dma2 = (struct dma *)DMA2_BASE;
+static CRC crc_unit = (struct crc *)CRC_BASE;
 static TIM tim1 = (struct tim *)TIM1_BASE;
 static TIM tim2 = (struct tim *)TIM2_BASE;
 static TIM tim3 = (struct tim *)TIM3_BASE;
@@ -45,6 +45,10 @@ struct scb {
     uint32_t bfar;     /* 38: Bus fault address */
 };
 
+#define SCB_SCR_SEVONPEND      (1u<<4)
+#define SCB_SCR_SLEEPDEEP      (1u<<2)
+#define SCB_SCR_SLEEPONEXIT    (1u<<1)
+
 #define SCB_CCR_STKALIGN       (1u<<9)
 #define SCB_CCR_BFHFNMIGN      (1u<<8)
 #define SCB_CCR_DIV_0_TRP      (1u<<4)
@@ -90,6 +94,34 @@ struct scb {
 
 #define SCB_BASE 0xe000ed00
 
+/* Core debug */
+struct dcb {
+    uint32_t dhcsr;    /* 00: Debug halting control and status */
+    uint32_t dcrsr;    /* 04: Debug core register selector */
+    uint32_t dcrdr;    /* 08: Debug core register data */
+    uint32_t demcr;    /* 0C: Debug exception and monitor control */
+};
+
+#define DCB_DEMCR_TRCENA    (1u<<24)
+
+#define DCB_BASE 0xe000edf0
+
+/* Data watchpoint and trace */
+struct dwt {
+    uint32_t ctrl;     /* 00: Control */
+    uint32_t cyccnt;   /* 04: Cycle count */
+    uint32_t cpicnt;   /* 08: CPI count */
+    uint32_t exccnt;   /* 0C: Exception overhead count */
+    uint32_t sleepcnt; /* 10: Sleep count */
+    uint32_t lsucnt;   /* 14: LSU count */
+    uint32_t foldcnt;  /* 18: Folded-instruction count */
+    uint32_t pcsr;     /* 1C: Program counter sample */
+};
+
+#define DWT_CTRL_CYCCNTENA  (1u<< 0)
+
+#define DWT_BASE 0xe0001000
+
 /* Nested vectored interrupt controller */
 struct nvic {
     uint32_t iser[32]; /*  00: Interrupt set-enable */
@@ -379,6 +411,17 @@ struct dma {
 #define DMA1_BASE 0x40020000
 #define DMA2_BASE 0x40020400
 
+/* CRC calculation unit */
+struct crc {
+    uint32_t dr;    /* 00: Data */
+    uint32_t idr;   /* 04: Independent data */
+    uint32_t cr;    /* 08: Control */
+};
+
+#define CRC_CR_RESET (1u<<0)
+
+#define CRC_BASE 0x40023000
+
 /* Timer */
 struct tim {
     uint32_t cr1;   /* 00: Control 1 */
@@ -10,8 +10,20 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
+/* Maximum number of threads, including the initial thread (power of 2). */
+#define THREAD_MAX 4
+
+/* Threads blocked until the queue is woken. */
+struct waitq {
+    /* Internal bookkeeping */
+    uint8_t waiters;
+};
+
 struct thread {
     /* Internal bookkeeping */
+    uint32_t *sp;
+    struct waitq exit_wq;
+    uint8_t id;
     bool_t exited;
 };
 
@@ -19,17 +31,36 @@ struct thread {
  * allocated for the lifetime of the thread. */
 void thread_start(struct thread *thread, uint32_t *stack, void (*func)(void*), void* arg);
 
-/* Yield execution to allow other threads to run. */
+/* Yield execution to allow other runnable threads to run. Returns immediately
+ * if no other thread is runnable. */
 void thread_yield(void);
 
+/* Yield to other runnable threads. If there are none, sleep until the next
+ * IRQ, or return at once if an IRQ has occurred since the last sleep. For
+ * use by polling loops which have found nothing to do. */
+void thread_idle(void);
+
+/* Block until @wq is woken by thread_wake_all(). Blocked threads are not run
+ * until then. Wakeups can be spurious, so the caller must recheck the reason
+ * it waits. To not miss a wakeup from IRQ context, the caller must make that
+ * check and call thread_wait() with IRQs masked at TIMER_IRQ_PRI. */
+void thread_wait(struct waitq *wq);
+
+/* Make all threads blocked on @wq runnable again. Safe to call from any
+ * priority level same or lower than TIMER_IRQ_PRI. */
+void thread_wake_all(struct waitq *wq);
+
+/* Block until time @deadline. */
+void thread_sleep_until(time_t deadline);
+
 /* Returns true if provided thread has exited. A thread cannot be joined
  * multiple times, unless it is started anew. */
 bool_t thread_tryjoin(struct thread *thread);
 
-/* Continuously yields until provided thread has exited. A thread cannot be
- * joined multiple times, unless it is started anew. */
+/* Blocks until provided thread has exited. A thread cannot be joined
+ * multiple times, unless it is started anew. */
 void thread_join(struct thread *thread);
 
 /* Reinitializes threading subsystem to its initial state, throwing away all
- * threads but the current. */
+ * threads but the initial thread, which must be the caller. */
 void thread_reset(void);
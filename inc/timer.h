@@ -13,7 +13,7 @@ struct timer {
     time_t deadline;
     void (*cb_fn)(void *);
     void *cb_dat;
-    struct timer *next;
+    uint8_t idx; /* Internal: position in queue of active timers */
 };
 
 /* Safe to call from any priority level same or lower than TIMER_IRQ_PRI. */
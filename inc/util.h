@@ -72,6 +72,33 @@ void *arena_alloc(uint32_t sz);
 uint32_t arena_total(void);
 uint32_t arena_avail(void);
 void arena_init(void);
+/* Remove @sz bytes from the top of the arena, for good: they survive every
+ * subsequent arena_init(). Call before the arena is in use. */
+void *arena_reserve(uint32_t sz);
+
+/* Named arena regions, for reporting. arena_init() selects ARENA_misc. */
+enum {
+    ARENA_misc,    /* Small global state */
+    ARENA_dma,     /* Flux DMA rings */
+    ARENA_image,   /* Image state and fast-seek cluster table */
+    ARENA_ring,    /* Bitcell ring buffers */
+    ARENA_journal, /* Write journal index and replay buffer */
+    ARENA_buf,     /* Mass-storage staging buffers */
+    ARENA_dirents, /* Sorted folder entries */
+    ARENA_cache,   /* Volume sector cache */
+    ARENA_nr
+};
+/* Account subsequent allocations to region @r. */
+void arena_region(unsigned int r);
+/* Record that region @r uses @sz bytes of free arena space in place,
+ * without allocating it (eg. the volume cache). */
+void arena_note(unsigned int r, uint32_t sz);
+/* Scoped allocation: arena_release() frees everything allocated since the
+ * matching arena_mark(). Scopes must not span a change of region. */
+void *arena_mark(void);
+void arena_release(void *mark);
+/* Log the size of each region, and free space. */
+void arena_report(void);
 
 /* Board-specific callouts */
 void board_init(void);
@@ -88,25 +115,63 @@ static inline int printk(const char *format, ...) { return 0; }
 #endif
 
 #if defined(LOGFILE)
-/* Logfile management */
-void logfile_flush(FIL *file);
+/* Logfile management: logfile_flush() writes out all buffered text, from
+ * the UI. logfile_stream() queues a little more as an async write, and is
+ * polled while the drive is idle. */
+void logfile_flush(void);
+void logfile_stream(void);
+/* Log from IRQ context, deferring the formatting to thread context. @fmt
+ * must be a string constant, and may consume up to three word arguments. */
+void trace(const char *fmt, uint32_t a, uint32_t b, uint32_t c);
 #else /* !LOGFILE */
-#define logfile_flush(f) ((void)0)
+#define logfile_flush() ((void)0)
+#define logfile_stream() ((void)0)
+#define trace(fmt, a, b, c) printk(fmt, a, b, c)
 #endif
 
 #if !defined(NDEBUG)
 /* Serial console control */
 void console_init(void);
+/* Drain console output by DMA, if the DMA channel is not otherwise in use.
+ * Call after display_init(). */
+void console_enable_dma(void);
 void console_sync(void);
 void console_crash_on_input(void);
 #else /* NDEBUG */
 #define console_init() ((void)0)
+#define console_enable_dma() ((void)0)
 #define console_sync() IRQ_global_disable()
 #define console_crash_on_input() ((void)0)
 #endif
 
 /* CRC-CCITT */
+extern const uint16_t crc16tab[][256];
 uint16_t crc16_ccitt(const void *buf, size_t len, uint16_t crc);
+#ifndef BOOTLOADER
+/* Slice-by-4: fold the four bytes of little-endian word @w into @crc. */
+static inline uint16_t crc16_ccitt_word(uint32_t w, uint16_t crc)
+{
+    w ^= _rev16(crc);
+    return crc16tab[3][(uint8_t)w] ^ crc16tab[2][(uint8_t)(w>>8)]
+        ^ crc16tab[1][(uint8_t)(w>>16)] ^ crc16tab[0][w>>24];
+}
+#endif
+/* CRC-32 by the CRC unit: polynomial 0x04c11db7, MSB first, initial value ~0,
+ * no final XOR. Input is a word at a time. There is only one unit: a CRC must
+ * be computed from reset to result by one thread at a time. */
+#define crc32_hw_reset() (crc_unit->cr = CRC_CR_RESET)
+#define crc32_hw_word(w) (crc_unit->dr = (w))
+#define crc32_hw_result() (crc_unit->dr)
+/* Fold @len bytes at @buf into the CRC-32 in progress, and return the result.
+ * @buf must be word aligned, and @len a multiple of 4. Large buffers are fed
+ * to the unit by DMA, and the caller yields meanwhile. */
+uint32_t crc32_hw(const void *buf, size_t len);
+#if !defined(NDEBUG) && !defined(BOOTLOADER)
+/* Print CRC cycles/byte. @scratch is 1536 bytes, word aligned. */
+void crc16_bench(void *scratch);
+#else
+#define crc16_bench(scratch) ((void)0)
+#endif
 
 /* Display setup and identification. */
 void display_init(void);
@@ -121,8 +186,9 @@ void speaker_pulse(void);
 
 /* Display: 3-digit 7-segment display */
 void led_7seg_init(void);
-void led_7seg_write_raw(const uint8_t *d);
-void led_7seg_write_string(const char *p);
+/* Returns FALSE if the display did not acknowledge the write. */
+bool_t led_7seg_write_raw(const uint8_t *d);
+bool_t led_7seg_write_string(const char *p);
 void led_7seg_write_decimal(unsigned int val);
 void led_7seg_display_setting(bool_t enable);
 int led_7seg_nr_digits(void);
@@ -151,6 +217,7 @@ uint16_t get_slot_nr(void);
 bool_t set_slot_nr(uint16_t slot_nr);
 void set_slot_name(const char *name);
 bool_t get_img_cfg(struct slot *slot);
+bool_t get_img_cfg_index(struct slot *slot);
 void IRQ_rotary(void);
 
 enum { DM_normal=0, DM_banner, DM_menu };
@@ -180,6 +247,7 @@ extern const char build_time[];
 extern char _stext[], _etext[];
 extern char _smaintext[], _emaintext[];
 extern char _sdat[], _edat[], _ldat[];
+extern char _sramfunc[], _eramfunc[]; /* SRAM code, within .data */
 extern char _sbss[], _ebss[];
 
 /* Stacks. */
@@ -187,6 +255,13 @@ extern uint32_t _thread_stacktop[], _thread_stackbottom[];
 extern uint32_t _thread1_stacktop[], _thread1_stackbottom[];
 extern uint32_t _irq_stacktop[], _irq_stackbottom[];
 
+/* Stack usage measurement. Unused stack is painted with STACK_PAINT, and the
+ * bottom word doubles as an overflow canary. stack_peak() returns the peak
+ * bytes used since the stack was painted. */
+#define STACK_PAINT 0xdeadbeef
+void stack_paint(uint32_t *bottom, uint32_t *top);
+unsigned int stack_peak(uint32_t *bottom, uint32_t *top);
+
 /* Default exception handler. */
 void EXC_unused(void);
 
@@ -199,6 +274,7 @@ void EXC_unused(void);
 #define WDATA_IRQ_PRI         7
 #define RDATA_IRQ_PRI         8
 #define FLOPPY_SOFTIRQ_PRI    9
+#define DMA_COPY_IRQ_PRI     12
 #define I2C_IRQ_PRI          13
 #define USB_IRQ_PRI          14
 #define CONSOLE_IRQ_PRI      15
@@ -22,15 +22,37 @@ struct volume_ops {
 };
 
 bool_t volume_connected(void);
+/* Read-only state is cached: It is refreshed on mount, and by drivers
+ * calling volume_readonly_update() when their write protection may have
+ * changed. */
 bool_t volume_readonly(void);
+void volume_readonly_update(void);
 /* Returns TRUE if volume is in the middle of an operation that may
  * thread_yield(); FALSE if no I/O in progress. When TRUE, the thread will
  * yield as soon as calling this method would begin returning FALSE. */
 bool_t volume_interrupt(void);
 
+/* Hot metadata sectors are kept in @mem (VOLUME_KEEP_SECS sectors), outside
+ * the memory given to volume_cache_init(). They outlive the cache, serving
+ * reads until the next cache is initialised, and then seeding that cache.
+ * This only partly keeps the cache warm: not a FAT and directory working set,
+ * but the two hottest sectors, typically the current folder's directory
+ * sector and the FAT sector of the image's cluster chain. The memory is lost
+ * to every image's buffers, whose 64kB-board sizes leave little headroom (see
+ * buf_profiles[] and the HFE write buffer check). Reads which the kept
+ * sectors save are reported as "kept" with each cache's statistics. */
+#define VOLUME_KEEP_SECS 2
+void volume_keep_init(void *mem);
+
 void volume_cache_init(void *start, void *end);
 void volume_cache_destroy(void);
 void volume_cache_metadata_only(FIL *fp);
+/* Hold metadata writes from @fs in the volume cache, or write through if @fs
+ * is NULL. Any dirty metadata is written back first. */
+void volume_set_writeback(FATFS *fs);
+/* Dirty metadata is due for write-back, which the next volume operation
+ * performs. An idle caller should issue a CTRL_SYNC disk_ioctl(). */
+bool_t volume_writeback_due(void);
 
 /*
  * Local variables:
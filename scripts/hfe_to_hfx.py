@@ -0,0 +1,69 @@
+# hfe_to_hfx.py
+#
+# Convert an HFE image to HFX, which stores each track side contiguously.
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys,struct,argparse
+
+def main(argv):
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("infile", help="input HFE filename")
+  parser.add_argument("outfile", help="output HFX filename")
+  args = parser.parse_args(argv[1:])
+
+  with open(args.infile, "rb") as f:
+    dat = f.read()
+
+  (sig, rev, nr_cyls, nr_sides, enc, rate, rpm, ifm, rsvd,
+   tlut_base) = struct.unpack("<8s4B2H2BH", dat[:20])
+  single_step = dat[21]
+  if sig == b"HXCHFEV3":
+    print("HFEv3 opcodes are not supported by HFX")
+    return 1
+  if sig != b"HXCPICFE" or rev > 1:
+    print("Not an HFE image")
+    return 1
+
+  # Split each cylinder's interleaved 256-byte blocks into its two sides.
+  sides = []
+  for cyl in range(nr_cyls):
+    off, ln = struct.unpack("<2H", dat[tlut_base*512+cyl*4:][:4])
+    trk = dat[off*512:off*512+(ln+511)//512*512]
+    for side in range(nr_sides):
+      s = bytearray()
+      for blk in range(0, len(trk), 512):
+        s += trk[blk+side*256:blk+side*256+256]
+      sides.append(bytes(s[:ln//2]))
+
+  # Header, then track list, then one sector-aligned run per track side.
+  tlut_blocks = (len(sides)*12 + 511) // 512
+  base = 1 + tlut_blocks
+  out_f = open(args.outfile, "wb")
+  out_f.write(struct.pack("<8s4B2H",
+                          b"FFHFXTRK", # signature
+                          0,           # revision
+                          nr_cyls,     # nr_cyls
+                          nr_sides,    # nr_sides
+                          0 if single_step else 1, # flags: double step
+                          rate,        # bitrate
+                          1))          # track_list_offset
+  out_f.write(bytearray(b'\xff'*(512-16)))
+  for s in sides:
+    out_f.write(struct.pack("<2I2H", base, len(s), 0, 0))
+    base += (len(s) + 511) // 512
+  out_f.write(bytearray(b'\xff'*(tlut_blocks*512-len(sides)*12)))
+  for s in sides:
+    out_f.write(s)
+    out_f.write(bytearray(b'\x88'*(-len(s) % 512)))
+
+  print("%u cylinders, %u sides: %u -> %u bytes"
+        % (nr_cyls, nr_sides, len(dat), out_f.tell()))
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv))
@@ -1,7 +1,8 @@
 /*
  * arena.c
  * 
- * Arena-based memory allocation. Only one arena, for now.
+ * Arena-based memory allocation. Only one arena, for now, but its space is
+ * accounted to named regions so that we can see where it goes.
  * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
@@ -12,15 +13,72 @@
 #define heap_bot (_ebss)
 static char *heap_p;
 static char *heap_top;
+static uint32_t reserved; /* Bytes held back from the top of RAM */
+
+static uint8_t region;
+static uint32_t region_sz[ARENA_nr];
+
+static const char *const region_name[ARENA_nr] = {
+    [ARENA_misc]    = "misc",
+    [ARENA_dma]     = "dma",
+    [ARENA_image]   = "image",
+    [ARENA_ring]    = "ring",
+    [ARENA_journal] = "journal",
+    [ARENA_buf]     = "buf",
+    [ARENA_dirents] = "dirents",
+    [ARENA_cache]   = "cache"
+};
 
 void *arena_alloc(uint32_t sz)
 {
     void *p = heap_p;
-    heap_p += (sz + 3) & ~3;
+    sz = (sz + 3) & ~3;
+    heap_p += sz;
     ASSERT(heap_p <= heap_top);
+    region_sz[region] += sz;
     return p;
 }
 
+void arena_region(unsigned int r)
+{
+    ASSERT(r < ARENA_nr);
+    region = r;
+}
+
+void arena_note(unsigned int r, uint32_t sz)
+{
+    ASSERT(r < ARENA_nr);
+    region_sz[r] = sz;
+}
+
+void *arena_mark(void)
+{
+    return heap_p;
+}
+
+void arena_release(void *mark)
+{
+    uint32_t sz = heap_p - (char *)mark;
+    /* A scope must not reach back into an earlier region. */
+    ASSERT(sz <= region_sz[region]);
+    region_sz[region] -= sz;
+    heap_p = mark;
+}
+
+void arena_report(void)
+{
+    unsigned int r;
+
+    printk("Arena:");
+    for (r = 0; r < ARENA_nr; r++)
+        if (region_sz[r])
+            printk(" %s=%u", region_name[r], region_sz[r]);
+    /* SRAM code sits below the arena, so its size comes straight out of it. */
+    if (_eramfunc != _sramfunc)
+        printk(" ramfunc=%u", (unsigned int)(_eramfunc - _sramfunc));
+    printk(" free=%u/%u\n", arena_avail(), arena_total());
+}
+
 uint32_t arena_total(void)
 {
     return heap_top - heap_bot;
@@ -31,10 +89,21 @@ uint32_t arena_avail(void)
     return heap_top - heap_p;
 }
 
+void *arena_reserve(uint32_t sz)
+{
+    sz = (sz + 3) & ~3;
+    reserved += sz;
+    heap_top -= sz;
+    ASSERT(heap_p <= heap_top);
+    return heap_top;
+}
+
 void arena_init(void)
 {
     heap_p = heap_bot;
-    heap_top = (char *)0x20000000 + ram_kb*1024;
+    heap_top = (char *)0x20000000 + ram_kb*1024 - reserved;
+    region = ARENA_misc;
+    memset(region_sz, 0, sizeof(region_sz));
 }
 
 /*
@@ -9,27 +9,52 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
+/* Replacement is a simplified 2Q. New items enter a FIFO probationary list.
+ * An item referenced again while on probation is promoted to a protected
+ * LRU list. Victims come from probation, unless probation has shrunk to a
+ * quarter of the cache. Hence one pass over a large file cycles only the
+ * probationary list, while repeatedly-used FAT and directory sectors stay
+ * protected.
+ *
+ * Items may also be dirty (written to the cache but not yet to storage).
+ * Dirty items are never chosen as victims, and are written back in the order
+ * they were last modified. */
+
 struct cache_ent {
     uint32_t id;
     struct list_head lru;
     struct list_head hash;
+    uint8_t refs;     /* References while on probation */
+    bool_t protected; /* On the protected list? */
+    bool_t dirty;
     uint8_t dat[0];
 };
 
 struct cache {
     uint32_t item_sz;
-    struct list_head lru;
-    struct list_head hash[32];
+    uint16_t nr_items, nr_protected;
+    uint32_t hash_mask;
+    struct list_head probation;
+    struct list_head protected;
+    struct list_head *hash;
+    uint8_t nr_dirty, max_dirty;
+    struct cache_ent *dirty[CACHE_MAX_DIRTY]; /* Oldest modification first */
     struct cache_ent ents[0];
 };
 
+/* Items are promoted after this many references on probation. Read-ahead 
+ * inserts a sector before the caller reads it, so a sector read once only 
+ * does not qualify. */
+#define PROMOTE_REFS 2
+
 static struct cache *cache;
-#define CACHE_HASH(_id) ((_id)&31)
+static struct cache_stats stats;
+#define CACHE_HASH(_c, _id) ((_id)&(_c)->hash_mask)
 
 struct cache *cache_init(void *start, void *end, unsigned int item_sz)
 {
     uint8_t *s, *e;
-    int i, nitm;
+    int i, nitm, nhash, ent_sz;
     struct cache *c;
     struct cache_ent *cent;
 
@@ -37,7 +62,19 @@ struct cache *cache_init(void *start, void *end, unsigned int item_sz)
     s = (uint8_t *)(((uint32_t)start + 3) & ~3);
     e = (uint8_t *)((uint32_t)end & ~3);
 
-    nitm = ((e - s) - (int)sizeof(*c)) / (int)(sizeof(*cent) + item_sz);
+    ent_sz = sizeof(*cent) + item_sz;
+    nitm = ((e - s) - (int)sizeof(*c)) / ent_sz;
+    if (nitm < 8) {
+        printk("No cache: too small (%d)\n", e - s);
+        return NULL;
+    }
+
+    /* Size the hash table for an average chain length of at most two. Then
+     * account for the hash table's own footprint. */
+    for (nhash = 4; nhash < nitm/2; nhash <<= 1)
+        continue;
+    nitm = ((e - s) - (int)sizeof(*c)
+            - nhash * (int)sizeof(struct list_head)) / ent_sz;
     if (nitm < 8) {
         printk("No cache: too small (%d)\n", e - s);
         return NULL;
@@ -46,71 +83,217 @@ struct cache *cache_init(void *start, void *end, unsigned int item_sz)
     /* Initialise the empty cache structure. */
     cache = c = (struct cache *)s;
     c->item_sz = item_sz;
-    list_init(&c->lru);
-    for (i = 0; i < ARRAY_SIZE(c->hash); i++)
+    c->nr_items = nitm;
+    c->nr_protected = 0;
+    c->hash_mask = nhash - 1;
+    c->nr_dirty = 0;
+    c->max_dirty = min_t(int, CACHE_MAX_DIRTY, nitm/2);
+    list_init(&c->probation);
+    list_init(&c->protected);
+    c->hash = (struct list_head *)((uint32_t)c->ents + nitm * ent_sz);
+    for (i = 0; i < nhash; i++)
         list_init(&c->hash[i]);
+    memset(&stats, 0, sizeof(stats));
 
-    /* Insert all the cache entries into the LRU list. They are not present 
-     * in any hash chain as none of the cache entries are yet in use. */
+    /* Insert all the cache entries into the probationary list. They are not
+     * present in any hash chain as none of the cache entries are yet in
+     * use. */
     cent = c->ents;
     for (i = 0; i < nitm; i++) {
-        list_insert_tail(&c->lru, &cent->lru);
+        list_insert_tail(&c->probation, &cent->lru);
         list_init(&cent->hash);
-        cent = (struct cache_ent *)((uint32_t)cent + sizeof(*cent) + item_sz);
+        cent->protected = cent->dirty = FALSE;
+        cent = (struct cache_ent *)((uint32_t)cent + ent_sz);
     }
 
-    printk("Cache %u items\n", nitm);
+    printk("Cache %u items, %u hash chains\n", nitm, nhash);
 
     return c;
 }
 
-const void *cache_lookup(struct cache *c, uint32_t id)
+static struct cache_ent *cache_find(struct cache *c, uint32_t id)
 {
     struct list_head *hash, *ent;
     struct cache_ent *cent;
 
     /* Look up the item in the appropriate hash chain. */
-    hash = &c->hash[CACHE_HASH(id)];
+    hash = &c->hash[CACHE_HASH(c, id)];
     for (ent = hash->next; ent != hash; ent = ent->next) {
         cent = container_of(ent, struct cache_ent, hash);
         if (cent->id == id)
-            goto found;
+            return cent;
     }
+
     return NULL;
+}
 
-found:
-    /* Item is cached. Move it to head of LRU and return the data. */
+/* Note a reference to a cached item: promote it, or move it to the head of
+ * its list. */
+static void cache_touch(struct cache *c, struct cache_ent *cent)
+{
     list_remove(&cent->lru);
-    list_insert_head(&c->lru, &cent->lru);
+    if (!cent->protected && (++cent->refs >= PROMOTE_REFS)) {
+        cent->protected = TRUE;
+        c->nr_protected++;
+    }
+    list_insert_head(cent->protected ? &c->protected : &c->probation,
+                     &cent->lru);
+}
+
+const void *cache_lookup(struct cache *c, uint32_t id)
+{
+    struct cache_ent *cent;
+
+    if ((cent = cache_find(c, id)) == NULL) {
+        stats.misses++;
+        return NULL;
+    }
+
+    /* Item is cached. Note the reference and return the data. */
+    stats.hits++;
+    cache_touch(c, cent);
     return cent->dat;
 }
 
-void cache_update(struct cache *c, uint32_t id, const void *dat)
+/* Least-recently-used clean entry on @list, or NULL if there is none. */
+static struct cache_ent *clean_tail(struct list_head *list)
+{
+    struct list_head *ent;
+    struct cache_ent *cent;
+
+    for (ent = list->prev; ent != list; ent = ent->prev) {
+        cent = container_of(ent, struct cache_ent, lru);
+        if (!cent->dirty)
+            return cent;
+    }
+
+    return NULL;
+}
+
+/* Find the entry for item @id, assigning it an entry if not present. */
+static struct cache_ent *cache_insert(struct cache *c, uint32_t id)
 {
     struct cache_ent *cent;
-    void *p;
 
-    /* Already in the cache? Just update the existing data. */
-    if ((p = (void *)cache_lookup(c, id)) != NULL)
-        goto found;
+    /* Already in the cache? */
+    if ((cent = cache_find(c, id)) != NULL) {
+        cache_touch(c, cent);
+        return cent;
+    }
 
-    /* Steal the oldest cache entry from the LRU. */
-    cent = container_of(c->lru.prev, struct cache_ent, lru);
-    p = cent->dat;
+    /* Steal the oldest probationary entry, unless probation has shrunk to a
+     * quarter of the cache: then steal the least-recently-used protected
+     * entry instead. There is always a clean entry as at most half the
+     * cache can be dirty. */
+    cent = (!list_is_empty(&c->protected)
+            && ((c->nr_items - c->nr_protected) <= c->nr_items/4))
+        ? clean_tail(&c->protected) : NULL;
+    if (cent == NULL)
+        cent = clean_tail(&c->probation);
+    if (cent == NULL)
+        cent = clean_tail(&c->protected);
+    ASSERT(cent != NULL);
 
     /* Remove the selected cache entry from the cache. */
     list_remove(&cent->lru);
-    if (!list_is_empty(&cent->hash))
+    if (!list_is_empty(&cent->hash)) {
         list_remove(&cent->hash);
+        stats.evictions++;
+    }
+    if (cent->protected) {
+        cent->protected = FALSE;
+        c->nr_protected--;
+    }
 
-    /* Reinsert the cache entry in the correct hash chain, and head of LRU. */
+    /* Reinsert the cache entry in the correct hash chain, and head of the
+     * probationary list. */
     cent->id = id;
-    list_insert_head(&c->lru, &cent->lru);
-    list_insert_head(&c->hash[CACHE_HASH(id)], &cent->hash);
+    cent->refs = 0;
+    list_insert_head(&c->probation, &cent->lru);
+    list_insert_head(&c->hash[CACHE_HASH(c, id)], &cent->hash);
 
-found:
-    /* Finally, store away the actual item data. */
-    memcpy(p, dat, c->item_sz);
+    return cent;
+}
+
+void cache_update(struct cache *c, uint32_t id, const void *dat)
+{
+    struct cache_ent *cent = cache_insert(c, id);
+    memcpy(cent->dat, dat, c->item_sz);
+}
+
+bool_t cache_write(struct cache *c, uint32_t id, const void *dat)
+{
+    struct cache_ent *cent = cache_find(c, id);
+    unsigned int i;
+
+    if (cent && cent->dirty) {
+        /* Already dirty: move to the back of the write-back order. */
+        for (i = 0; c->dirty[i] != cent; i++)
+            continue;
+        memmove(&c->dirty[i], &c->dirty[i+1],
+                (c->nr_dirty - i - 1) * sizeof(c->dirty[0]));
+        c->nr_dirty--;
+    } else if (c->nr_dirty >= c->max_dirty) {
+        return FALSE;
+    }
+
+    cent = cache_insert(c, id);
+    memcpy(cent->dat, dat, c->item_sz);
+    cent->dirty = TRUE;
+    c->dirty[c->nr_dirty++] = cent;
+    return TRUE;
+}
+
+bool_t cache_writeback(struct cache *c,
+                       bool_t (*write)(uint32_t id, const void *dat))
+{
+    struct cache_ent *cent;
+    unsigned int i;
+
+    for (i = 0; i < c->nr_dirty; i++) {
+        cent = c->dirty[i];
+        if (!(*write)(cent->id, cent->dat))
+            break;
+        cent->dirty = FALSE;
+    }
+
+    /* Anything not written back remains dirty, in order. */
+    c->nr_dirty -= i;
+    memmove(&c->dirty[0], &c->dirty[i], c->nr_dirty * sizeof(c->dirty[0]));
+    return c->nr_dirty == 0;
+}
+
+static unsigned int export_list(struct cache *c, struct list_head *list,
+                                uint32_t *id, uint8_t *p, unsigned int N)
+{
+    struct list_head *ent;
+    struct cache_ent *cent;
+    unsigned int n = 0;
+
+    for (ent = list->next; (ent != list) && (n < N); ent = ent->next) {
+        cent = container_of(ent, struct cache_ent, lru);
+        if (cent->dirty || list_is_empty(&cent->hash))
+            continue;
+        id[n++] = cent->id;
+        memcpy(p, cent->dat, c->item_sz);
+        p += c->item_sz;
+    }
+
+    return n;
+}
+
+unsigned int cache_export(struct cache *c, uint32_t *id,
+                          void *dat, unsigned int N)
+{
+    uint8_t *p = dat;
+    unsigned int n = export_list(c, &c->protected, id, p, N);
+    return n + export_list(c, &c->probation, id + n,
+                           p + n * c->item_sz, N - n);
+}
+
+void cache_get_stats(struct cache_stats *_stats)
+{
+    *_stats = stats;
 }
 
 void cache_update_N(struct cache *c, uint32_t id,
@@ -124,6 +307,20 @@ void cache_update_N(struct cache *c, uint32_t id,
     }
 }
 
+void cache_fill_N(struct cache *c, uint32_t id, void *dat, unsigned int N)
+{
+    struct cache_ent *cent;
+    uint8_t *p = dat;
+    while (N--) {
+        if (((cent = cache_find(c, id)) != NULL) && cent->dirty)
+            memcpy(p, cent->dat, c->item_sz);
+        else
+            cache_update(c, id, p);
+        id++;
+        p += c->item_sz;
+    }
+}
+
 /*
  * Local variables:
  * mode: C
@@ -36,6 +36,7 @@ next_line:
     /* Skip leading whitespace. */
     while (isspace(c))
         F_read(opts->file, &c, 1, NULL);
+    opts->ofs = f_tell(opts->file) - 1;
 
     /* Option name parsing. */
     section = (c == '['); /* "[section]" */
@@ -26,6 +26,19 @@ static unsigned int cons, prod;
  * and the transmit-empty flag is polled manually for each byte. */
 static bool_t sync_console;
 
+/* When DMA1 channel 4 is not needed elsewhere, the ring is drained by DMA.
+ * That channel's completion IRQ belongs to the display driver, so instead a
+ * timer fires when the transfer in flight should be done, and chains the
+ * next. Transfers are contiguous runs of the ring, of @dma_nr bytes starting
+ * at @cons. All state is updated with IRQs disabled. printk() may be called
+ * at any IRQ priority, so it leaves arming the timer to the soft IRQ. */
+#define dma_tx (dma1->ch4)
+#define dma_tx_ch 4
+#define BYTE_TICKS (10 * (TIME_MHZ * 1000000u / BAUD)) /* 8n1 */
+static bool_t tx_dma;
+static unsigned int dma_nr;
+static struct timer dma_timer;
+
 static void flush_ring_to_serial(void)
 {
     unsigned int c = cons, p = prod;
@@ -41,31 +54,96 @@ static void flush_ring_to_serial(void)
     cons = c;
 }
 
+static void dma_timer_arm(void)
+{
+    timer_set(&dma_timer, time_now() + dma_tx.cndtr * BYTE_TICKS);
+}
+
 static void SOFTIRQ_console(void)
 {
-    flush_ring_to_serial();
+    if (!tx_dma) {
+        flush_ring_to_serial();
+        return;
+    }
+    IRQ_global_disable();
+    if (!sync_console && dma_nr)
+        dma_timer_arm();
+    IRQ_global_enable();
+}
+
+static void dma_tx_start(void)
+{
+    unsigned int c = cons, p = prod;
+
+    if (c == p)
+        return;
+
+    dma_nr = min_t(unsigned int, p - c, sizeof(ring) - MASK(c));
+    dma_tx.ccr = 0;
+    dma1->ifcr = DMA_IFCR_CGIF(dma_tx_ch);
+    dma_tx.cmar = (uint32_t)(unsigned long)&ring[MASK(c)];
+    dma_tx.cndtr = dma_nr;
+    dma_tx.ccr = (DMA_CCR_PL_LOW |
+                  DMA_CCR_MSIZE_8BIT |
+                  DMA_CCR_PSIZE_16BIT |
+                  DMA_CCR_MINC |
+                  DMA_CCR_DIR_M2P |
+                  DMA_CCR_EN);
+}
+
+/* Retire the DMA transfer in flight, waiting for it if @wait. Returns FALSE
+ * if it is still in progress. */
+static bool_t dma_tx_retire(bool_t wait)
+{
+    while (dma_tx.cndtr != 0) {
+        if (!wait)
+            return FALSE;
+        cpu_relax();
+    }
+
+    dma_tx.ccr = 0;
+    cons += dma_nr;
+    dma_nr = 0;
+    return TRUE;
+}
+
+static void dma_timer_fn(void *unused)
+{
+    IRQ_global_disable();
+    if (!sync_console) {
+        if (dma_tx_retire(FALSE))
+            dma_tx_start();
+        if (dma_nr)
+            dma_timer_arm();
+    }
+    IRQ_global_enable();
 }
 
 static void kick_tx(void)
 {
     if (sync_console) {
+        if (tx_dma) {
+            /* Finish the transfer in flight, then poll as usual. */
+            dma_tx_retire(TRUE);
+            usart1->cr3 = 0;
+            tx_dma = FALSE;
+        }
         flush_ring_to_serial();
+    } else if (tx_dma) {
+        if ((dma_nr == 0) && (cons != prod)) {
+            dma_tx_start();
+            IRQx_set_pending(CONSOLE_SOFTIRQ);
+        }
     } else if (cons != prod) {
         IRQx_set_pending(CONSOLE_SOFTIRQ);
     }
 }
 
-int vprintk(const char *format, va_list ap)
+/* Copy formatted string @p into the ring. Called with IRQs disabled. */
+static void ring_put(const char *p)
 {
-    static char str[128];
-    char *p, c;
-    int n;
-
-    IRQ_global_disable();
-
-    n = vsnprintf(str, sizeof(str), format, ap);
+    char c;
 
-    p = str;
     while (((c = *p++) != '\0') && ((prod-cons) != (sizeof(ring) - 1))) {
         switch (c) {
         case '\r': /* CR: ignore as we generate our own CR/LF */
@@ -80,6 +158,28 @@ int vprintk(const char *format, va_list ap)
     }
 
     kick_tx();
+}
+
+int vprintk(const char *format, va_list ap)
+{
+    /* Threads are cooperatively scheduled, so can share one buffer, and may
+     * format into it with IRQs enabled. IRQ handlers can nest, so format
+     * with IRQs disabled into a buffer of their own. */
+    static char thread_str[128], irq_str[128];
+    char *str;
+    int n;
+
+    if (in_exception()) {
+        str = irq_str;
+        IRQ_global_disable();
+        n = vsnprintf(str, sizeof(irq_str), format, ap);
+    } else {
+        str = thread_str;
+        n = vsnprintf(str, sizeof(thread_str), format, ap);
+        IRQ_global_disable();
+    }
+
+    ring_put(str);
 
     if (!sync_console)
         IRQ_global_enable();
@@ -129,6 +229,25 @@ void console_init(void)
     IRQx_enable(CONSOLE_SOFTIRQ);
 }
 
+void console_enable_dma(void)
+{
+    /* DMA1 channel 4 also serves I2C2 (display/OSD) and SPI2 (SD card). */
+    if ((rcc->apb1enr & RCC_APB1ENR_I2C2EN)
+        || (board_id == BRDREV_Gotek_sd_card))
+        return;
+
+    timer_init(&dma_timer, dma_timer_fn, NULL);
+    dma_tx.cpar = (uint32_t)(unsigned long)&usart1->dr;
+
+    IRQ_global_disable();
+    if (!sync_console) {
+        usart1->cr3 = USART_CR3_DMAT;
+        tx_dma = TRUE;
+        kick_tx();
+    }
+    IRQ_global_enable();
+}
+
 /* Debug helper: if we get stuck somewhere, calling this beforehand will cause 
  * any serial input to cause a crash dump of the stuck context. */
 void console_crash_on_input(void)
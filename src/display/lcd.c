@@ -76,12 +76,15 @@ static uint8_t _bl;
 static uint8_t i2c_addr;
 static uint8_t i2c_dead;
 static uint8_t i2c_row;
+static volatile bool_t i2c_idle; /* No I2C transaction: awaiting new text */
 static bool_t is_oled_display;
 static uint8_t oled_height;
 
 #define OLED_ADDR 0x3c
 enum { OLED_unknown, OLED_ssd1306, OLED_sh1106 };
 static uint8_t oled_model;
+static uint8_t oled_page; /* SH1106: Page within current row being sent */
+static bool_t oled_data;  /* Data for current row to be sent next */
 static void oled_init(void);
 static unsigned int oled_prep_buffer(void);
 
@@ -98,6 +101,25 @@ static uint8_t buffer[256] aligned(4);
 /* Text buffer, rendered into I2C data and placed into buffer[]. */
 static char text[4][40];
 
+/* Text as last sent to each display row (LCD row, or OLED 16-pixel row). 
+ * Only the span of columns which differ from text[] is sent. */
+static char shown[4][40];
+static uint8_t shown_size[4]; /* OLED: oled_to_lcd_row() double height */
+static uint8_t span_lo, span_hi; /* Span of columns in current row */
+
+/* Wait this long for new text before polling for changes anyway (eg. to
+ * display mode). Occasionally re-send everything, in case the display has
+ * lost sync. */
+#define POLL_TIMEOUT time_ms(50)
+#define RESYNC_PERIOD time_ms(1000)
+static struct timer poll_timer;
+static time_t resync_time;
+static void poll_fn(void *unused)
+{
+    if (i2c_idle)
+        IRQx_set_pending(I2C_EVENT_IRQ);
+}
+
 /* Columns and rows of text. */
 uint8_t lcd_columns, lcd_rows;
 
@@ -130,6 +152,7 @@ static void IRQ_i2c_error(void)
     dma1->ifcr = DMA_IFCR_CGIF(4) | DMA_IFCR_CGIF(5);
 
     timer_cancel(&timeout_timer);
+    timer_cancel(&poll_timer);
 
     lcd_init();
 }
@@ -138,6 +161,12 @@ static void IRQ_i2c_event(void)
 {
     uint16_t sr1 = i2c->sr1;
 
+    if (i2c_idle) {
+        /* Woken by new text, or the poll timer. */
+        dma_tx_tc_btf();
+        return;
+    }
+
     if (sr1 & I2C_SR1_SB) {
         /* Send address. Clears SR1_SB. */
         uint8_t a = in_osd ? OSD_I2C_ADDR : i2c_addr;
@@ -205,6 +234,62 @@ static void emit8(uint8_t **p, uint8_t val, uint8_t signals)
     emit4(p, (val << 4) | signals);
 }
 
+/* End the current I2C transaction, if any, and start another. */
+static void i2c_restart(void)
+{
+    if (!i2c_idle)
+        i2c_stop();
+    i2c_idle = FALSE;
+    timer_cancel(&poll_timer);
+    i2c->cr2 |= I2C_CR2_ITEVTEN;
+    i2c->cr1 |= I2C_CR1_START;
+}
+
+/* Nothing to send: End the I2C transaction and wait for new text. */
+static void i2c_park(void)
+{
+    if (!i2c_idle)
+        i2c_stop();
+    i2c_idle = TRUE;
+    timer_cancel(&timeout_timer);
+    timer_set(&poll_timer, time_now() + POLL_TIMEOUT);
+}
+
+/* Start a new refresh of the display rows. */
+static void refresh_start(void)
+{
+    i2c_row = 0;
+    refresh_count++;
+    if (time_since(resync_time) > RESYNC_PERIOD) {
+        resync_time = time_now();
+        memset(shown, 0, sizeof(shown));
+    }
+}
+
+/* Compare display row @d with text row @p (NULL if blank). If they differ,
+ * update the row's shown[] text and return TRUE with the differing span of
+ * columns in span_lo..span_hi-1. */
+#define text_at(p, i) ((p) ? (p)[i] : ' ')
+static bool_t row_diff(unsigned int d, const char *p)
+{
+    char *s = shown[d];
+    unsigned int lo, hi;
+
+    for (lo = 0; (lo < lcd_columns) && (s[lo] == text_at(p, lo)); lo++)
+        continue;
+    if (lo == lcd_columns)
+        return FALSE;
+    for (hi = lcd_columns; s[hi-1] == text_at(p, hi-1); hi--)
+        continue;
+
+    span_lo = lo;
+    span_hi = hi;
+    for (; lo < hi; lo++)
+        s[lo] = text_at(p, lo);
+
+    return TRUE;
+}
+
 /* Snapshot text buffer into the command buffer. */
 static unsigned int osd_prep_buffer(void)
 {
@@ -249,33 +334,44 @@ static unsigned int lcd_prep_buffer(void)
     char *p;
     uint8_t *q = buffer;
     unsigned int i, row;
+    bool_t restarted = FALSE;
+
+    order = (lcd_rows == 2) ? 0x7710 : 0x2103;
+    if ((ff_cfg.display_order != DORD_default) && (display_mode == DM_normal))
+        order = ff_cfg.display_order;
+
+    for (;;) {
+        if (i2c_row > lcd_rows) {
+            refresh_start();
+            restarted = TRUE;
+        }
+
+        /* Find the next row with changed text. */
+        for (; i2c_row < lcd_rows; i2c_row++) {
+            row = (order >> (i2c_row * DORD_shift)) & DORD_row;
+            p = (row < ARRAY_SIZE(text)) ? text[row] : NULL;
+            if (row_diff(i2c_row, p))
+                goto found;
+        }
 
-    if (i2c_row == lcd_rows) {
         i2c_row++;
         if (has_osd) {
             i2c_stop();
             return osd_prep_buffer();
         }
-    }
 
-    if (i2c_row > lcd_rows) {
-        i2c_row = 0;
-        refresh_count++;
-        i2c_stop();
-        i2c->cr2 |= I2C_CR2_ITEVTEN;
-        i2c->cr1 |= I2C_CR1_START;
+        /* Display is up to date if nothing changed since a new refresh. */
+        if (restarted)
+            return 0;
     }
 
-    order = (lcd_rows == 2) ? 0x7710 : 0x2103;
-    if ((ff_cfg.display_order != DORD_default) && (display_mode == DM_normal))
-        order = ff_cfg.display_order;
+found:
+    if (restarted)
+        i2c_restart();
 
-    row = (order >> (i2c_row * DORD_shift)) & DORD_row;
-    p = (row < ARRAY_SIZE(text)) ? text[row] : NULL;
-
-    emit8(&q, CMD_SETDDRADDR | row_offs[i2c_row], 0);
-    for (i = 0; i < lcd_columns; i++)
-        emit8(&q, p ? *p++ : ' ', _RS);
+    emit8(&q, CMD_SETDDRADDR | (row_offs[i2c_row] + span_lo), 0);
+    for (i = span_lo; i < span_hi; i++)
+        emit8(&q, shown[i2c_row][i], _RS);
 
     i2c_row++;
 
@@ -310,6 +406,10 @@ static void dma_tx_tc_btf(void)
         dma_sz = osd_prep_buffer();
     } else {
         dma_sz = is_oled_display ? oled_prep_buffer() : lcd_prep_buffer();
+        if (dma_sz == 0) {
+            i2c_park();
+            return;
+        }
     }
     dma_start(dma_sz);
 }
@@ -426,15 +526,27 @@ static uint8_t i2c_probe_range(uint8_t s, uint8_t e)
     return 0;
 }
 
+/* Wake the idle refresh pipeline to send changed text. Call with I2C IRQs
+ * masked. */
+static void lcd_kick(void)
+{
+    if (i2c_idle)
+        IRQx_set_pending(I2C_EVENT_IRQ);
+}
+
 void lcd_clear(void)
 {
+    uint32_t oldpri = IRQ_save(I2C_IRQ_PRI);
     memset(text, ' ', sizeof(text));
+    lcd_kick();
+    IRQ_restore(oldpri);
 }
 
 void lcd_write(int col, int row, int min, const char *str)
 {
     char c, *p;
     uint32_t oldpri;
+    bool_t changed = FALSE;
 
     if (min < 0)
         min = lcd_columns;
@@ -445,25 +557,42 @@ void lcd_write(int col, int row, int min, const char *str)
     oldpri = IRQ_save(I2C_IRQ_PRI);
 
     while ((c = *str++) && (col++ < lcd_columns)) {
+        changed |= (*p != c);
         *p++ = c;
         min--;
     }
-    while ((min-- > 0) && (col++ < lcd_columns))
+    while ((min-- > 0) && (col++ < lcd_columns)) {
+        changed |= (*p != ' ');
         *p++ = ' ';
+    }
+
+    if (changed)
+        lcd_kick();
 
     IRQ_restore(oldpri);
 }
 
 void lcd_backlight(bool_t on)
 {
-    /* Will be picked up the next time text[] is rendered. */
-    _bl = on ? _BL : 0;
+    uint8_t bl = on ? _BL : 0;
+    uint32_t oldpri;
+
+    if (bl == _bl)
+        return;
+
+    /* Will be picked up when all rows are next sent. */
+    oldpri = IRQ_save(I2C_IRQ_PRI);
+    _bl = bl;
+    memset(shown, 0, sizeof(shown));
+    lcd_kick();
+    IRQ_restore(oldpri);
 }
 
 void lcd_sync(void)
 {
     uint8_t c = refresh_count;
-    while ((uint8_t)(refresh_count - c) < 2)
+    /* An idle display is up to date. */
+    while (!i2c_idle && ((uint8_t)(refresh_count - c) < 2))
         cpu_relax();
 }
 
@@ -474,6 +603,10 @@ bool_t lcd_init(void)
 
     i2c_dead = FALSE;
     i2c_row = 0;
+    i2c_idle = FALSE;
+    oled_page = 0;
+    oled_data = FALSE;
+    memset(shown, 0, sizeof(shown));
     in_osd = OSD_no;
     osd_buttons_rx = 0;
 
@@ -619,6 +752,7 @@ bool_t lcd_init(void)
     /* Timeout handler for if I2C transmission borks. */
     timer_init(&timeout_timer, timeout_fn, NULL);
     timer_set(&timeout_timer, time_now() + DMA_TIMEOUT);
+    timer_init(&poll_timer, poll_fn, NULL);
 
     if (is_oled_display) {
         oled_init();
@@ -673,59 +807,45 @@ fail:
     return FALSE;
 }
 
+/* OLED fonts are stored as pre-rendered glyph columns: @w columns for the
+ * upper page of each glyph, followed by @w columns for the lower page. */
 extern const uint8_t oled_font_6x13[];
-static void oled_convert_text_row_6x13(char *pc)
-{
-    unsigned int i, c;
-    const uint8_t *p;
-    uint8_t *q = buffer;
-    const unsigned int w = 6;
-
-    q[0] = q[128] = 0;
-    q++;
-
-    for (i = 0; i < lcd_columns; i++) {
-        if ((c = *pc++ - 0x20) > 0x5e)
-            c = '.' - 0x20;
-        p = &oled_font_6x13[c * w * 2];
-        memcpy(q, p, w);
-        memcpy(q+128, p+w, w);
-        q += w;
-    }
-
-    /* Fill remainder of buffer[] with zeroes. */
-    memset(q, 0, 127-lcd_columns*w);
-    memset(q+128, 0, 127-lcd_columns*w);
-}
-
 #ifdef font_extra
 extern const uint8_t oled_font_8x16[];
-static void oled_convert_text_row_8x16(char *pc)
+#endif
+
+/* Blit the glyphs of columns @lo..@hi-1 of text row @pc into buffer[]. */
+static void oled_convert_text_row(const char *pc, unsigned int lo,
+                                  unsigned int hi)
 {
-    unsigned int i, c;
-    const uint8_t *p;
-    uint8_t *q = buffer;
-    const unsigned int w = 8;
+    unsigned int i, c, w = 6, ofs = 1;
+    const uint8_t *font = oled_font_6x13, *p;
+    uint8_t *q;
 
-    for (i = 0; i < lcd_columns; i++) {
-        if ((c = *pc++ - 0x20) > 0x5e)
+#ifdef font_extra
+    if (ff_cfg.oled_font == FONT_8x16) {
+        font = oled_font_8x16;
+        w = 8;
+        ofs = 0;
+    }
+#endif
+
+    q = &buffer[ofs + lo*w];
+    for (i = lo; i < hi; i++) {
+        if ((c = pc[i] - 0x20) > 0x5e)
             c = '.' - 0x20;
-        p = &oled_font_8x16[c * w * 2];
+        p = &font[c * w * 2];
         memcpy(q, p, w);
         memcpy(q+128, p+w, w);
         q += w;
     }
-}
-#endif
 
-static void oled_convert_text_row(char *pc)
-{
-#ifdef font_extra
-    if (ff_cfg.oled_font == FONT_8x16)
-        oled_convert_text_row_8x16(pc);
-    else
-#endif
-        oled_convert_text_row_6x13(pc);
+    /* Fill margins of buffer[] with zeroes. */
+    if (ofs)
+        buffer[0] = buffer[128] = 0;
+    q = &buffer[ofs + lcd_columns*w];
+    memset(q, 0, 128-ofs-lcd_columns*w);
+    memset(q+128, 0, 128-ofs-lcd_columns*w);
 }
 
 static unsigned int oled_queue_cmds(
@@ -741,96 +861,115 @@ static unsigned int oled_queue_cmds(
     return p - buf;
 }
 
-static void oled_double_height(uint8_t *dst, uint8_t *src, uint8_t mask)
+/* Double the height of @n columns of page @src: its low nibbles (@mask bit 0)
+ * and/or high nibbles (@mask bit 1) are expanded into consecutive pages at
+ * @dst. */
+static void oled_double_height(uint8_t *dst, const uint8_t *src,
+                               unsigned int n, uint8_t mask)
 {
     const uint8_t tbl[] = {
         0x00, 0x03, 0x0c, 0x0f, 0x30, 0x33, 0x3c, 0x3f,
         0xc0, 0xc3, 0xcc, 0xcf, 0xf0, 0xf3, 0xfc, 0xff
     };
-    uint8_t x, *p, *q;
+    uint8_t x, *q = dst;
     unsigned int i;
-    if ((mask == 3) && (src == dst)) {
-        p = src + 128;
-        q = dst + 256;
-        for (i = 0; i < 128; i++) {
-            x = *--p;
-            *--q = tbl[x>>4];
-        }
-        p = src + 128;
-        for (i = 0; i < 128; i++) {
-            x = *--p;
-            *--q = tbl[x&15];
-        }
-    } else {
-        p = src;
-        q = dst;
-        if (mask & 1) {
-            for (i = 0; i < 128; i++) {
-                x = *p++;
-                *q++ = tbl[x&15];
-            }
-        }
-        if (mask & 2) {
-            p = src;
-            for (i = 0; i < 128; i++) {
-                x = *p++;
-                *q++ = tbl[x>>4];
-            }
-        }
+
+    /* Each column is read before it is written, so that @src may overlap
+     * @dst. */
+    for (i = 0; i < n; i++) {
+        x = *src++;
+        if (mask & 1)
+            q[0] = tbl[x&15];
+        if (mask & 2)
+            q[(mask & 1) ? 128 : 0] = tbl[x>>4];
+        q++;
     }
 }
 
-static unsigned int oled_start_i2c(uint8_t *buf)
+/* Pixel columns spanned by display columns span_lo..span_hi-1. */
+static void oled_span(unsigned int *x0, unsigned int *x1)
 {
-    static const uint8_t ssd1306_addr_cmds[] = {
-        0x20, 0,      /* horizontal addressing mode */
-        0x21, 0, 127, /* column address range: 0-127 */
-        0x22, 0, 7,   /* page address range: 0-7 */
-    }, ztech_addr_cmds[] = {
-        0xda, 0x12,   /* alternate com pins config */
-        0x21, 4, 131, /* column address range: 4-131 */
-    }, sh1106_addr_cmds[] = {
-        0x10          /* column address high nibble is zero */
-    };
+    unsigned int w = 6, ofs = 1;
+
+    if ((span_lo == 0) && (span_hi == lcd_columns)) {
+        /* Whole row, including any blank margins. */
+        *x0 = 0;
+        *x1 = 128;
+        return;
+    }
+
+#ifdef font_extra
+    if (ff_cfg.oled_font == FONT_8x16) {
+        w = 8;
+        ofs = 0;
+    }
+#endif
 
-    uint8_t dynamic_cmds[4], *dc = dynamic_cmds;
+    *x0 = ofs + span_lo * w;
+    *x1 = ofs + span_hi * w;
+}
+
+/* Start an I2C transaction to write the current span of pixel columns within
+ * the current row: both pages (SSD1306) or page @oled_page (SH1106). */
+static unsigned int oled_start_i2c(uint8_t *buf)
+{
+    uint8_t dynamic_cmds[12], *dc = dynamic_cmds;
     uint8_t *p = buf;
+    unsigned int x0, x1;
+
+    oled_span(&x0, &x1);
 
     /* Set up the display address range. */
     if (oled_model == OLED_sh1106) {
-        p += oled_queue_cmds(p, sh1106_addr_cmds, sizeof(sh1106_addr_cmds));
-        /* Column address: 0 or 2 (seems 128x64 displays are shifted by 2). */
-        *dc++ = (oled_height == 64) ? 0x02 : 0x00;
+        /* Column address: Offset by 2 on 128x64 displays (seems they are
+         * shifted by 2). */
+        x0 += (oled_height == 64) ? 2 : 0;
+        *dc++ = 0x10 | (x0 >> 4);
+        *dc++ = 0x00 | (x0 & 15);
         /* Page address: according to i2c_row. */
-        *dc++ = 0xb0 + i2c_row;
+        *dc++ = 0xb0 + i2c_row*2 + oled_page;
     } else {
-        p += oled_queue_cmds(p, ssd1306_addr_cmds, sizeof(ssd1306_addr_cmds));
+        /* ZHONGJY_TECH 2.23" 128x32 display based on SSD1305 controller is
+         * offset horizontally. */
+        if (ff_cfg.display_type & DISPLAY_ztech) {
+            x0 += 4;
+            x1 += 4;
+        }
+        *dc++ = 0x20; /* horizontal addressing mode */
+        *dc++ = 0;
+        *dc++ = 0x21; /* column address range */
+        *dc++ = x0;
+        *dc++ = x1 - 1;
+        *dc++ = 0x22; /* page address range: according to i2c_row */
+        *dc++ = i2c_row*2;
+        *dc++ = i2c_row*2 + 1;
     }
 
     /* Display on/off according to backlight setting. */
     *dc++ = _bl ? 0xaf : 0xae;
 
-    p += oled_queue_cmds(p, dynamic_cmds, dc - dynamic_cmds);
+    /* ZHONGJY_TECH display also has alternate COM pin mapping. */
+    if (ff_cfg.display_type & DISPLAY_ztech) {
+        *dc++ = 0xda;
+        *dc++ = 0x12;
+    }
 
-    /* ZHONGJY_TECH 2.23" 128x32 display based on SSD1305 controller. 
-     * It has alternate COM pin mapping and is offset horizontally. */
-    if (ff_cfg.display_type & DISPLAY_ztech)
-        p += oled_queue_cmds(p, ztech_addr_cmds, sizeof(ztech_addr_cmds));
+    p += oled_queue_cmds(p, dynamic_cmds, dc - dynamic_cmds);
 
     /* All subsequent bytes are data bytes. */
     *p++ = 0x40;
 
     /* Start the I2C transaction. */
-    i2c->cr2 |= I2C_CR2_ITEVTEN;
-    i2c->cr1 |= I2C_CR1_START;
+    i2c_restart();
 
     return p - buf;
 }
 
-static int oled_to_lcd_row(int in_row)
+/* Text row and double-height half (if any) of OLED 16-pixel row @in_row. */
+static int oled_to_lcd_row(int in_row, int *prow)
 {
     uint16_t order;
-    int i = 0, row;
+    int i = 0;
     bool_t large = FALSE;
 
     order = (oled_height == 32) ? 0x7710 : menu_mode ? 0x7903 : 0x7183;
@@ -846,95 +985,109 @@ static int oled_to_lcd_row(int in_row)
     }
 
     /* Remap the row */
-    row = order & DORD_row;
-    if (row < lcd_rows) {
-        oled_convert_text_row(text[row]);
-    } else {
-        memset(buffer, 0, 256);
-    }
+    *prow = order & DORD_row;
 
     return large ? i - in_row : 0;
 }
 
-static unsigned int ssd1306_prep_buffer(void)
+/* Compare OLED row @d with the text it displays. */
+static bool_t oled_row_diff(unsigned int d)
 {
-    int size;
-
-    /* If we have completed a complete fill of the OLED display, start a new 
-     * I2C transaction. The OLED display seems to occasionally silently lose 
-     * a byte and then we lose sync with the display address. */
-    if (i2c_row == (oled_height / 16)) {
-        i2c_row++;
-        if (has_osd) {
-            i2c_stop();
-            return osd_prep_buffer();
-        }
-    }
+    int row, size = oled_to_lcd_row(d, &row);
 
-    if (i2c_row > (oled_height / 16)) {
-        i2c_row = 0;
-        refresh_count++;
-        i2c_stop();
-        return oled_start_i2c(buffer);
+    if (size != shown_size[d]) {
+        shown_size[d] = size;
+        memset(shown[d], 0, sizeof(shown[d]));
     }
 
-    /* Convert one row of text[] into buffer[] writes. */
-    size = oled_to_lcd_row(i2c_row);
-    if (size != 0)
-        oled_double_height(buffer, &buffer[(size == 1) ? 128 : 0], 0x3);
-
-    i2c_row++;
-
-    return 256;
+    return row_diff(d, (row < lcd_rows) ? text[row] : NULL);
 }
 
-static unsigned int sh1106_prep_buffer(void)
+/* Convert the current span of the current row into buffer[] writes. */
+static unsigned int oled_data_prep_buffer(void)
 {
-    int size;
-    uint8_t *p = buffer;
+    unsigned int x0, x1, w;
+    int size = shown_size[i2c_row];
 
-    if (i2c_row == (oled_height / 8)) {
-        i2c_row++;
-        if (has_osd) {
-            i2c_stop();
-            return osd_prep_buffer();
-        }
-    }
+    oled_span(&x0, &x1);
+    w = x1 - x0;
 
-    if (i2c_row > (oled_height / 8)) {
-        i2c_row = 0;
-        refresh_count++;
-    }
+    oled_convert_text_row(shown[i2c_row], span_lo, span_hi);
 
-    /* Convert one row of text[] into buffer[] writes. */
-    size = oled_to_lcd_row(i2c_row/2);
-    if (size != 0) {
-        oled_double_height(&buffer[128], &buffer[(size == 1) ? 128 : 0],
-                           (i2c_row & 1) + 1);
+    if (oled_model == OLED_sh1106) {
+        /* One page of the row, moved to buffer[128]. */
+        if (size != 0) {
+            oled_double_height(&buffer[128 + x0],
+                               &buffer[((size == 1) ? 128 : 0) + x0],
+                               w, oled_page + 1);
+        } else {
+            if (oled_page == 0)
+                memcpy(&buffer[128 + x0], &buffer[x0], w);
+        }
+        memmove(buffer, &buffer[128 + x0], w);
+        /* Every page needs a new page address and hence new I2C
+         * transaction. */
+        if (oled_page++ == 0)
+            return w;
+        oled_page = 0;
     } else {
-        if (!(i2c_row & 1))
-            memcpy(&buffer[128], &buffer[0], 128);
+        /* Both pages of the row. */
+        if (size != 0)
+            oled_double_height(&buffer[x0],
+                               &buffer[((size == 1) ? 128 : 0) + x0],
+                               w, 0x3);
+        memmove(buffer, &buffer[x0], w);
+        memmove(&buffer[w], &buffer[128 + x0], w);
+        w *= 2;
     }
 
-    /* Every 8 rows needs a new page address and hence new I2C transaction. */
-    i2c_stop();
-    p += oled_start_i2c(p);
-
-    /* Patch the data bytes onto the end of the address setup sequence. */
-    memcpy(p, &buffer[128], 128);
-    p += 128;
-
     i2c_row++;
 
-    return p - buffer;
+    return w;
 }
 
 /* Snapshot text buffer into the bitmap buffer. */
 static unsigned int oled_prep_buffer(void)
 {
-    return (oled_model == OLED_sh1106)
-        ? sh1106_prep_buffer()
-        : ssd1306_prep_buffer();
+    unsigned int nr_rows = oled_height / 16;
+    bool_t restarted = FALSE;
+
+    if (oled_data) {
+        oled_data = FALSE;
+        return oled_data_prep_buffer();
+    }
+
+    if (oled_page != 0)
+        goto found;
+
+    for (;;) {
+        if (i2c_row > nr_rows) {
+            refresh_start();
+            restarted = TRUE;
+        }
+
+        /* Find the next row with changed text. */
+        for (; i2c_row < nr_rows; i2c_row++)
+            if (oled_row_diff(i2c_row))
+                goto found;
+
+        i2c_row++;
+        if (has_osd) {
+            i2c_stop();
+            return osd_prep_buffer();
+        }
+
+        /* Display is up to date if nothing changed since a new refresh. */
+        if (restarted)
+            return 0;
+    }
+
+found:
+    /* Every span is written by a new I2C transaction. The OLED display seems
+     * to occasionally silently lose a byte and then we lose sync with the
+     * display address. */
+    oled_data = TRUE;
+    return oled_start_i2c(buffer);
 }
 
 static bool_t oled_probe_model(void)
@@ -1038,7 +1191,8 @@ static void oled_init(void)
     p += oled_queue_cmds(p, cmds, sizeof(rot_cmds));
 
     /* Start off the I2C transaction. */
-    p += oled_start_i2c(p);
+    i2c->cr2 |= I2C_CR2_ITEVTEN;
+    i2c->cr1 |= I2C_CR1_START;
 
     /* Send the initialisation command sequence by DMA. */
     i2c->cr2 |= I2C_CR2_DMAEN;
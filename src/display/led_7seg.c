@@ -37,6 +37,9 @@ static const uint8_t digits[] = {
 
 static uint8_t nr_digits;
 
+/* Segments currently displayed. Only digits which change are sent. */
+static uint8_t cur_d[3];
+
 
 /*********
  * TM1651 (3-digit) display.
@@ -130,20 +133,26 @@ static bool_t tm1651_send_cmd(uint8_t cmd)
     return fail;
 }
 
-static void tm1651_update_display(const uint8_t *d)
+/* Write digits @i to @j-1. Writing the final digit clears dat3 too. Returns
+ * TRUE on failure. */
+static bool_t tm1651_update_display(const uint8_t *d, unsigned int i,
+                                    unsigned int j)
 {
     bool_t fail = TRUE;
+    unsigned int k;
     int retry;
 
     for (retry = 0; fail && (retry < 3); retry++) {
         tm1651_start();
-        fail = (tm1651_write(0xc0)      /* set addr 0 */
-                || tm1651_write(d[0])   /* dat0 */
-                || tm1651_write(d[1])   /* dat1 */
-                || tm1651_write(d[2])   /* dat2 */
-                || tm1651_write(0x00)); /* dat3 */
+        fail = tm1651_write(0xc0 + i); /* set addr i */
+        for (k = i; !fail && (k < j); k++)
+            fail = tm1651_write(d[k]);  /* dat<k> */
+        if (!fail && (j == 3))
+            fail = tm1651_write(0x00);  /* dat3 */
         tm1651_stop();
     }
+
+    return fail;
 }
 
 static bool_t tm1651_init(void)
@@ -220,15 +229,33 @@ void led_7seg_display_setting(bool_t enable)
         shiftreg_display_setting(enable);
 }
 
-void led_7seg_write_raw(const uint8_t *d)
+bool_t led_7seg_write_raw(const uint8_t *d)
 {
-    if (nr_digits == 3)
-        tm1651_update_display(d);
-    else
-        shiftreg_update_display(d);
+    unsigned int i, j;
+
+    /* Find the span of digits which have changed. */
+    for (i = 0; (i < nr_digits) && (d[i] == cur_d[i]); i++)
+        continue;
+    if (i == nr_digits)
+        return TRUE;
+    for (j = nr_digits; d[j-1] == cur_d[j-1]; j--)
+        continue;
+
+    if (nr_digits == 3) {
+        if (tm1651_update_display(d, i, j)) {
+            /* Digits in the span are now unknown: Rewrite them next time. */
+            memset(&cur_d[i], 0xff, j - i);
+            return FALSE;
+        }
+    } else {
+        shiftreg_update_display(d); /* all or nothing */
+    }
+
+    memcpy(cur_d, d, nr_digits);
+    return TRUE;
 }
 
-void led_7seg_write_string(const char *p)
+bool_t led_7seg_write_string(const char *p)
 {
     uint8_t d[3] = { 0 }, c;
     unsigned int i;
@@ -247,7 +274,7 @@ void led_7seg_write_string(const char *p)
         }
     }
 
-    led_7seg_write_raw(d);
+    return led_7seg_write_raw(d);
 }
 
 void led_7seg_write_decimal(unsigned int val)
@@ -265,6 +292,8 @@ void led_7seg_init(void)
     if (nr_digits == 2)
         shiftreg_init();
 
+    /* Display contents are unknown: write every digit. */
+    memset(cur_d, 0xff, sizeof(cur_d));
     led_7seg_write_string("");
     led_7seg_display_setting(TRUE);
 }
@@ -0,0 +1,99 @@
+/*
+ * dma_copy.c
+ * 
+ * Background memory-to-memory copies on a spare DMA channel. The flux DMA
+ * channels run at higher priority, so a copy only takes otherwise idle bus
+ * cycles from them.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define DMA1_CH1_IRQ 11
+void IRQ_11(void) __attribute__((alias("IRQ_dma_copy")));
+
+#define dma_copy (dma1->ch1)
+#define dma_copy_ch 1
+
+/* Threads waiting for the copy in flight to complete. */
+static struct waitq copy_wq;
+
+static void IRQ_dma_copy(void)
+{
+    /* Clear DMA peripheral interrupts, stop the channel, and wake waiters. */
+    dma1->ifcr = DMA_IFCR_CGIF(dma_copy_ch);
+    dma_copy.ccr = 0;
+    thread_wake_all(&copy_wq);
+}
+
+void dma_copy_init(void)
+{
+    dma_copy.ccr = 0;
+    dma1->ifcr = DMA_IFCR_CGIF(dma_copy_ch);
+
+    IRQx_set_prio(DMA1_CH1_IRQ, DMA_COPY_IRQ_PRI);
+    IRQx_clear_pending(DMA1_CH1_IRQ);
+    IRQx_enable(DMA1_CH1_IRQ);
+}
+
+static void copy_start(uint32_t par, uint32_t mar, size_t n, uint32_t ccr)
+{
+    ASSERT(!dma_copy_busy());
+    ASSERT(!((par | mar | n) & 3));
+    ASSERT((n != 0) && (n <= DMA_COPY_MAX));
+
+    dma_copy.cpar = par;
+    dma_copy.cmar = mar;
+    dma_copy.cndtr = n / 4;
+    dma_copy.ccr = (ccr |
+                    DMA_CCR_MEM2MEM |
+                    DMA_CCR_PL_LOW |
+                    DMA_CCR_MSIZE_32BIT |
+                    DMA_CCR_PSIZE_32BIT |
+                    DMA_CCR_MINC |
+                    DMA_CCR_TCIE |
+                    DMA_CCR_EN);
+}
+
+void dma_copy_start(void *dest, const void *src, size_t n)
+{
+    /* In memory-to-memory mode the "peripheral" side is the source. */
+    copy_start((uint32_t)(unsigned long)src, (uint32_t)(unsigned long)dest,
+               n, DMA_CCR_PINC | DMA_CCR_DIR_P2M);
+}
+
+void dma_copy_to_reg(volatile uint32_t *reg, const void *src, size_t n)
+{
+    /* Memory to a fixed "peripheral" address. */
+    copy_start((uint32_t)(unsigned long)reg, (uint32_t)(unsigned long)src,
+               n, DMA_CCR_DIR_M2P);
+}
+
+bool_t dma_copy_busy(void)
+{
+    return !!(dma_copy.ccr & DMA_CCR_EN);
+}
+
+void dma_copy_wait(void)
+{
+    uint32_t oldpri;
+
+    /* Check and sleep with the completion IRQ masked, so as not to miss the
+     * wakeup. */
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    while (dma_copy_busy())
+        thread_wait(&copy_wq);
+    IRQ_restore(oldpri);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1481,6 +1481,7 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
 		}
+		if (clst < fs->scan_clst) fs->scan_nfree++;	/* FlashFloppy: Already counted? */
 #if FF_FS_EXFAT || FF_USE_TRIM
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
 			ecl = nxt;
@@ -1624,6 +1625,7 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 		fs->last_clst = ncl;
 		if (fs->free_clst <= fs->n_fatent - 2) fs->free_clst--;
 		fs->fsi_flag |= 1;
+		if (ncl < fs->scan_clst) fs->scan_nfree--;	/* FlashFloppy: Already counted? */
 	} else {
 		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;	/* Failed. Generate error status */
 	}
@@ -2353,6 +2355,86 @@ static void create_xdir (
 
 
 
+#if FF_USE_LFN && !defined(BOOTLOADER)
+/* FlashFloppy: Cache of recent name lookups. Each entry maps a volume mount,
+ * directory and hash of the upper-cased name to the offset of the object's
+ * first directory entry. A hit is only a hint: dir_find() checks the object
+ * at that offset as usual, and falls back to a full scan on mismatch. Entries
+ * are filled by dir_read() (eg. while the navigator lists a folder) and by
+ * dir_find(). A stale offset may land mid-way through another object's LFN
+ * chain, and then match this object by its SFN alone, losing its LFN entries.
+ * So dir_register() and dir_remove() drop the directory's entries. */
+#define DCACHE_NR 16
+static struct {
+	WORD id;
+	DWORD sclust, hash, ofs;
+} dcache[DCACHE_NR];
+
+static DWORD dcache_hash (const WCHAR* s)
+{
+	DWORD h = 2166136261u;
+	while (*s) h = (h ^ ff_wtoupper(*s++)) * 16777619u;
+	return h;
+}
+
+static void dcache_put (DIR* dp, DWORD hash)
+{
+	UINT i = hash % DCACHE_NR;
+
+	dcache[i].id = dp->obj.fs->id;
+	dcache[i].sclust = dp->obj.sclust;
+	dcache[i].hash = hash;
+	dcache[i].ofs = (dp->blk_ofs != 0xFFFFFFFF) ? dp->blk_ofs : dp->dptr;
+}
+
+static int dcache_get (DIR* dp, DWORD hash, DWORD* ofs)
+{
+	UINT i = hash % DCACHE_NR;
+
+	if (dcache[i].id != dp->obj.fs->id || dcache[i].sclust != dp->obj.sclust
+		|| dcache[i].hash != hash) return 0;
+	*ofs = dcache[i].ofs;
+	return 1;
+}
+
+#if !FF_FS_READONLY
+/* Drop all entries for the directory @dp, which is about to be modified. */
+static void dcache_inval (DIR* dp)
+{
+	UINT i;
+
+	for (i = 0; i < DCACHE_NR; i++) {
+		if (dcache[i].id == dp->obj.fs->id
+			&& dcache[i].sclust == dp->obj.sclust) dcache[i].id = 0;
+	}
+}
+#endif
+
+/* Cache the object just read by dir_read(). Objects without an LFN are hashed
+ * by their 8.3 name, which is how they would be looked up. */
+static void dcache_put_read (DIR* dp)
+{
+	WCHAR name[13];
+	UINT i, j;
+	BYTE c;
+
+	if (dp->blk_ofs != 0xFFFFFFFF) {
+		dcache_put(dp, dcache_hash(dp->obj.fs->lfnbuf));
+		return;
+	}
+	for (i = j = 0; i < 11; i++) {
+		c = dp->dir[i];
+		if (c == ' ') continue;
+		if (c >= 0x80 || c == RDDEM) return;	/* Not worth converting */
+		if (i == 8) name[j++] = '.';
+		name[j++] = c;
+	}
+	name[j] = 0;
+	dcache_put(dp, dcache_hash(name));
+}
+#endif
+
+
 #if FF_FS_MINIMIZE <= 1 || FF_FS_RPATH >= 2 || FF_USE_LABEL || FF_FS_EXFAT
 /*-----------------------------------------------------------------------*/
 /* Read an object from the directory                                     */
@@ -2414,6 +2496,9 @@ static FRESULT dir_read (
 					if (ord != 0 || sum != sum_sfn(dp->dir)) {	/* Is there a valid LFN? */
 						dp->blk_ofs = 0xFFFFFFFF;			/* It has no LFN. */
 					}
+#if !defined(BOOTLOADER)
+					if (!vol) dcache_put_read(dp);
+#endif
 					break;
 				}
 			}
@@ -2439,8 +2524,11 @@ static FRESULT dir_read (
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
 
-static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
-	DIR* dp					/* Pointer to the directory object with the file name */
+/* Match the name in @dp against directory entries from the current position.
+ * If @one then only the first object is checked (FR_NO_FILE if no match). */
+static FRESULT dir_scan (
+	DIR* dp,
+	int one
 )
 {
 	FRESULT res;
@@ -2450,8 +2538,6 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	BYTE a, ord, sum;
 #endif
 
-	res = dir_sdi(dp, 0);			/* Rewind directory object */
-	if (res != FR_OK) return res;
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
 		BYTE nc;
@@ -2484,6 +2570,7 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 #if FF_USE_LFN		/* LFN configuration */
 		dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;
 		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
+			if (one) { res = FR_NO_FILE; break; }
 			ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 		} else {
 			if (a == AM_LFN) {			/* An LFN entry is found */
@@ -2499,6 +2586,7 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 			} else {					/* An SFN entry is found */
 				if (ord == 0 && sum == sum_sfn(dp->dir)) break;	/* LFN matched? */
 				if (!(dp->fn[NSFLAG] & NS_LOSS) && !mem_cmp(dp->dir, dp->fn, 11)) break;	/* SFN matched? */
+				if (one) { res = FR_NO_FILE; break; }
 				ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 			}
 		}
@@ -2512,6 +2600,33 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	return res;
 }
 
+static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp					/* Pointer to the directory object with the file name */
+)
+{
+	FRESULT res;
+#if FF_USE_LFN && !defined(BOOTLOADER)
+	DWORD hash = dcache_hash(dp->obj.fs->lfnbuf), ofs;
+
+	if (dcache_get(dp, hash, &ofs)) {	/* Try the cached location first */
+		res = dir_sdi(dp, ofs);
+		if (res == FR_OK) res = dir_scan(dp, 1);
+		if (res == FR_OK) return res;
+		/* Stale or invalid hint: fall back to a full scan. */
+	}
+#endif
+
+	res = dir_sdi(dp, 0);			/* Rewind directory object */
+	if (res != FR_OK) return res;
+#if FF_USE_LFN && !defined(BOOTLOADER)
+	res = dir_scan(dp, 0);
+	if (res == FR_OK) dcache_put(dp, hash);
+	return res;
+#else
+	return dir_scan(dp, 0);
+#endif
+}
+
 
 
 
@@ -2531,6 +2646,9 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	BYTE sn[12], sum;
 
 
+#ifndef BOOTLOADER
+	dcache_inval(dp);	/* FlashFloppy: Lookup hints may go stale */
+#endif
 	if (dp->fn[NSFLAG] & (NS_DOT | NS_NONAME)) return FR_INVALID_NAME;	/* Check name validity */
 	for (nlen = 0; fs->lfnbuf[nlen]; nlen++) ;	/* Get lfn length */
 
@@ -2635,6 +2753,9 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 #if FF_USE_LFN		/* LFN configuration */
 	DWORD last = dp->dptr;
 
+#ifndef BOOTLOADER
+	dcache_inval(dp);	/* FlashFloppy: Lookup hints may go stale */
+#endif
 	res = (dp->blk_ofs == 0xFFFFFFFF) ? FR_OK : dir_sdi(dp, dp->blk_ofs);	/* Goto top of the entry block if LFN is exist */
 	if (res == FR_OK) {
 		do {
@@ -2685,6 +2806,92 @@ void flashfloppy_fill_fileinfo(FIL* fp)
 	fp->obj.sclust = ld_clust(fs, dir);
 	fp->obj.objsize = ld_dword(dir + DIR_FileSize);
 }
+
+/* FlashFloppy: Resume reading open directory @dp at byte offset @ofs,
+ * previously saved from dp->dptr between calls to f_readdir(). */
+void flashfloppy_dir_seek(DIR* dp, DWORD ofs)
+{
+	if (dir_sdi(dp, ofs) != FR_OK)
+		F_die(FR_DISK_ERR);
+}
+
+/* FlashFloppy: Fingerprint the entries of the current directory, such that it
+ * changes when an entry is added, removed, renamed, resized or relocated.
+ * Timestamps and deleted entries are not included. Nor is the entry with
+ * 11-byte short name @skip, whose first cluster and size are returned instead
+ * (0 if not found). The directory is read straight from the volume, @nr_secs
+ * sectors at a time. */
+FRESULT flashfloppy_dir_fingerprint(FATFS* fs, const char* skip, BYTE* buf,
+									UINT nr_secs, DWORD* fpr,
+									DWORD* skip_clust, DWORD* skip_size)
+{
+	FFOBJID obj;
+	DWORD clst, pclst;
+	LBA_t sect = 0;
+	UINT left = 0, n, i;
+	BYTE *dir;
+
+	*skip_clust = *skip_size = 0;
+	crc32_hw_reset();	/* Fingerprint is a CRC-32 by the CRC unit */
+	obj.fs = fs;
+	clst = fs->cdir;
+	if (clst == 0) {	/* Root directory */
+		if (fs->fs_type == FS_FAT32) {
+			clst = (DWORD)fs->dirbase;
+		} else {		/* Static table */
+			sect = fs->dirbase;
+			left = fs->n_rootdir / (SS(fs) / SZDIRE);
+		}
+	}
+
+	for (;;) {
+		if (left == 0) {
+			if (clst == 0) break;	/* End of chain */
+			/* Take a run of consecutive clusters, no larger than the buffer
+			 * unless it is a single cluster. */
+			sect = clst2sect(fs, clst);
+			if (sect == 0) return FR_INT_ERR;
+			left = fs->csize;
+			for (;;) {
+				pclst = clst;
+				clst = get_fat(&obj, pclst);
+				if (clst == 1) return FR_INT_ERR;
+				if (clst == 0xFFFFFFFF) return FR_DISK_ERR;
+				if (clst >= fs->n_fatent) clst = 0;
+				if ((clst != pclst + 1) || (left + fs->csize > nr_secs)) break;
+				left += fs->csize;
+			}
+		}
+		n = (left < nr_secs) ? left : nr_secs;
+		if (disk_read(fs->pdrv, buf, sect, n) != RES_OK) return FR_DISK_ERR;
+		for (dir = buf; dir < buf + n * SS(fs); dir += SZDIRE) {
+			if (dir[DIR_Name] == 0) goto done;	/* End of directory */
+			if (dir[DIR_Name] == DDEM) continue;
+			if (dir[DIR_Attr] != AM_LFN && !mem_cmp(dir, skip, 11)) {
+				*skip_clust = ld_clust(fs, dir);
+				*skip_size = ld_dword(dir + DIR_FileSize);
+				continue;
+			}
+			/* Entry location: deleted and trailing entries do not matter. */
+			crc32_hw_word((DWORD)(sect * (SS(fs) / SZDIRE)
+								  + (dir - buf) / SZDIRE));
+			if (dir[DIR_Attr] == AM_LFN) {
+				for (i = 0; i < SZDIRE; i += 4) crc32_hw_word(ld_dword(dir + i));
+			} else {	/* Name, attributes, first cluster and size */
+				for (i = 0; i < 12; i += 4) crc32_hw_word(ld_dword(dir + i));
+				crc32_hw_word(ld_word(dir + DIR_FstClusHI)
+							  | (DWORD)ld_word(dir + DIR_FstClusLO) << 16);
+				crc32_hw_word(ld_dword(dir + DIR_FileSize));
+			}
+		}
+		sect += n;
+		left -= n;
+	}
+
+done:
+	*fpr = crc32_hw_result();
+	return FR_OK;
+}
 #endif
 
 static void get_fileinfo (
@@ -3523,6 +3730,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 #if !FF_FS_READONLY
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->scan_clst = 0;
 #endif
 		fmt = FS_EXFAT;			/* FAT sub-type */
 	} else
@@ -3588,6 +3796,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 #if !FF_FS_READONLY
 		/* Get FSInfo if available */
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->scan_clst = 0;
 		fs->fsi_flag = 0x80;
 #if (FF_FS_NOFSINFO & 3) != 3
 		if (fmt == FS_FAT32				/* Allow to update FSInfo only if BPB_FSInfo32 == 1 */
@@ -4910,6 +5119,56 @@ FRESULT f_getfree (
 }
 
 
+/* FlashFloppy: Count free clusters a little at a time, so that the count can
+ * proceed in the background. At most @nr_secs FAT sectors are scanned per
+ * call. Clusters allocated or freed in the meantime are accounted. Returns
+ * FR_OK once fs->free_clst is valid, or FR_TIMEOUT if more calls are needed.
+ * exFAT is not supported. */
+FRESULT flashfloppy_count_free(FATFS* fs, UINT nr_secs)
+{
+	FRESULT res = FR_OK;
+	FFOBJID obj;
+	DWORD clst, stat;
+	UINT i, epb;
+
+	if (fs->free_clst <= fs->n_fatent - 2) return FR_OK;
+	if (fs->scan_clst < 2) {	/* Start a new count */
+		fs->scan_clst = 2;
+		fs->scan_nfree = 0;
+	}
+
+	clst = fs->scan_clst;
+	if (fs->fs_type == FS_FAT12) {	/* FAT12: Entries straddle sectors */
+		obj.fs = fs;
+		for (i = nr_secs * SS(fs) * 2 / 3; i && clst < fs->n_fatent; i--, clst++) {
+			stat = get_fat(&obj, clst);
+			if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (stat == 1) { res = FR_INT_ERR; break; }
+			if (stat == 0) fs->scan_nfree++;
+		}
+	} else {	/* FAT16/32: Scan whole sectors of WORD/DWORD entries */
+		epb = SS(fs) / ((fs->fs_type == FS_FAT16) ? 2 : 4);
+		for (; nr_secs && clst < fs->n_fatent; nr_secs--) {
+			res = move_window(fs, fs->fatbase + clst / epb);
+			if (res != FR_OK) break;
+			for (i = clst % epb; i < epb && clst < fs->n_fatent; i++, clst++) {
+				if (fs->fs_type == FS_FAT16
+					? ld_word(fs->win + i * 2) == 0
+					: (ld_dword(fs->win + i * 4) & 0x0FFFFFFF) == 0) fs->scan_nfree++;
+			}
+		}
+	}
+	fs->scan_clst = clst;
+	if (res != FR_OK) return res;
+
+	if (clst < fs->n_fatent) return FR_TIMEOUT;
+	fs->free_clst = fs->scan_nfree;	/* Now free_clst is valid */
+	fs->fsi_flag |= 1;				/* FAT32: FSInfo is to be updated */
+	fs->scan_clst = 0;
+	return FR_OK;
+}
+
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -5571,18 +5830,38 @@ FRESULT f_expand (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst, pclst;
 
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
-	if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+	/* FlashFloppy: A non-empty file may be extended. A contiguous block is
+	 * allocated for the clusters beyond the file's current allocation, and is
+	 * appended to its cluster chain. A block directly following the file's
+	 * last cluster is preferred, so that the file remains contiguous. */
+	if (fsz <= fp->obj.objsize || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
 #if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT && fp->obj.objsize != 0) LEAVE_FF(fs, FR_DENIED);
 	if (fs->fs_type != FS_EXFAT && fsz >= 0x100000000) LEAVE_FF(fs, FR_DENIED);	/* Check if in size limit */
 #endif
 	n = (DWORD)fs->csize * SS(fs);	/* Cluster size */
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
-	stcl = fs->last_clst; lclst = 0;
+	tcl -= (DWORD)(fp->obj.objsize / n) + ((fp->obj.objsize & (n - 1)) ? 1 : 0);	/* ...beyond those allocated */
+	stcl = fs->last_clst; lclst = 0; pclst = 0;
+	if (fp->obj.objsize != 0) {	/* Find the last cluster of the file */
+		pclst = fp->obj.sclust;
+		while ((n = get_fat(&fp->obj, pclst)) >= 2 && n < fs->n_fatent) pclst = n;
+		if (n == 1) LEAVE_FF(fs, FR_INT_ERR);
+		if (n == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+		stcl = pclst + 1;
+	}
+	if (tcl == 0) {	/* Already allocated: just update the file size */
+		if (opt) {
+			fp->obj.objsize = fsz;
+			fp->flag |= FA_MODIFIED;
+		}
+		LEAVE_FF(fs, FR_OK);
+	}
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
 
 #if FF_FS_EXFAT
@@ -5621,6 +5900,9 @@ FRESULT f_expand (
 					if (res != FR_OK) break;
 					lclst = clst;
 				}
+				if (res == FR_OK && pclst != 0) {	/* Append it to the file */
+					res = put_fat(fs, pclst, scl);
+				}
 			} else {		/* Set it as suggested point for next allocation */
 				lclst = scl - 1;
 			}
@@ -5630,7 +5912,7 @@ FRESULT f_expand (
 	if (res == FR_OK) {
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
 		if (opt) {	/* Is it allocated now? */
-			fp->obj.sclust = scl;		/* Update object allocation information */
+			if (pclst == 0) fp->obj.sclust = scl;	/* Update object allocation information */
 			fp->obj.objsize = fsz;
 			if (FF_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
 			fp->flag |= FA_MODIFIED;
@@ -5638,6 +5920,9 @@ FRESULT f_expand (
 				fs->free_clst -= tcl;
 				fs->fsi_flag |= 1;
 			}
+			if (scl < fs->scan_clst) {	/* FlashFloppy: Already counted? */
+				fs->scan_nfree -= (tcl < fs->scan_clst - scl) ? tcl : fs->scan_clst - scl;
+			}
 		}
 	}
 
@@ -153,6 +153,8 @@ typedef struct {
 #if !FF_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+	DWORD	scan_clst;		/* FlashFloppy: Next FAT entry to count (0:no count in progress) */
+	DWORD	scan_nfree;		/* FlashFloppy: Free FAT entries counted so far */
 #endif
 #if FF_FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -58,7 +58,11 @@
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
+#if defined(BOOTLOADER)
 #define FF_USE_EXPAND	0
+#else
+#define FF_USE_EXPAND	1
+#endif
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
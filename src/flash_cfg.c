@@ -22,12 +22,14 @@ const struct ff_cfg dfl_ff_cfg = {
 struct ff_cfg ff_cfg;
 
 #define SLOTW_NR   64           /* Number of 16-bit words per slot */
+#define SLOTW_SRC  (SLOTW_DEAD-sizeof(struct ff_cfg_src)/2) /* FF.CFG file */
 #define SLOTW_DEAD (SLOTW_NR-2) /* If != 0xffff: this slot is deleted */
 #define SLOTW_CRC  (SLOTW_NR-1) /* CRC over entire config slot */
 union cfg_slot {
     struct ff_cfg ff_cfg;
     uint16_t words[SLOTW_NR];
 };
+#define slot_src(_slot) ((struct ff_cfg_src *)&(_slot)->words[SLOTW_SRC])
 
 #define SLOT_BASE (union cfg_slot *)(0x8020000 - FLASH_PAGE_SIZE)
 #define SLOT_NR   (FLASH_PAGE_SIZE / sizeof(union cfg_slot))
@@ -66,13 +68,14 @@ static union cfg_slot *cfg_slot_find(void)
     return NULL;
 }
 
-void flash_ff_cfg_update(void *scratch)
+void flash_ff_cfg_update(void *scratch, const struct ff_cfg_src *src)
 {
     union cfg_slot *new_slot = scratch, *slot = cfg_slot_find();
     uint16_t crc;
 
     /* Nothing to do if Flashed configuration is valid and up to date. */
-    if (slot_is_valid(slot) && !memcmp(&slot->ff_cfg, &ff_cfg, sizeof(ff_cfg)))
+    if (slot_is_valid(slot) && !memcmp(&slot->ff_cfg, &ff_cfg, sizeof(ff_cfg))
+        && !memcmp(slot_src(slot), src, sizeof(*src)))
         return;
 
     fpec_init();
@@ -95,6 +98,7 @@ void flash_ff_cfg_update(void *scratch)
 
     memset(new_slot, 0, sizeof(*new_slot));
     memcpy(&new_slot->ff_cfg, &ff_cfg, sizeof(ff_cfg));
+    memcpy(slot_src(new_slot), src, sizeof(*src));
     new_slot->words[SLOTW_DEAD] = 0xffff;
     crc = htobe16(crc16_ccitt(new_slot, sizeof(*new_slot)-2, 0xffff));
     /* Write up to but excluding SLOTW_DEAD. */
@@ -111,12 +115,26 @@ void flash_ff_cfg_erase(void)
         erase_slot(slot);
 }
 
+bool_t flash_ff_cfg_src_match(struct ff_cfg_src *src)
+{
+    union cfg_slot *slot = cfg_slot_find();
+
+    if (!slot_is_valid(slot)
+        || memcmp(&slot->ff_cfg, &ff_cfg, sizeof(ff_cfg))
+        || memcmp(slot_src(slot), src, offsetof(struct ff_cfg_src, flags)))
+        return FALSE;
+
+    src->flags = slot_src(slot)->flags;
+    return TRUE;
+}
+
 void flash_ff_cfg_read(void)
 {
     union cfg_slot *slot = cfg_slot_find();
     bool_t found = slot_is_valid(slot);
 
     BUILD_BUG_ON(sizeof(*slot) != sizeof(slot->words));
+    BUILD_BUG_ON(sizeof(struct ff_cfg) > SLOTW_SRC*2);
 
     ff_cfg = dfl_ff_cfg;
     printk("Config: ");
@@ -159,6 +159,7 @@ static void update_amiga_id(struct drive *drv, bool_t amiga_hd_id)
 void floppy_cancel(void)
 {
     struct drive *drv = &drive;
+    struct f_async_stats stats;
 
     /* Initialised? Bail if not. */
     if (!dma_rd)
@@ -198,15 +199,13 @@ void floppy_cancel(void)
     drive_change_output(drv, outp_index, FALSE);
     drive_change_output(drv, outp_dskchg, TRUE);
 
-    /* Clean up I/O. This must avoid potential cancel_call()s while still
-     * getting volume communication into a consistent state. */
-    F_async_cancel_all();
-    /* cancel_call() circumvents the threading subsystem and may leave it in an
-     * incoherent state. Volume operations never cancel so it is safe to
-     * thread_yield() if a volume operation is in progress. */
-    while (volume_interrupt())
-        thread_yield();
-    thread_reset();
+    flux_stats_report();
+    F_async_get_stats(&stats);
+    printk("Async I/O: max depth %u, max wait %u us read, %u us deferred, "
+           "%u overtakes\n", stats.max_depth, stats.max_wait_us[0],
+           stats.max_wait_us[1], stats.nr_overtakes);
+
+    floppy_cancel_io();
 }
 
 void floppy_set_fintf_mode(void)
@@ -311,13 +310,6 @@ void floppy_init(void)
     motor_chgrst_eject(drv);
 }
 
-static void io_thread_main(void *arg) {
-    while (1) {
-        F_async_drain();
-        thread_yield();
-    }
-}
-
 void floppy_insert(unsigned int unit, struct slot *slot)
 {
     struct image *im;
@@ -333,7 +325,7 @@ void floppy_insert(unsigned int unit, struct slot *slot)
         drive_change_output(drv, outp_hden, TRUE);
 
     timer_dma_init();
-    thread_start(&drv->io_thread, _thread1_stacktop, io_thread_main, NULL);
+    io_thread_start(drv);
 
     /* Drive is ready. Set output signals appropriately. */
     update_amiga_id(drv, im->stk_per_rev > stk_ms(300));
@@ -348,22 +340,23 @@ void floppy_insert(unsigned int unit, struct slot *slot)
 
 static void floppy_sync_flux(void)
 {
-    const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
+    const uint16_t buf_mask = dma_rd->len - 1;
     struct drive *drv = &drive;
     uint32_t prefetch_us;
     uint16_t nr_to_wrap, nr_to_cons, nr;
     int32_t ticks;
+    unsigned int i;
 
     /* No DMA should occur until the timer is enabled. */
-    ASSERT(dma_rd->cons == (ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr));
+    ASSERT(dma_rd->cons == (dma_rd->len - dma_rdata.cndtr));
 
-    nr_to_wrap = ARRAY_SIZE(dma_rd->buf) - dma_rd->prod;
+    nr_to_wrap = dma_rd->len - dma_rd->prod;
     nr_to_cons = (dma_rd->cons - dma_rd->prod - 1) & buf_mask;
     nr = min(nr_to_wrap, nr_to_cons);
     if (nr) {
-        dma_rd->prod += image_rdata_flux(
-            drv->image, &dma_rd->buf[dma_rd->prod], nr);
-        dma_rd->prod &= buf_mask;
+        nr = image_rdata_flux(drv->image, &dma_rd->buf[dma_rd->prod], nr);
+        dma_rd_queued(&dma_rd->buf[dma_rd->prod], nr);
+        dma_rd->prod = (dma_rd->prod + nr) & buf_mask;
     }
 
     nr = (dma_rd->prod - dma_rd->cons) & buf_mask;
@@ -376,12 +369,17 @@ static void floppy_sync_flux(void)
         max_prefetch_us = prefetch_us;
         printk("[%uus]\n", max_prefetch_us);
     }
+    for (i = 0; i < ARRAY_SIZE(prefetch_bucket_ms); i++)
+        if (prefetch_us < prefetch_bucket_ms[i] * 1000u)
+            break;
+    flux_stats.prefetch[i]++;
 
     if (!drv->index_suppressed) {
         ticks = time_diff(time_now(), sync_time) - time_us(1);
         if (ticks > time_ms(15)) {
             /* Too long to wait. Immediately re-sync index timing. */
             drv->index_suppressed = TRUE;
+            flux_stats.skips++;
             printk("Trk %u: skip %ums\n",
                    drv->image->cur_track, (ticks+time_us(500))/time_ms(1));
         } else if (ticks > time_ms(5)) {
@@ -394,6 +392,7 @@ static void floppy_sync_flux(void)
             ticks = time_diff(time_now(), sync_time);
             if (ticks < -100) {
                 drv->index_suppressed = TRUE;
+                flux_stats.lates++;
                 printk("Trk %u: late %uus\n",
                        drv->image->cur_track, -ticks/time_us(1));
             }
@@ -424,14 +423,10 @@ static void floppy_sync_flux(void)
         if (image_ticks_since_index(drv->image)
             < (sync_pos*(SYSCLK_MHZ/STK_MHZ))) {
 
-            /* Sum all flux timings in the DMA buffer. */
-            const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
-            uint32_t i, ticks = 0;
-            for (i = dma_rd->cons; i != dma_rd->prod; i = (i+1) & buf_mask)
-                ticks += dma_rd->buf[i] + 1;
-
-            /* Subtract current flux offset beyond the index. */
-            ticks -= image_ticks_since_index(drv->image);
+            /* All flux timings in the DMA buffer, less current flux offset
+             * beyond the index. */
+            uint32_t ticks = dma_rd->ticks
+                - image_ticks_since_index(drv->image);
 
             /* Calculate deadline for index timer. */
             ticks /= SYSCLK_MHZ/TIME_MHZ;
@@ -458,6 +453,32 @@ static void floppy_sync_flux(void)
     rdata_start();
 }
 
+/* track-change = realtime: Is the host part-way through a seek? If so, return
+ * in *@cyl the predicted destination: A step arriving before its predecessor
+ * settles suggests that the seek continues at the same rate. */
+static bool_t drive_mid_seek(struct drive *drv, int *cyl)
+{
+    uint8_t state = drv->step.state;
+    int dir = drv->step.inward ? 1 : -1;
+
+    if (ff_cfg.track_change != TRKCHG_realtime)
+        return FALSE;
+
+    *cyl = drv->cyl;
+    if (state & STEP_active) {
+        /* Step not yet applied to drv->cyl. */
+        *cyl += dir;
+    } else if (!(state & STEP_settling) || !drv->step.interval
+               || (time_since(drv->step.start) >= 2*drv->step.interval)) {
+        /* Heads are at rest, or the seek is overdue to continue. */
+        return FALSE;
+    }
+
+    if (drv->step.interval)
+        *cyl += dir;
+    return TRUE;
+}
+
 static bool_t dma_rd_handle(struct drive *drv)
 {
     switch (dma_rd->state) {
@@ -466,6 +487,7 @@ static bool_t dma_rd_handle(struct drive *drv)
         struct image *im = drv->image;
         time_t index_time, read_start_pos;
         unsigned int track;
+        int cyl;
         /* Allow 10ms from current rotational position to load new track */
         int32_t delay = time_ms(10);
         /* Allow extra time if heads are settling. */
@@ -475,6 +497,12 @@ static bool_t dma_rd_handle(struct drive *drv)
             int32_t delta = time_diff(time_now(), step_settle);
             delay = max_t(int32_t, delta, delay);
         }
+        /* Mid-seek: Read ahead the destination rather than loading each
+         * track stepped over. The reads overlap the emulated seek time. */
+        if (drive_mid_seek(drv, &cyl)) {
+            image_prefetch(im, cyl);
+            break;
+        }
         /* No data fetch while stepping. */
         barrier(); /* check STEP_settling /then/ check STEP_active */
         if (drv->step.state & STEP_active)
@@ -493,6 +521,8 @@ static bool_t dma_rd_handle(struct drive *drv)
             return TRUE;
         }
         read_start_pos *= SYSCLK_MHZ/STK_MHZ;
+        /* Step direction guides speculative prefetch of the next cylinder. */
+        im->step_dir = drv->step.inward ? 1 : -1;
         image_setup_track(im, track, &read_start_pos);
         prefetch_start_time = time_now();
         read_start_pos /= SYSCLK_MHZ/STK_MHZ;
@@ -525,7 +555,8 @@ static bool_t dma_rd_handle(struct drive *drv)
         dma_rd->state = DMA_inactive;
         /* Reinitialise the circular buffer to empty. */
         dma_rd->cons = dma_rd->prod =
-            ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr;
+            dma_rd->len - dma_rdata.cndtr;
+        dma_rd->ticks = 0;
         /* Free-running index timer. */
         timer_cancel(&index.timer);
         timer_set(&index.timer, index.prev_time + drv->image->stk_per_rev);
@@ -35,10 +35,43 @@ struct dma_ring {
         uint16_t prod; /* dma_rd: our producer index for flux samples */
         uint16_t prev_sample; /* dma_wr: previous CCRx sample value */
     };
-    /* DMA ring buffer of timer values (ARR or CCRx). */
-    uint16_t buf[1024];
+    /* dma_rd: SYSCLK ticks of flux queued ahead of the timer, including the
+     * remainder of the current sample. Correct as of @ticks_time. */
+    uint32_t ticks;
+    time_t ticks_time;
+    /* dma_rd: Refill interrupts this revolution, and maximum seen. */
+    uint16_t refills, max_refills;
+    /* DMA ring buffer of timer values (ARR or CCRx). Power of two. */
+    uint16_t len;
+    uint16_t buf[];
 };
 
+/* RDATA ring is refilled in half-ring batches, one per DMA half-transfer or
+ * transfer-complete interrupt. */
+#define RDATA_REFILL_BATCH (dma_rd->len / 2)
+
+/* Flux and bitcell buffer sizes, by board RAM and by whether the image
+ * handler is asynchronous (streams through ring_io, so has little need to
+ * buffer write bitcells). Larger buffers extend the time that storage may
+ * stall before the flux stream underruns. The first match is used. */
+static const struct buf_profile {
+    uint8_t ram_kb; /* Minimum board RAM */
+    bool_t async;
+    uint8_t write_bc_kb; /* Power of two. read_bc is half of this. */
+    uint16_t rdata_len; /* Samples in the RDATA DMA ring. Power of two. */
+    uint8_t nr_writes; /* Write pipeline entries. Power of two. */
+} buf_profiles[] = {
+    /* A short write of a single sector occupies about 1kB of write_bc, so
+     * the pipeline is sized to let write_bc fill with such writes. */
+    { 64, FALSE, 32, 1024, 32 },
+    { 64, TRUE,   8, 2048,  8 },
+    {  0, FALSE,  8, 1024,  8 },
+    {  0, TRUE,   4, 1024,  8 },
+};
+
+/* Samples in the WDATA DMA ring. Drained promptly, from IRQ context. */
+#define WDATA_RING_LEN 1024
+
 /* DMA buffers are permanently allocated while a disk image is loaded, allowing 
  * independent and concurrent management of the RDATA/WDATA pins. */
 static struct dma_ring *dma_rd; /* RDATA DMA buffer */
@@ -67,6 +100,9 @@ static struct drive {
         uint8_t state;
         bool_t inward;
         time_t start;
+        /* Ticks since the previous step, if it had not yet settled. Non-zero
+         * while a multi-track seek is in progress. */
+        uint32_t interval;
         struct timer timer;
     } step;
     uint32_t restart_pos;
@@ -76,6 +112,12 @@ static struct drive {
 
 static struct image *image;
 
+/* Per-image flux statistics, logged on eject. Prefetch latencies are
+ * counted in buckets bounded above by prefetch_bucket_ms[]. */
+static const uint8_t prefetch_bucket_ms[FLUX_PREFETCH_BUCKETS-1] = {
+    1, 2, 5, 10, 20, 50, 100 };
+static struct flux_stats flux_stats;
+
 static struct {
     struct timer timer, timer_deassert;
     struct timer custom_timer;
@@ -131,14 +173,103 @@ static void floppy_init_irqs(void)
     }
 }
 
-/* Allocate and initialise a DMA ring. */
-static struct dma_ring *dma_ring_alloc(void)
+static const struct buf_profile *buf_profile_find(bool_t async)
 {
-    struct dma_ring *dma = arena_alloc(sizeof(*dma));
-    memset(dma, 0, offsetof(struct dma_ring, buf));
+    const struct buf_profile *p = buf_profiles;
+    while ((p->ram_kb > ram_kb) || (p->async != async))
+        p++;
+    return p;
+}
+
+/* Allocate and initialise a DMA ring of @len samples. */
+static struct dma_ring *dma_ring_alloc(uint16_t len)
+{
+    struct dma_ring *dma = arena_alloc(sizeof(*dma) + len * sizeof(dma->buf[0]));
+    memset(dma, 0, sizeof(*dma));
+    dma->len = len;
     return dma;
 }
 
+/* Account for @nr flux samples just queued at @p in the RDATA ring. */
+static void dma_rd_queued(const uint16_t *p, uint16_t nr)
+{
+    uint32_t ticks = 0;
+    while (nr--)
+        ticks += *p++ + 1;
+    dma_rd->ticks += ticks;
+}
+
+/* Account for flux samples consumed by the timer since @ticks_time. The timer
+ * runs off SYSCLK, so this is simply the elapsed time. */
+static void dma_rd_consumed(time_t now)
+{
+    int32_t ticks = dma_rd->ticks - time_diff(dma_rd->ticks_time, now)
+        * (SYSCLK_MHZ/TIME_MHZ);
+    dma_rd->ticks = max_t(int32_t, ticks, 0);
+    dma_rd->ticks_time = now;
+}
+
+static void flux_stats_report(void)
+{
+    unsigned int i, nr = 0;
+
+    for (i = 0; i < ARRAY_SIZE(flux_stats.prefetch); i++)
+        nr += flux_stats.prefetch[i];
+    if (nr != 0) {
+        printk("Prefetch:");
+        for (i = 0; i < ARRAY_SIZE(prefetch_bucket_ms); i++)
+            printk(" <%ums:%u", prefetch_bucket_ms[i], flux_stats.prefetch[i]);
+        printk(" more:%u\n", flux_stats.prefetch[i]);
+    }
+
+    printk("Flux: %u underruns, %u index skips, %u late index, "
+           "%u missed writes\n", flux_stats.underruns, flux_stats.skips,
+           flux_stats.lates, flux_stats.missed_writes);
+    if (flux_stats.max_writes > 1)
+        printk("Writes: %u queued at peak\n", flux_stats.max_writes);
+}
+
+void floppy_get_flux_stats(struct flux_stats *stats)
+{
+    uint32_t oldpri = IRQ_save(TIMER_IRQ_PRI);
+    *stats = flux_stats;
+    IRQ_restore(oldpri);
+}
+
+static void io_thread_main(void *arg) {
+    while (1) {
+        F_async_drain();
+        /* Sleep until more async I/O is queued. */
+        F_async_sleep();
+    }
+}
+
+/* Start the thread which runs async I/O for the mounted image. */
+static void io_thread_start(struct drive *drv)
+{
+    stack_paint(_thread1_stackbottom, _thread1_stacktop);
+    thread_start(&drv->io_thread, _thread1_stacktop, io_thread_main, NULL);
+}
+
+/* Stop all I/O for the unmounted image, and discard the I/O thread. */
+static void floppy_cancel_io(void)
+{
+    time_t t = time_now();
+
+    /* Clean up I/O. This must avoid potential cancel_call()s while still
+     * getting volume communication into a consistent state. */
+    F_async_cancel_all();
+    /* cancel_call() circumvents the threading subsystem and may leave it in an
+     * incoherent state. Volume operations never cancel so it is safe to
+     * thread_yield() if a volume operation is in progress. Large transfers
+     * are interrupted between volume commands. */
+    while (volume_interrupt())
+        thread_yield();
+    thread_reset();
+
+    printk("Cancel: I/O stopped in %u us\n", time_since(t) / TIME_MHZ);
+}
+
 /* Allocate floppy resources and mount the given image. 
  * On return: dma_rd, dma_wr, image and index are all valid. */
 static void floppy_mount(struct slot *slot)
@@ -148,19 +279,27 @@ static void floppy_mount(struct slot *slot)
     struct drive *drv = &drive;
     FSIZE_t fastseek_sz;
     DWORD *cltbl;
+    void *jnl_mem;
     FRESULT fr;
+    const struct buf_profile *prof;
+    uint16_t state_sz = image_state_size(slot);
     bool_t async = FALSE, retry;
 
     do {
         retry = FALSE;
+        prof = buf_profile_find(async);
 
         arena_init();
+        memset(&flux_stats, 0, sizeof(flux_stats));
 
-        _dma_rd = dma_ring_alloc();
-        _dma_wr = dma_ring_alloc();
+        arena_region(ARENA_dma);
+        _dma_rd = dma_ring_alloc(prof->rdata_len);
+        _dma_wr = dma_ring_alloc(WDATA_RING_LEN);
 
-        im = arena_alloc(sizeof(*im));
-        memset(im, 0, sizeof(*im));
+        arena_region(ARENA_image);
+        im = arena_alloc(image_size(state_sz));
+        memset(im, 0, image_size(state_sz));
+        im->state_sz = state_sz;
 
         /* Create a fast-seek cluster table for the image. */
 #define MAX_FILE_FRAGS 511 /* up to a 4kB cluster table */
@@ -186,20 +325,19 @@ static void floppy_mount(struct slot *slot)
             }
         }
 
+        im->bufs.nr_writes = prof->nr_writes;
+        im->bufs.write = arena_alloc(prof->nr_writes * sizeof(struct write));
+
         /* ~0 avoids sync match within fewer than 32 bits of scan start. */
         im->write_bc_window = ~0;
 
-        if (!async) {
-            /* Large buffer to absorb write latencies at mass-storage layer. */
-            int ring_kb = (ram_kb >= 64) ? 32 : 8;
-            im->bufs.write_bc.len = ring_kb * 1024; /* power of two */
-            im->bufs.write_bc.p = arena_alloc(im->bufs.write_bc.len);
-        } else {
-            /* Size at least 4kb so a 512 byte sector (1k bc) can be fully
-             * encoded into the 2kb read_bc, with space to spare. */
-            im->bufs.write_bc.len = 4*1024; /* Power of two. */
-            im->bufs.write_bc.p = arena_alloc(im->bufs.write_bc.len);
-        }
+        arena_region(ARENA_ring);
+        /* Synchronous handlers need a large buffer to absorb write latencies
+         * at mass-storage layer. Asynchronous handlers need at least 4kB so
+         * a 512 byte sector (1k bc) can be fully encoded into the 2kB read_bc,
+         * with space to spare. */
+        im->bufs.write_bc.len = prof->write_bc_kb * 1024;
+        im->bufs.write_bc.p = arena_alloc(im->bufs.write_bc.len);
 
         /* Read BC buffer overlaps the second half of the write BC buffer. This 
          * is because:
@@ -216,9 +354,15 @@ static void floppy_mount(struct slot *slot)
         im->bufs.read_bc.p = (char *)im->bufs.write_bc.p
             + im->bufs.read_bc.len;
 
+        /* Index and replay buffer for the write journal, if enabled. */
+        arena_region(ARENA_journal);
+        jnl_mem = (ff_cfg.write_journal && (ram_kb >= 64))
+            ? arena_alloc(JOURNAL_MEM_SZ) : NULL;
+
         /* Any remaining space is used for staging I/O to mass storage, shared
          * between read and write paths (Change of use of this memory space is
          * fully serialised). */
+        arena_region(ARENA_buf);
         im->bufs.write_data.len = arena_avail();
         im->bufs.write_data.p = arena_alloc(im->bufs.write_data.len);
         im->bufs.read_data = im->bufs.write_data;
@@ -233,8 +377,12 @@ static void floppy_mount(struct slot *slot)
         {
             uint8_t cyl = drive_calc_track(drv)>>1;
             /* Skip useless loading if D-A guaranteed. */
-            if (cyl != 255)
-                image_open(im, slot, cltbl, FALSE);
+            if ((cyl != 255) && !image_open(im, slot, cltbl, FALSE)) {
+                /* A handler was skipped for lack of state space. */
+                state_sz = IMAGE_STATE_MAX;
+                retry = TRUE;
+                continue;
+            }
             /* Now that the number of image cylinders is known, do a precise D-A
              * check. */
             if (in_da_mode(im, cyl)) {
@@ -258,11 +406,20 @@ static void floppy_mount(struct slot *slot)
 
     } while (f_size(&im->fp) != fastseek_sz || retry);
 
+    /* Journal writes which pass through the ring_io and ADF write paths. The
+     * read buffer is not yet in use, so is scratch space for the journal's
+     * file handle. */
+    journal_init((!(slot->attributes & AM_RDO) && im->disk_handler->async
+                  && !image_in_da_mode(im)) ? &im->fp : NULL,
+                 jnl_mem, (FIL *)im->bufs.read_data.p);
+
     /* After image is extended at mount time, we permit no further changes 
      * to the file metadata. Clear the dirent info to ensure this. */
     im->fp.dir_ptr = NULL;
     im->fp.dir_sect = 0;
 
+    arena_report();
+
     _dma_rd->state = DMA_stopping;
 
     /* Make allocated state globally visible now. */
@@ -305,7 +462,7 @@ static void timer_dma_init(void)
     /* DMA setup: From a circular buffer into the RDATA Timer's ARR. */
     dma_rdata.cpar = (uint32_t)(unsigned long)&tim_rdata->arr;
     dma_rdata.cmar = (uint32_t)(unsigned long)dma_rd->buf;
-    dma_rdata.cndtr = ARRAY_SIZE(dma_rd->buf);
+    dma_rdata.cndtr = dma_rd->len;
     dma_rdata.ccr = (DMA_CCR_PL_HIGH |
                      DMA_CCR_MSIZE_16BIT |
                      DMA_CCR_PSIZE_16BIT |
@@ -332,7 +489,7 @@ static void timer_dma_init(void)
     /* DMA setup: From the WDATA Timer's CCRx into a circular buffer. */
     dma_wdata.cpar = (uint32_t)(unsigned long)&tim_wdata->ccr1;
     dma_wdata.cmar = (uint32_t)(unsigned long)dma_wr->buf;
-    dma_wdata.cndtr = ARRAY_SIZE(dma_wr->buf);
+    dma_wdata.cndtr = dma_wr->len;
     dma_wdata.ccr = (DMA_CCR_PL_HIGH |
                      DMA_CCR_MSIZE_16BIT |
                      DMA_CCR_PSIZE_16BIT |
@@ -397,7 +554,7 @@ static void wdata_stop(void)
 
     /* Remember where this write's DMA stream ended. */
     write = get_write(image, image->wr_prod);
-    write->dma_end = ARRAY_SIZE(dma_wr->buf) - dma_wdata.cndtr;
+    write->dma_end = dma_wr->len - dma_wdata.cndtr;
     image->wr_prod++;
 
 #if !defined(QUICKDISK)
@@ -417,19 +574,24 @@ static void wdata_start(void)
 {
     struct write *write;
     uint32_t start_pos;
+    uint16_t queued;
 
     switch (dma_wr->state) {
     case DMA_starting:
     case DMA_active:
         /* Already active: ignore WGATE glitch. */
-        printk("*** WGATE glitch\n");
+        trace("*** WGATE glitch\n", 0, 0, 0);
         return;
     case DMA_stopping:
-        if ((image->wr_prod - image->wr_cons) >= ARRAY_SIZE(image->write)) {
+        queued = image->wr_prod - image->wr_cons;
+        if (queued >= image->bufs.nr_writes) {
             /* The write pipeline is full. Complain to the log. */
-            printk("*** Missed write\n");
+            trace("*** Missed write (%u queued)\n", queued, 0, 0);
+            flux_stats.missed_writes++;
             return;
         }
+        flux_stats.max_writes = max_t(uint16_t, flux_stats.max_writes,
+                                      queued + 1);
         break;
     case DMA_inactive:
         /* The write path is quiescent and ready to process this new write. */
@@ -503,6 +665,7 @@ static void rdata_start(void)
     tim_rdata->egr = TIM_EGR_UG;
     tim_rdata->sr = 0; /* dummy write, gives h/w time to process EGR.UG=1 */
     tim_rdata->cr1 = TIM_CR1_CEN;
+    dma_rd->ticks_time = time_now();
 
     /* Enable output. */
     if (drive.sel)
@@ -515,10 +678,17 @@ out:
     IRQ_global_enable();
 }
 
+/* Did the last floppy_handle() find only IRQ-driven work outstanding? */
+static bool_t handle_idle;
+
 static void floppy_read_data(struct drive *drv)
 {
     /* Read some track data if there is buffer space. */
-    if (image_read_track(drv->image) && dma_rd->kick_dma_irq) {
+    if (!image_read_track(drv->image)) {
+        /* Nothing to do until the flux DMA drains the buffers, or until a
+         * step or write. None of which can happen before DMA is active. */
+        handle_idle = (dma_rd->state == DMA_active);
+    } else if (dma_rd->kick_dma_irq) {
         /* We buffered some more data and the DMA handler requested a kick. */
         dma_rd->kick_dma_irq = FALSE;
         IRQx_set_pending(dma_rdata_irq);
@@ -588,19 +758,33 @@ static bool_t dma_wr_handle(struct drive *drv)
     return FALSE;
 }
 
+bool_t floppy_idle(void)
+{
+    return handle_idle;
+}
+
 bool_t floppy_handle(void)
 {
     struct drive *drv = &drive;
+    static bool_t sel;
+
+    /* The host is done with the drive for now: Sync the image file. */
+    if (sel != drv->sel) {
+        sel = drv->sel;
+        if (!sel)
+            ring_io_sync_hint();
+    }
 
+    handle_idle = FALSE;
     return ((dma_wr->state == DMA_inactive)
             ? dma_rd_handle : dma_wr_handle)(drv);
 }
 
-static void IRQ_rdata_dma(void)
+static ramfunc void _IRQ_rdata_dma(void)
 {
-    const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
+    const uint16_t buf_mask = dma_rd->len - 1;
     uint32_t prev_ticks_since_index, ticks, i;
-    uint16_t nr_to_wrap, nr_to_cons, nr, dmacons, done;
+    uint16_t todo, nr, dmacons, done;
     time_t now;
     struct drive *drv = &drive;
 
@@ -612,38 +796,44 @@ static void IRQ_rdata_dma(void)
         return;
 
     /* Find out where the DMA engine's consumer index has got to. */
-    dmacons = ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr;
+    dmacons = dma_rd->len - dma_rdata.cndtr;
 
     /* Check for DMA catching up with the producer index (underrun). */
     if (((dmacons < dma_rd->cons)
          ? (dma_rd->prod >= dma_rd->cons) || (dma_rd->prod < dmacons)
          : (dma_rd->prod >= dma_rd->cons) && (dma_rd->prod < dmacons))
-        && (dmacons != dma_rd->cons))
-        printk("RDATA underrun! %x-%x-%x\n",
-               dma_rd->cons, dma_rd->prod, dmacons);
+        && (dmacons != dma_rd->cons)) {
+        trace("RDATA underrun! %x-%x-%x\n",
+              dma_rd->cons, dma_rd->prod, dmacons);
+        flux_stats.underruns++;
+    }
 
     dma_rd->cons = dmacons;
+    dma_rd_consumed(time_now());
 
-    /* Find largest contiguous stretch of ring buffer we can fill. */
-    nr_to_wrap = ARRAY_SIZE(dma_rd->buf) - dma_rd->prod;
-    nr_to_cons = (dmacons - dma_rd->prod - 1) & buf_mask;
-    nr = min(nr_to_wrap, nr_to_cons);
-    if (nr == 0) /* Buffer already full? Then bail. */
+    /* Refill at most one batch per interrupt. The DMA half- and full-transfer
+     * interrupts bring us back here for the next batch. */
+    todo = min_t(uint16_t, RDATA_REFILL_BATCH,
+                 (dmacons - dma_rd->prod - 1) & buf_mask);
+    if (todo == 0) /* Buffer already full? Then bail. */
         return;
+    dma_rd->refills++;
 
-    /* Now attempt to fill the contiguous stretch with flux data calculated 
-     * from buffered image data. */
+    /* Now attempt to fill the batch with flux data calculated from buffered
+     * image data. The batch may straddle the end of the ring. */
     prev_ticks_since_index = image_ticks_since_index(drv->image);
-    dma_rd->prod += done = image_rdata_flux(
-        drv->image, &dma_rd->buf[dma_rd->prod], nr);
-    dma_rd->prod &= buf_mask;
-    if (done != nr) {
-        /* Read buffer ran dry: kick us when more data is available. */
+    do {
+        nr = min_t(uint16_t, todo, dma_rd->len - dma_rd->prod);
+        done = image_rdata_flux(drv->image, &dma_rd->buf[dma_rd->prod], nr);
+        dma_rd_queued(&dma_rd->buf[dma_rd->prod], done);
+        dma_rd->prod = (dma_rd->prod + done) & buf_mask;
+        todo -= done;
+    } while (todo && (done == nr));
+
+    /* Read buffer ran dry: if the next half-transfer interrupt may come too
+     * late, kick us when more data is available. */
+    if (todo && (((dma_rd->prod - dmacons) & buf_mask) < RDATA_REFILL_BATCH))
         dma_rd->kick_dma_irq = TRUE;
-    } else if (nr != nr_to_cons) {
-        /* We didn't fill the ring: re-enter this ISR to do more work. */
-        IRQx_set_pending(dma_rdata_irq);
-    }
 
     ASSERT(drv->image->index_pulses_len < MAX_CUSTOM_PULSES);
     if (drv->image->index_pulses_ver != index.custom_pulses_ver) {
@@ -671,40 +861,42 @@ static void IRQ_rdata_dma(void)
     if (image_ticks_since_index(drv->image) >= prev_ticks_since_index)
         return;
 
-    /* We crossed the index mark: Synchronise index pulse to the bitstream. */
-    for (;;) {
-        /* Snapshot current position in flux stream, including progress through
-         * current timer sample. */
-        now = time_now();
-        /* Ticks left in current sample. */
-        ticks = tim_rdata->arr - tim_rdata->cnt;
-        /* Index of next sample. */
-        dmacons = ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr;
-        /* If another sample was loaded meanwhile, try again for a consistent
-         * snapshot. */
-        if (dmacons == dma_rd->cons)
-            break;
-        dma_rd->cons = dmacons;
+    /* Log maximum refill interrupts per revolution. */
+    if (dma_rd->refills > dma_rd->max_refills) {
+        dma_rd->max_refills = dma_rd->refills;
+        trace("RDATA: %u refills/rev\n", dma_rd->max_refills, 0, 0);
     }
-    /* Sum all flux timings in the DMA buffer. */
-    for (i = dmacons; i != dma_rd->prod; i = (i+1) & buf_mask)
-        ticks += dma_rd->buf[i] + 1;
+    dma_rd->refills = 0;
+
+    /* We crossed the index mark: Synchronise index pulse to the bitstream.
+     * Ticks remaining in the DMA ring are tracked incrementally. */
+    now = time_now();
+    dma_rd_consumed(now);
     /* Subtract current flux offset beyond the index. */
-    ticks -= image_ticks_since_index(drv->image);
+    ticks = dma_rd->ticks - image_ticks_since_index(drv->image);
     /* Calculate deadline for index timer. */
     ticks /= SYSCLK_MHZ/TIME_MHZ;
     timer_set(&index.timer, now + ticks);
 }
 
-static void IRQ_wdata_dma(void)
+static ramfunc void IRQ_rdata_dma(void)
+{
+    uint32_t t = profile_start();
+    _IRQ_rdata_dma();
+    profile_end(PROF_rdata_dma, t);
+}
+
+/* Returns the number of flux samples processed. */
+static ramfunc unsigned int _IRQ_wdata_dma(void)
 {
-    const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
+    const uint16_t buf_mask = dma_wr->len - 1;
     uint16_t cons, prod, prev, curr, next;
     uint16_t cell = image->write_bc_ticks, window;
     uint32_t bc_dat = 0, bc_prod;
     uint32_t *bc_buf = image->bufs.write_bc.p;
-    unsigned int sync = image->sync;
+    unsigned int sync = image->sync, zeros, nr, k;
     unsigned int bc_bufmask = (image->bufs.write_bc.len / 4) - 1;
+    unsigned int nr_samples;
     struct write *write = NULL;
 
     window = cell + (cell >> 1);
@@ -714,10 +906,10 @@ static void IRQ_wdata_dma(void)
 
     /* If we happen to be called in the wrong state, just bail. */
     if (dma_wr->state == DMA_inactive)
-        return;
+        return 0;
 
     /* Find out where the DMA engine's producer index has got to. */
-    prod = ARRAY_SIZE(dma_wr->buf) - dma_wdata.cndtr;
+    prod = dma_wr->len - dma_wdata.cndtr;
 
     /* Check if we are processing the tail end of a write. */
     barrier(); /* interrogate peripheral /then/ check for write-end. */
@@ -734,24 +926,28 @@ static void IRQ_wdata_dma(void)
         next = dma_wr->buf[cons];
         curr = next - prev;
         prev = next;
-        while (curr > window) {
-            curr -= cell;
-            bc_dat <<= 1;
-            bc_prod++;
+        /* Number of empty bitcells preceding this flux transition. */
+        zeros = (curr > window) ? (curr - window - 1) / cell + 1 : 0;
+        for (nr = zeros; nr != 0; nr -= k) {
+            /* Shift in zeroes up to the next 32-bit boundary. */
+            k = min_t(unsigned int, nr, 32 - (bc_prod & 31));
+            bc_dat = (k < 32) ? bc_dat << k : 0;
+            bc_prod += k;
             if (!(bc_prod&31))
                 bc_buf[((bc_prod-1) / 32) & bc_bufmask] = htobe32(bc_dat);
         }
         bc_dat = (bc_dat << 1) | 1;
         bc_prod++;
+        /* Only check for sync where the bitcell run can complete a sync mark. */
         switch (sync) {
         case SYNC_fm:
             /* FM clock sync clock byte is 0xc7. Check for:
              * 1010 1010 1010 1010 1x1x 0x0x 0x1x 1x1x */
-            if ((bc_dat & 0xffffd555) == 0x55555015)
+            if ((zeros <= 1) && ((bc_dat & 0xffffd555) == 0x55555015))
                 bc_prod = (bc_prod - 31) | 31;
             break;
         case SYNC_mfm:
-            if (bc_dat == 0x44894489)
+            if ((zeros == 2) && (bc_dat == 0x44894489))
                 bc_prod &= ~31;
             break;
         }
@@ -775,10 +971,20 @@ static void IRQ_wdata_dma(void)
     }
 
     /* Save our progress for next time. */
+    nr_samples = (cons - dma_wr->cons) & buf_mask;
     image->write_bc_window = bc_dat;
     image->bufs.write_bc.prod = bc_prod;
     dma_wr->cons = cons;
     dma_wr->prev_sample = prev;
+
+    return nr_samples;
+}
+
+static ramfunc void IRQ_wdata_dma(void)
+{
+    uint32_t t = profile_start();
+    unsigned int nr = _IRQ_wdata_dma();
+    profile_end_n(PROF_wdata_dma, t, nr);
 }
 
 void floppy_sync(void)
@@ -787,6 +993,7 @@ void floppy_sync(void)
     struct image *im = drv->image;
 
     image_sync(im);
+    journal_sync();
 }
 
 /*
@@ -39,34 +39,68 @@ union op_args {
         void* buff;
         DRESULT *res;
     } disk_ioctl;
+    struct {
+        FATFS *fs;
+        UINT nr_secs;
+    } count_free;
 };
 
 struct op;
 
 typedef void (*f_op_func)(struct op *op);
 
+/* Priority classes. Ops run in FIFO order within a class, and reads (which
+ * the flux generator may be starving for) go ahead of deferred writes and
+ * syncs. */
+#define PRIO_read     0
+#define PRIO_deferred 1
+
 struct op {
     f_op_func func;
     FIL *fp;
     union op_args args;
+    FOP seq;
+    /* Extent accessed, if known (len != 0). Bytes, or sectors for disk ops. */
+    FSIZE_t off;
+    uint32_t len;
+    time_t queued;
+    /* Completion callback, if any. */
+    void (*cb)(FOP oper, void *arg);
+    void *cb_arg;
+    uint8_t prio;
     bool_t cancelled;
+    bool_t started;
+    bool_t done;
+    /* An lseek which must run immediately before the following op. */
+    bool_t linked;
 };
 
-#define OPS_LEN 4 /* Power of 2. */
+#define OPS_LEN 16 /* Power of 2. */
 #define OPS_MASK(x) ((x)&(OPS_LEN-1))
 static struct {
     struct op ops[OPS_LEN];
+    /* cons is the oldest op not yet done. Later ops may already be done. */
     int prod, cons;
+    struct f_async_stats stats;
+    /* The I/O thread sleeps here while no ops are queued. */
+    struct waitq queued_wq;
+    /* Threads waiting for an op to complete. */
+    struct waitq done_wq;
 } f_async_queue;
 
+static void do_lseek(struct op *op);
+static void do_write(struct op *op);
+static void do_disk_write(struct op *op);
+
 bool_t F_async_isdone(FOP oper) {
     ASSERT(oper - f_async_queue.prod < 0);
-    return oper - f_async_queue.cons < 0;
+    return (oper - f_async_queue.cons < 0)
+        || f_async_queue.ops[OPS_MASK(oper)].done;
 }
 
 void F_async_wait(FOP oper) {
     while (!F_async_isdone(oper))
-        thread_yield();
+        thread_wait(&f_async_queue.done_wq);
 }
 
 void F_async_cancel(FOP oper) {
@@ -84,10 +118,44 @@ FOP F_async_get_completed_op(void) {
     return f_async_queue.cons - 4; /* "Random" op. Chosen by fair dice roll. */
 }
 
-static FOP enqueue(f_op_func func, FIL *fp, union op_args *args) {
-    struct op *op;
+void F_async_whendone(FOP oper, void (*cb)(FOP oper, void *arg), void *arg) {
+    struct op *op = &f_async_queue.ops[OPS_MASK(oper)];
+    if (F_async_isdone(oper)) {
+        cb(oper, arg);
+        return;
+    }
+    op->cb = cb;
+    op->cb_arg = arg;
+}
+
+void F_async_get_stats(struct f_async_stats *stats) {
+    *stats = f_async_queue.stats;
+}
+
+/* Must @op (a read) stay behind a pending op which repositions the file or
+ * writes data it may need? */
+static bool_t conflicts_with_write(struct op *op) {
+    struct op *w;
+    int i;
+    for (i = f_async_queue.cons; i != f_async_queue.prod; i++) {
+        w = &f_async_queue.ops[OPS_MASK(i)];
+        if (w->done || (w->fp != op->fp))
+            continue;
+        if ((w->func == do_lseek) && !w->linked)
+            return TRUE;
+        if ((w->func != do_write) && (w->func != do_disk_write))
+            continue;
+        if (!w->len || !op->len) /* Unknown extent */
+            return TRUE;
+        if ((op->off < w->off + w->len) && (w->off < op->off + op->len))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void wait_for_slots(int nr) {
     bool_t printed = FALSE;
-    while (f_async_queue.prod - f_async_queue.cons >= OPS_LEN) {
+    while (f_async_queue.prod - f_async_queue.cons > OPS_LEN - nr) {
         if (!printed) {
             printk("async queue full; blocking on I/O\n");
             printk("0: %x 1: %x\n",
@@ -95,26 +163,119 @@ static FOP enqueue(f_op_func func, FIL *fp, union op_args *args) {
                     f_async_queue.ops[OPS_MASK(f_async_queue.prod-2)].func);
             printed = TRUE;
         }
-        thread_yield();
+        thread_wait(&f_async_queue.done_wq);
+    }
+}
+
+/* @off is relative to the preceding lseek (if any) for file ops, which are
+ * otherwise of unknown extent. Disk ops specify an absolute @off. */
+static FOP enqueue(f_op_func func, FIL *fp, union op_args *args,
+                   uint8_t prio, bool_t file_op, FSIZE_t off, uint32_t len) {
+    struct op *op, *lseek = NULL;
+    unsigned int depth;
+
+    wait_for_slots(1);
+
+    /* An lseek immediately preceding this op is bound to it: they share a
+     * priority class and run back to back. */
+    if (f_async_queue.prod != f_async_queue.cons) {
+        lseek = &f_async_queue.ops[OPS_MASK(f_async_queue.prod-1)];
+        if ((lseek->func != do_lseek) || (lseek->fp != fp)
+            || lseek->done || lseek->linked)
+            lseek = NULL;
     }
+
     op = &f_async_queue.ops[OPS_MASK(f_async_queue.prod)];
     op->func = func;
     op->fp = fp;
     op->args = *args;
+    op->seq = f_async_queue.prod;
+    if (file_op) {
+        op->off = lseek ? lseek->args.lseek.ofs + off : 0;
+        op->len = lseek ? len : 0;
+    } else {
+        op->off = off;
+        op->len = len;
+    }
+    op->queued = time_now();
+    op->cb = NULL;
     op->cancelled = FALSE;
+    op->started = FALSE;
+    op->done = FALSE;
+    op->linked = FALSE;
+
+    if (lseek)
+        lseek->linked = TRUE;
+    if ((prio == PRIO_read) && conflicts_with_write(op))
+        prio = PRIO_deferred;
+    op->prio = prio;
+    if (lseek)
+        lseek->prio = prio;
+
+    depth = f_async_queue.prod - f_async_queue.cons + 1;
+    if (depth > f_async_queue.stats.max_depth)
+        f_async_queue.stats.max_depth = depth;
+
+    /* The I/O thread sleeps while the queue is empty. */
+    thread_wake_all(&f_async_queue.queued_wq);
+
     return f_async_queue.prod++;
 }
 
-void F_async_drain(void) {
-    while (f_async_queue.prod != f_async_queue.cons) {
-        struct op *op = &f_async_queue.ops[OPS_MASK(f_async_queue.cons)];
-        if (!op->cancelled) {
-            op->func(op);
-        }
+/* Oldest pending read, else oldest pending op. */
+static struct op *next_op(void) {
+    struct op *op, *oldest = NULL;
+    int i;
+    for (i = f_async_queue.cons; i != f_async_queue.prod; i++) {
+        op = &f_async_queue.ops[OPS_MASK(i)];
+        if (op->done)
+            continue;
+        if (op->prio == PRIO_read)
+            return op;
+        if (oldest == NULL)
+            oldest = op;
+    }
+    return oldest;
+}
+
+static void run_op(struct op *op) {
+    uint32_t wait_us = time_since(op->queued) / TIME_MHZ;
+    struct f_async_stats *stats = &f_async_queue.stats;
+
+    if (wait_us > stats->max_wait_us[op->prio])
+        stats->max_wait_us[op->prio] = wait_us;
+    if (op != &f_async_queue.ops[OPS_MASK(f_async_queue.cons)])
+        stats->nr_overtakes++;
+
+    op->started = TRUE;
+    if (!op->cancelled)
+        op->func(op);
+    op->done = TRUE;
+    if (op->cb && !op->cancelled)
+        (*op->cb)(op->seq, op->cb_arg);
+
+    while ((f_async_queue.cons != f_async_queue.prod)
+           && f_async_queue.ops[OPS_MASK(f_async_queue.cons)].done)
         f_async_queue.cons++;
+
+    thread_wake_all(&f_async_queue.done_wq);
+}
+
+void F_async_drain(void) {
+    struct op *op;
+    while ((op = next_op()) != NULL) {
+        bool_t linked = op->linked;
+        run_op(op);
+        if (linked)
+            run_op(&f_async_queue.ops[OPS_MASK(op - f_async_queue.ops + 1)]);
     }
 }
 
+void F_async_sleep(void) {
+    while (next_op() == NULL)
+        thread_wait(&f_async_queue.queued_wq);
+}
+
 static void do_lseek(struct op *op) {
     /* Short-circuit if already appropriately positioned. The caller of
      * F_lseek_async can't check fptr themselves like they could using the
@@ -126,7 +287,9 @@ static void do_lseek(struct op *op) {
 
 FOP F_lseek_async(FIL *fp, FSIZE_t ofs) {
     union op_args args = { .lseek = {ofs} };
-    return enqueue(do_lseek, fp, &args);
+    /* Make room for the op which this lseek will be bound to. */
+    wait_for_slots(2);
+    return enqueue(do_lseek, fp, &args, PRIO_deferred, TRUE, 0, 0);
 }
 
 static void do_read(struct op *op) {
@@ -140,7 +303,20 @@ static void do_read(struct op *op) {
 
 FOP F_read_async(FIL *fp, void *buff, UINT btr, UINT *br) {
     union op_args args = { .read = {buff, btr, br} };
-    return enqueue(do_read, fp, &args);
+    return enqueue(do_read, fp, &args, PRIO_read, TRUE, 0, btr);
+}
+
+static void do_read_lba(struct op *op) {
+    if (disk_read(op->fp->obj.fs->pdrv, op->args.disk_read.buff,
+            op->args.disk_read.sector, op->args.disk_read.count) != RES_OK)
+        F_die(FR_DISK_ERR);
+}
+
+FOP F_read_lba_async(FIL *fp, FSIZE_t ofs, LBA_t sector,
+                     void *buff, UINT btr) {
+    union op_args args = { .disk_read = {buff, sector, btr / 512} };
+    /* A file op of known extent, so it is ordered against writes to @fp. */
+    return enqueue(do_read_lba, fp, &args, PRIO_read, FALSE, ofs, btr);
 }
 
 static void do_write(struct op *op) {
@@ -154,7 +330,7 @@ static void do_write(struct op *op) {
 
 FOP F_write_async(FIL *fp, const void *buff, UINT btw, UINT *bw) {
     union op_args args = { .write = {buff, btw, bw} };
-    return enqueue(do_write, fp, &args);
+    return enqueue(do_write, fp, &args, PRIO_deferred, TRUE, 0, btw);
 }
 
 static void do_sync(struct op *op) {
@@ -163,7 +339,7 @@ static void do_sync(struct op *op) {
 
 FOP F_sync_async(FIL *fp) {
     union op_args args = { 0 };
-    return enqueue(do_sync, fp, &args);
+    return enqueue(do_sync, fp, &args, PRIO_deferred, TRUE, 0, 0);
 }
 
 static void do_disk_read(struct op *op) {
@@ -172,9 +348,37 @@ static void do_disk_read(struct op *op) {
         F_die(FR_DISK_ERR);
 }
 
+static void do_merged(struct op *op) {
+    /* Data was transferred by the preceding op. */
+}
+
 FOP disk_read_async(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
     union op_args args = { .disk_read = {buff, sector, count} };
-    return enqueue(do_disk_read, (void*)(uintptr_t) pdrv, &args);
+    struct op *prev = &f_async_queue.ops[OPS_MASK(f_async_queue.prod-1)];
+
+    /* Merge with an adjacent, not yet started, read of the preceding sectors
+     * into the preceding buffer space. The merged op completes immediately
+     * after the preceding op, as they share its priority class. */
+    if ((f_async_queue.prod != f_async_queue.cons)
+        && (f_async_queue.prod - f_async_queue.cons < OPS_LEN)
+        && (prev->func == do_disk_read) && !prev->started && !prev->cancelled
+        && (prev->fp == (void *)(uintptr_t)pdrv)
+        && (prev->args.disk_read.sector + prev->args.disk_read.count
+            == sector)
+        && (prev->args.disk_read.buff + prev->args.disk_read.count * 512
+            == buff)) {
+        struct op merged = *prev;
+        merged.len += count;
+        if ((prev->prio == PRIO_deferred) || !conflicts_with_write(&merged)) {
+            prev->args.disk_read.count += count;
+            prev->len += count;
+            return enqueue(do_merged, (void*)(uintptr_t) pdrv, &args,
+                    prev->prio, FALSE, sector, count);
+        }
+    }
+
+    return enqueue(do_disk_read, (void*)(uintptr_t) pdrv, &args,
+            PRIO_read, FALSE, sector, count);
 }
 
 static void do_disk_write(struct op *op) {
@@ -190,7 +394,8 @@ static void do_disk_write(struct op *op) {
 
 FOP disk_write_async(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
     union op_args args = { .disk_write = {buff, sector, count} };
-    return enqueue(do_disk_write, (void*)(uintptr_t) pdrv, &args);
+    return enqueue(do_disk_write, (void*)(uintptr_t) pdrv, &args,
+            PRIO_deferred, FALSE, sector, count);
 }
 
 static void do_disk_ioctl(struct op *op) {
@@ -204,5 +409,21 @@ static void do_disk_ioctl(struct op *op) {
 
 FOP disk_ioctl_async(BYTE pdrv, BYTE cmd, void* buff, DRESULT *res) {
     union op_args args = { .disk_ioctl = {cmd, buff, res} };
-    return enqueue(do_disk_ioctl, (void*)(uintptr_t) pdrv, &args);
+    return enqueue(do_disk_ioctl, (void*)(uintptr_t) pdrv, &args,
+            PRIO_deferred, FALSE, 0, 0);
+}
+
+/* Hack inside the guts of FatFS. */
+FRESULT flashfloppy_count_free(FATFS *fs, UINT nr_secs);
+
+static void do_count_free(struct op *op) {
+    FRESULT fr = flashfloppy_count_free(op->args.count_free.fs,
+                                        op->args.count_free.nr_secs);
+    if ((fr != FR_OK) && (fr != FR_TIMEOUT))
+        F_die(fr);
+}
+
+FOP F_count_free_async(FATFS *fs, UINT nr_secs) {
+    union op_args args = { .count_free = {fs, nr_secs} };
+    return enqueue(do_count_free, NULL, &args, PRIO_deferred, FALSE, 0, 0);
 }
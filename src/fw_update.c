@@ -101,11 +101,49 @@ static bool_t fw_update_requested(void)
     return requested;
 }
 
+static bool_t page_is_blank(uint32_t p)
+{
+    const uint32_t *q = (const uint32_t *)p;
+    unsigned int i;
+    for (i = 0; i < flash_page_size/4; i++)
+        if (q[i] != ~0u)
+            return FALSE;
+    return TRUE;
+}
+
+/* Does the flash page containing @p already hold the @nr bytes at @buf, and
+ * is the remainder of that page blank? */
+static bool_t page_matches(uint32_t p, const void *buf, unsigned int nr)
+{
+    const uint32_t *q = (const uint32_t *)p;
+    unsigned int i;
+    if (memcmp(q, buf, nr) != 0)
+        return FALSE;
+    for (i = nr/4; i < flash_page_size/4; i++)
+        if (q[i] != ~0u)
+            return FALSE;
+    return TRUE;
+}
+
 static void erase_old_firmware(void)
 {
     uint32_t p;
+    /* Page erases are slow (tens of ms each), so skip pages which are blank
+     * already: Typically everything beyond the previous firmware image. */
     for (p = FIRMWARE_START; p < FIRMWARE_END; p += flash_page_size)
-        fpec_page_erase(p);
+        if (!page_is_blank(p))
+            fpec_page_erase(p);
+}
+
+/* Erase the first page, holding the vector table, before any other page is
+ * changed. The bootloader jumps to the main firmware whenever the reset SP is
+ * valid, so this page must remain blank until every other page is in place
+ * and verified. An update which is interrupted then restarts on next boot. */
+static void erase_vectors(void)
+{
+    old_firmware_erased = TRUE;
+    if (!page_is_blank(FIRMWARE_START))
+        fpec_page_erase(FIRMWARE_START);
 }
 
 static void msg_display(const char *p)
@@ -130,12 +168,13 @@ int update(void *unused)
     static FILINFO fno;
     static char update_fname[FF_MAX_LFN+1];
 
-    /* Our file buffer. Again, off stack. */
-    static uint8_t buf[2048];
+    /* Our file buffer. Again, off stack. Sized for multi-sector reads, and
+     * word aligned for crc32_hw(). */
+    static uint8_t buf[4096] aligned(4);
 
-    uint32_t p;
+    uint32_t p, file_crc32, fw_crc32;
     uint16_t footer[2], crc;
-    UINT i, nr;
+    UINT i, nr, off, n, nr_prg, vec;
     FIL *fp = &file;
 
     /* Find the update file, confirming that it exists and there is no 
@@ -173,53 +212,98 @@ int update(void *unused)
         fail_code = FC_bad_file;
         goto fail;
     }
+    /* Bytes of the file in the vector-table page, which is programmed last. */
+    vec = min_t(UINT, flash_page_size, f_size(fp));
 
-    /* Check the CRC-CCITT. */
+    /* Check the CRC-CCITT. Also take a CRC-32 of the file beyond the vector
+     * page in the CRC unit, to verify the programmed firmware against. */
     msg_display("CRC");
     crc = 0xffff;
+    crc32_hw_reset();
+    file_crc32 = crc32_hw_result();
     F_lseek(fp, 0);
     for (i = 0; !f_eof(fp); i++) {
         nr = min_t(UINT, sizeof(buf), f_size(fp) - f_tell(fp));
         F_read(&file, buf, nr, NULL);
         crc = crc16_ccitt(buf, nr, crc);
+        off = i ? 0 : vec;
+        if (nr > off)
+            file_crc32 = crc32_hw(buf + off, nr - off);
     }
     if (crc != 0) {
         fail_code = FC_bad_crc;
         goto fail;
     }
 
-    /* Erase the old firmware. */
-    msg_display("CLR");
-    fpec_init();
-    erase_old_firmware();
-    old_firmware_erased = TRUE;
-
-    /* Program the new firmware. */
+    /* Program the new firmware, a page at a time. Pages which already hold
+     * the new contents are neither erased nor reprogrammed: Successive
+     * releases typically differ in only part of the image. The vector page
+     * is erased before the first change, and programmed last. */
     msg_display("PRG");
-    crc = 0xffff;
+    fpec_init();
     F_lseek(fp, 0);
     p = FIRMWARE_START;
+    nr_prg = 0;
     for (i = 0; !f_eof(fp); i++) {
         nr = min_t(UINT, sizeof(buf), f_size(fp) - f_tell(fp));
         F_read(&file, buf, nr, NULL);
-        fpec_write(buf, nr, p);
-        if (memcmp((void *)p, buf, nr) != 0) {
-            /* Byte-by-byte verify failed. */
-            fail_code = FC_bad_prg;
-            goto fail;
+        for (off = 0; off < nr; off += n) {
+            n = min_t(UINT, flash_page_size, nr - off);
+            if ((p + off == FIRMWARE_START)
+                || page_matches(p + off, buf + off, n))
+                continue;
+            if (!old_firmware_erased)
+                erase_vectors();
+            if (!page_is_blank(p + off))
+                fpec_page_erase(p + off);
+            fpec_write(buf + off, n, p + off);
+            if (memcmp((void *)(p + off), buf + off, n) != 0) {
+                /* Byte-by-byte verify failed. */
+                fail_code = FC_bad_prg;
+                goto fail;
+            }
+            nr_prg++;
         }
         p += nr;
     }
 
-    /* Verify the new firmware (CRC-CCITT). */
-    p = FIRMWARE_START;
-    crc = crc16_ccitt((void *)p, f_size(fp), 0xffff);
-    if (crc) {
+    /* Erase whatever remains of the old firmware beyond the new image. */
+    msg_display("CLR");
+    p = (p + flash_page_size - 1) & ~(flash_page_size - 1);
+    for (; p < FIRMWARE_END; p += flash_page_size) {
+        if (!page_is_blank(p)) {
+            if (!old_firmware_erased)
+                erase_vectors();
+            fpec_page_erase(p);
+        }
+    }
+
+    /* Verify the new firmware beyond the vector page (CRC-32). */
+    crc32_hw_reset();
+    fw_crc32 = crc32_hw_result();
+    if (f_size(fp) > vec)
+        fw_crc32 = crc32_hw((void *)(FIRMWARE_START + vec), f_size(fp) - vec);
+    if (fw_crc32 != file_crc32) {
         /* CRC verify failed. */
         fail_code = FC_bad_prg;
         goto fail;
     }
 
+    /* Everything else is in place: Now program the vector page. */
+    F_lseek(fp, 0);
+    F_read(&file, buf, vec, NULL);
+    if (old_firmware_erased || !page_matches(FIRMWARE_START, buf, vec)) {
+        erase_vectors();
+        fpec_write(buf, vec, FIRMWARE_START);
+        if (memcmp((void *)FIRMWARE_START, buf, vec) != 0) {
+            fail_code = FC_bad_prg;
+            goto fail;
+        }
+        nr_prg++;
+    }
+    printk("%u of %u pages reprogrammed\n", nr_prg,
+           (f_size(fp) + flash_page_size - 1) / flash_page_size);
+
     /* All done! */
     fail_code = 0;
 
@@ -300,20 +384,24 @@ int main(void)
      * UPDATE MODE
      */
 
-    /* Initialise the world. */
+    /* Bring up only what we need to sample the buttons. On an ordinary boot
+     * we go straight back through reset into the main firmware. */
     canary_init();
     stm32_init();
+    board_init();
+
+    if (!update_requested && !buttons_pressed())
+        reset_to_main_fw();
+
+    /* Initialise the world. */
     time_init();
     console_init();
-    board_init();
+    dma_copy_init();
 
     printk("\n** FF Update Bootloader v%s for Gotek\n", fw_ver);
     printk("** Keir Fraser <keir.xen@gmail.com>\n");
     printk("** https://github.com/keirf/FlashFloppy\n\n");
 
-    if (!update_requested && !buttons_pressed())
-        reset_to_main_fw();
-
     delay_ms(200); /* 5v settle */
 
     flash_ff_cfg_read();
@@ -62,6 +62,10 @@ static const struct exti_irq exti_irqs[] = {
     /* MTR/CHGRST */ { 40, TIMER_IRQ_PRI, 0 }
 };
 
+/* SIDE glitch filter. */
+static struct timer side_timer;
+static void side_timer_fn(void *);
+
 bool_t floppy_ribbon_is_reversed(void)
 {
     time_t t_start = time_now();
@@ -83,6 +87,8 @@ static void board_floppy_init(void)
 {
     uint32_t pins;
 
+    timer_init(&side_timer, side_timer_fn, NULL);
+
     gpio_configure_pin(gpiob, pin_dir,   GPI_bus);
     gpio_configure_pin(gpioa, pin_step,  GPI_bus);
     gpio_configure_pin(gpioa, pin_sel0,  GPI_bus);
@@ -230,6 +236,7 @@ static void IRQ_STEP_changed(void)
 {
     struct drive *drv = &drive;
     uint8_t idr_a, idr_b;
+    time_t now;
 
     /* Latch inputs. */
     idr_a = gpioa->idr;
@@ -258,7 +265,10 @@ static void IRQ_STEP_changed(void)
         return;
 
     /* Valid step request for this drive: start the step operation. */
-    drv->step.start = time_now();
+    now = time_now();
+    drv->step.interval = (drv->step.state == STEP_settling)
+        ? time_diff(drv->step.start, now) : 0;
+    drv->step.start = now;
     drv->step.state = STEP_started;
     if (drv->outp & m(outp_trk0))
         drive_change_output(drv, outp_trk0, FALSE);
@@ -274,30 +284,50 @@ static void IRQ_STEP_changed(void)
     IRQx_set_pending(FLOPPY_SOFTIRQ);
 }
 
+static void side_change(struct drive *drv, uint8_t hd)
+{
+    drv->head = hd;
+    if ((dma_rd != NULL) && (drv->image->nr_sides == 2))
+        rdata_stop();
+}
+
+/* SIDE has been stable for the glitch-filter period. Runs at the same
+ * priority as IRQ_SIDE_changed(). */
+static void side_timer_fn(void *unused)
+{
+    struct drive *drv = &drive;
+    uint8_t hd = !(gpiob->idr & m(pin_side));
+    if (hd != drv->head)
+        side_change(drv, hd);
+}
+
 static void IRQ_SIDE_changed(void)
 {
-    stk_time_t t = stk_now();
-    unsigned int filter = stk_us(ff_cfg.side_select_glitch_filter);
     struct drive *drv = &drive;
     uint8_t hd;
 
-    do {
-        /* Clear SIDE-changed flag. */
-        exti->pr = m(pin_side);
+    /* Clear SIDE-changed flag. */
+    exti->pr = m(pin_side);
 
-        /* Has SIDE actually changed? */
-        hd = !(gpiob->idr & m(pin_side));
-        if (hd == drv->head)
-            return;
+    /* Has SIDE actually changed? */
+    hd = !(gpiob->idr & m(pin_side));
 
-        /* If configured to do so, wait a few microseconds to ensure this isn't
-         * a glitch (eg. signal is mistaken for the archaic Fault-Reset line by
-         * old CP/M loaders, and pulsed LOW when starting a read). */
-    } while (stk_diff(t, stk_now()) < filter);
+    if (!ff_cfg.side_select_glitch_filter) {
+        if (hd != drv->head)
+            side_change(drv, hd);
+        return;
+    }
 
-    drv->head = hd;
-    if ((dma_rd != NULL) && (drv->image->nr_sides == 2))
-        rdata_stop();
+    /* If configured to do so, accept the change only once SIDE has been
+     * stable for a few microseconds, to ensure this isn't a glitch (eg.
+     * signal is mistaken for the archaic Fault-Reset line by old CP/M
+     * loaders, and pulsed LOW when starting a read). Every edge restarts
+     * the timer, so we never wait here. */
+    if (hd == drv->head)
+        timer_cancel(&side_timer);
+    else
+        timer_set(&side_timer,
+                  time_now() + time_us(ff_cfg.side_select_glitch_filter));
 }
 
 static void IRQ_WGATE_changed(void)
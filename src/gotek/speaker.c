@@ -9,54 +9,46 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
-/* JPB: PA2 */
+/* JPB: PA2 = TIM2_CH3 */
 #define gpio_spk gpioa
 #define pin_spk 2
+#define tim_spk (tim2)
 
-static struct {
-    volatile enum { STATE_idle, STATE_active, STATE_masked } state;
-    time_t start;
-    struct timer timer;
-} pulse;
-
-static void pulse_timer_fn(void *unused)
-{
-    switch (pulse.state) {
-    case STATE_idle:
-        break;
-    case STATE_active:
-        gpio_write_pin(gpio_spk, pin_spk, FALSE);
-        pulse.state = STATE_masked;
-        /* Mask to typical minimum floppy step cycle (3ms) less 10% */
-        timer_set(&pulse.timer, pulse.start + time_us(2700));
-        break;
-    case STATE_masked:
-        pulse.state = STATE_idle;
-        break;
-    }
-}
+/* Each click is a single run of the timer in one-pulse mode. The output is
+ * high from the start of the run until CCR3, and the run spans the masking
+ * period. CCR3 is preloaded with zero, which applies from the update event at
+ * the end of the run, so the output stays low while the timer is stopped. */
 
 void speaker_init(void)
 {
-    pulse.state = STATE_idle;
-    gpio_configure_pin(gpio_spk, pin_spk, GPO_pushpull(_2MHz, FALSE));
-    timer_init(&pulse.timer, pulse_timer_fn, NULL);
+    /* Count in time_t ticks. */
+    tim_spk->psc = SYSCLK_MHZ/TIME_MHZ-1;
+    /* Mask to typical minimum floppy step cycle (3ms) less 10% */
+    tim_spk->arr = time_us(2700);
+    tim_spk->ccr3 = 0;
+    tim_spk->ccmr2 = (TIM_CCMR2_CC3S(TIM_CCS_OUTPUT) |
+                      TIM_CCMR2_OC3PE |
+                      TIM_CCMR2_OC3M(TIM_OCM_PWM1));
+    tim_spk->ccer = TIM_CCER_CC3E;
+    tim_spk->egr = TIM_EGR_UG;
+    tim_spk->cr1 = TIM_CR1_OPM;
+    gpio_configure_pin(gpio_spk, pin_spk, AFO_pushpull(_2MHz));
 }
 
 void speaker_pulse(void)
 {
     unsigned int volume = ff_cfg.step_volume;
-    time_t now;
 
-    if (!volume || (pulse.state != STATE_idle))
+    /* The timer runs until the masking period is over. */
+    if (!volume || (tim_spk->cr1 & TIM_CR1_CEN))
         return;
 
-    gpio_write_pin(gpio_spk, pin_spk, TRUE);
-
-    now = time_now();
-    pulse.state = STATE_active;
-    pulse.start = now;
-    timer_set(&pulse.timer, now + volume*volume*3);
+    /* Load the pulse width for this run (UG also zeroes the counter), then
+     * preload zero for the end of the run. */
+    tim_spk->ccr3 = volume*volume*3;
+    tim_spk->egr = TIM_EGR_UG;
+    tim_spk->ccr3 = 0;
+    tim_spk->cr1 = TIM_CR1_OPM | TIM_CR1_CEN;
 }
 
 /*
@@ -51,8 +51,12 @@ static void progress_write(struct image *im)
     for (cnt = 1; wb->cons + cnt < wb->prod && idx + cnt < wb->len; cnt++)
         if (im->adf.write_offsets[idx+cnt] != off + cnt)
             break;
-    F_lseek_async(&im->fp, off*512);
-    im->adf.write_op = F_write_async(&im->fp, wb->p + idx*512, cnt*512, NULL);
+    if (!journal_write_async(&im->fp, off*512, wb->p + idx*512, cnt,
+                             &im->adf.write_op)) {
+        F_lseek_async(&im->fp, off*512);
+        im->adf.write_op = F_write_async(&im->fp, wb->p + idx*512,
+                                         cnt*512, NULL);
+    }
     im->adf.write_cnt = cnt;
     im->adf.sync_state = SYNC_NEEDED;
 }
@@ -68,6 +72,23 @@ static uint32_t amigados_checksum(void *dat, unsigned int bytes)
     return csum;
 }
 
+/* Decode @n data longwords from their even and odd MFM halves into @w,
+ * returning the XOR of the (masked) MFM longwords for the data checksum. */
+static uint32_t decode_data(uint32_t *w, const uint32_t *e,
+                            const uint32_t *o, unsigned int n)
+{
+    uint32_t x, y, dsum = 0;
+
+    while (n--) {
+        x = *e++ & 0x55555555;
+        y = *o++ & 0x55555555;
+        dsum ^= x ^ y;
+        *w++ = (x << 1) | y;
+    }
+
+    return dsum;
+}
+
 static bool_t adf_open(struct image *im)
 {
     if ((f_size(&im->fp) % (2*11*512)) || (f_size(&im->fp) == 0))
@@ -190,6 +211,15 @@ static bool_t adf_read_track(struct image *im)
     _l &= 0x55555555u; /* data bits */                          \
     _l |= (~((l>>2)|l) & 0x55555555u) << 1; /* clock bits */    \
     emit_raw(_l); })
+/* Run of MFM-encoded zero longs, filled as 16-bit bitcell words. */
+#define emit_fill_zero(n) ({                                    \
+    unsigned int _n = (n);                                      \
+    if (_n != 0) {                                              \
+        mfm_ring_fill((uint16_t *)bc_b, bc_mask*2+1, bc_p*2,    \
+                      pr, 0xaaaa, _n*2);                        \
+        pr = 0xaaaaaaaau;                                       \
+    }                                                           \
+    bc_p += _n; })
 
     if (im->adf.write_offsets != NULL) {
         progress_write(im);
@@ -203,7 +233,7 @@ static bool_t adf_read_track(struct image *im)
                 (im->cur_track & ~1) * im->adf.nr_secs * 512,
                 ((im->cur_track & ~1) + 1) * im->adf.nr_secs * 512,
                 im->adf.nr_secs);
-        im->adf.ring_io.batch_secs = 2;
+        im->adf.ring_io.batch_secs = ring_io_batch_secs(im->write_bc_ticks*16);
         im->adf.ring_io_inited = TRUE;
 
         ring_io_seek(&im->adf.ring_io,
@@ -217,16 +247,14 @@ static bool_t adf_read_track(struct image *im)
         /* Post-index track gap */
         if (bc_space < POST_IDX_GAP_BC/32)
             return FALSE;
-        for (i = 0; i < POST_IDX_GAP_BC/32; i++)
-            emit_long(0);
+        emit_fill_zero(POST_IDX_GAP_BC/32);
 
     } else if (im->adf.decode_pos == im->adf.nr_secs+1) {
 
         /* Pre-index track gap */
         if (bc_space < im->adf.pre_idx_gap_bc/32)
             return FALSE;
-        for (i = 0; i < im->adf.pre_idx_gap_bc/32-1; i++)
-            emit_long(0);
+        emit_fill_zero(im->adf.pre_idx_gap_bc/32-1);
         emit_raw(0xaaaaaaa0); /* write splice */
         im->adf.decode_pos = -1;
 
@@ -256,8 +284,7 @@ static bool_t adf_read_track(struct image *im)
         emit_long(even(info));
         emit_long(odd(info));
         /* label */
-        for (i = 0; i < 8; i++)
-            emit_long(0);
+        emit_fill_zero(8);
         /* header checksum */
         csum = info ^ (info >> 1);
         emit_long(0);
@@ -304,7 +331,7 @@ static bool_t adf_write_track(struct image *im)
     struct image_buf *wb = &im->adf.write_buffer;
     uint32_t c = wr->cons / 32, p = wr->prod / 32;
     uint32_t info, dsum, csum;
-    unsigned int i, sect;
+    unsigned int i, n, sect;
     unsigned int hd = im->cur_track & 1;
 
     /* If we are processing final data then use the end index, rounded up. */
@@ -362,13 +389,13 @@ static bool_t adf_write_track(struct image *im)
         im->adf.write_offsets[wb->prod % wb->len]
             = im->cur_track * im->adf.nr_secs + sect;
         w = wb->p + (wb->prod % wb->len) * 512;
-        for (i = dsum = 0; i < 128; i++) {
-            uint32_t o = buf[(c + 128) & bufmask] & 0x55555555;
-            uint32_t e = buf[c++ & bufmask] & 0x55555555;
-            dsum ^= o ^ e;
-            *w++ = (e << 1) | o;
+        for (i = dsum = 0; i < 128; i += n) {
+            /* Decode in runs which wrap neither half in the bitcell ring. */
+            uint32_t e = (c + i) & bufmask, o = (c + 128 + i) & bufmask;
+            n = min_t(unsigned int, 128 - i, bufmask + 1 - max(e, o));
+            dsum ^= decode_data(&w[i], &buf[e], &buf[o], n);
         }
-        c += 128;
+        c += 256;
 
         /* Validate the data checksum. */
         csum = be32toh(csum ^ dsum);
@@ -13,8 +13,15 @@
 
 #define SEC_SZ 512
 
+/* Maximum size of the read-ahead ring, in sectors. */
+#define RA_MAX_SECS 64
+
+/* A run of queued sectors is held back while it may yet grow, for up to this
+ * long since a sector was last added to it. */
+#define WRITE_DEFER_MS 50
+
 #define CMD_NOP          0
-#define CMD_SET_LBA      1 /* p[0-3] = LBA (little endian) */
+#define CMD_SET_LBA      1 /* p[0-3] = LBA (little endian), p[5] = nr_sec */
 #define CMD_SET_CYL      2 /* p[0] = drive A cyl, p[1] = drive B cyl */
 #define CMD_SET_RPM      3 /* p[0] = 0x00 -> default, 0xFF -> 300 RPM */
 #define CMD_SELECT_IMAGE 4 /* p[0-1] = slot # (little endian) */
@@ -49,6 +56,26 @@ static unsigned int enc_sec_sz(struct image *im)
     return im->da.idam_sz + im->da.dam_sz;
 }
 
+/* Account a completed write_op in the write rate reported to the host. */
+static void write_done(struct image *im)
+{
+    struct directaccess *da = &im->da;
+    uint32_t ms, us = time_diff(da->write_start, time_now()) / TIME_MHZ;
+
+    da->write_max_us = max_t(uint32_t, da->write_max_us, us);
+    da->write_us += us;
+    da->write_secs += da->write_cnt;
+    /* Decay, so that the rate tracks recent writes. */
+    if (da->write_us >= (1u << 24)) {
+        da->write_us /= 2;
+        da->write_secs /= 2;
+    }
+    ms = da->write_us / 1000;
+    if (ms != 0)
+        da->dass.write_kb_per_sec = min_t(uint32_t, 0xffff,
+                                          (da->write_secs * 500) / ms);
+}
+
 static void progress_write(struct image *im)
 {
     struct image_buf *wb = &im->da.write_buffer;
@@ -62,13 +89,18 @@ static void progress_write(struct image *im)
         return;
     if (im->da.write_cnt) {
         wb->cons += im->da.write_cnt;
+        write_done(im);
         im->da.write_cnt = 0;
     }
     if (wb->prod == wb->cons) {
-        if (im->da.sync_state == SYNCING)
+        if (im->da.sync_state == SYNCING) {
             im->da.sync_state = SYNCED;
-        else if (im->da.sync_state == SYNC_NEEDED) {
+            im->da.sync_max_us = max_t(
+                uint32_t, im->da.sync_max_us,
+                time_diff(im->da.write_start, time_now()) / TIME_MHZ);
+        } else if (im->da.sync_state == SYNC_NEEDED) {
             im->da.write_op = disk_ioctl_async(0, CTRL_SYNC, NULL, NULL);
+            im->da.write_start = time_now();
             im->da.sync_state = SYNCING;
         }
         return;
@@ -80,16 +112,83 @@ static void progress_write(struct image *im)
         if (im->da.write_offsets[idx+cnt] != off + cnt)
             break;
     ASSERT(off);
+
+    /* Hold back a run which the host may be about to extend, so that it is
+     * written in one command. Not if the buffer is filling up. */
+    if ((wb->cons + cnt == wb->prod) && (idx + cnt < wb->len)
+        && (wb->prod - wb->cons < wb->len / 2)
+        && (time_diff(im->da.write_last, time_now()) < time_ms(WRITE_DEFER_MS)))
+        return;
+
     im->da.write_op = disk_write_async(0, wb->p + idx*512, off, cnt);
     im->da.write_cnt = cnt;
+    im->da.write_start = time_now();
     im->da.sync_state = SYNC_NEEDED;
 }
 
+/* Sector @lba is being written: Any copy in the read-ahead ring is stale. */
+static void ra_invalidate(struct image *im, LBA_t lba)
+{
+    if ((lba >= im->da.ra_lo) && (lba < im->da.ra_hi + im->da.ra_cnt))
+        im->da.ra_discard = TRUE;
+}
+
+/* Keep read-ahead moving. Returns the data of sector @lba, or NULL if it is
+ * not yet read. Reads cover the host's current burst of nr_sec sectors and,
+ * if the host is streaming, the next burst too. */
+static uint8_t *ra_read(struct image *im, LBA_t lba)
+{
+    struct da_status_sector *dass = &im->da.dass;
+    struct directaccess *da = &im->da;
+    LBA_t end;
+    uint16_t idx, cnt;
+
+    thread_yield();
+    if (da->ra_cnt != 0) {
+        if (!F_async_isdone(da->read_op))
+            goto out;
+        if (!da->ra_discard)
+            da->ra_hi += da->ra_cnt;
+        da->ra_cnt = 0;
+    }
+
+    /* Restart the window at @lba if it is stale, or @lba is not in it. */
+    if (da->ra_discard || (lba < da->ra_lo) || (lba > da->ra_hi)) {
+        da->ra_discard = FALSE;
+        da->ra_lo = da->ra_hi = lba;
+    } else if (lba >= da->ra_lo + da->ra_secs) {
+        /* Slide the window forward over @lba. */
+        da->ra_lo = lba + 1 - da->ra_secs;
+    }
+
+    /* Reads must follow any writes to mass storage. */
+    if (da->sync_state || (da->write_buffer.prod != da->write_buffer.cons))
+        goto out;
+
+    end = dass->lba_base + dass->nr_sec;
+    if (da->ra_seq && (end < da->ra_lim))
+        end = min_t(LBA_t, end + dass->nr_sec, da->ra_lim);
+    end = min_t(LBA_t, end, da->ra_lo + da->ra_secs);
+    if (da->ra_hi < end) {
+        idx = da->ra_hi % da->ra_secs;
+        cnt = min_t(LBA_t, end - da->ra_hi, da->ra_secs - idx);
+        da->read_op = disk_read_async(0, da->ra_buf + idx*SEC_SZ,
+                                      da->ra_hi, cnt);
+        da->ra_cnt = cnt;
+    }
+
+out:
+    if ((lba < da->ra_lo) || (lba >= da->ra_hi) || da->ra_discard)
+        return NULL;
+    return da->ra_buf + (lba % da->ra_secs) * SEC_SZ;
+}
+
 static bool_t da_open(struct image *im)
 {
     struct da_status_sector *dass = &im->da.dass;
     struct image_buf *rd = &im->bufs.read_data;
-    int p_used = 0;
+    FATFS *fs = im->fp.obj.fs;
+    int p_used = 0, space;
     bool_t version_override = (ff_cfg.da_report_version[0] != '\0');
 
     printk("D-A Mode Entered\n");
@@ -100,6 +199,14 @@ static bool_t da_open(struct image *im)
     /* 768 bytes for cache overhead. */
     volume_cache_init(rd->p + p_used, rd->p + p_used + 8*SEC_SZ + 768);
     p_used += 8*SEC_SZ + 768;
+    /* Read-ahead gets up to half the space not needed by a minimal write
+     * buffer. */
+    space = rd->len - p_used - 8*(SEC_SZ + sizeof(*im->da.write_offsets)) - 3;
+    im->da.ra_secs = max_t(int, 1, min_t(int, RA_MAX_SECS,
+                                         space / (2*SEC_SZ)));
+    im->da.ra_buf = rd->p + p_used;
+    p_used += im->da.ra_secs * SEC_SZ;
+    im->da.ra_lim = fs->database + (LBA_t)(fs->n_fatent - 2) * fs->csize;
     im->da.write_buffer.p = rd->p + p_used;
     im->da.write_buffer.len =
         (rd->len - p_used - 3) / (512 + sizeof(*im->da.write_offsets));
@@ -108,6 +215,7 @@ static bool_t da_open(struct image *im)
     p_used += im->da.write_buffer.len * 512;
     ASSERT(p_used <= rd->len);
     ASSERT(im->da.write_buffer.len >= 8);
+    printk("D-A Read-Ahead: %u sectors\n", im->da.ra_secs);
 
     im->da.write_buffer.prod = 0;
     im->da.write_buffer.cons = 0;
@@ -218,7 +326,6 @@ static void da_setup_track(
 
     rd->prod = rd->cons = 0;
     bc->prod = bc->cons = 0;
-    im->da.read_op_started = FALSE;
 
     if (start_pos) {
         im->da.trash_bc = decode_off * 16;
@@ -226,6 +333,57 @@ static void da_setup_track(
     }
 }
 
+/* Fill the telemetry block of the status sector. */
+static void telemetry_fill(struct image *im, struct da_telemetry *t)
+{
+    static const uint8_t isr_prof[] = {
+        PROF_rdata_dma, PROF_wdata_dma, PROF_timer };
+    struct flux_stats flux;
+    struct f_async_stats async;
+    struct cache_stats cache;
+    struct profile_stat prof;
+    unsigned int i;
+
+    BUILD_BUG_ON(sizeof(struct da_status_sector) > DA_TELEMETRY_OFF);
+    BUILD_BUG_ON(DA_TELEMETRY_OFF + sizeof(*t) > 256);
+    BUILD_BUG_ON(sizeof(t->prefetch) != sizeof(flux.prefetch));
+    BUILD_BUG_ON(ARRAY_SIZE(isr_prof) != ARRAY_SIZE(t->isr));
+
+    t->sig = DA_TELEMETRY_SIG;
+    t->ver = DA_TELEMETRY_VER;
+    t->len = sizeof(*t);
+
+    floppy_get_flux_stats(&flux);
+    t->underruns = flux.underruns;
+    t->index_skips = flux.skips;
+    t->late_index = flux.lates;
+    t->missed_writes = flux.missed_writes;
+    t->max_writes = flux.max_writes;
+    memcpy(t->prefetch, flux.prefetch, sizeof(t->prefetch));
+
+    F_async_get_stats(&async);
+    t->async_max_depth = async.max_depth;
+    t->async_overtakes = async.nr_overtakes;
+    t->async_max_wait_us[0] = async.max_wait_us[0];
+    t->async_max_wait_us[1] = async.max_wait_us[1];
+
+    cache_get_stats(&cache);
+    t->cache_hits = cache.hits;
+    t->cache_misses = cache.misses;
+    t->cache_evictions = cache.evictions;
+
+    t->write_max_us = im->da.write_max_us;
+    t->sync_max_us = im->da.sync_max_us;
+
+    for (i = 0; i < ARRAY_SIZE(t->isr); i++) {
+        profile_get(isr_prof[i], &prof);
+        t->isr[i].nr = prof.nr;
+        t->isr[i].min = prof.min;
+        t->isr[i].avg = prof.avg;
+        t->isr[i].max = prof.max;
+    }
+}
+
 static bool_t da_read_track(struct image *im)
 {
     struct da_status_sector *dass = &im->da.dass;
@@ -235,27 +393,19 @@ static bool_t da_read_track(struct image *im)
     progress_write(im);
     if (rd->prod == rd->cons) {
         uint8_t sec = im->da.trk_sec;
+        im->da.rd_p = buf;
         if (sec == 0) {
             struct da_status_sector *da = (struct da_status_sector *)buf;
             memset(da, 0, SEC_SZ);
             memcpy(da, dass, sizeof(*dass));
+            telemetry_fill(im, (struct da_telemetry *)(buf + DA_TELEMETRY_OFF));
             dass->read_cnt++;
         } else if (dass->lba_base == ~0u) {
             memset(buf, 0, SEC_SZ);
             if (sec == 1)
                 strcpy((char *)buf, im->slot->name);
-        } else {
-            if (!im->da.read_op_started) {
-                if (im->da.sync_state)
-                    return FALSE;
-                im->da.read_op =
-                    disk_read_async(0, buf, dass->lba_base+sec-1, 1);
-                im->da.read_op_started = TRUE;
-            }
-            thread_yield();
-            if (!F_async_isdone(im->da.read_op))
-                return FALSE;
-            im->da.read_op_started = FALSE;
+        } else if ((im->da.rd_p = ra_read(im, dass->lba_base+sec-1)) == NULL) {
+            return FALSE;
         }
         rd->prod++;
         if (++im->da.trk_sec >= (dass->nr_sec + 1))
@@ -270,7 +420,7 @@ static bool_t fm_read_track(struct image *im)
     struct da_status_sector *dass = &im->da.dass;
     struct image_buf *bc = &im->bufs.read_bc;
     struct image_buf *rd = &im->bufs.read_data;
-    uint8_t *buf = im->da.rd_buf;
+    uint8_t *buf = im->da.rd_p;
     uint16_t *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     uint16_t crc;
@@ -288,46 +438,44 @@ static bool_t fm_read_track(struct image *im)
 #define emit_raw(r) ({                          \
     uint16_t _r = (r);                          \
     bc_b[bc_p++ & bc_mask] = htobe16(_r); })
-#define emit_byte(b) emit_raw(bintomfm(b) | 0xaaaa)
+#define emit_byte(b) emit_raw(bintofm(b))
+#define emit_fill(b, n) ({                          \
+    unsigned int _n = (n);                      \
+    fm_ring_fill(bc_b, bc_mask, bc_p, b, _n);   \
+    bc_p += _n; })
     if (im->da.decode_pos == 0) {
         /* Post-index track gap */
-        for (i = 0; i < FM_GAP_4A; i++)
-            emit_byte(0xff);
+        emit_fill(0xff, FM_GAP_4A);
     } else if (im->da.decode_pos == (1 + (dass->nr_sec + 1) * 2)) {
         /* Pre-index track gap */
-        for (i = 0; i < FM_GAP_4; i++)
-            emit_byte(0xff);
+        emit_fill(0xff, FM_GAP_4);
         im->da.decode_pos = -1;
     } else if (im->da.decode_pos & 1) {
         /* IDAM */
         uint8_t cyl = 254, hd = 0, sec = (im->da.decode_pos-1) >> 1, no = 2;
         uint8_t idam[5] = { 0xfe, cyl, hd, sec, no };
-        for (i = 0; i < FM_GAP_SYNC; i++)
-            emit_byte(0x00);
-        emit_raw(fm_sync(idam[0], FM_SYNC_CLK));
+        emit_fill(0x00, FM_GAP_SYNC);
+        emit_raw(FM_IDAM);
         for (i = 1; i < 5; i++)
             emit_byte(idam[i]);
         crc = crc16_ccitt(idam, sizeof(idam), 0xffff);
         emit_byte(crc >> 8);
         emit_byte(crc);
-        for (i = 0; i < FM_GAP_2; i++)
-            emit_byte(0xff);
+        emit_fill(0xff, FM_GAP_2);
     } else {
         /* DAM */
-        uint8_t dam[1] = { 0xfb };
-        for (i = 0; i < FM_GAP_SYNC; i++)
-            emit_byte(0x00);
-        emit_raw(fm_sync(dam[0], FM_SYNC_CLK));
-        for (i = 0; i < SEC_SZ; i++)
-            emit_byte(buf[i]);
-        crc = crc16_ccitt(buf, SEC_SZ, FM_DAM_CRC);
+        emit_fill(0x00, FM_GAP_SYNC);
+        emit_raw(FM_DAM);
+        crc = fm_ring_encode_crc(bc_b, bc_mask, bc_p, buf, SEC_SZ,
+                                 FM_DAM_CRC);
+        bc_p += SEC_SZ;
         emit_byte(crc >> 8);
         emit_byte(crc);
-        for (i = 0; i < FM_GAP_3; i++)
-            emit_byte(0xff);
+        emit_fill(0xff, FM_GAP_3);
         rd->cons++;
     }
 #undef emit_raw
+#undef emit_fill
 #undef emit_byte
 
     if (im->da.trash_bc) {
@@ -347,7 +495,7 @@ static bool_t mfm_read_track(struct image *im)
     struct da_status_sector *dass = &im->da.dass;
     struct image_buf *bc = &im->bufs.read_bc;
     struct image_buf *rd = &im->bufs.read_data;
-    uint8_t *buf = im->da.rd_buf;
+    uint8_t *buf = im->da.rd_p;
     uint16_t *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     uint16_t pr, crc;
@@ -368,55 +516,52 @@ static bool_t mfm_read_track(struct image *im)
     bc_b[bc_p++ & bc_mask] = htobe16(_r & ~(pr << 15));  \
     pr = _r; })
 #define emit_byte(b) emit_raw(bintomfm(b))
+#define emit_fill_raw(r, n) ({                           \
+    unsigned int _n = (n);                               \
+    pr = mfm_ring_fill(bc_b, bc_mask, bc_p, pr, r, _n);  \
+    bc_p += _n; })
+#define emit_fill(b, n) emit_fill_raw(mfmtab[(uint8_t)(b)], n)
     if (im->da.decode_pos == 0) {
         /* IAM */
-        for (i = 0; i < MFM_GAP_4A; i++)
-            emit_byte(0x4e);
-        for (i = 0; i < MFM_GAP_SYNC; i++)
-            emit_byte(0x00);
-        for (i = 0; i < 3; i++)
-            emit_raw(0x5224);
+        emit_fill(0x4e, MFM_GAP_4A);
+        emit_fill(0x00, MFM_GAP_SYNC);
+        emit_fill_raw(0x5224, 3);
         emit_byte(0xfc);
-        for (i = 0; i < MFM_GAP_1; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, MFM_GAP_1);
     } else if (im->da.decode_pos == (1 + (dass->nr_sec + 1) * 2)) {
         /* Track gap. */
-        for (i = 0; i < MFM_GAP_4; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, MFM_GAP_4);
         im->da.decode_pos = -1;
     } else if (im->da.decode_pos & 1) {
         /* IDAM */
         uint8_t cyl = 255, hd = 0, sec = (im->da.decode_pos-1) >> 1, no = 2;
         uint8_t idam[8] = { 0xa1, 0xa1, 0xa1, 0xfe, cyl, hd, sec, no };
-        for (i = 0; i < MFM_GAP_SYNC; i++)
-            emit_byte(0x00);
-        for (i = 0; i < 3; i++)
-            emit_raw(0x4489);
-        for (; i < 8; i++)
+        emit_fill(0x00, MFM_GAP_SYNC);
+        emit_fill_raw(0x4489, 3);
+        for (i = 3; i < 8; i++)
             emit_byte(idam[i]);
         crc = crc16_ccitt(idam, sizeof(idam), 0xffff);
         emit_byte(crc >> 8);
         emit_byte(crc);
-        for (i = 0; i < MFM_GAP_2; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, MFM_GAP_2);
     } else {
         /* DAM */
         uint8_t dam[4] = { 0xa1, 0xa1, 0xa1, 0xfb };
-        for (i = 0; i < MFM_GAP_SYNC; i++)
-            emit_byte(0x00);
-        for (i = 0; i < 3; i++)
-            emit_raw(0x4489);
+        emit_fill(0x00, MFM_GAP_SYNC);
+        emit_fill_raw(0x4489, 3);
         emit_byte(dam[3]);
-        for (i = 0; i < SEC_SZ; i++)
-            emit_byte(buf[i]);
-        crc = crc16_ccitt(buf, SEC_SZ, MFM_DAM_CRC);
+        crc = mfm_ring_encode_crc(bc_b, bc_mask, bc_p, pr,
+                                  buf, SEC_SZ, MFM_DAM_CRC);
+        bc_p += SEC_SZ;
+        pr = mfmtab[buf[SEC_SZ-1]];
         emit_byte(crc >> 8);
         emit_byte(crc);
-        for (i = 0; i < MFM_GAP_3; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, MFM_GAP_3);
         rd->cons++;
     }
 #undef emit_raw
+#undef emit_fill
+#undef emit_fill_raw
 #undef emit_byte
 
     if (im->da.trash_bc) {
@@ -601,15 +746,23 @@ static void process_wdata(
         case CMD_NOP:
             dass->last_cmd_status = 0; /* ok */
             break;
-        case CMD_SET_LBA:
+        case CMD_SET_LBA: {
+            LBA_t prev_end = dass->lba_base + dass->nr_sec;
             for (i = 0; i < 4; i++) {
                 dass->lba_base <<= 8;
                 dass->lba_base |= dac->param[3-i];
             }
             dass->nr_sec = dac->param[5] ?: (im->sync == SYNC_fm) ? 4 : 8;
             printk("D-A LBA %08x, nr=%u\n", dass->lba_base, dass->nr_sec);
+            /* A host stepping burst by burst is likely streaming, so it is
+             * worth reading ahead into its next burst. Sectors below the
+             * new burst will not be re-read: Recycle them. */
+            im->da.ra_seq = (dass->lba_base == prev_end);
+            if (dass->lba_base > im->da.ra_lo)
+                im->da.ra_lo = min_t(LBA_t, dass->lba_base, im->da.ra_hi);
             dass->last_cmd_status = 0; /* ok */
             break;
+        }
         case CMD_SET_CYL:
             printk("D-A Cyl A=%u B=%u\n", dac->param[0], dac->param[1]);
             for (i = 0; i < 2; i++)
@@ -642,17 +795,23 @@ static void process_wdata(
     } else if (dass->lba_base != ~0u) {
         /* All good: write out to mass storage. */
         dass->write_cnt++;
+        ra_invalidate(im, dass->lba_base+sect-1);
         im->da.write_offsets[wb->prod % wb->len] = dass->lba_base+sect-1;
         wb->prod++;
+        im->da.write_last = time_now();
     }
 }
 
 static void da_sync(struct image *im)
 {
-    if (im->da.read_op_started) {
+    struct image_buf *wb = &im->da.write_buffer;
+
+    if (im->da.ra_cnt) {
         F_async_wait(im->da.read_op);
     }
-    while (im->da.sync_state) {
+    /* No more sectors are coming: Write out any held-back run. */
+    im->da.write_last = time_now() - time_ms(WRITE_DEFER_MS);
+    while (im->da.sync_state || (wb->prod != wb->cons)) {
         progress_write(im);
         F_async_wait(im->da.write_op);
     }
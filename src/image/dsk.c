@@ -65,9 +65,178 @@ static struct tib *tib_p(struct image *im)
     return (struct tib *)((char *)rd->p + 256);
 }
 
+/* Pre-encoded ID fields (C,H,R,N,CRC) of the current track, IDAM_WORDS
+ * bitcell words per sector. Stashed after the DIB/TIB and sector buffer. */
+#define IDAM_WORDS 6
+#define IDAM_BYTES ((29*IDAM_WORDS*2 + 3) & ~3)
+static uint16_t *idam_p(struct image *im)
+{
+    struct image_buf *rd = &im->bufs.read_data;
+    return (uint16_t *)((char *)rd->p + 512 + 1024);
+}
+
+/* Per-track tables, stashed after the pre-encoded ID fields:
+ *  trk_off: Extended DSK file offset of each track, in 256-byte units
+ *           (0 if the track is not formatted).
+ *  tib_off: Offset of each track's TIB in the TIB cache (TIB_NONE if none).
+ * The TIB cache follows, holding each TIB trimmed to its sector infos. */
+#define TIB_NONE 0xffff
+#define TIB_CACHE_MAX 4096
+#define nr_trks(_im) ((_im)->nr_cyls * (_im)->nr_sides)
+#define tib_len(_tib) (offsetof(struct tib, sib) \
+                       + min_t(unsigned, (_tib)->nr_secs, 29) * sizeof(struct sib))
+static uint16_t *trk_off_p(struct image *im)
+{
+    return (uint16_t *)((char *)idam_p(im) + IDAM_BYTES);
+}
+
+static uint16_t *tib_off_p(struct image *im)
+{
+    return trk_off_p(im) + nr_trks(im);
+}
+
+static uint8_t *tib_cache_p(struct image *im)
+{
+    return (uint8_t *)(tib_off_p(im) + ((nr_trks(im) + 1) & ~1));
+}
+
+/* Length of the sector data following Track Info Block @tib. */
+static uint32_t tib_data_len(struct image *im, struct tib *tib)
+{
+    uint32_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < min_t(unsigned, tib->nr_secs, 29); i++)
+        len += im->dsk.extended
+            ? le16toh(tib->sib[i].actual_length)
+            : 128 << min_t(unsigned, tib->sec_sz, 8);
+
+    return len;
+}
+
+/* Read the Track Info Block of track @nr, at file offset im->dsk.trk_off,
+ * from the TIB cache if possible. Valid TIBs are added to the cache. */
+static void dsk_read_tib(struct image *im, unsigned int nr, bool_t async)
+{
+    struct tib *tib = tib_p(im);
+    uint16_t *tib_off = tib_off_p(im);
+    uint8_t *cache = tib_cache_p(im);
+    unsigned int len;
+
+    if (tib_off[nr] != TIB_NONE) {
+        struct tib *ctib = (struct tib *)(cache + tib_off[nr]);
+        memcpy(tib, ctib, tib_len(ctib));
+        return;
+    }
+
+    if (async) {
+        F_lseek_async(&im->fp, im->dsk.trk_off);
+        F_async_wait(F_read_async(&im->fp, tib, 256, NULL));
+    } else {
+        F_lseek(&im->fp, im->dsk.trk_off);
+        F_read(&im->fp, tib, 256, NULL);
+    }
+    if (strncmp(tib->sig, "Track-Info", 10) || !tib->nr_secs)
+        return;
+
+    len = tib_len(tib);
+    if ((im->dsk.tib_cache_used + len) <= im->dsk.tib_cache_len) {
+        tib_off[nr] = im->dsk.tib_cache_used;
+        memcpy(cache + tib_off[nr], tib, len);
+        im->dsk.tib_cache_used += len;
+    }
+}
+
+/* An Extended DSK written by scripts/edsk_ff_optimise.py is followed by a
+ * copy of every formatted track's TIB, trimmed as in the TIB cache, so that
+ * the cache is filled by a single read at offset @off. */
+struct tib_index {
+    char sig[8]; /* "FF-TIBS" */
+    uint32_t len; /* Bytes of trimmed TIBs which follow */
+    uint32_t rsvd;
+};
+
+static void dsk_load_tib_index(struct image *im, FSIZE_t off)
+{
+    struct tib_index hdr;
+    uint16_t *trk_off = trk_off_p(im), *tib_off = tib_off_p(im);
+    uint8_t *cache = tib_cache_p(im);
+    unsigned int i, len, pos = 0;
+    struct tib *tib;
+
+    F_lseek(&im->fp, off);
+    F_read(&im->fp, &hdr, sizeof(hdr), NULL);
+    if (strncmp(hdr.sig, "FF-TIBS", sizeof(hdr.sig)))
+        return;
+    len = min_t(uint32_t, le32toh(hdr.len), im->dsk.tib_cache_len);
+    F_read(&im->fp, cache, len, NULL);
+
+    /* Any TIBs which do not fit are read individually, as usual. */
+    for (i = 0; i < nr_trks(im); i++) {
+        if (!trk_off[i])
+            continue;
+        tib = (struct tib *)(cache + pos);
+        if ((pos + offsetof(struct tib, sib) > len)
+            || strncmp(tib->sig, "Track-Info", 10)
+            || (pos + tib_len(tib) > len))
+            break;
+        if (tib->nr_secs)
+            tib_off[i] = pos;
+        pos += tib_len(tib);
+    }
+    im->dsk.tib_cache_used = pos;
+    printk("DSK: %u TIBs indexed\n", i);
+}
+
+/* File offset of the start of track @nr (its TIB). Returns 0 if the track is
+ * not formatted. */
+static uint32_t dsk_trk_off(struct image *im, unsigned int nr)
+{
+    if (im->dsk.extended)
+        return trk_off_p(im)[nr] * 256;
+    return 0x100 + nr * im->dsk.track_sz;
+}
+
+/* Speculatively prefetch the sector data of cylinder @cyl, predicted to be
+ * the host's next seek target. Only tracks with a cached TIB are known. */
+static void dsk_prefetch_cyl(struct image *im, int cyl)
+{
+    uint16_t *tib_off = tib_off_p(im);
+    uint32_t off = ~0u, end = 0, trk_off;
+    unsigned int side, nr;
+    struct tib *tib;
+
+    if ((cyl < 0) || (cyl >= im->nr_cyls))
+        return;
+
+    for (side = 0; side < im->nr_sides; side++) {
+        nr = cyl * im->nr_sides + side;
+        if (!(trk_off = dsk_trk_off(im, nr)) || (tib_off[nr] == TIB_NONE))
+            continue;
+        tib = (struct tib *)(tib_cache_p(im) + tib_off[nr]);
+        off = min(off, trk_off + 256);
+        end = max(end, trk_off + 256 + tib_data_len(im, tib));
+    }
+    if (end <= off)
+        return;
+    off &= ~511;
+    end = (end + 511) & ~511;
+
+    ring_io_prefetch(&im->dsk.ring_io, off, end - off);
+}
+
+static void dsk_prefetch(struct image *im, int cyl)
+{
+    dsk_prefetch_cyl(im, cyl);
+    ring_io_progress(&im->dsk.ring_io);
+}
+
 static bool_t dsk_open(struct image *im)
 {
     struct dib *dib = dib_p(im);
+    uint16_t *trk_off, *tib_off, off;
+    uint8_t *cache, *end;
+    unsigned int i;
 
     /* HACK! We stash TIB in the read-data area. Assert that it is also
      * available at the same offset in the write-data area too. */
@@ -94,6 +263,7 @@ static bool_t dsk_open(struct image *im)
 
     im->nr_cyls = dib->nr_tracks;
     im->nr_sides = dib->nr_sides;
+    im->dsk.track_sz = le16toh(dib->track_sz);
     printk("DSK: %u cyls, %u sides\n", im->nr_cyls, im->nr_sides);
 
     /* DSK data rate is fixed at 2us bitcell. Where the specified track layout 
@@ -101,8 +271,36 @@ static bool_t dsk_open(struct image *im)
      * length and thus the period between index pulses. */
     im->ticks_per_cell = im->write_bc_ticks * 16;
 
-    volume_cache_init(im->bufs.write_data.p + 512 + 1024,
-                      im->bufs.write_data.p + im->bufs.write_data.len);
+    /* Cumulative track offsets, so that a seek is not a sum over all
+     * preceding tracks. */
+    trk_off = trk_off_p(im);
+    tib_off = tib_off_p(im);
+    for (i = 0, off = 1; i < nr_trks(im); i++) {
+        if (im->dsk.extended) {
+            trk_off[i] = dib->track_szs[i] ? off : 0;
+            off += dib->track_szs[i];
+        }
+        tib_off[i] = TIB_NONE;
+    }
+
+    /* Load all TIBs now, as far as the cache allows, so that seeks need not
+     * wait on mass storage for track metadata. */
+    cache = tib_cache_p(im);
+    end = (uint8_t *)im->bufs.write_data.p + im->bufs.write_data.len;
+    im->dsk.tib_cache_len = min_t(unsigned int, TIB_CACHE_MAX,
+                                  (end - cache) / 2);
+    im->dsk.tib_cache_used = 0;
+    if (im->dsk.extended && !strncmp(dib->creator, "FlashFloppy", 11))
+        dsk_load_tib_index(im, (FSIZE_t)off * 256);
+    for (i = 0; i < nr_trks(im); i++)
+        if ((im->dsk.trk_off = dsk_trk_off(im, i)) != 0)
+            dsk_read_tib(im, i, FALSE);
+
+    /* Track data is streamed through a ring in the remaining space. */
+    im->dsk.track_data.p = (void *)(((uint32_t)cache
+                                     + im->dsk.tib_cache_len + 3) & ~3);
+    im->dsk.track_data.len = min_t(uint32_t, RING_IO_MAX_RING_LEN,
+                                   end - (uint8_t *)im->dsk.track_data.p);
 
     return TRUE;
 }
@@ -110,12 +308,17 @@ static bool_t dsk_open(struct image *im)
 static void dsk_seek_track(
     struct image *im, uint16_t track, unsigned int cyl, unsigned int side)
 {
-    struct dib *dib = dib_p(im);
     struct tib *tib = tib_p(im);
     unsigned int i, nr;
-    uint32_t tracklen;
+    uint32_t tracklen, base;
+
+    /* Write back the previous track before its TIB is overwritten. */
+    ring_io_writeback(&im->dsk.ring_io);
+    ring_io_shutdown(&im->dsk.ring_io);
 
     im->cur_track = track;
+    im->dsk.sec_crc_valid = 0;
+    im->dsk.trk_len = 0;
 
     if (cyl >= im->nr_cyls) {
     unformatted:
@@ -125,20 +328,12 @@ static void dsk_seek_track(
         goto out;
     }
 
-    im->dsk.trk_off = 0x100;
     nr = (unsigned int)cyl * im->nr_sides + side;
-    if (im->dsk.extended) {
-        if (dib->track_szs[nr] == 0)
-            goto unformatted;
-        for (i = 0; i < nr; i++)
-            im->dsk.trk_off += dib->track_szs[i] * 256;
-    } else {
-        im->dsk.trk_off += nr * le16toh(dib->track_sz);
-    }
+    if ((im->dsk.trk_off = dsk_trk_off(im, nr)) == 0)
+        goto unformatted;
 
     /* Read the Track Info Block and Sector Info Blocks. */
-    F_lseek(&im->fp, im->dsk.trk_off);
-    F_read(&im->fp, tib, 256, NULL);
+    dsk_read_tib(im, nr, TRUE);
     im->dsk.trk_off += 256;
     if (strncmp(tib->sig, "Track-Info", 10) || !tib->nr_secs)
         goto unformatted;
@@ -151,12 +346,43 @@ static void dsk_seek_track(
     if (tib->nr_secs > 29)
         tib->nr_secs = 29;
 
+    im->dsk.trk_len = tib_data_len(im, tib);
+
     /* Compute per-sector actual length. */
     for (i = 0; i < tib->nr_secs; i++)
         tib->sib[i].actual_length = im->dsk.extended
             ? le16toh(tib->sib[i].actual_length)
             : 128 << min_t(unsigned, tib->sec_sz, 8);
 
+    /* Pre-encode the ID fields. */
+    for (i = 0; i < tib->nr_secs; i++) {
+        uint8_t idam[10] = { 0xa1, 0xa1, 0xa1, 0xfe };
+        uint16_t crc;
+        if ((tib->sib[i].stat1 & 0x01) && !(tib->sib[i].stat2 & 0x01))
+            idam[3] = 0x00; /* Missing Address Mark (ID) */
+        memcpy(&idam[4], &tib->sib[i].c, 4);
+        crc = crc16_ccitt(idam, 8, 0xffff);
+        if ((tib->sib[i].stat1 & 0x20) && !(tib->sib[i].stat2 & 0x20))
+            crc = ~crc; /* CRC Error in ID */
+        idam[8] = crc >> 8;
+        idam[9] = crc;
+        mfm_encode(&idam_p(im)[i*IDAM_WORDS], mfmtab[idam[3]],
+                   &idam[4], IDAM_WORDS);
+    }
+
+    /* Stream the sector data through a ring of whole blocks, and guess the
+     * next cylinder from the direction of the last head step. */
+    if (im->dsk.trk_len != 0) {
+        base = im->dsk.trk_off & ~511;
+        im->dsk.trk_ring_off = im->dsk.trk_off - base;
+        ring_io_init(&im->dsk.ring_io, &im->fp, &im->dsk.track_data, base, ~0,
+                     (im->dsk.trk_ring_off + im->dsk.trk_len + 511) / 512);
+        im->dsk.ring_io.batch_secs = ring_io_batch_secs(im->write_bc_ticks*16);
+        /* Merge rewrites of the track until the host moves on. */
+        im->dsk.ring_io.write_defer_ms = RING_IO_WRITE_DEFER_MS;
+        dsk_prefetch_cyl(im, cyl + (im->step_dir ?: 1));
+    }
+
 out:
     im->dsk.idx_sz = GAP_4A;
     im->dsk.idx_sz += GAP_SYNC + 4 + GAP_1;
@@ -259,6 +485,7 @@ static void dsk_setup_track(
         dsk_seek_track(im, track, cyl, side);
 
     im->dsk.write_sector = -1;
+    im->dsk.crc_sec = -1;
 
     im->cur_bc = (sys_ticks * 16) / im->ticks_per_cell;
     im->cur_bc &= ~15;
@@ -279,6 +506,83 @@ static void dsk_setup_track(
     }
 }
 
+/* End of sector @sec's data field: Either pick up its cached CRC, or cache
+ * the CRC we accumulated (only if we generated the DAM). Weak sectors vary
+ * each revolution and are never cached. */
+static void sec_crc_done(struct image *im, unsigned int sec)
+{
+    struct tib *tib = tib_p(im);
+
+    if (im->dsk.sec_crc_valid & (1u << sec)) {
+        im->dsk.crc = im->dsk.sec_crc[sec];
+    } else if ((im->dsk.crc_sec == sec)
+               && (data_sz(&tib->sib[sec]) == tib->sib[sec].actual_length)) {
+        im->dsk.sec_crc[sec] = im->dsk.crc;
+        im->dsk.sec_crc_valid |= 1u << sec;
+    }
+    im->dsk.crc_sec = -1;
+}
+
+/* Copy the next chunk (up to 1kB) of sector data from the track ring into the
+ * staging buffer, once ring_io has read it in. */
+static void dsk_fetch_data(struct image *im)
+{
+    struct tib *tib = tib_p(im);
+    struct image_buf *rd = &im->bufs.read_data;
+    struct image_buf *td = &im->dsk.track_data;
+    struct ring_io *rio = &im->dsk.ring_io;
+    uint8_t *buf = (uint8_t *)rd->p + 512; /* skip DIB/TIB */
+    uint32_t off = 0;
+    uint16_t len;
+    unsigned int i;
+
+    if (tib->nr_secs == 0)
+        return;
+
+    for (i = 0; i < im->dsk.trk_pos; i++)
+        off += tib->sib[i].actual_length;
+    len = data_sz(&tib->sib[i]);
+    if (len != tib->sib[i].actual_length) {
+        /* Weak sector -- pick different data each revolution. */
+        off += len * (im->dsk.rev % (tib->sib[i].actual_length / len));
+    }
+    off += im->dsk.rd_sec_pos * 1024;
+    len -= im->dsk.rd_sec_pos * 1024;
+
+    if (im->dsk.trk_len != 0) {
+        ring_io_seek(rio, im->dsk.trk_ring_off + off, FALSE, FALSE);
+        ring_io_progress(rio);
+    }
+
+    if (rd->prod != rd->cons)
+        return;
+    if ((len != 0) && (td->cons + min_t(uint16_t, len, 1024) > td->prod))
+        return;
+
+    if (len > 1024) {
+        len = 1024;
+        im->dsk.rd_sec_pos++;
+    } else {
+        im->dsk.rd_sec_pos = 0;
+        if (++im->dsk.trk_pos >= tib->nr_secs) {
+            im->dsk.trk_pos = 0;
+            im->dsk.rev++;
+        }
+    }
+
+    /* Sectors are not block aligned, so may wrap the ring anywhere. */
+    for (uint16_t todo = len; todo > 0;) {
+        uint32_t idx = ring_io_idx(rio, td->cons);
+        uint16_t tocopy = min_t(uint16_t, todo, ring_io_idxend(rio) - idx);
+        memcpy(buf, td->p + idx, tocopy);
+        td->cons += tocopy;
+        buf += tocopy;
+        todo -= tocopy;
+    }
+
+    rd->prod++;
+}
+
 static bool_t dsk_read_track(struct image *im)
 {
     struct tib *tib = tib_p(im);
@@ -290,31 +594,10 @@ static bool_t dsk_read_track(struct image *im)
     uint16_t pr, crc;
     unsigned int i;
 
-    if (tib->nr_secs && (rd->prod == rd->cons)) {
-        uint16_t off = 0, len;
-        for (i = 0; i < im->dsk.trk_pos; i++)
-            off += tib->sib[i].actual_length;
-        len = data_sz(&tib->sib[i]);
-        if (len != tib->sib[i].actual_length) {
-            /* Weak sector -- pick different data each revolution. */
-            off += len * (im->dsk.rev % (tib->sib[i].actual_length / len));
-        }
-        off += im->dsk.rd_sec_pos * 1024;
-        len -= im->dsk.rd_sec_pos * 1024;
-        if (len > 1024) {
-            len = 1024;
-            im->dsk.rd_sec_pos++;
-        } else {
-            im->dsk.rd_sec_pos = 0;
-            if (++im->dsk.trk_pos >= tib->nr_secs) {
-                im->dsk.trk_pos = 0;
-                im->dsk.rev++;
-            }
-        }
-        F_lseek(&im->fp, im->dsk.trk_off + off);
-        F_read(&im->fp, buf, len, NULL);
-        rd->prod++;
-    }
+    dsk_fetch_data(im);
+
+    if (tib->nr_secs && (rd->prod == rd->cons))
+        return FALSE; /* Wait for read to complete. */
 
     /* Generate some MFM if there is space in the raw-bitcell ring buffer. */
     bc_p = bc->prod / 16; /* MFM words */
@@ -329,21 +612,22 @@ static bool_t dsk_read_track(struct image *im)
     bc_b[bc_p++ & bc_mask] = htobe16(_r & ~(pr << 15));  \
     pr = _r; })
 #define emit_byte(b) emit_raw(mfmtab[(uint8_t)(b)])
+#define emit_fill_raw(r, n) ({                           \
+    unsigned int _n = (n);                               \
+    pr = mfm_ring_fill(bc_b, bc_mask, bc_p, pr, r, _n);  \
+    bc_p += _n; })
+#define emit_fill(b, n) emit_fill_raw(mfmtab[(uint8_t)(b)], n)
 
     if (im->dsk.decode_pos == 0) {
         /* Post-index track gap */
         if (bc_space < im->dsk.idx_sz)
             return FALSE;
-        for (i = 0; i < GAP_4A; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, GAP_4A);
         /* IAM */
-        for (i = 0; i < GAP_SYNC; i++)
-            emit_byte(0x00);
-        for (i = 0; i < 3; i++)
-            emit_raw(0x5224);
+        emit_fill(0x00, GAP_SYNC);
+        emit_fill_raw(0x5224, 3);
         emit_byte(0xfc);
-        for (i = 0; i < GAP_1; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, GAP_1);
     } else if (im->dsk.decode_pos == (tib->nr_secs * 4 + 1)) {
         /* Pre-index track gap */
         uint16_t sz = im->dsk.gap4 - im->dsk.decode_data_pos * 1024;
@@ -357,31 +641,24 @@ static bool_t dsk_read_track(struct image *im)
             im->dsk.decode_data_pos = 0;
             im->dsk.decode_pos = -1;
         }
-        for (i = 0; i < sz; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, sz);
     } else {
         uint8_t sec = (im->dsk.decode_pos-1) >> 2;
         switch ((im->dsk.decode_pos - 1) & 3) {
         case 0: /* IDAM */ {
-            uint8_t idam[8] = { 0xa1, 0xa1, 0xa1, 0xfe };
+            const uint16_t *hdr = &idam_p(im)[sec*IDAM_WORDS];
             if (bc_space < (GAP_SYNC + 8 + 2 + GAP_2))
                 return FALSE;
+            emit_fill(0x00, GAP_SYNC);
+            emit_fill_raw(0x4489, 3);
             if ((tib->sib[sec].stat1 & 0x01) && !(tib->sib[sec].stat2 & 0x01))
-                idam[3] = 0x00; /* Missing Address Mark (ID) */
-            memcpy(&idam[4], &tib->sib[sec].c, 4);
-            for (i = 0; i < GAP_SYNC; i++)
-                emit_byte(0x00);
-            for (i = 0; i < 3; i++)
-                emit_raw(0x4489);
-            for (; i < 8; i++)
-                emit_byte(idam[i]);
-            crc = crc16_ccitt(idam, sizeof(idam), 0xffff);
-            if ((tib->sib[sec].stat1 & 0x20) && !(tib->sib[sec].stat2 & 0x20))
-                crc = ~crc; /* CRC Error in ID */
-            emit_byte(crc >> 8);
-            emit_byte(crc);
-            for (i = 0; i < GAP_2; i++)
-                emit_byte(0x4e);
+                emit_byte(0x00); /* Missing Address Mark (ID) */
+            else
+                emit_byte(0xfe);
+            for (i = 0; i < IDAM_WORDS; i++)
+                bc_b[bc_p++ & bc_mask] = hdr[i];
+            pr = be16toh(hdr[IDAM_WORDS-1]);
+            emit_fill(0x4e, GAP_2);
             break;
         }
         case 1: /* DAM */ {
@@ -392,12 +669,11 @@ static bool_t dsk_read_track(struct image *im)
                 dam[3] = 0x00; /* Missing Address Mark (Data) */
             else if (tib->sib[sec].stat2 & 0x40)
                 dam[3] = 0xf8; /* Found DDAM */
-            for (i = 0; i < GAP_SYNC; i++)
-                emit_byte(0x00);
-            for (i = 0; i < 3; i++)
-                emit_raw(0x4489);
+            emit_fill(0x00, GAP_SYNC);
+            emit_fill_raw(0x4489, 3);
             emit_byte(dam[3]);
             im->dsk.crc = crc16_ccitt(dam, sizeof(dam), 0xffff);
+            im->dsk.crc_sec = sec;
             break;
         }
         case 2: /* Data */ {
@@ -412,9 +688,17 @@ static bool_t dsk_read_track(struct image *im)
             } else {
                 im->dsk.decode_data_pos = 0;
             }
-            for (i = 0; i < sec_sz; i++)
-                emit_byte(buf[i]);
-            im->dsk.crc = crc16_ccitt(buf, sec_sz, im->dsk.crc);
+            if (im->dsk.sec_crc_valid & (1u << sec)) {
+                for (i = 0; i < sec_sz; i++)
+                    emit_byte(buf[i]);
+            } else {
+                im->dsk.crc = mfm_ring_encode_crc(bc_b, bc_mask, bc_p, pr,
+                                                 buf, sec_sz, im->dsk.crc);
+                bc_p += sec_sz;
+                pr = mfmtab[buf[sec_sz-1]];
+            }
+            if (im->dsk.decode_data_pos == 0)
+                sec_crc_done(im, sec);
             rd->cons++;
             break;
         }
@@ -428,8 +712,7 @@ static bool_t dsk_read_track(struct image *im)
                 crc = ~crc; /* CRC Error in Data */
             emit_byte(crc >> 8);
             emit_byte(crc);
-            for (i = 0; i < tib->gap3; i++)
-                emit_byte(0x4e);
+            emit_fill(0x4e, tib->gap3);
             break;
         }
         }
@@ -469,17 +752,18 @@ static int dsk_find_first_write_sector(
 
 static bool_t dsk_write_track(struct image *im)
 {
-    bool_t flush;
+    bool_t flush, stalled = FALSE;
     struct write *write = get_write(im, im->wr_cons);
     struct tib *tib = tib_p(im);
     struct image_buf *wr = &im->bufs.write_bc;
+    struct image_buf *td = &im->dsk.track_data;
+    struct ring_io *rio = &im->dsk.ring_io;
     uint16_t *buf = wr->p;
     unsigned int bufmask = (wr->len / 2) - 1;
     uint8_t *wrbuf = (uint8_t *)im->bufs.write_data.p + 512; /* skip DIB/TIB */
     uint32_t c = wr->cons / 16, p = wr->prod / 16;
     unsigned int i;
-    time_t t;
-    uint16_t crc, off;
+    uint16_t crc;
     uint8_t x;
 
     /* If we are processing final data then use the end index, rounded up. */
@@ -488,28 +772,37 @@ static bool_t dsk_write_track(struct image *im)
     if (flush)
         p = (write->bc_end + 15) / 16;
 
-    while ((int16_t)(p - c) > 128) {
+    while ((int16_t)(p - c) > 1) { /* At least 2 bytes. */
 
-        uint32_t sc = c;
+        if (im->dsk.decode_pos == 0) {
 
-        if (be16toh(buf[c++ & bufmask]) != 0x4489)
-            continue;
-        if ((x = mfmtobin(buf[c & bufmask])) == 0xa1)
-            continue;
-        c++;
+            if (be16toh(buf[c++ & bufmask]) != 0x4489)
+                continue;
+            if ((x = mfmtobin(buf[c & bufmask])) == 0xa1)
+                continue;
+            c++;
 
-        switch (x) {
+            if (x == 0xfe) /* IDAM */
+                im->dsk.decode_pos = 1;
+            else if (x == 0xfb) /* DAM */
+                im->dsk.decode_pos = 2;
 
-        case 0xfe: /* IDAM */
+        } else if (im->dsk.decode_pos == 1) {
+
+            /* ID record, shy address mark */
+            if ((int16_t)(p - c) < 6)
+                break;
             for (i = 0; i < 3; i++)
                 wrbuf[i] = 0xa1;
-            wrbuf[i++] = x;
-            for (; i < 10; i++)
-                wrbuf[i] = mfmtobin(buf[c++ & bufmask]);
+            wrbuf[i++] = 0xfe;
+            mfm_ring_to_bin(buf, bufmask, c, &wrbuf[i], 6);
+            c += 6;
+            i += 6;
+            im->dsk.decode_pos = 0;
             crc = crc16_ccitt(wrbuf, i, 0xffff);
             if (crc != 0) {
                 printk("DSK IDAM Bad CRC: %04x, %02x\n", crc, wrbuf[6]);
-                break;
+                continue;
             }
             /* Convert logical sector number -> rotational number. */
             for (i = 0; i < tib->nr_secs; i++)
@@ -520,74 +813,128 @@ static bool_t dsk_write_track(struct image *im)
                 printk("DSK IDAM Bad Sector: %02x\n", wrbuf[6]);
                 im->dsk.write_sector = -2;
             }
-            break;
+            im->dsk.decode_data_pos = 0;
+
+        } else if (im->dsk.decode_pos == 2) {
 
-        case 0xfb: /* DAM */ {
-            unsigned int nr, todo, sec_sz;
+            /* Data record, shy address mark */
+            unsigned int sec_sz;
             int sec_nr = im->dsk.write_sector;
 
             if (sec_nr < 0) {
-                if (sec_nr == -1)
+                if (sec_nr == -1) {
                     sec_nr = dsk_find_first_write_sector(im, write, tib);
+                    im->dsk.write_sector = sec_nr;
+                    im->dsk.decode_data_pos = 0;
+                }
                 if (sec_nr < 0) {
                     printk("DSK DAM Unknown\n");
-                    goto dam_out;
+                    im->dsk.write_sector = -2;
+                    im->dsk.decode_pos = 0;
+                    continue;
                 }
             }
 
             sec_sz = data_sz(&tib->sib[sec_nr]);
-            if ((int16_t)(p - c) < (sec_sz + 2)) {
-                c = sc;
-                goto out;
-            }
 
-            crc = MFM_DAM_CRC;
-
-            printk("Write %d[%02x]/%u... ",
-                   sec_nr, tib->sib[sec_nr].r, tib->nr_secs);
-            t = time_now();
+            if (!im->dsk.decode_data_pos) {
+                uint32_t off;
+                for (i = off = 0; i < sec_nr; i++)
+                    off += tib->sib[i].actual_length;
+                off += im->dsk.trk_ring_off;
+                /* The file cannot grow once mounted, and ring_io writes
+                 * whole blocks. */
+                if ((im->dsk.trk_len == 0)
+                    || (im->dsk.trk_off - im->dsk.trk_ring_off
+                        + ((off + sec_sz + 511) & ~511)
+                        > f_size(&im->fp))) {
+                    printk("DSK Write past EOF: %d[%02x]\n",
+                           sec_nr, tib->sib[sec_nr].r);
+                    im->dsk.write_sector = -2;
+                    im->dsk.decode_pos = 0;
+                    continue;
+                }
+                im->dsk.crc = MFM_DAM_CRC;
+                ring_io_seek(rio, off, TRUE, FALSE);
+                printk("Write %d[%02x]/%u\n",
+                       sec_nr, tib->sib[sec_nr].r, tib->nr_secs);
+                im->dsk.sec_crc_valid &= ~(1u << sec_nr);
+            }
 
-            for (i = off = 0; i < sec_nr; i++)
-                off += tib->sib[i].actual_length;
-            F_lseek(&im->fp, im->dsk.trk_off + off);
+            if (im->dsk.decode_data_pos < sec_sz) {
+                unsigned int nr;
+                uint32_t idx = ring_io_idx(rio, td->cons);
+                nr = sec_sz - im->dsk.decode_data_pos;
+                nr = min_t(unsigned int, nr, ring_io_idxend(rio) - idx);
+                nr = min_t(unsigned int, nr, p - c);
+
+                /* Waiting on the read is rare: It is akin to an underrun
+                 * during normal reading. */
+                if (td->cons + nr > td->prod) {
+                    stalled = TRUE;
+                    break;
+                }
 
-            for (todo = sec_sz; todo != 0; todo -= nr) {
-                nr = min_t(unsigned int, todo, 1024);
-                mfm_ring_to_bin(buf, bufmask, c, wrbuf, nr);
+                mfm_ring_to_bin(buf, bufmask, c, td->p + idx, nr);
                 c += nr;
-                crc = crc16_ccitt(wrbuf, nr, crc);
-                F_write(&im->fp, wrbuf, nr, NULL);
+                im->dsk.crc = crc16_ccitt(td->p + idx, nr, im->dsk.crc);
+                td->cons += nr;
+                im->dsk.decode_data_pos += nr;
+                if (im->dsk.decode_data_pos == sec_sz)
+                    ring_io_flush(rio);
             }
 
-            printk("%u us\n", time_diff(t, time_now()) / TIME_MHZ);
+            if (im->dsk.decode_data_pos < sec_sz)
+                continue;
 
+            if ((int16_t)(p - c) < 2)
+                break;
             mfm_ring_to_bin(buf, bufmask, c, wrbuf, 2);
             c += 2;
-            crc = crc16_ccitt(wrbuf, 2, crc);
+            crc = crc16_ccitt(wrbuf, 2, im->dsk.crc);
             if (crc != 0) {
                 printk("DSK Bad CRC: %04x, %d[%02x]\n",
                        crc, sec_nr, tib->sib[sec_nr].r);
             }
-
-            dam_out:
             im->dsk.write_sector = -2;
-            break;
-        }
+            im->dsk.decode_pos = 0;
 
         }
     }
 
-out:
+    if (im->dsk.trk_len != 0) {
+        if (flush && !stalled)
+            ring_io_flush(rio);
+        else
+            ring_io_progress(rio);
+    }
+
     wr->cons = c * 16;
-    return flush;
+    return flush && !stalled;
+}
+
+static void dsk_sync(struct image *im)
+{
+    ring_io_sync(&im->dsk.ring_io);
+    ring_io_shutdown(&im->dsk.ring_io);
+}
+
+/* ring_io writes whole blocks, so pad out a final partial block at mount. */
+static FSIZE_t dsk_extend(struct image *im)
+{
+    return (f_size(&im->fp) + 511) & ~511;
 }
 
 const struct image_handler dsk_image_handler = {
     .open = dsk_open,
+    .extend = dsk_extend,
     .setup_track = dsk_setup_track,
     .read_track = dsk_read_track,
     .rdata_flux = bc_rdata_flux,
     .write_track = dsk_write_track,
+    .sync = dsk_sync,
+    .prefetch = dsk_prefetch,
+    .async = TRUE,
 };
 
 /*
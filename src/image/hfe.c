@@ -60,22 +60,241 @@ struct track_header {
     uint16_t len;
 };
 
+/* HFX: HFE bitcells, but each track side is stored contiguously from a
+ * sector boundary, so that a side streams from a single run of sectors.
+ * Fields are little endian. */
+struct hfx_header {
+    char sig[8]; /* "FFHFXTRK" */
+    uint8_t formatrevision;
+    uint8_t nr_cyls, nr_sides;
+    uint8_t flags;
+    uint16_t bitrate; /* Default for all tracks: kbit/s, as HFE */
+    uint16_t track_list_offset; /* Sector of the track list */
+};
+
+/* hfx_header.flags */
+#define HFX_double_step (1u<<0)
+
+/* Track list: one entry per track side, ordered by cylinder then side. */
+struct hfx_track {
+    uint32_t offset; /* Sector of the track side's bitcells */
+    uint32_t len; /* Bytes of bitcells */
+    uint16_t bitrate; /* kbit/s, or 0 for the disk default */
+    uint16_t rsvd;
+};
+
 /* HFEv3 opcodes. The 4-bit codes have their bit ordering reversed. */
 enum {
     OP_nop = 0,     /* 0: no effect */
     OP_index = 8,   /* 1: index mark */
     OP_bitrate = 4, /* 2: +1byte: new bitrate */
     OP_skip = 12,   /* 3: +1byte: skip 0-8 bits in next byte */
-    OP_rand = 2     /* 4: flaky byte */
+    OP_rand = 2,    /* 4: flaky byte */
+    OP_none = 0xff  /* (data byte) */
+};
+
+/* Opcode found by prescan of a V3 track. */
+struct hfe_op {
+    uint16_t pos; /* Byte offset within track side */
+    uint8_t op, arg;
 };
 
+/* Opcodes tabled per track side. A side with more is scanned as it streams. */
+#define HFE_MAX_OPS 64
+#define HFE_OPS_OVERFLOW 0xff
+
 #define MAX_BC_SECS 8
 
+/* Flux positions within each possible bitcell byte. HFE bytes are sent LSB
+ * first: each nibble of an entry is the 1-based offset of a set bit, in
+ * transmission order, terminated by a zero nibble. */
+static const uint32_t hfe_flux_lut[256] = {
+    0x00000000, 0x00000001, 0x00000002, 0x00000021,
+    0x00000003, 0x00000031, 0x00000032, 0x00000321,
+    0x00000004, 0x00000041, 0x00000042, 0x00000421,
+    0x00000043, 0x00000431, 0x00000432, 0x00004321,
+    0x00000005, 0x00000051, 0x00000052, 0x00000521,
+    0x00000053, 0x00000531, 0x00000532, 0x00005321,
+    0x00000054, 0x00000541, 0x00000542, 0x00005421,
+    0x00000543, 0x00005431, 0x00005432, 0x00054321,
+    0x00000006, 0x00000061, 0x00000062, 0x00000621,
+    0x00000063, 0x00000631, 0x00000632, 0x00006321,
+    0x00000064, 0x00000641, 0x00000642, 0x00006421,
+    0x00000643, 0x00006431, 0x00006432, 0x00064321,
+    0x00000065, 0x00000651, 0x00000652, 0x00006521,
+    0x00000653, 0x00006531, 0x00006532, 0x00065321,
+    0x00000654, 0x00006541, 0x00006542, 0x00065421,
+    0x00006543, 0x00065431, 0x00065432, 0x00654321,
+    0x00000007, 0x00000071, 0x00000072, 0x00000721,
+    0x00000073, 0x00000731, 0x00000732, 0x00007321,
+    0x00000074, 0x00000741, 0x00000742, 0x00007421,
+    0x00000743, 0x00007431, 0x00007432, 0x00074321,
+    0x00000075, 0x00000751, 0x00000752, 0x00007521,
+    0x00000753, 0x00007531, 0x00007532, 0x00075321,
+    0x00000754, 0x00007541, 0x00007542, 0x00075421,
+    0x00007543, 0x00075431, 0x00075432, 0x00754321,
+    0x00000076, 0x00000761, 0x00000762, 0x00007621,
+    0x00000763, 0x00007631, 0x00007632, 0x00076321,
+    0x00000764, 0x00007641, 0x00007642, 0x00076421,
+    0x00007643, 0x00076431, 0x00076432, 0x00764321,
+    0x00000765, 0x00007651, 0x00007652, 0x00076521,
+    0x00007653, 0x00076531, 0x00076532, 0x00765321,
+    0x00007654, 0x00076541, 0x00076542, 0x00765421,
+    0x00076543, 0x00765431, 0x00765432, 0x07654321,
+    0x00000008, 0x00000081, 0x00000082, 0x00000821,
+    0x00000083, 0x00000831, 0x00000832, 0x00008321,
+    0x00000084, 0x00000841, 0x00000842, 0x00008421,
+    0x00000843, 0x00008431, 0x00008432, 0x00084321,
+    0x00000085, 0x00000851, 0x00000852, 0x00008521,
+    0x00000853, 0x00008531, 0x00008532, 0x00085321,
+    0x00000854, 0x00008541, 0x00008542, 0x00085421,
+    0x00008543, 0x00085431, 0x00085432, 0x00854321,
+    0x00000086, 0x00000861, 0x00000862, 0x00008621,
+    0x00000863, 0x00008631, 0x00008632, 0x00086321,
+    0x00000864, 0x00008641, 0x00008642, 0x00086421,
+    0x00008643, 0x00086431, 0x00086432, 0x00864321,
+    0x00000865, 0x00008651, 0x00008652, 0x00086521,
+    0x00008653, 0x00086531, 0x00086532, 0x00865321,
+    0x00008654, 0x00086541, 0x00086542, 0x00865421,
+    0x00086543, 0x00865431, 0x00865432, 0x08654321,
+    0x00000087, 0x00000871, 0x00000872, 0x00008721,
+    0x00000873, 0x00008731, 0x00008732, 0x00087321,
+    0x00000874, 0x00008741, 0x00008742, 0x00087421,
+    0x00008743, 0x00087431, 0x00087432, 0x00874321,
+    0x00000875, 0x00008751, 0x00008752, 0x00087521,
+    0x00008753, 0x00087531, 0x00087532, 0x00875321,
+    0x00008754, 0x00087541, 0x00087542, 0x00875421,
+    0x00087543, 0x00875431, 0x00875432, 0x08754321,
+    0x00000876, 0x00008761, 0x00008762, 0x00087621,
+    0x00008763, 0x00087631, 0x00087632, 0x00876321,
+    0x00008764, 0x00087641, 0x00087642, 0x00876421,
+    0x00087643, 0x00876431, 0x00876432, 0x08764321,
+    0x00008765, 0x00087651, 0x00087652, 0x00876521,
+    0x00087653, 0x00876531, 0x00876532, 0x08765321,
+    0x00087654, 0x00876541, 0x00876542, 0x08765421,
+    0x00876543, 0x08765431, 0x08765432, 0x87654321,
+};
+
 #define absdiff_t(type,x,y) \
     ({ type __x = (x); type __y = (y); __x < __y ? __y-__x: __x-__y; })
 
 static void hfe_seek_track(struct image *im, uint16_t track, bool_t async);
 
+/* Bytes of a track side per 512-byte sector of the file. */
+#define hfe_blk(im) ((im)->hfe.is_hfx ? 512 : 256)
+
+/* System ticks to stream one byte of file. */
+#define hfe_byte_ticks(im) ((im)->write_bc_ticks * 8 * hfe_blk(im) / 512)
+
+/* Sectors of file holding the current track. */
+#define hfe_trk_secs(im) \
+    (((im)->hfe.trk_len * ((im)->hfe.is_hfx ? 1 : 2) + 511) / 512)
+
+static uint32_t hfe_bitrate_ticks(uint8_t arg)
+{
+    return (sysclk_us(2) * 16 * arg) / 72;
+}
+
+/* Every listed track must be non-empty and lie within the file. The start
+ * sector @blk is range-checked before scaling, as a byte offset may not fit
+ * in FSIZE_t. */
+static bool_t hfe_track_valid(struct image *im, unsigned int nr,
+                              uint32_t blk, uint32_t len)
+{
+    FSIZE_t sz = f_size(&im->fp);
+    if ((len != 0) && (len <= sz) && (blk <= (sz - len) / 512))
+        return TRUE;
+    printk("HFE: Bad track list entry %u: %u bytes at sector %u\n",
+           nr, len, blk);
+    return FALSE;
+}
+
+/* Validate @nr track-list entries at @p, the first of which is entry @i. */
+static bool_t hfe_tlut_valid(struct image *im, const void *p,
+                             unsigned int i, unsigned int nr)
+{
+    const struct hfx_track *x = p;
+    const struct track_header *t = p;
+
+    for (; nr != 0; i++, nr--, x++, t++) {
+        if (im->hfe.is_hfx
+            ? !hfe_track_valid(im, i, le32toh(x->offset), le32toh(x->len))
+            : !hfe_track_valid(im, i, le16toh(t->offset), le16toh(t->len)))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Read and validate the track list of @nr entries of @sz bytes. The list is
+ * kept at the end of the read buffer, so that no seek waits on metadata I/O,
+ * unless it would take more than an eighth of the buffer. Otherwise it is
+ * streamed through the (as yet unused) read buffer, and validated as it is
+ * read. Returns FALSE if the list is truncated or has a bad entry. */
+static bool_t hfe_load_tlut(struct image *im, unsigned int nr, unsigned int sz)
+{
+    struct image_buf *rd = &im->bufs.read_data;
+    uint32_t len = nr * sz;
+    unsigned int i, n;
+    UINT br;
+
+    F_lseek(&im->fp, im->hfe.tlut_base*512);
+
+    if (len <= rd->len / 8) {
+        rd->len = (rd->len - len) & ~3;
+        im->hfe.tlut = (uint8_t *)rd->p + rd->len;
+        F_read(&im->fp, im->hfe.tlut, len, &br);
+        return (br == len) && hfe_tlut_valid(im, im->hfe.tlut, 0, nr);
+    }
+
+    for (i = 0; i < nr; i += n) {
+        n = min_t(unsigned int, nr - i, rd->len / sz);
+        F_read(&im->fp, rd->p, n * sz, &br);
+        if ((br != n * sz) || !hfe_tlut_valid(im, rd->p, i, n))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static bool_t hfx_open(struct image *im)
+{
+    struct hfx_header xhdr;
+    uint16_t bitrate;
+
+    F_lseek(&im->fp, 0);
+    F_read(&im->fp, &xhdr, sizeof(xhdr), NULL);
+    bitrate = le16toh(xhdr.bitrate);
+    if (strncmp(xhdr.sig, "FFHFXTRK", sizeof(xhdr.sig))
+        || (xhdr.formatrevision > 0)
+        || (xhdr.nr_cyls == 0)
+        || (xhdr.nr_sides < 1) || (xhdr.nr_sides > 2)
+        || (bitrate == 0))
+        return FALSE;
+
+    im->hfe.is_hfx = TRUE;
+    im->hfe.double_step = !!(xhdr.flags & HFX_double_step);
+    im->hfe.tlut_base = le16toh(xhdr.track_list_offset);
+    im->nr_cyls = xhdr.nr_cyls;
+    if (im->hfe.double_step)
+        im->nr_cyls = min_t(unsigned int, im->nr_cyls*2, 255);
+    im->nr_sides = xhdr.nr_sides;
+    im->write_bc_ticks = sysclk_us(500) / bitrate;
+    im->ticks_per_cell = im->write_bc_ticks * 16;
+    im->hfe.dfl_ticks_per_cell = im->ticks_per_cell;
+    im->sync = SYNC_none;
+
+    if (!hfe_load_tlut(im, xhdr.nr_cyls * im->nr_sides,
+                       sizeof(struct hfx_track)))
+        return FALSE;
+
+    /* Get an initial value for ticks per revolution. */
+    hfe_seek_track(im, 0, FALSE);
+    im->cur_track = -1;
+
+    return TRUE;
+}
+
 static bool_t hfe_open(struct image *im)
 {
     struct disk_header dhdr;
@@ -83,8 +302,12 @@ static bool_t hfe_open(struct image *im)
     /* File data is less compact since it contains data for both heads. */
     uint32_t norm_buf_size = im->bufs.write_bc.len + im->bufs.read_data.len/2;
 
+    im->index_pulses = im->hfe.index_pulses;
+
     F_read(&im->fp, &dhdr, sizeof(dhdr), NULL);
-    if (!strncmp(dhdr.sig, "HXCHFEV3", sizeof(dhdr.sig))) {
+    if (!strncmp(dhdr.sig, "FFHFXTRK", sizeof(dhdr.sig))) {
+        return hfx_open(im);
+    } else if (!strncmp(dhdr.sig, "HXCHFEV3", sizeof(dhdr.sig))) {
         if (dhdr.formatrevision > 0)
             return FALSE;
         im->hfe.is_v3 = TRUE;
@@ -112,8 +335,20 @@ static bool_t hfe_open(struct image *im)
     im->nr_sides = dhdr.nr_sides;
     im->write_bc_ticks = sysclk_us(500) / bitrate;
     im->ticks_per_cell = im->write_bc_ticks * 16;
+    im->hfe.dfl_ticks_per_cell = im->ticks_per_cell;
     im->sync = SYNC_none;
 
+    if (im->hfe.is_v3) {
+        /* Opcode tables live at the end of the read buffer. */
+        im->bufs.read_data.len = (im->bufs.read_data.len
+            - 2 * HFE_MAX_OPS * sizeof(struct hfe_op)) & ~3;
+        im->hfe.ops = (struct hfe_op *)
+            ((uint8_t *)im->bufs.read_data.p + im->bufs.read_data.len);
+    }
+
+    if (!hfe_load_tlut(im, dhdr.nr_tracks, sizeof(struct track_header)))
+        return FALSE;
+
     /* Get an initial value for ticks per revolution. */
     hfe_seek_track(im, 0, FALSE);
     im->cur_track = -1;
@@ -126,12 +361,238 @@ static bool_t hfe_open(struct image *im)
     return TRUE;
 }
 
+/* Table the opcodes in a 256-byte block of track side @side, at byte offset
+ * @pos. An opcode's argument may be in the following block: @st carries it. */
+static void hfe_scan_block(struct image *im, unsigned int side,
+                           uint32_t pos, const uint8_t *p, uint8_t *st)
+{
+    struct hfe_op *ops = &im->hfe.ops[side * HFE_MAX_OPS];
+    uint8_t *nr = &im->hfe.nr_ops[side];
+    unsigned int i, n = min_t(unsigned int, 256, im->hfe.trk_len - pos);
+    uint8_t x;
+
+    for (i = 0; (i < n) && (*nr != HFE_OPS_OVERFLOW); i++) {
+        x = p[i];
+        if (*st) {
+            /* Argument byte, then (OP_skip only) a partial data byte. */
+            if (*st & 2)
+                ops[*nr-1].arg = _rbit32(x) >> 24;
+            *st = (*st == 3);
+            continue;
+        }
+        if ((x & 0xf) != 0xf)
+            continue;
+        if (*nr == HFE_MAX_OPS) {
+            *nr = HFE_OPS_OVERFLOW;
+            break;
+        }
+        ops[*nr].pos = pos + i;
+        ops[*nr].op = x >> 4;
+        ops[*nr].arg = 0;
+        (*nr)++;
+        if (x >> 4 == OP_bitrate)
+            *st = 2;
+        else if (x >> 4 == OP_skip)
+            *st = 3;
+    }
+}
+
+/* Read the whole V3 track at file sector @trk_off and table its opcodes, so
+ * that index pulses and seek positions are known before the track streams.
+ * The read buffer is free for use as the ring is not yet seeked. The last
+ * chunk read is left there as the ring's first contents. */
+static void hfe_prescan(struct image *im, uint16_t trk_off, bool_t async)
+{
+    struct image_buf *rd = &im->bufs.read_data;
+    uint8_t *buf = rd->p, st[2] = { 0, 0 };
+    unsigned int blk, nr_blks = (im->hfe.trk_len + 255) / 256;
+    unsigned int i, n = 0, side, max = im->hfe.ring_io.ring_len / 512;
+    FSIZE_t off;
+    FOP fop;
+
+    im->hfe.nr_ops[0] = im->hfe.nr_ops[1] = 0;
+    for (blk = 0; blk < nr_blks; blk += n) {
+        n = min_t(unsigned int, nr_blks - blk, max);
+        off = (FSIZE_t)(trk_off + blk) * 512;
+        if (!async) {
+            F_lseek(&im->fp, off);
+            F_read(&im->fp, buf, n * 512, NULL);
+        } else {
+            /* Sectors held in the write journal must be read from there. */
+            if (!journal_read_async(&im->fp, off, buf, &n, &fop)) {
+                F_lseek_async(&im->fp, off);
+                fop = F_read_async(&im->fp, buf, n * 512, NULL);
+            }
+            F_async_wait(fop);
+        }
+        for (i = 0; i < n; i++)
+            for (side = 0; side < im->nr_sides; side++)
+                hfe_scan_block(im, side, (blk + i) * 256,
+                               &buf[i*512 + side*256], &st[side]);
+    }
+
+    ring_io_preload(&im->hfe.ring_io, (blk - n) * 512, n * 512);
+}
+
+/* Walk the opcode table of the current side to find the bitcell at @ticks,
+ * placing the stream there. Index pulses and revolution length are updated.
+ * Returns FALSE if the side's opcodes are not fully tabled. */
+static bool_t hfe_ops_seek(struct image *im, uint32_t ticks)
+{
+    unsigned int side = im->cur_track & 1;
+    struct hfe_op *ops = &im->hfe.ops[side * HFE_MAX_OPS];
+    unsigned int i, nr = im->hfe.nr_ops[side], nr_pulses = 0;
+    uint32_t bc = 0, t = 0, op_bc, span, tpc = im->hfe.dfl_ticks_per_cell;
+    bool_t found = FALSE;
+
+    if (!im->hfe.ops || (nr == HFE_OPS_OVERFLOW))
+        return FALSE;
+
+    /* The bitrate at index is the last set by the previous revolution. */
+    for (i = 0; i < nr; i++)
+        if (ops[i].op == OP_bitrate)
+            tpc = hfe_bitrate_ticks(ops[i].arg);
+
+    for (i = 0; ; i++) {
+        op_bc = (i < nr) ? ops[i].pos * 8 : im->tracklen_bc;
+        if (op_bc > bc) {
+            /* Bitcells of data up to the next opcode. */
+            span = (op_bc - bc) * tpc;
+            if (!found && (ticks < t + span)) {
+                im->cur_bc = bc + (ticks - t) / tpc;
+                im->cur_ticks = t + (im->cur_bc - bc) * tpc;
+                im->ticks_per_cell = tpc;
+                im->hfe.next_op = i;
+                found = TRUE;
+            }
+            t += span;
+            bc = op_bc;
+        }
+        if (i == nr)
+            break;
+        switch (ops[i].op) {
+        case OP_index:
+            if ((nr_pulses < MAX_CUSTOM_PULSES - 1)
+                && (im->hfe.index_pulses[nr_pulses++] != t)) {
+                im->hfe.index_pulses[nr_pulses-1] = t;
+                im->index_pulses_ver++;
+            }
+            bc += 8;
+            break;
+        case OP_bitrate:
+            tpc = hfe_bitrate_ticks(ops[i].arg);
+            bc += 2*8;
+            break;
+        case OP_skip:
+            bc += 2*8 + (ops[i].arg & 7);
+            break;
+        case OP_rand:
+            /* Random data: Bitcells and ticks as for any other byte. */
+            break;
+        default:
+            bc += 8;
+            break;
+        }
+    }
+
+    if (!found) {
+        im->cur_bc = im->cur_ticks = 0;
+        im->ticks_per_cell = tpc;
+        im->hfe.next_op = 0;
+    }
+    im->write_bc_ticks = im->ticks_per_cell / 16;
+
+    im->tracklen_ticks = t;
+    im->stk_per_rev = stk_sysclk(t / 16);
+    if (im->index_pulses_len != nr_pulses) {
+        im->index_pulses_len = nr_pulses;
+        im->index_pulses_ver++;
+    }
+
+    return TRUE;
+}
+
+/* Switch the stream to the given HFX side of the current cylinder. */
+static void hfx_select_side(struct image *im, unsigned int side)
+{
+    im->hfe.trk_len = im->hfe.hfx_side[side].len;
+    im->tracklen_bc = im->hfe.trk_len * 8;
+    im->ticks_per_cell = im->hfe.hfx_side[side].ticks_per_cell;
+    im->write_bc_ticks = im->ticks_per_cell / 16;
+    im->stk_per_rev = stk_sysclk(im->tracklen_bc * im->write_bc_ticks);
+}
+
+static void hfx_seek_track(struct image *im, uint16_t track, bool_t async)
+{
+    struct hfx_track thdr[2];
+    unsigned int i, nr, side = track & 1;
+    uint32_t secs[2];
+    FSIZE_t off[2];
+    uint16_t bitrate;
+
+    /* Both sides of the cylinder, which are adjacent in the track list. */
+    nr = (track/2)*im->nr_sides;
+    if (im->hfe.tlut) {
+        memcpy(thdr, &((struct hfx_track *)im->hfe.tlut)[nr],
+               im->nr_sides * sizeof(thdr[0]));
+    } else if (async) {
+        F_lseek_async(&im->fp, im->hfe.tlut_base*512 + nr * sizeof(thdr[0]));
+        F_async_wait(F_read_async(&im->fp, thdr,
+                                  im->nr_sides * sizeof(thdr[0]), NULL));
+    } else {
+        F_lseek(&im->fp, im->hfe.tlut_base*512 + nr * sizeof(thdr[0]));
+        F_read(&im->fp, thdr, im->nr_sides * sizeof(thdr[0]), NULL);
+    }
+
+    for (i = 0; i < im->nr_sides; i++) {
+        /* A track side longer than 64kB would not fit the ring in any
+         * case. */
+        im->hfe.hfx_side[i].len = min_t(uint32_t, le32toh(thdr[i].len),
+                                        0xffff);
+        bitrate = le16toh(thdr[i].bitrate);
+        im->hfe.hfx_side[i].ticks_per_cell = bitrate
+            ? (sysclk_us(500) / bitrate) * 16 : im->hfe.dfl_ticks_per_cell;
+        secs[i] = (im->hfe.hfx_side[i].len + 511) / 512;
+        off[i] = (FSIZE_t)le32toh(thdr[i].offset) * 512;
+    }
+
+    /* Hold side 1 in the shadow ring if both sides are fully buffered. The
+     * rings share a length, so the sides must span equal sector counts, as
+     * they do when converted from HFE. */
+    im->hfe.hfx_shadow = ((im->nr_sides == 2)
+                          && (secs[0] == secs[1])
+                          && (secs[0] * 512 * 2 <= im->bufs.read_data.len)
+                          && ((off[0] < off[1])
+                              ? (off[0] + secs[0] * 512 <= off[1])
+                              : (off[1] + secs[1] * 512 <= off[0])));
+
+    hfx_select_side(im, side);
+
+    if (im->hfe.hfx_shadow)
+        ring_io_init(&im->hfe.ring_io, &im->fp, &im->bufs.read_data,
+                     off[0], off[1], secs[0]);
+    else
+        ring_io_init(&im->hfe.ring_io, &im->fp, &im->bufs.read_data,
+                     off[side], ~0, secs[side]);
+    im->hfe.ring_io.batch_secs = ring_io_batch_secs(hfe_byte_ticks(im));
+    im->hfe.ring_io.trailing_secs = MAX_BC_SECS;
+    im->hfe.ring_io.explicit_changes = TRUE;
+    im->hfe.ring_io.write_defer_ms = RING_IO_WRITE_DEFER_MS;
+}
+
 static void hfe_seek_track(struct image *im, uint16_t track, bool_t async)
 {
     struct track_header thdr;
     uint16_t trk_off, old_len;
 
-    if (async) {
+    if (im->hfe.is_hfx) {
+        hfx_seek_track(im, track, async);
+        return;
+    }
+
+    if (im->hfe.tlut) {
+        thdr = ((struct track_header *)im->hfe.tlut)[track/2];
+    } else if (async) {
         F_lseek_async(&im->fp, im->hfe.tlut_base*512 + (track/2)*4);
         F_async_wait(F_read_async(&im->fp, &thdr, sizeof(thdr), NULL));
     } else {
@@ -150,12 +611,18 @@ static void hfe_seek_track(struct image *im, uint16_t track, bool_t async)
         im->stk_per_rev = stk_sysclk(im->tracklen_bc * im->write_bc_ticks);
 
     ring_io_init(&im->hfe.ring_io, &im->fp, &im->bufs.read_data,
-            (LBA_t)trk_off * 512, ~0, (im->hfe.trk_len*2 + 511) / 512);
-    /* Aggressively batch our reads at HD data rate, as that can be faster
-     * than some USB drives will serve up a single block.*/
-    im->hfe.ring_io.batch_secs =
-        (im->write_bc_ticks > sysclk_ns(1500)) ? 4 : 8;
+            (LBA_t)trk_off * 512, ~0, hfe_trk_secs(im));
+    if (im->hfe.ops)
+        hfe_prescan(im, trk_off, async);
+    /* Each file byte carries only four bitcells of a side, so the file
+     * streams fast: At HD rate faster than some USB drives serve up a single
+     * block. */
+    im->hfe.ring_io.batch_secs = ring_io_batch_secs(hfe_byte_ticks(im));
     im->hfe.ring_io.trailing_secs = MAX_BC_SECS;
+    /* Each sector holds both sides: Write back only sectors that changed, and
+     * give a write to the other side the chance to merge with this one. */
+    im->hfe.ring_io.explicit_changes = TRUE;
+    im->hfe.ring_io.write_defer_ms = RING_IO_WRITE_DEFER_MS;
 }
 
 static void hfe_setup_track(
@@ -165,28 +632,38 @@ static void hfe_setup_track(
     uint32_t sys_ticks, opcode_adj_bc = 0;
     uint8_t cyl = track >> (im->hfe.double_step ? 2 : 1);
     uint8_t side = track & (im->nr_sides - 1);
+    bool_t shadow;
     int i;
 
     track = cyl*2 + side;
-    if (track/2 != im->cur_track/2) {
-        ring_io_sync(&im->hfe.ring_io);
+    /* An HFE ring holds both sides of a cylinder, as does an HFX ring with a
+     * shadow. Otherwise an HFX ring holds only one side. */
+    if ((track/2 != im->cur_track/2)
+        || (im->hfe.is_hfx && !im->hfe.hfx_shadow
+            && (track != im->cur_track))) {
+        ring_io_writeback(&im->hfe.ring_io);
         ring_io_shutdown(&im->hfe.ring_io);
 
         im->cur_track = track;
         hfe_seek_track(im, track, TRUE);
     } else if (track != im->cur_track) {
         im->cur_track = track;
+        if (im->hfe.is_hfx)
+            hfx_select_side(im, side);
     }
+    shadow = im->hfe.is_hfx && im->hfe.hfx_shadow && side;
 
     /* If track does not fit in memory, now is a good time to flush writes to
      * reduce chances of future buffer underrun caused by a very slow write.
      * However if write-drain=realtime, then any delays cut into reads so we
      * just accept the buffer underrun risk. */
-    if ((im->hfe.trk_len*2 + 511) / 512 > im->bufs.read_data.len
+    if (hfe_trk_secs(im) > im->bufs.read_data.len
             && ff_cfg.write_drain != WDRAIN_realtime)
-        ring_io_sync(&im->hfe.ring_io);
+        ring_io_writeback(&im->hfe.ring_io);
 
     sys_ticks = start_pos ? *start_pos : get_write(im, im->wr_cons)->start;
+    if (hfe_ops_seek(im, sys_ticks * 16))
+        goto found;
     im->cur_bc = (sys_ticks * 16) / im->ticks_per_cell;
     if (im->hfe.is_v3 && im->tracklen_ticks > 0
         && im->tracklen_ticks < im->tracklen_bc * im->ticks_per_cell) {
@@ -212,33 +689,36 @@ static void hfe_setup_track(
         opcode_adj_bc  = 0;
     }
     im->cur_ticks = im->cur_bc * im->ticks_per_cell;
-    im->ticks_since_flux = 0;
 
     /* Must be careful to exclude opcode_adj_bc from tick calculations. */
     im->cur_bc += opcode_adj_bc;
 
+found:
+    im->ticks_since_flux = 0;
     sys_ticks = im->cur_ticks / 16;
 
     bc->prod = bc->cons = 0;
 
     for (i = 0; i < im->index_pulses_len; i++)
-        if (im->cur_ticks < im->index_pulses[i])
+        if (im->cur_ticks < im->hfe.index_pulses[i])
             break;
     im->hfe.next_index_pulses_pos = i;
 
     if (start_pos) {
         /* Read mode. */
-        ring_io_seek(&im->hfe.ring_io, im->cur_bc/8 / 256 * 512, FALSE, FALSE);
+        ring_io_seek(&im->hfe.ring_io, im->cur_bc/8 / hfe_blk(im) * 512,
+                     FALSE, shadow);
         /* Consumer may be ahead of producer, but only until the first read
          * completes. */
-        bc->cons = im->cur_bc % (256*8);
+        bc->cons = im->cur_bc % (hfe_blk(im)*8);
         *start_pos = sys_ticks;
     } else {
-        uint32_t pos = im->cur_bc / 8 / 256 * 512
-                     + im->cur_bc / 8 % 256
-                     + (im->cur_track & 1) * 256;
+        uint32_t pos = im->hfe.is_hfx ? im->cur_bc / 8
+                     : (im->cur_bc / 8 / 256 * 512
+                        + im->cur_bc / 8 % 256
+                        + (im->cur_track & 1) * 256);
         /* Write mode. */
-        ring_io_seek(&im->hfe.ring_io, pos, TRUE, FALSE);
+        ring_io_seek(&im->hfe.ring_io, pos, TRUE, shadow);
         im->hfe.fresh_seek = TRUE;
     }
 }
@@ -250,7 +730,8 @@ static bool_t hfe_read_track(struct image *im)
     uint8_t *buf = rd->p;
     uint8_t *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
-    unsigned int nr_sec;
+    unsigned int nr_sec, blk = hfe_blk(im);
+    uint32_t side_off = im->hfe.is_hfx ? 0 : (im->cur_track&1)*256;
 
     ring_io_progress(&im->hfe.ring_io);
     if (rd->cons >= rd->prod)
@@ -264,17 +745,17 @@ static bool_t hfe_read_track(struct image *im)
     bc_space = min_t(uint32_t, bc_len, MAX_BC_SECS*256)
         - (int16_t)(bc_p - bc_c);
 
-    nr_sec = min_t(unsigned int, (rd->prod - rd->cons)/512, bc_space/256);
+    nr_sec = min_t(unsigned int, (rd->prod - rd->cons)/512, bc_space/blk);
     if (nr_sec == 0)
         return FALSE;
 
     while (nr_sec--) {
-        uint32_t cons = rd->cons + (im->cur_track&1)*256;
+        uint32_t cons = rd->cons + side_off;
         memcpy(&bc_b[bc_p & bc_mask],
                &buf[ring_io_idx(&im->hfe.ring_io, cons)],
-               256);
+               blk);
         rd->cons += 512;
-        bc_p += 256;
+        bc_p += blk;
     }
 
     barrier();
@@ -283,16 +764,24 @@ static bool_t hfe_read_track(struct image *im)
     return TRUE;
 }
 
-static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
+static ramfunc uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf,
+                                      uint16_t nr)
 {
     struct image_buf *bc = &im->bufs.read_bc;
     uint8_t *bc_b = bc->p;
     uint32_t bc_c = bc->cons, bc_p = bc->prod, bc_mask = bc->len - 1;
     uint32_t ticks = im->ticks_since_flux;
     uint32_t ticks_per_cell = im->ticks_per_cell;
-    uint32_t y = 8, todo = nr;
-    uint8_t x;
-    bool_t is_v3 = im->hfe.is_v3;
+    uint32_t y = 8, todo = nr, e, p, p0, op_bc;
+    uint8_t x, op, arg;
+    unsigned int side = im->cur_track & 1, nr_ops = im->hfe.nr_ops[side];
+    struct hfe_op *ops = im->hfe.ops + side * HFE_MAX_OPS;
+    /* Opcodes not found by prescan must be found in the stream. */
+    bool_t scan_v3 = im->hfe.is_v3 && (nr_ops == HFE_OPS_OVERFLOW);
+
+    if (scan_v3)
+        nr_ops = 0;
+    op_bc = (im->hfe.next_op < nr_ops) ? ops[im->hfe.next_op].pos * 8 : ~0;
 
     while ((int32_t)(bc_p - bc_c) >= 3*8) {
         ASSERT(y == 8);
@@ -301,25 +790,38 @@ static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
             im->tracklen_ticks = im->cur_ticks;
             im->cur_bc = im->cur_ticks = 0;
             im->stk_per_rev = stk_sysclk(im->tracklen_ticks / 16);
-            /* Skip tail of current 256-byte block. */
-            bc_c = (bc_c + 256*8-1) & ~(256*8-1);
+            /* Skip tail of current block. */
+            bc_c = (bc_c + hfe_blk(im)*8-1) & ~(hfe_blk(im)*8-1);
             if (im->index_pulses_len != im->hfe.next_index_pulses_pos) {
                 im->index_pulses_len = im->hfe.next_index_pulses_pos;
                 im->index_pulses_ver++;
             }
             im->hfe.next_index_pulses_pos = 0;
+            im->hfe.next_op = 0;
+            op_bc = nr_ops ? ops[0].pos * 8 : ~0;
             continue;
         }
         y = bc_c % 8;
         x = bc_b[(bc_c/8) & bc_mask] >> y;
-        if (is_v3 && (y == 0) && ((x & 0xf) == 0xf)) {
+        op = OP_none;
+        if (im->cur_bc == op_bc) {
+            /* V3 opcode found by prescan. */
+            op = ops[im->hfe.next_op].op;
+            arg = ops[im->hfe.next_op].arg;
+            op_bc = (++im->hfe.next_op < nr_ops)
+                ? ops[im->hfe.next_op].pos * 8 : ~0;
+        } else if (scan_v3 && (y == 0) && ((x & 0xf) == 0xf)) {
+            op = x >> 4;
+            arg = _rbit32(bc_b[(bc_c/8+1) & bc_mask]) >> 24;
+        }
+        if (op != OP_none) {
             /* V3 byte-aligned opcode processing. */
-            switch (x >> 4) {
+            switch (op) {
             case OP_index:
                 if (im->hfe.next_index_pulses_pos < MAX_CUSTOM_PULSES
-                    && im->index_pulses[im->hfe.next_index_pulses_pos] != im->cur_ticks) {
+                    && im->hfe.index_pulses[im->hfe.next_index_pulses_pos] != im->cur_ticks) {
 
-                    im->index_pulses[im->hfe.next_index_pulses_pos]
+                    im->hfe.index_pulses[im->hfe.next_index_pulses_pos]
                         = im->cur_ticks;
                     if (im->index_pulses_len < im->hfe.next_index_pulses_pos+1)
                         im->index_pulses_len = im->hfe.next_index_pulses_pos+1;
@@ -334,16 +836,14 @@ static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
                 y = 8;
                 continue;
             case OP_bitrate:
-                x = _rbit32(bc_b[(bc_c/8+1) & bc_mask]) >> 24;
-                im->ticks_per_cell = ticks_per_cell = 
-                    (sysclk_us(2) * 16 * x) / 72;
+                im->ticks_per_cell = ticks_per_cell = hfe_bitrate_ticks(arg);
                 im->write_bc_ticks = ticks_per_cell / 16;
                 bc_c += 2*8;
                 im->cur_bc += 2*8;
                 y = 8;
                 continue;
             case OP_skip:
-                x = (_rbit32(bc_b[(bc_c/8+1) & bc_mask]) >> 24) & 7;
+                x = arg & 7;
                 bc_c += 2*8 + x;
                 im->cur_bc += 2*8 + x;
                 y = x;
@@ -357,17 +857,24 @@ static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
         bc_c += 8 - y;
         im->cur_bc += 8 - y;
         im->cur_ticks += (8 - y) * ticks_per_cell;
-        while (y < 8) {
-            y++;
-            ticks += ticks_per_cell;
-            if (x & 1) {
-                *tbuf++ = (ticks >> 4) - 1;
-                ticks &= 15;
-                if (!--todo)
-                    goto out;
+        /* Emit a flux transition for each set bit, consuming bitcells up to
+         * and including that bit. Any trailing zero cells are added to the
+         * carried-over tick count below. */
+        e = hfe_flux_lut[x];
+        p0 = 0;
+        while ((p = e & 15) != 0) {
+            ticks += (p - p0) * ticks_per_cell;
+            *tbuf++ = (ticks >> 4) - 1;
+            ticks &= 15;
+            p0 = p;
+            if (!--todo) {
+                y += p;
+                goto out;
             }
-            x >>= 1;
+            e >>= 4;
         }
+        ticks += (8 - y - p0) * ticks_per_cell;
+        y = 8;
     }
 
 out:
@@ -385,10 +892,10 @@ static bool_t hfe_write_track(struct image *im)
     struct image_buf *wr = &im->bufs.write_bc;
     uint8_t *buf = wr->p;
     unsigned int bufmask = wr->len - 1;
-    uint8_t *w;
+    uint8_t *w, b;
     struct image_buf *rd = &im->bufs.read_data;
     uint32_t i, space, c = wr->cons / 8, p = wr->prod / 8;
-    bool_t is_v3 = im->hfe.is_v3;
+    bool_t is_v3 = im->hfe.is_v3, changed;
 
     /* If we are processing final data then use the end index, rounded to
      * nearest. */
@@ -404,10 +911,18 @@ static bool_t hfe_write_track(struct image *im)
 
         /* All bytes remaining in the raw-bitcell buffer. */
         nr = space = (p - c) & bufmask;
-        /* Limit to end of current 256-byte HFE block. */
-        nr = min_t(UINT, nr, 256 - (pos & 255));
-        /* Limit to end of HFE track. */
-        nr = min_t(UINT, nr, im->hfe.trk_len - pos / 512 * 256 - pos % 256);
+        if (im->hfe.is_hfx) {
+            /* Limit to end of sector, and of track. */
+            nr = min_t(UINT, nr, 512 - (pos & 511));
+            nr = min_t(UINT, nr, im->hfe.trk_len - min_t(UINT, pos,
+                                                        im->hfe.trk_len));
+        } else {
+            /* Limit to end of current 256-byte HFE block. */
+            nr = min_t(UINT, nr, 256 - (pos & 255));
+            /* Limit to end of HFE track. */
+            nr = min_t(UINT, nr,
+                       im->hfe.trk_len - pos / 512 * 256 - pos % 256);
+        }
 
         /* Bail if no bytes to write. */
         if (nr == 0)
@@ -423,6 +938,7 @@ static bool_t hfe_write_track(struct image *im)
         /* Encode into the sector buffer for later write-out. */
         w = rd->p + ring_io_idx(&im->hfe.ring_io, rd->cons);
         i = 0;
+        changed = FALSE;
 
         if (im->hfe.fresh_seek && is_v3 && (pos & 255) >= 1) {
             /* Avoid writing in the middle of an opcode. */
@@ -472,16 +988,25 @@ static bool_t hfe_write_track(struct image *im)
                     continue;
 
                 case OP_rand:
-                    /* Replace with data. */
+                    /* Replace with data. The prescan is now stale. */
+                    if (im->hfe.nr_ops[im->cur_track & 1] != 0)
+                        im->hfe.nr_ops[im->cur_track & 1] = HFE_OPS_OVERFLOW;
                     break;
                 }
             }
-            *w++ = _rbit32(buf[c++ & bufmask]) >> 24;
+            b = _rbit32(buf[c++ & bufmask]) >> 24;
+            if (*w != b) {
+                *w = b;
+                changed = TRUE;
+            }
+            w++;
         }
 
+        if (changed)
+            ring_io_changed(&im->hfe.ring_io, rd->cons);
         rd->cons += i; /* i may be larger than nr due to opcodes. */
         /* Stay aligned to track side. */
-        if (rd->cons % 256 == 0)
+        if (!im->hfe.is_hfx && (rd->cons % 256 == 0))
             rd->cons += 256;
     }
 
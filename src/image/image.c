@@ -42,6 +42,7 @@ const struct image_type image_type[] = {
     { "dsk", &dsk_image_handler },
     { "hdm", &pc98hdm_image_handler },
     { "hfe", &hfe_image_handler },
+    { "hfx", &hfe_image_handler },
     { "img", &img_image_handler },
     { "ima", &img_image_handler },
     { "out", &img_image_handler },
@@ -75,9 +76,64 @@ const struct image_type image_type[] = {
 #endif /* QUICKDISK */
 
 
+/* Filename extensions of up to four characters, lower-cased and packed into
+ * a word (0 if none, or too long), for classifying directory entries without
+ * string copies or compares. */
+static uint32_t ext_pack(const char *ext)
+{
+    uint32_t key = 0;
+    unsigned int i;
+
+    for (i = 0; ext[i] != '\0'; i++) {
+        if (i == 4)
+            return 0;
+        key |= (uint32_t)(uint8_t)tolower(ext[i]) << (i*8);
+    }
+    return key;
+}
+
+static uint32_t ext_key(const char *name)
+{
+    const char *p = strrchr(name, '.');
+    return p ? ext_pack(p+1) : 0;
+}
+
+/* Open-addressed hash of image_type[] by extension key. Each slot holds an
+ * index into image_type[] plus one, or 0 if empty. Built on first use. */
+#define EXT_HASH_NR 32 /* power of two, above the number of types */
+#define ext_hash(key) (((key) * 2654435761u) >> 27)
+static struct {
+    bool_t built;
+    uint8_t idx[EXT_HASH_NR];
+    uint32_t key[EXT_HASH_NR];
+} ext_tab;
+
+static const struct image_type *ext_lookup(uint32_t key)
+{
+    unsigned int i, h;
+
+    if (!ext_tab.built) {
+        for (i = 0; image_type[i].handler != NULL; i++) {
+            uint32_t k = ext_pack(image_type[i].ext);
+            for (h = ext_hash(k); ext_tab.idx[h]; h = (h+1) & (EXT_HASH_NR-1))
+                continue;
+            ext_tab.key[h] = k;
+            ext_tab.idx[h] = i + 1;
+        }
+        ext_tab.built = TRUE;
+    }
+
+    if (key == 0)
+        return NULL;
+    for (h = ext_hash(key); ext_tab.idx[h]; h = (h+1) & (EXT_HASH_NR-1))
+        if (ext_tab.key[h] == key)
+            return &image_type[ext_tab.idx[h] - 1];
+    return NULL;
+}
+
 bool_t image_valid(FILINFO *fp)
 {
-    char ext[8];
+    uint32_t key;
 
     /* Skip directories. */
     if (fp->fattrib & AM_DIR)
@@ -88,31 +144,73 @@ bool_t image_valid(FILINFO *fp)
         return FALSE;
 
     /* Check valid extension. */
-    filename_extension(fp->fname, ext, sizeof(ext));
-    if (!strcmp(ext, "adf") && !is_quickdisk) {
+    key = ext_key(fp->fname);
+    if ((key == ('a' | 'd'<<8 | 'f'<<16)) && !is_quickdisk)
         return (ff_cfg.host == HOST_acorn) || !(fp->fsize % (2*11*512));
-    } else {
-        const struct image_type *type;
-        for (type = &image_type[0]; type->handler != NULL; type++)
-            if (!strcmp(ext, type->ext))
-                return TRUE;
-    }
+    return ext_lookup(key) != NULL;
+}
 
-    return FALSE;
+/* Recently-opened images, keyed by first cluster and size, and the handler
+ * and probe which opened each. An entry is dropped when its image is written,
+ * as that may change the outcome of the probes. */
+#define PROBE_CACHE_NR 8
+static struct probe_cache {
+    uint32_t clust, size;
+    const struct image_handler *handler;
+    uint8_t probe;
+} probe_cache[PROBE_CACHE_NR], *probe_cache_cur;
+
+/* Bytes of handler state used by @handler. */
+static unsigned int handler_state_size(const struct image_handler *handler)
+{
+#if !defined(QUICKDISK)
+    if (handler == &adf_image_handler)
+        return sizeof(struct adf_image);
+    if (handler == &hfe_image_handler)
+        return sizeof(struct hfe_image);
+    if (handler == &dsk_image_handler)
+        return sizeof(struct dsk_image);
+    if (handler == &da_image_handler)
+        return sizeof(struct directaccess);
+    if (handler == &dummy_image_handler)
+        return 0;
+    /* All other handlers are sector-image formats. */
+    return sizeof(struct img_image);
+#else
+    return sizeof(struct qd_image);
+#endif
+}
+
+void image_probe_cache_flush(void)
+{
+    memset(probe_cache, 0, sizeof(probe_cache));
+    probe_cache_cur = NULL;
 }
 
+/* Set by try_handler() if a handler was skipped for lack of state space. */
+static bool_t state_short;
+
 static bool_t try_handler(struct image *im, struct slot *slot,
                           DWORD *cltbl,
-                          const struct image_handler *handler)
+                          const struct image_handler *handler,
+                          uint8_t probe)
 {
     struct image_bufs bufs = im->bufs;
+    uint16_t state_sz = im->state_sz;
     BYTE mode;
 
+    if (handler_state_size(handler) > state_sz) {
+        state_short = TRUE;
+        return FALSE;
+    }
+
     /* Reinitialise image structure, except for static buffers. */
-    memset(im, 0, sizeof(*im));
+    memset(im, 0, image_size(state_sz));
     im->bufs = bufs;
+    im->state_sz = state_sz;
     im->cur_track = ~0;
     im->slot = slot;
+    im->probe = probe;
 
     /* Sensible defaults. */
     im->sync = SYNC_mfm;
@@ -132,7 +230,84 @@ static bool_t try_handler(struct image *im, struct slot *slot,
 
 #if !defined(QUICKDISK)
 
-void image_open(struct image *im, struct slot *slot, DWORD *cltbl,
+static uint8_t probe_cache_next;
+
+static struct probe_cache *probe_cache_lookup(struct slot *slot)
+{
+    struct probe_cache *pc;
+    for (pc = &probe_cache[0]; pc < &probe_cache[PROBE_CACHE_NR]; pc++)
+        if ((pc->handler != NULL) && (pc->clust == slot->firstCluster)
+            && (pc->size == slot->size))
+            return pc;
+    return NULL;
+}
+
+static void probe_cache_insert(struct image *im, struct slot *slot)
+{
+    struct probe_cache *pc = probe_cache_lookup(slot);
+    if ((pc == NULL) && (slot->firstCluster != 0)) {
+        pc = &probe_cache[probe_cache_next++ % PROBE_CACHE_NR];
+        pc->clust = slot->firstCluster;
+        pc->size = slot->size;
+    }
+    if (pc != NULL) {
+        pc->handler = im->disk_handler;
+        pc->probe = im->probe;
+    }
+    probe_cache_cur = pc;
+}
+
+/* The handler hinted by @ext, the filename extension of an image. */
+static const struct image_handler *ext_hint(const char *ext)
+{
+    const struct image_type *type;
+    const struct image_handler *hint;
+
+    for (type = &image_type[0]; type->handler != NULL; type++)
+        if (!strcmp(ext, type->ext))
+            break;
+    hint = type->handler;
+
+    /* Apply host-specific overrides to the hint. */
+    switch (ff_cfg.host) {
+    case HOST_acorn:
+        if (hint == &adf_image_handler)
+            hint = &adfs_image_handler;
+        break;
+    case HOST_tandy_coco:
+        if (hint == &dsk_image_handler)
+            hint = &jvc_image_handler;
+        break;
+    }
+
+    return hint;
+}
+
+uint16_t image_state_size(struct slot *slot)
+{
+    char ext[sizeof(slot->type)+1];
+    const struct image_handler *hint;
+    struct probe_cache *pc;
+    unsigned int sz;
+
+    if ((pc = probe_cache_lookup(slot)) != NULL) {
+        /* The handler which opened this image last time. */
+        sz = handler_state_size(pc->handler);
+    } else {
+        /* The handler hinted by the filename extension. An image opened
+         * only by a fallback handler with larger state is reopened with
+         * IMAGE_STATE_MAX. */
+        memcpy(ext, slot->type, sizeof(slot->type));
+        ext[sizeof(slot->type)] = '\0';
+        hint = ext_hint(ext);
+        sz = (hint != NULL) ? handler_state_size(hint) : IMAGE_STATE_MAX;
+    }
+
+    /* Leave room to switch to Direct Access mode. */
+    return max_t(unsigned int, sz, sizeof(struct directaccess));
+}
+
+bool_t image_open(struct image *im, struct slot *slot, DWORD *cltbl,
         bool_t da_mode)
 {
     static const struct image_handler * const image_handlers[] = {
@@ -145,40 +320,35 @@ void image_open(struct image *im, struct slot *slot, DWORD *cltbl,
 
     char ext[sizeof(slot->type)+1];
     const struct image_handler *hint;
-    const struct image_type *type;
+    struct probe_cache *pc;
     int i;
 
+    probe_cache_cur = NULL;
+    state_short = FALSE;
+
     if (da_mode) {
-        if (try_handler(im, slot, cltbl, &da_image_handler))
-            return;
+        if (try_handler(im, slot, cltbl, &da_image_handler, 0))
+            return TRUE;
         F_die(FR_BAD_IMAGE);
     }
 
+    /* Go straight to the handler which opened this image last time. */
+    if ((pc = probe_cache_lookup(slot)) != NULL) {
+        if (try_handler(im, slot, cltbl, pc->handler, pc->probe))
+            goto found;
+        pc->handler = NULL;
+    }
+
     /* Extract filename extension (if available). */
     memcpy(ext, slot->type, sizeof(slot->type));
     ext[sizeof(slot->type)] = '\0';
 
     /* Use the extension as a hint to the correct image handler. */
-    for (type = &image_type[0]; type->handler != NULL; type++)
-        if (!strcmp(ext, type->ext))
-            break;
-    hint = type->handler;
-
-    /* Apply host-specific overrides to the hint. */
-    switch (ff_cfg.host) {
-    case HOST_acorn:
-        if (hint == &adf_image_handler)
-            hint = &adfs_image_handler;
-        break;
-    case HOST_tandy_coco:
-        if (hint == &dsk_image_handler)
-            hint = &jvc_image_handler;
-        break;
-    }
+    hint = ext_hint(ext);
 
     while (hint != NULL) {
-        if (try_handler(im, slot, cltbl, hint))
-            return;
+        if (try_handler(im, slot, cltbl, hint, 0))
+            goto found;
         /* Hint failed. Try a secondary hint. */
         if (hint == &img_image_handler) {
             /* IMG,IMA,DSK,OUT -> XDF */
@@ -194,24 +364,36 @@ void image_open(struct image *im, struct slot *slot, DWORD *cltbl,
 
     /* Filename extension hinting failed: walk the handler list. */
     for (i = 0; i < ARRAY_SIZE(image_handlers); i++) {
-        if (try_handler(im, slot, cltbl, image_handlers[i]))
-            return;
+        if (try_handler(im, slot, cltbl, image_handlers[i], 0))
+            goto found;
     }
 
-    /* No handler found: bad image. */
+    /* No handler found. Retry with full state space if any was skipped,
+     * else this is a bad image. */
+    if (state_short)
+        return FALSE;
     F_die(FR_BAD_IMAGE);
+
+found:
+    probe_cache_insert(im, slot);
+    return TRUE;
 }
 
 #else /* defined(QUICKDISK) */
 
-void image_open(struct image *im, struct slot *slot, DWORD *cltbl,
-        bool_t da_mode)
+uint16_t image_state_size(struct slot *slot)
 {
-    if (try_handler(im, slot, cltbl, &qd_image_handler))
-        return;
+    return sizeof(struct qd_image);
+}
 
+bool_t image_open(struct image *im, struct slot *slot, DWORD *cltbl,
+        bool_t da_mode)
+{
     /* No handler found: bad image. */
-    F_die(FR_BAD_IMAGE);
+    if (!try_handler(im, slot, cltbl, &qd_image_handler, 0))
+        F_die(FR_BAD_IMAGE);
+
+    return TRUE;
 }
 
 #endif
@@ -228,6 +410,7 @@ bool_t image_in_da_mode(struct image *im)
 void image_extend(struct image *im)
 {
     FSIZE_t new_sz;
+    FRESULT fr;
 
     if (!(im->disk_handler->extend && im->fp.dir_ptr && ff_cfg.extend_image))
         return;
@@ -239,10 +422,18 @@ void image_extend(struct image *im)
     /* Disable fast-seek mode, as it disallows extending the file. */
     im->fp.cltbl = NULL;
 
-    /* Attempt to extend the file. */
-    F_lseek(&im->fp, new_sz);
+    /* Attempt to extend the file in one contiguous run of clusters. Else fall
+     * back to extending it cluster by cluster. */
+    printk("Extend: %u -> %u bytes\n", f_size(&im->fp), new_sz);
+    fr = f_expand(&im->fp, new_sz, 1);
+    if (fr == FR_DENIED) {
+        printk("Extend: No contiguous free space\n");
+        F_lseek(&im->fp, new_sz);
+    } else if (fr != FR_OK) {
+        F_die(fr);
+    }
     F_sync(&im->fp);
-    if (f_tell(&im->fp) != new_sz)
+    if (f_size(&im->fp) != new_sz)
         F_die(FR_DISK_FULL);
 
     /* Update the slot for the new file size. */
@@ -290,17 +481,32 @@ void image_setup_track(
 
 bool_t image_read_track(struct image *im)
 {
-    return im->track_handler->read_track(im);
+    uint32_t t = profile_start();
+    bool_t res = im->track_handler->read_track(im);
+    profile_end(PROF_read_track, t);
+    return res;
 }
 
 uint16_t image_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
 {
-    return im->track_handler->rdata_flux(im, tbuf, nr);
+    uint32_t t = profile_start();
+    uint16_t res = im->track_handler->rdata_flux(im, tbuf, nr);
+    profile_end_n(PROF_rdata_flux, t, res);
+    return res;
 }
 
 bool_t image_write_track(struct image *im)
 {
-    return im->track_handler->write_track(im);
+    uint32_t t;
+    bool_t res;
+    if (probe_cache_cur != NULL) {
+        probe_cache_cur->handler = NULL;
+        probe_cache_cur = NULL;
+    }
+    t = profile_start();
+    res = im->track_handler->write_track(im);
+    profile_end(PROF_write_track, t);
+    return res;
 }
 
 void image_sync(struct image *im)
@@ -309,6 +515,13 @@ void image_sync(struct image *im)
         im->track_handler->sync(im);
 }
 
+void image_prefetch(struct image *im, int cyl)
+{
+    const struct image_handler *h = im->track_handler;
+    if ((h == im->disk_handler) && (h->prefetch != NULL))
+        h->prefetch(im, cyl);
+}
+
 uint32_t image_ticks_since_index(struct image *im)
 {
     uint32_t ticks = im->cur_ticks - im->ticks_since_flux;
@@ -14,7 +14,10 @@ static void raw_setup_track(
     struct image *im, uint16_t track, uint32_t *start_pos);
 static bool_t raw_read_track(struct image *im);
 static bool_t raw_write_track(struct image *im);
+static void sec_crc_invalidate(struct image *im, int sec_i);
+static void raw_encode_idams(struct image *im);
 static void raw_sync(struct image *im);
+static void raw_prefetch(struct image *im, int cyl);
 static bool_t raw_open(struct image *im);
 static void mfm_prep_track(struct image *im);
 static bool_t mfm_read_track(struct image *im);
@@ -22,6 +25,10 @@ static void fm_prep_track(struct image *im);
 static bool_t fm_read_track(struct image *im);
 static void *align_p(void *p);
 static void check_p(void *p, struct image *im);
+static void alloc_sec_offsets(struct image *im);
+static uint32_t sec_offset(struct image *im, unsigned int sec_i);
+static void build_sec_map(uint8_t *sec_map, const struct raw_trk *trk,
+                          unsigned int pos);
 
 #define SIMPLE_EMPTY_TRK 2 /* if has_empty */
 const static struct simple_layout {
@@ -66,6 +73,14 @@ static bool_t xdf_check(const struct bpb *bpb);
 
 #define BATCH_SIZE 256
 
+/* Staging space at the start of write_data, for ID and CRC fields being
+ * written. Grown to BATCH_SIZE if sector data must be staged for reads. */
+#define STAGING_MIN 32
+
+/* An image buffered whole in RAM is loaded in batches of at least this many
+ * sectors. */
+#define RESIDENT_BATCH_SECS 8
+
 #define sec_sz(n) (128u << (n))
 
 #define _IAM 1 /* IAM */
@@ -264,6 +279,190 @@ static void tag_add_layout(
     }
 }
 
+/* Split IMG.CFG section name @p at any "::<size>" suffix. Returns TRUE, with
+ * the size in *@size, if there is one. */
+static bool_t tag_split(char *p, int *size)
+{
+    char *q = p;
+    while ((q = strchr(q, ':')) != NULL) {
+        if (*++q == ':') {
+            /* Found "::<size>" */
+            *size = strtol(q+1, NULL, 10);
+            q[-1] = '\0'; /* terminate tagname string */
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Score an IMG.CFG section for the image. The best-scoring section is used,
+ * or the first of several. Sections scoring zero or less are never used. */
+static int tag_score(struct image *im, bool_t name_match, bool_t no_name,
+                     bool_t has_size, int size)
+{
+    int score = 0;
+    /* Match on size is worth less than a match on tagname.
+     * Mismatch on size clobbers the section. */
+    if (has_size)
+        score += (im_size(im) == size) ? 2 : -100;
+    if (name_match) {
+        /* Tagname match is worth the most. */
+        score += 4;
+    } else if (no_name) {
+        /* Empty (default) section is worth the least. */
+        score += 1;
+    } else {
+        /* Non-match on a non-empty tagname clobbers the section. */
+        score -= 100;
+    }
+    return score;
+}
+
+/* The sections of IMG.CFG are indexed in a file alongside it, so that
+ * tag_open() can find the section it wants without parsing the whole file. */
+#define IMGIDX_SIG 0x58494646 /* "FFIX" */
+struct imgidx_hdr {
+    uint32_t sig; /* 0 if incomplete */
+    uint32_t clust, size, mtime; /* Of the indexed IMG.CFG */
+    uint32_t nr; /* Number of sections */
+};
+struct imgidx_ent {
+    uint32_t hash; /* Of the tagname, case insensitive */
+    int32_t size;
+    uint32_t ofs; /* Of the section in IMG.CFG */
+    uint8_t has_size, no_name;
+    uint16_t pad;
+};
+
+static uint32_t tag_hash(const char *p)
+{
+    uint32_t h = 2166136261u;
+    while (*p)
+        h = (h ^ tolower(*p++)) * 16777619u;
+    return h;
+}
+
+static FRESULT img_cfg_write(FIL *fil, const void *p, UINT sz)
+{
+    UINT bw;
+    FRESULT fr = f_write(fil, p, sz, &bw);
+    return (!fr && (bw != sz)) ? FR_DISK_FULL : fr;
+}
+
+bool_t img_cfg_index(FIL *cfg, uint32_t mtime, FIL *idx, char *buf, int len)
+{
+    const static struct opt no_opts[] = { { NULL } };
+    struct opts opts = {
+        .file = cfg,
+        .opts = no_opts,
+        .arg = buf,
+        .argmax = len-1
+    };
+    struct imgidx_hdr hdr, ihdr;
+    struct imgidx_ent ent;
+    FRESULT fr;
+    UINT br;
+    int size;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.clust = cfg->obj.sclust;
+    hdr.size = f_size(cfg);
+    hdr.mtime = mtime;
+
+    /* Is the existing index up to date? */
+    fr = f_open(idx, IMG_CFG_INDEX_NAME, FA_READ);
+    if (!fr) {
+        fr = f_read(idx, &ihdr, sizeof(ihdr), &br);
+        (void)f_close(idx);
+        if (!fr && (br == sizeof(ihdr)) && (ihdr.sig == IMGIDX_SIG)
+            && !memcmp(&ihdr.clust, &hdr.clust, 3*sizeof(uint32_t))
+            && (f_size(idx) == sizeof(ihdr) + ihdr.nr * sizeof(ent)))
+            return TRUE;
+    }
+
+    if (volume_readonly())
+        return FALSE;
+
+    fr = f_open(idx, IMG_CFG_INDEX_NAME, FA_CREATE_ALWAYS | FA_WRITE);
+    if (fr)
+        goto out;
+    fr = img_cfg_write(idx, &hdr, sizeof(hdr));
+
+    F_lseek(cfg, 0);
+    memset(&ent, 0, sizeof(ent));
+    while (!fr && (get_next_opt(&opts) != OPT_eof)) {
+        /* We were given no options, so get only sections. */
+        ent.ofs = opts.ofs;
+        ent.has_size = tag_split(buf, &size);
+        ent.size = ent.has_size ? size : 0;
+        ent.no_name = (*buf == '\0');
+        ent.hash = tag_hash(buf);
+        fr = img_cfg_write(idx, &ent, sizeof(ent));
+        hdr.nr++;
+    }
+
+    if (!fr) {
+        hdr.sig = IMGIDX_SIG;
+        fr = f_lseek(idx, 0);
+        if (!fr)
+            fr = img_cfg_write(idx, &hdr, sizeof(hdr));
+    }
+    if (!fr)
+        fr = f_close(idx);
+    else
+        (void)f_close(idx);
+
+out:
+    printk("IMG.CFG: %u sections: %s (%d)\n",
+           hdr.nr, fr ? "Index failed" : "Indexed", fr);
+    if (fr)
+        (void)f_unlink(IMG_CFG_INDEX_NAME);
+    return !fr;
+}
+
+/* Find the IMG.CFG section which tag_open() will use, via the index. Returns
+ * the section's offset in IMG.CFG, with its score in *@p_score, or TAG_none
+ * if there is no such section, or TAG_unindexed if there is no index. */
+#define TAG_none      -1
+#define TAG_unindexed -2
+static int tag_lookup(struct image *im, const char *tag, int *p_score,
+                      FIL *fil, struct slot *slot, char *buf, int len)
+{
+    struct imgidx_ent *ent = (struct imgidx_ent *)buf;
+    struct imgidx_hdr hdr;
+    uint32_t hash = tag ? tag_hash(tag) : 0;
+    int i, j, n, score, ofs = TAG_none;
+
+    if (!get_img_cfg_index(slot))
+        return TAG_unindexed;
+
+    fatfs_from_slot(fil, slot, FA_READ);
+    F_read(fil, &hdr, sizeof(hdr), NULL);
+    if ((hdr.sig != IMGIDX_SIG)
+        || (f_size(fil) != sizeof(hdr) + hdr.nr * sizeof(*ent))) {
+        ofs = TAG_unindexed;
+        goto out;
+    }
+
+    *p_score = 0;
+    for (i = 0; i < hdr.nr; i += n) {
+        n = min_t(int, hdr.nr - i, len / sizeof(*ent));
+        F_read(fil, ent, n * sizeof(*ent), NULL);
+        for (j = 0; j < n; j++) {
+            score = tag_score(im, tag && (ent[j].hash == hash),
+                              ent[j].no_name, ent[j].has_size, ent[j].size);
+            if (score > *p_score) {
+                *p_score = score;
+                ofs = ent[j].ofs;
+            }
+        }
+    }
+
+out:
+    F_close(fil);
+    return ofs;
+}
+
 static bool_t tag_open(struct image *im, char *tag)
 {
     enum {
@@ -307,7 +506,7 @@ static bool_t tag_open(struct image *im, char *tag)
         [IMGCFG_file_layout] = { "file-layout" },
     };
 
-    int match, active, option, nr_t = 0;
+    int match, active, option, nr_t = 0, ofs, score = 0;
     struct simple_layout t_layout, d_layout;
     struct {
         FIL file;
@@ -324,14 +523,28 @@ static bool_t tag_open(struct image *im, char *tag)
     if (!get_img_cfg(&heap->slot))
         return FALSE;
 
+    /* Go straight to the section given by the index, if there is one. */
+    ofs = tag_lookup(im, tag, &score, &heap->file, &heap->slot,
+                     heap->buf, sizeof(heap->buf));
+    if (ofs == TAG_none)
+        return FALSE;
+
+    get_img_cfg(&heap->slot);
     fatfs_from_slot(&heap->file, &heap->slot, FA_READ);
+    if (ofs >= 0)
+        F_lseek(&heap->file, ofs);
 
     match = active = 0;
 
     while ((option = get_next_opt(&opts)) != OPT_eof) {
 
         if (option == OPT_section) {
-            char *p, *q;
+            bool_t has_size;
+            int size;
+            char *p;
+            /* An indexed section is done at the next section. */
+            if ((ofs >= 0) && match)
+                break;
             /* New section: Finalise any currently-active section. */
             if (active) {
                 tag_add_layout(im, &t_layout, nr_t);
@@ -339,27 +552,16 @@ static bool_t tag_open(struct image *im, char *tag)
                 active = 0;
             }
             /* Parse the tag name and optional size following "::". */
-            p = q = opts.arg;
-            while ((q = strchr(q, ':')) != NULL) {
-                if (*++q == ':') {
-                    /* Found "::<size>" */
-                    int size = strtol(q+1, NULL, 10);
-                    /* Match on size is worth less than a match on tagname.
-                     * Mismatch on size clobbers the section. */
-                    active += (im_size(im) == size) ? 2 : -100;
-                    q[-1] = '\0'; /* terminate tagname string */
-                    break;
-                }
-            }
-            if (tag && !strcmp_ci(p, tag)) {
-                /* Tagname match is worth the most. */
-                active += 4;
-            } else if (*p == '\0') {
-                /* Empty (default) section is worth the least. */
-                active += 1;
-            } else {
-                /* Non-match on a non-empty tagname clobbers the section. */
-                active -= 100;
+            p = opts.arg;
+            has_size = tag_split(p, &size);
+            active = tag_score(im, tag && !strcmp_ci(p, tag), *p == '\0',
+                               has_size, size);
+            if ((ofs >= 0) && (active != score)) {
+                /* Index does not match IMG.CFG: Parse the whole file. */
+                ofs = TAG_unindexed;
+                active = 0;
+                F_lseek(&heap->file, 0);
+                continue;
             }
             if (active > match) {
                 /* Best score so far: Process the section. */
@@ -490,15 +692,30 @@ static bool_t tag_open(struct image *im, char *tag)
     return match ? raw_open(im) : FALSE;
 }
 
+/* Probes tried by img_open(), in order. */
+#define IMG_PROBE_tag     1
+#define IMG_PROBE_host    2
+#define IMG_PROBE_default 3
+
 static bool_t img_open(struct image *im)
 {
     const struct raw_type *type;
+    uint8_t probe = im->probe;
     char *dot;
 
+    /* Skip any probes which failed when this image was last opened. */
+    if (probe == IMG_PROBE_default)
+        goto fallback;
+    if (probe == IMG_PROBE_host)
+        goto host;
+
+    im->probe = IMG_PROBE_tag;
     dot = strrchr(im->slot->name, '.');
     if (tag_open(im, dot ? dot+1 : NULL))
         return TRUE;
 
+host:
+    im->probe = IMG_PROBE_host;
     switch (ff_cfg.host) {
     case HOST_akai:
     case HOST_gem:
@@ -550,6 +767,7 @@ static bool_t img_open(struct image *im)
 
 fallback:
     /* Fall back to default list. */
+    im->probe = IMG_PROBE_default;
     reset_all_params(im);
     return raw_type_open(im, img_type);
 }
@@ -1299,6 +1517,7 @@ struct xdf_format {
 
 struct xdf_info {
     uint32_t *file_sec_offsets[4]; /* C0H0 C0H1 CnH0 CnH1 */
+    uint8_t *sec_map[4]; /* Rotational order of each track layout */
     const struct xdf_format *fmt;
     uint32_t cyl_bytes;
 };
@@ -1346,7 +1565,7 @@ static bool_t xdf_open(struct image *im)
     const struct xdf_format *fmt;
     struct raw_sec *sec;
     struct raw_trk *trk;
-    uint8_t *trk_map;
+    uint8_t *trk_map, *sec_map;
     struct bpb bpb;
     uint32_t *offs, *off;
 
@@ -1408,7 +1627,9 @@ found:
     /* File sector offsets: Dummy non-NULL until xdf_setup_track(). */
     im->img.file_sec_offsets = (uint32_t *)0xdeadbeef;
 
-    offs = off = (uint32_t *)align_p(im->img.heap_bottom)
+    sec_map = (uint8_t *)im->img.heap_bottom
+        - 2*fmt->sec_per_track0 - 2*fmt->sec_per_trackN;
+    offs = off = (uint32_t *)align_p(sec_map)
         - 2*fmt->sec_per_track0 - 2*fmt->sec_per_trackN;
     xdf_info = (struct xdf_info *)offs - 1;
     check_p(xdf_info, im);
@@ -1416,6 +1637,15 @@ found:
     xdf_info->fmt = fmt;
     xdf_info->cyl_bytes = fmt->logical_sec_per_track * 2 * 512;
 
+    /* The four layouts have no skew, so their sector maps are fixed: The
+     * host can step between cylinders without them being recomputed. */
+    for (i = 0; i < 4; i++) {
+        trk = &im->img.trk_info[i];
+        build_sec_map(sec_map, trk, 0);
+        xdf_info->sec_map[i] = sec_map;
+        sec_map += trk->nr_sectors;
+    }
+
     /* Cyl 0 Image Layout (Thanks to fdutils/xdfcopy!):
      *   FS   Desc.    #secs-in-image  #secs-on-disk
      *   MAIN Boot     1               1
@@ -1479,6 +1709,7 @@ static void xdf_setup_track(
     im->img.trk_off = (track>>1) * xdf_info->cyl_bytes;
     im->img.trk_len = xdf_info->cyl_bytes;
     im->img.file_sec_offsets = xdf_info->file_sec_offsets[offs_sel];
+    im->img.sec_map = xdf_info->sec_map[offs_sel];
 
     raw_setup_track(im, track, start_pos);
 }
@@ -1490,6 +1721,7 @@ const struct image_handler img_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1500,6 +1732,7 @@ const struct image_handler d81_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1510,6 +1743,7 @@ const struct image_handler st_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1520,6 +1754,7 @@ const struct image_handler adfs_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1530,6 +1765,7 @@ const struct image_handler atr_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1540,6 +1776,7 @@ const struct image_handler mbd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1550,6 +1787,7 @@ const struct image_handler mgt_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1560,6 +1798,7 @@ const struct image_handler pc98fdi_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1570,6 +1809,7 @@ const struct image_handler pc98hdm_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1581,6 +1821,7 @@ const struct image_handler trd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1591,6 +1832,7 @@ const struct image_handler opd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1602,6 +1844,7 @@ const struct image_handler ssd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1613,6 +1856,7 @@ const struct image_handler dsd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1623,6 +1867,7 @@ const struct image_handler sdu_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1633,6 +1878,7 @@ const struct image_handler jvc_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1643,6 +1889,7 @@ const struct image_handler vdk_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1653,6 +1900,7 @@ const struct image_handler ti99_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1663,6 +1911,7 @@ const struct image_handler xdf_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
 };
 
@@ -1734,6 +1983,60 @@ static unsigned int calc_track_off(
     return off;
 }
 
+/* Fill @sec_map with the logical sector numbers of track @trk in rotational
+ * order, starting with the first logical sector at position @pos. */
+static void build_sec_map(uint8_t *sec_map, const struct raw_trk *trk,
+                          unsigned int pos)
+{
+    unsigned int i;
+
+    memset(sec_map, 0xff, trk->nr_sectors);
+    for (i = 0; i < trk->nr_sectors; i++) {
+        while (sec_map[pos] != 0xff)
+            pos = (pos + 1) % trk->nr_sectors;
+        sec_map[pos] = i;
+        pos = (pos + trk->interleave) % trk->nr_sectors;
+    }
+}
+
+/* Write-back deferral for the track ring. With write-drain=instant the host
+ * expects the drive to be ready as soon as its write ends, so each sector is
+ * written back as soon as it is received, leaving little to flush on a seek. */
+static uint16_t raw_write_defer_ms(void)
+{
+    return (ff_cfg.write_drain == WDRAIN_instant) ? 0 : RING_IO_WRITE_DEFER_MS;
+}
+
+/* Speculatively prefetch the given cylinder, predicted to be the host's next
+ * seek target. */
+static void raw_prefetch_cyl(struct image *im, int cyl)
+{
+    uint32_t off, end;
+
+    if ((cyl < 0) || (cyl >= im->nr_cyls) || im->img.file_sec_offsets)
+        return;
+
+    off = calc_track_off(im, cyl, 0);
+    end = off + calc_track_len(im, cyl, 0);
+    if (im->nr_sides > 1) {
+        uint32_t off1 = calc_track_off(im, cyl, 1);
+        off = min(off, off1);
+        end = max(end, off1 + calc_track_len(im, cyl, 1));
+    }
+    off &= ~511;
+    end = (end + 511) & ~511;
+
+    ring_io_prefetch(&im->img.ring_io, off, end - off);
+}
+
+static void raw_prefetch(struct image *im, int cyl)
+{
+    if (im->img.resident)
+        return;
+    raw_prefetch_cyl(im, cyl);
+    ring_io_progress(&im->img.ring_io);
+}
+
 static void raw_seek_track(
     struct image *im, uint16_t track, unsigned int cyl, unsigned int side)
 {
@@ -1744,6 +2047,8 @@ static void raw_seek_track(
     uint32_t shadow_trk_off = 0, shadow_trk_len = 0;
 
     im->cur_track = track;
+    track_render_invalidate(im);
+    sec_crc_invalidate(im, -1);
 
     /* Update image structure with info for this track. */
     trk = &im->img.trk_info[im->img.trk_map[cyl*im->nr_sides + side]];
@@ -1753,15 +2058,19 @@ static void raw_seek_track(
     trk->rpm = trk->rpm ?: 300;
     im->stk_per_rev = (stk_ms(200) * 300) / trk->rpm;
 
-    if (trk->nr_sectors != 0) {
-        /* Create logical sector map in rotational order. */
-        memset(im->img.sec_map, 0xff, trk->nr_sectors);
+    if ((trk->nr_sectors != 0) && (im->img.file_sec_offsets == NULL)) {
+        /* Create logical sector map in rotational order. XDF instead points
+         * sec_map at maps precomputed by xdf_open(). */
         pos = ((cyl*trk->cskew) + (side*trk->hskew)) % trk->nr_sectors;
+        build_sec_map(im->img.sec_map, trk, pos);
+    }
+
+    if (im->img.file_sec_offsets == NULL) {
+        /* Prefix sums of sector sizes, so finding sector data is O(1). */
+        uint32_t off = 0;
         for (i = 0; i < trk->nr_sectors; i++) {
-            while (im->img.sec_map[pos] != 0xff)
-                pos = (pos + 1) % trk->nr_sectors;
-            im->img.sec_map[pos] = i;
-            pos = (pos + trk->interleave) % trk->nr_sectors;
+            im->img.sec_offsets[i] = off;
+            off += sec_sz(im->img.sec_info[i].n);
         }
     }
 
@@ -1771,17 +2080,26 @@ static void raw_seek_track(
     } else {
         mfm_prep_track(im);
     }
+    raw_encode_idams(im);
 
     if (im->img.file_sec_offsets != NULL) {
         /* Assume xdf, where track offset is the same for both side. */
         trk_off = im->img.trk_off;
         trk_len = im->img.trk_len;
     } else {
-        trk_off = calc_track_off(im, cyl, 0);
-        trk_len = calc_track_len(im, cyl, 0);
+        /* On-disk location of both sides is cached for the current cylinder,
+         * so that a change of head does not recalculate it. */
+        if (old_track >> 1 != cyl) {
+            for (i = 0; i < im->nr_sides; i++) {
+                im->img.cyl_trk_off[i] = calc_track_off(im, cyl, i);
+                im->img.cyl_trk_len[i] = calc_track_len(im, cyl, i);
+            }
+        }
+        trk_off = im->img.cyl_trk_off[0];
+        trk_len = im->img.cyl_trk_len[0];
         if (im->nr_sides > 1) {
-            shadow_trk_off = calc_track_off(im, cyl, 1);
-            shadow_trk_len = calc_track_len(im, cyl, 1);
+            shadow_trk_off = im->img.cyl_trk_off[1];
+            shadow_trk_len = im->img.cyl_trk_len[1];
         }
 
         im->img.shadow = side > 0;
@@ -1805,23 +2123,35 @@ static void raw_seek_track(
     shadow_trk_len = (shadow_trk_len + 511) & ~511;
 
     if (shadow_trk_len) {
-        bool_t disable_shadow = FALSE;
+        bool_t disable_shadow = FALSE, overlap;
+        /* Span of the whole cylinder, if both sides are stored together. */
+        uint32_t cyl_off = min(trk_off, shadow_trk_off);
+        uint32_t cyl_len = max(trk_off + trk_len,
+                               shadow_trk_off + shadow_trk_len) - cyl_off;
         trk_len = shadow_trk_len = max_t(uint32_t, trk_len, shadow_trk_len);
 
         /* Check if both sides fit in memory. We want to fully-buffer at least
          * the current side. */
         disable_shadow |= im->img.track_data.len < trk_len*2;
         /* Check if the two sides overlap, which would confuse the ring. This
-         * implies tracks are not 512-byte aligned which we choose not to
-         * bother optimizing. */
+         * implies tracks are not 512-byte aligned. */
         if (trk_off < shadow_trk_off)
-            disable_shadow |= trk_off + trk_len > shadow_trk_off;
+            overlap = trk_off + trk_len > shadow_trk_off;
         else
-            disable_shadow |= shadow_trk_off + shadow_trk_len > trk_off;
+            overlap = shadow_trk_off + shadow_trk_len > trk_off;
+        disable_shadow |= overlap;
         /* ED rate stresses reads too much to use shadow ring. */
         disable_shadow |= trk->data_rate == /*ED*/ 1000;
-        if (disable_shadow) {
-            if (side > 1) {
+        if (disable_shadow && overlap && (trk->data_rate != /*ED*/ 1000)
+            && (cyl_len <= im->img.track_data.len)) {
+            /* Dual-head buffering: A single ring spans both sides of the
+             * cylinder, so a head change merely seeks within the ring. */
+            trk_off = cyl_off;
+            trk_len = cyl_len;
+            shadow_trk_off = shadow_trk_len = 0;
+            im->img.shadow = FALSE;
+        } else if (disable_shadow) {
+            if (side > 0) {
                 trk_off = shadow_trk_off;
                 trk_len = shadow_trk_len;
             }
@@ -1831,13 +2161,37 @@ static void raw_seek_track(
         }
     }
 
-    if (old_track >> 1 != track >> 1) {
+    if (im->img.resident) {
+        /* The ring holds the whole image. */
+        trk_off = shadow_trk_off = shadow_trk_len = 0;
+        im->img.shadow = FALSE;
+    }
+
+    /* Offset of this side's track data within its ring_io window. */
+    im->img.trk_ring_off = im->img.trk_off
+        - (im->img.shadow ? shadow_trk_off : trk_off);
+
+    if (im->img.resident) {
+        /* No reads on a seek. Deferred writes are flushed, so that ring_io
+         * only ever tracks writes to the current cylinder. */
+        if (old_track >> 1 != track >> 1)
+            ring_io_writeback(&im->img.ring_io);
+    } else if (old_track >> 1 != track >> 1) {
         FSIZE_t shadow_off = shadow_trk_len > 0 ? shadow_trk_off : ~0;
-        ring_io_sync(&im->img.ring_io);
+        ring_io_writeback(&im->img.ring_io);
         ring_io_shutdown(&im->img.ring_io);
         ring_io_init(&im->img.ring_io, &im->fp, &im->img.track_data,
                 trk_off, shadow_off, trk_len / 512);
-        im->img.ring_io.batch_secs = 2;
+        im->img.ring_io.batch_secs = ring_io_batch_secs(
+            (sysclk_us(500) / trk->data_rate) * 16);
+        /* Keep the block behind the consumer: The encoder reads the most
+         * recently fetched batch in place. */
+        im->img.ring_io.trailing_secs = 1;
+        /* Write back only sectors whose contents change, once the host has
+         * stopped rewriting them or seeks away. */
+        im->img.ring_io.explicit_changes = TRUE;
+        im->img.ring_io.write_defer_ms = raw_write_defer_ms();
+        raw_prefetch_cyl(im, cyl + (im->step_dir ?: 1));
     }
 }
 
@@ -1919,6 +2273,7 @@ static void raw_setup_track(
         raw_seek_track(im, track, cyl, side);
 
     im->img.write_sector = -1;
+    im->img.crc_sec = -1;
 
     im->cur_bc = (sys_ticks * 16) / im->ticks_per_cell;
     im->cur_bc &= ~15;
@@ -1931,20 +2286,149 @@ static void raw_setup_track(
     bc->prod = bc->cons = 0;
 
     if (start_pos) {
-        decode_off = calc_start_pos(im);
-
-        im->img.trash_bc = decode_off * 16;
+        int32_t bc = im->cur_bc - im->img.track_delay_bc;
+        if (bc < 0)
+            bc += im->tracklen_bc;
+        if (track_render_seek(im, bc)) {
+            /* Replay from the pre-rendered track. */
+            im->img.trash_bc = bc % 16;
+        } else {
+            decode_off = calc_start_pos(im);
+            im->img.trash_bc = decode_off * 16;
+        }
         *start_pos = sys_ticks;
     } else {
         im->img.decode_pos = 0;
     }
 }
 
+/* Pre-rendered track buffer: Sized for an HD track if possible, but must not
+ * squeeze track data below what is needed for both sides of an HD track. */
+#define RENDER_MAX_BYTES (200000/8)
+#define RENDER_MIN_BYTES (100000/8)
+#define RENDER_MIN_TRACK_DATA (2*18*512)
+
+/* One data-field CRC per sector of the current track. */
+#define SEC_CRC_BYTES (256*2)
+
+/* Pre-encoded ID fields (C,H,R,N,CRC), IDAM_WORDS bitcell words per sector. */
+#define IDAM_WORDS 6
+#define IDAM_BYTES (256*IDAM_WORDS*2)
+
+static void raw_encode_idams(struct image *im)
+{
+    struct raw_trk *trk = im->img.trk;
+    struct raw_sec *sec = im->img.sec_info;
+    uint16_t *p = im->img.idam_bc, crc;
+    uint8_t c = im->cur_track/2;
+    uint8_t h = trk->head ? trk->head-1 : im->cur_track&1;
+    unsigned int i, j;
+
+    if (p == NULL)
+        return;
+
+    for (i = 0; i < trk->nr_sectors; i++, sec++, p += IDAM_WORDS) {
+        uint8_t idam[10] = { 0xa1, 0xa1, 0xa1, 0xfe, c, h, sec->r, sec->n };
+        if (trk->is_fm) {
+            crc = crc16_ccitt(&idam[3], 5, 0xffff);
+            idam[8] = crc >> 8;
+            idam[9] = crc;
+            for (j = 0; j < IDAM_WORDS; j++)
+                p[j] = htobe16(mfmtab[idam[4+j]] | 0xaaaa);
+        } else {
+            crc = crc16_ccitt(idam, 8, 0xffff);
+            idam[8] = crc >> 8;
+            idam[9] = crc;
+            mfm_encode(p, mfmtab[0xfe], &idam[4], IDAM_WORDS);
+        }
+    }
+}
+
+static void sec_crc_invalidate(struct image *im, int sec_i)
+{
+    if (sec_i < 0)
+        memset(im->img.sec_crc_valid, 0, sizeof(im->img.sec_crc_valid));
+    else
+        im->img.sec_crc_valid[sec_i/32] &= ~(1u << (sec_i&31));
+}
+
+static bool_t sec_crc_is_valid(struct image *im, unsigned int sec_i)
+{
+    return (im->img.sec_crc != NULL)
+        && (im->img.sec_crc_valid[sec_i/32] & (1u << (sec_i&31)));
+}
+
+/* End of sector @sec_i's data field: Either pick up its cached CRC, or cache
+ * the CRC we accumulated (only possible if we generated the DAM). */
+static void sec_crc_done(struct image *im, unsigned int sec_i)
+{
+    if (sec_crc_is_valid(im, sec_i)) {
+        im->img.crc = im->img.sec_crc[sec_i];
+    } else if ((im->img.sec_crc != NULL) && (im->img.crc_sec == sec_i)) {
+        im->img.sec_crc[sec_i] = im->img.crc;
+        im->img.sec_crc_valid[sec_i/32] |= 1u << (sec_i&31);
+    }
+    im->img.crc_sec = -1;
+}
+
 static bool_t raw_open(struct image *im)
 {
-    im->img.track_data.p = im->bufs.write_data.p + BATCH_SIZE;
+    unsigned int i, staging = STAGING_MIN;
+    int render_len;
+    FSIZE_t len;
+
+    if (im->img.file_sec_offsets == NULL)
+        alloc_sec_offsets(im);
+
+    /* Sector data is encoded in place from the track_data ring, unless some
+     * track needs process_data() to transform a staged copy. */
+    for (i = 0; i < im->nr_cyls*im->nr_sides; i++)
+        if (im->img.trk_info[im->img.trk_map[i]].invert_data)
+            staging = BATCH_SIZE;
+    im->img.track_data.p = im->bufs.write_data.p + staging;
     im->img.track_data.len = im->img.heap_bottom - im->img.track_data.p;
 
+    render_len = min_t(int, RENDER_MAX_BYTES,
+                       im->img.track_data.len - RENDER_MIN_TRACK_DATA) & ~3;
+    if (ff_cfg.track_cache && (ram_kb >= 64)
+        && (render_len >= RENDER_MIN_BYTES)) {
+        im->img.track_data.len -= render_len;
+        track_render_init(im, im->img.track_data.p + im->img.track_data.len,
+                          render_len);
+    }
+
+    /* Sector CRC cache, if it fits without squeezing track data. */
+    im->img.sec_crc = NULL;
+    if (im->img.track_data.len >= RENDER_MIN_TRACK_DATA + SEC_CRC_BYTES) {
+        im->img.track_data.len -= SEC_CRC_BYTES;
+        im->img.sec_crc = (uint16_t *)(im->img.track_data.p
+                                       + im->img.track_data.len);
+    }
+
+    /* Pre-encoded ID fields, likewise. */
+    im->img.idam_bc = NULL;
+    if (im->img.track_data.len >= RENDER_MIN_TRACK_DATA + IDAM_BYTES) {
+        im->img.track_data.len -= IDAM_BYTES;
+        im->img.idam_bc = (uint16_t *)(im->img.track_data.p
+                                       + im->img.track_data.len);
+    }
+
+    /* An image small enough is buffered whole, in a single ring. Seeks are
+     * then served from RAM. Allow for the image being extended. */
+    len = max_t(FSIZE_t, f_size(&im->fp), raw_extend(im));
+    len = (len + 511) & ~511;
+    im->img.resident = (len <= im->img.track_data.len)
+        && (len <= RING_IO_MAX_RING_LEN);
+    if (im->img.resident) {
+        ring_io_init(&im->img.ring_io, &im->fp, &im->img.track_data,
+                     0, ~0, len / 512);
+        /* Load the image in large reads. */
+        im->img.ring_io.batch_secs = RESIDENT_BATCH_SECS;
+        im->img.ring_io.explicit_changes = TRUE;
+        im->img.ring_io.write_defer_ms = raw_write_defer_ms();
+        printk("IMG: %u kB image is RAM resident\n", len / 1024);
+    }
+
     /* Initialise write_bc_ticks (used by floppy_insert to set outp_hden). */
     im->cur_track = ~0;
     raw_seek_track(im, 0, 0, 0);
@@ -1968,7 +2452,32 @@ void process_data(struct image *im, void *p, unsigned int len)
 
 static bool_t raw_read_track(struct image *im)
 {
-    return (im->sync == SYNC_fm) ? fm_read_track(im) : mfm_read_track(im);
+    struct image_buf *bc = &im->bufs.read_bc;
+    uint32_t bc_prod = bc->prod;
+    bool_t track_start, progress;
+
+    if (im->render.state == RENDER_valid) {
+        /* Keep background I/O (including prefetch) moving. */
+        ring_io_progress(&im->img.ring_io);
+        progress = track_render_replay(im);
+        if (im->img.trash_bc) {
+            uint16_t to_consume = min_t(uint32_t, bc->prod - bc->cons,
+                                        im->img.trash_bc);
+            im->img.trash_bc -= to_consume;
+            bc->cons += to_consume;
+        }
+        return progress;
+    }
+
+    /* Does this call emit bitcells from the start of the track? */
+    track_start = (im->img.decode_pos == 0)
+        || ((im->img.decode_pos == 1) && (im->img.idx_sz == 0));
+
+    progress = (im->sync == SYNC_fm) ? fm_read_track(im) : mfm_read_track(im);
+    if (progress)
+        track_render_capture(im, bc_prod, track_start);
+
+    return progress;
 }
 
 static int raw_find_first_write_sector(
@@ -2000,6 +2509,34 @@ static int raw_find_first_write_sector(
     return *sec_map;
 }
 
+/* Decode @nr bytes of sector data at @c in the write bitcell ring, into the
+ * track ring at its write cursor. Hosts often rewrite a track to change only
+ * one sector: Ring sectors left unchanged are not written back. */
+static void raw_write_data(struct image *im, const uint16_t *buf,
+                           unsigned int bufmask, uint32_t c, unsigned int nr)
+{
+    struct image_buf *td = &im->img.track_data;
+    uint32_t tmp[8], pos = td->cons;
+    uint8_t *p = td->p + ring_io_idx(&im->img.ring_io, pos);
+    unsigned int n;
+
+    while (nr != 0) {
+        n = min_t(unsigned int, nr, sizeof(tmp));
+        n = min_t(unsigned int, n, 512 - pos % 512);
+        mfm_ring_to_bin(buf, bufmask, c, tmp, n);
+        im->img.crc = crc16_ccitt(tmp, n, im->img.crc);
+        process_data(im, tmp, n);
+        if (memcmp(p, tmp, n)) {
+            memcpy(p, tmp, n);
+            ring_io_changed(&im->img.ring_io, pos);
+        }
+        c += n;
+        p += n;
+        pos += n;
+        nr -= n;
+    }
+}
+
 static bool_t raw_write_track(struct image *im)
 {
     bool_t flush;
@@ -2014,6 +2551,9 @@ static bool_t raw_write_track(struct image *im)
     struct raw_sec *sec;
     unsigned int i;
 
+    /* Rendered bitcells are stale once the track is written. */
+    track_render_invalidate(im);
+
     /* If we are processing final data then use the end index, rounded up. */
     barrier();
     flush = (im->wr_cons != im->wr_bc);
@@ -2057,15 +2597,17 @@ static bool_t raw_write_track(struct image *im)
                 break;
             if (im->sync == SYNC_fm) {
                 wrbuf[0] = 0xfe;
-                for (i = 1; i < 7; i++)
-                    wrbuf[i] = mfmtobin(buf[c++ & bufmask]);
+                mfm_ring_to_bin(buf, bufmask, c, &wrbuf[1], 6);
+                c += 6;
+                i = 7;
                 idam_r = wrbuf[3];
             } else { /* MFM */
                 for (i = 0; i < 3; i++)
                     wrbuf[i] = 0xa1;
                 wrbuf[i++] = 0xfe;
-                for (; i < 10; i++)
-                    wrbuf[i] = mfmtobin(buf[c++ & bufmask]);
+                mfm_ring_to_bin(buf, bufmask, c, &wrbuf[i], 6);
+                c += 6;
+                i += 6;
                 idam_r = wrbuf[6];
             }
             crc = crc16_ccitt(wrbuf, i, 0xffff);
@@ -2114,17 +2656,10 @@ static bool_t raw_write_track(struct image *im)
                 im->img.crc = (im->sync == SYNC_fm) ? FM_DAM_CRC : MFM_DAM_CRC;
 
                 sec = &im->img.sec_info[sec_nr];
-
-                if (im->img.file_sec_offsets) {
-                    off = im->img.file_sec_offsets[sec_nr];
-                } else {
-                    sec = im->img.sec_info;
-                    for (i = off = 0; i < sec_nr; i++)
-                        off += sec_sz(sec++->n);
-                }
-                off += im->img.trk_off % 512;
+                off = sec_offset(im, sec_nr) + im->img.trk_ring_off;
                 ring_io_seek(&im->img.ring_io, off, TRUE, im->img.shadow);
                 printk("Write %u[%02x]/%u\n", sec_nr, sec->r, trk->nr_sectors);
+                sec_crc_invalidate(im, sec_nr);
             }
 
             if (im->img.decode_data_pos < sec_sz) {
@@ -2143,14 +2678,10 @@ static bool_t raw_write_track(struct image *im)
                 if (td->cons + nr > td->prod)
                     break;
 
-                mfm_ring_to_bin(buf, bufmask, c, td->p + idx, nr);
+                raw_write_data(im, buf, bufmask, c, nr);
                 c += nr;
-                im->img.crc = crc16_ccitt(td->p + idx, nr, im->img.crc);
-                process_data(im, td->p + idx, nr);
                 td->cons += nr;
                 im->img.decode_data_pos += nr;
-                if (im->img.decode_data_pos == sec_sz)
-                    ring_io_flush(&im->img.ring_io);
             }
 
             if (im->img.decode_data_pos < sec_sz)
@@ -2163,11 +2694,18 @@ static bool_t raw_write_track(struct image *im)
             im->img.crc = crc16_ccitt(wrbuf, 2, im->img.crc);
             if (im->img.crc != 0)
                 printk("IMG Bad CRC: %04x\n", im->img.crc);
+            /* Sector complete: Queue its write-back now, rather than when
+             * the write gate drops. */
+            ring_io_flush(&im->img.ring_io);
             im->img.write_sector = -2;
             im->img.decode_pos = 0;
         }
     }
 
+    /* Write complete: Queue any sector it cut short. */
+    if (flush)
+        ring_io_flush(&im->img.ring_io);
+
     ring_io_progress(&im->img.ring_io);
     wr->cons = c * 16;
     return flush;
@@ -2209,11 +2747,19 @@ static void raw_dump_info(struct image *im)
         printk("\n");
 }
 
+/* Offset of the data of sector @sec_i from the start of the track. */
+static uint32_t sec_offset(struct image *im, unsigned int sec_i)
+{
+    return im->img.file_sec_offsets
+        ? im->img.file_sec_offsets[sec_i] : im->img.sec_offsets[sec_i];
+}
+
 static void img_fetch_data(struct image *im)
 {
     struct image_buf *rd = &im->bufs.read_data;
     uint8_t *buf = rd->p;
-    struct raw_sec *sec, *s;
+    struct raw_sec *sec;
+    unsigned int i;
     uint8_t sec_i;
     uint16_t off, len;
 
@@ -2223,20 +2769,13 @@ static void img_fetch_data(struct image *im)
     sec_i = im->img.sec_map[im->img.trk_sec];
     sec = &im->img.sec_info[sec_i];
 
-    if (im->img.file_sec_offsets) {
-        off = im->img.file_sec_offsets[sec_i];
-    } else {
-        off = 0;
-        for (s = im->img.sec_info; s != sec; s++)
-            off += sec_sz(s->n);
-    }
-
+    off = sec_offset(im, sec_i);
     len = sec_sz(sec->n);
 
     off += im->img.rd_sec_pos * BATCH_SIZE;
     len -= im->img.rd_sec_pos * BATCH_SIZE;
 
-    off += im->img.trk_off % 512;
+    off += im->img.trk_ring_off;
     ring_io_seek(&im->img.ring_io, off, FALSE, im->img.shadow);
     ring_io_progress(&im->img.ring_io);
 
@@ -2255,17 +2794,34 @@ static void img_fetch_data(struct image *im)
             im->img.trk_sec = 0;
     }
 
-    for (uint16_t todo = len; todo > 0;) {
+    /* The encoder reads the batch in place, so it must not be recycled by
+     * ring_io before it is consumed: See trailing_secs. */
+    for (i = 0; i < 2; i++) {
         uint32_t idx = ring_io_idx(&im->img.ring_io, im->img.track_data.cons);
         uint32_t idxend = ring_io_idxend(&im->img.ring_io);
-        uint16_t tocopy = min_t(uint16_t, todo, idxend - idx);
+        uint16_t n = min_t(uint16_t, len, idxend - idx);
         ASSERT(idx % 4 == 0);
-        ASSERT(tocopy % 32 == 0);
-        memcpy_fast(buf, im->img.track_data.p + idx, tocopy);
-        im->img.track_data.cons += tocopy;
-        todo -= tocopy;
+        im->img.batch_p[i] = im->img.track_data.p + idx;
+        im->img.batch_len[i] = n;
+        im->img.track_data.cons += n;
+        len -= n;
+    }
+    ASSERT(len == 0);
+
+    if (im->img.trk->invert_data) {
+        /* Transform a copy, as the ring may be written back to the file. */
+        for (i = 0, len = 0; i < 2; i++) {
+            if (im->img.batch_len[i] == 0)
+                continue;
+            ASSERT(im->img.batch_len[i] % 32 == 0);
+            memcpy_fast(buf + len, im->img.batch_p[i], im->img.batch_len[i]);
+            len += im->img.batch_len[i];
+        }
+        process_data(im, buf, len);
+        im->img.batch_p[0] = buf;
+        im->img.batch_len[0] = len;
+        im->img.batch_len[1] = 0;
     }
-    process_data(im, buf, len);
 
     rd->prod++;
 }
@@ -2351,6 +2907,22 @@ static struct raw_trk *add_track_layout(
     return &trk[i];
 }
 
+/* Allocate the sector-offsets table at the bottom of the heap, big enough for
+ * the track with the most sectors. */
+static void alloc_sec_offsets(struct image *im)
+{
+    uint8_t *trk_map = im->img.trk_map;
+    unsigned int i, nr = 0;
+    uint32_t *p;
+
+    for (i = 0; i < im->nr_cyls*im->nr_sides; i++)
+        nr = max_t(unsigned int, nr, im->img.trk_info[trk_map[i]].nr_sectors);
+
+    p = (uint32_t *)align_p(im->img.heap_bottom) - nr;
+    check_p(p, im);
+    im->img.sec_offsets = p;
+}
+
 /* Check the final track-map and track-info structures for validity. */
 static void finalise_track_map(struct image *im)
 {
@@ -2502,11 +3074,10 @@ static bool_t mfm_read_track(struct image *im)
     struct image_buf *rd = &im->bufs.read_data;
     struct image_buf *bc = &im->bufs.read_bc;
     struct raw_trk *trk = im->img.trk;
-    uint8_t *buf = rd->p;
     uint16_t *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     uint16_t pr, crc;
-    unsigned int i;
+    unsigned int i, j;
 
     img_fetch_data(im);
 
@@ -2526,22 +3097,23 @@ static bool_t mfm_read_track(struct image *im)
     bc_b[bc_p++ & bc_mask] = htobe16(_r & ~(pr << 15));  \
     pr = _r; })
 #define emit_byte(b) emit_raw(mfmtab[(uint8_t)(b)])
+#define emit_fill_raw(r, n) ({                           \
+    unsigned int _n = (n);                               \
+    pr = mfm_ring_fill(bc_b, bc_mask, bc_p, pr, r, _n);  \
+    bc_p += _n; })
+#define emit_fill(b, n) emit_fill_raw(mfmtab[(uint8_t)(b)], n)
 
     if (im->img.decode_pos == 0) {
         /* Post-index track gap */
         if (bc_space < im->img.idx_sz)
             return FALSE;
-        for (i = 0; i < trk->gap_4a; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, trk->gap_4a);
         if (trk->has_iam) {
             /* IAM */
-            for (i = 0; i < MFM_GAP_SYNC; i++)
-                emit_byte(0x00);
-            for (i = 0; i < 3; i++)
-                emit_raw(0x5224);
+            emit_fill(0x00, MFM_GAP_SYNC);
+            emit_fill_raw(0x5224, 3);
             emit_byte(0xfc);
-            for (i = 0; i < MFM_GAP_1; i++)
-                emit_byte(0x4e);
+            emit_fill(0x4e, MFM_GAP_1);
         }
     } else if (im->img.decode_pos == (trk->nr_sectors * 4 + 1)) {
         /* Pre-index track gap */
@@ -2556,8 +3128,7 @@ static bool_t mfm_read_track(struct image *im)
             im->img.decode_data_pos = 0;
             im->img.decode_pos = (im->img.idx_sz != 0) ? -1 : 0;
         }
-        for (i = 0; i < sz; i++)
-            emit_byte(0x4e);
+        emit_fill(0x4e, sz);
     } else {
         struct raw_sec *sec = &im->img.sec_info[im->img.sec_map[(
                     im->img.decode_pos-1)>>2]];
@@ -2569,30 +3140,34 @@ static bool_t mfm_read_track(struct image *im)
                                 c, h, sec->r, sec->n };
             if (bc_space < im->img.idam_sz)
                 return FALSE;
-            for (i = 0; i < MFM_GAP_SYNC; i++)
-                emit_byte(0x00);
-            for (i = 0; i < 3; i++)
-                emit_raw(0x4489);
-            for (; i < 8; i++)
-                emit_byte(idam[i]);
-            crc = crc16_ccitt(idam, sizeof(idam), 0xffff);
-            emit_byte(crc >> 8);
-            emit_byte(crc);
-            for (i = 0; i < im->img.post_crc_syncs; i++)
-                emit_raw(0x4489);
-            for (i = 0; i < trk->gap_2; i++)
-                emit_byte(0x4e);
+            emit_fill(0x00, MFM_GAP_SYNC);
+            emit_fill_raw(0x4489, 3);
+            if (im->img.idam_bc != NULL) {
+                const uint16_t *hdr = &im->img.idam_bc[
+                    (sec - im->img.sec_info) * IDAM_WORDS];
+                emit_byte(0xfe);
+                for (i = 0; i < IDAM_WORDS; i++)
+                    bc_b[bc_p++ & bc_mask] = hdr[i];
+                pr = be16toh(hdr[IDAM_WORDS-1]);
+            } else {
+                for (i = 3; i < 8; i++)
+                    emit_byte(idam[i]);
+                crc = crc16_ccitt(idam, sizeof(idam), 0xffff);
+                emit_byte(crc >> 8);
+                emit_byte(crc);
+            }
+            emit_fill_raw(0x4489, im->img.post_crc_syncs);
+            emit_fill(0x4e, trk->gap_2);
             break;
         }
         case 1: /* DAM */ {
             if (bc_space < im->img.dam_sz_pre)
                 return FALSE;
-            for (i = 0; i < MFM_GAP_SYNC; i++)
-                emit_byte(0x00);
-            for (i = 0; i < 3; i++)
-                emit_raw(0x4489);
+            emit_fill(0x00, MFM_GAP_SYNC);
+            emit_fill_raw(0x4489, 3);
             emit_byte(0xfb);
             im->img.crc = MFM_DAM_CRC;
+            im->img.crc_sec = sec - im->img.sec_info;
             break;
         }
         case 2: /* Data */ {
@@ -2607,9 +3182,23 @@ static bool_t mfm_read_track(struct image *im)
             } else {
                 im->img.decode_data_pos = 0;
             }
-            for (i = 0; i < sec_sz; i++)
-                emit_byte(buf[i]);
-            im->img.crc = crc16_ccitt(buf, sec_sz, im->img.crc);
+            for (j = 0; j < 2; j++) {
+                uint8_t *buf = im->img.batch_p[j];
+                uint16_t n = im->img.batch_len[j];
+                if (n == 0)
+                    continue;
+                if (sec_crc_is_valid(im, sec - im->img.sec_info)) {
+                    for (i = 0; i < n; i++)
+                        emit_byte(buf[i]);
+                } else {
+                    im->img.crc = mfm_ring_encode_crc(bc_b, bc_mask, bc_p, pr,
+                                                     buf, n, im->img.crc);
+                    bc_p += n;
+                    pr = mfmtab[buf[n-1]];
+                }
+            }
+            if (im->img.decode_data_pos == 0)
+                sec_crc_done(im, sec - im->img.sec_info);
             rd->cons++;
             break;
         }
@@ -2619,16 +3208,16 @@ static bool_t mfm_read_track(struct image *im)
             crc = im->img.crc;
             emit_byte(crc >> 8);
             emit_byte(crc);
-            for (i = 0; i < im->img.post_crc_syncs; i++)
-                emit_raw(0x4489);
-            for (i = 0; i < trk->gap_3; i++)
-                emit_byte(0x4e);
+            emit_fill_raw(0x4489, im->img.post_crc_syncs);
+            emit_fill(0x4e, trk->gap_3);
             break;
         }
         }
     }
 
 #undef emit_raw
+#undef emit_fill
+#undef emit_fill_raw
 #undef emit_byte
 
     if (im->img.trash_bc) {
@@ -2728,10 +3317,9 @@ static bool_t fm_read_track(struct image *im)
     struct image_buf *rd = &im->bufs.read_data;
     struct image_buf *bc = &im->bufs.read_bc;
     struct raw_trk *trk = im->img.trk;
-    uint8_t *buf = rd->p;
     uint16_t crc, *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
-    unsigned int i;
+    unsigned int i, j;
 
     img_fetch_data(im);
 
@@ -2748,21 +3336,22 @@ static bool_t fm_read_track(struct image *im)
 #define emit_raw(r) ({                          \
     uint16_t _r = (r);                          \
     bc_b[bc_p++ & bc_mask] = htobe16(_r); })
-#define emit_byte(b) emit_raw(mfmtab[(uint8_t)(b)] | 0xaaaa)
+#define emit_byte(b) emit_raw(bintofm(b))
+#define emit_fill(b, n) ({                          \
+    unsigned int _n = (n);                      \
+    fm_ring_fill(bc_b, bc_mask, bc_p, b, _n);   \
+    bc_p += _n; })
 
     if (im->img.decode_pos == 0) {
         /* Post-index track gap */
         if (bc_space < im->img.idx_sz)
             return FALSE;
-        for (i = 0; i < trk->gap_4a; i++)
-            emit_byte(0xff);
+        emit_fill(0xff, trk->gap_4a);
         if (trk->has_iam) {
             /* IAM */
-            for (i = 0; i < FM_GAP_SYNC; i++)
-                emit_byte(0x00);
-            emit_raw(fm_sync(0xfc, 0xd7));
-            for (i = 0; i < FM_GAP_1; i++)
-                emit_byte(0xff);
+            emit_fill(0x00, FM_GAP_SYNC);
+            emit_raw(FM_IAM);
+            emit_fill(0xff, FM_GAP_1);
         }
     } else if (im->img.decode_pos == (trk->nr_sectors * 4 + 1)) {
         /* Pre-index track gap */
@@ -2777,8 +3366,7 @@ static bool_t fm_read_track(struct image *im)
             im->img.decode_data_pos = 0;
             im->img.decode_pos = (im->img.idx_sz != 0) ? -1 : 0;
         }
-        for (i = 0; i < sz; i++)
-            emit_byte(0xff);
+        emit_fill(0xff, sz);
     } else {
         struct raw_sec *sec = &im->img.sec_info[im->img.sec_map[(
                     im->img.decode_pos-1)>>2]];
@@ -2789,25 +3377,30 @@ static bool_t fm_read_track(struct image *im)
             uint8_t idam[5] = { 0xfe, c, h, sec->r, sec->n };
             if (bc_space < im->img.idam_sz)
                 return FALSE;
-            for (i = 0; i < FM_GAP_SYNC; i++)
-                emit_byte(0x00);
-            emit_raw(fm_sync(idam[0], FM_SYNC_CLK));
-            for (i = 1; i < 5; i++)
-                emit_byte(idam[i]);
-            crc = crc16_ccitt(idam, sizeof(idam), 0xffff);
-            emit_byte(crc >> 8);
-            emit_byte(crc);
-            for (i = 0; i < trk->gap_2; i++)
-                emit_byte(0xff);
+            emit_fill(0x00, FM_GAP_SYNC);
+            emit_raw(FM_IDAM);
+            if (im->img.idam_bc != NULL) {
+                const uint16_t *hdr = &im->img.idam_bc[
+                    (sec - im->img.sec_info) * IDAM_WORDS];
+                for (i = 0; i < IDAM_WORDS; i++)
+                    bc_b[bc_p++ & bc_mask] = hdr[i];
+            } else {
+                for (i = 1; i < 5; i++)
+                    emit_byte(idam[i]);
+                crc = crc16_ccitt(idam, sizeof(idam), 0xffff);
+                emit_byte(crc >> 8);
+                emit_byte(crc);
+            }
+            emit_fill(0xff, trk->gap_2);
             break;
         }
         case 1: /* DAM */ {
             if (bc_space < im->img.dam_sz_pre)
                 return FALSE;
-            for (i = 0; i < FM_GAP_SYNC; i++)
-                emit_byte(0x00);
-            emit_raw(fm_sync(0xfb, FM_SYNC_CLK));
+            emit_fill(0x00, FM_GAP_SYNC);
+            emit_raw(FM_DAM);
             im->img.crc = FM_DAM_CRC;
+            im->img.crc_sec = sec - im->img.sec_info;
             break;
         }
         case 2: /* Data */ {
@@ -2822,9 +3415,20 @@ static bool_t fm_read_track(struct image *im)
             } else {
                 im->img.decode_data_pos = 0;
             }
-            for (i = 0; i < sec_sz; i++)
-                emit_byte(buf[i]);
-            im->img.crc = crc16_ccitt(buf, sec_sz, im->img.crc);
+            for (j = 0; j < 2; j++) {
+                uint8_t *buf = im->img.batch_p[j];
+                uint16_t n = im->img.batch_len[j];
+                if (sec_crc_is_valid(im, sec - im->img.sec_info)) {
+                    for (i = 0; i < n; i++)
+                        emit_byte(buf[i]);
+                } else {
+                    im->img.crc = fm_ring_encode_crc(bc_b, bc_mask, bc_p,
+                                                     buf, n, im->img.crc);
+                    bc_p += n;
+                }
+            }
+            if (im->img.decode_data_pos == 0)
+                sec_crc_done(im, sec - im->img.sec_info);
             rd->cons++;
             break;
         }
@@ -2834,14 +3438,14 @@ static bool_t fm_read_track(struct image *im)
             crc = im->img.crc;
             emit_byte(crc >> 8);
             emit_byte(crc);
-            for (i = 0; i < trk->gap_3; i++)
-                emit_byte(0xff);
+            emit_fill(0xff, trk->gap_3);
             break;
         }
         }
     }
 
 #undef emit_raw
+#undef emit_fill
 #undef emit_byte
 
     if (im->img.trash_bc) {
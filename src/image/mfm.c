@@ -47,6 +47,7 @@ const uint16_t mfmtab[] = {
 uint8_t always_inline mfmtobin(uint16_t x)
 {
     uint8_t y;
+#if defined(__arm__)
     x = be16toh(x) << 1;
     asm volatile (
         "lsrs %1,%1,#2 ; rrx %0,%0\n"
@@ -59,15 +60,47 @@ uint8_t always_inline mfmtobin(uint16_t x)
         "lsrs %1,%1,#2 ; rrx %0,%0\n"
         "rev %0,%0\n"
         : "=&r" (y) : "r" (x) );
+#else
+    /* Host build (host/Makefile): Gather the data bits in C. */
+    x = be16toh(x) & 0x5555;
+    x = (x | (x >> 1)) & 0x3333;
+    x = (x | (x >> 2)) & 0x0f0f;
+    y = x | (x >> 4);
+#endif
     return y;
 }
 
+/* Decode two consecutive big-endian MFM words, as fetched by a single 32-bit
+ * load, into two data bytes. The first byte is returned in bits 15:8. */
+static always_inline uint16_t mfm2tobin(uint32_t x)
+{
+    x = _rev32(x) & 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0f0f0f0f;
+    x = (x | (x >> 4)) & 0x00ff00ff;
+    return x | (x >> 8);
+}
+
 void mfm_to_bin(const void *in, void *out, unsigned int nr)
 {
     const uint16_t *_in = in;
+    const uint32_t *_in32;
     uint8_t *_out = out;
-    while (nr--)
+    uint16_t x;
+
+    /* Word-align the input, then decode two bytes per 32-bit load. */
+    if (((uint32_t)_in & 2) && nr) {
         *_out++ = mfmtobin(*_in++);
+        nr--;
+    }
+    _in32 = (const uint32_t *)_in;
+    for (; nr >= 2; nr -= 2) {
+        x = mfm2tobin(*_in32++);
+        *_out++ = x >> 8;
+        *_out++ = x;
+    }
+    if (nr)
+        *_out = mfmtobin(*(const uint16_t *)_in32);
 }
 
 void mfm_ring_to_bin(const uint16_t *ring, unsigned int mask,
@@ -81,18 +114,143 @@ void mfm_ring_to_bin(const uint16_t *ring, unsigned int mask,
         mfm_to_bin(ring, (uint8_t *)out + head, nr - head);
 }
 
-uint16_t fm_sync(uint8_t dat, uint8_t clk)
+void mfm_encode(uint16_t *out, uint16_t pr, const void *in, unsigned int nr)
+{
+    const uint8_t *b = in;
+    uint16_t x;
+    while (nr--) {
+        x = mfmtab[*b++];
+        *out++ = htobe16(x & ~(pr << 15));
+        pr = x;
+    }
+}
+
+ramfunc uint16_t mfm_ring_encode_crc(uint16_t *ring, unsigned int mask,
+                                     unsigned int idx, uint16_t pr,
+                                     const void *in, unsigned int nr,
+                                     uint16_t crc)
+{
+    const uint8_t *b = in;
+    uint32_t w;
+    uint16_t x;
+    unsigned int i;
+
+#define emit(_b) ({                                     \
+    x = mfmtab[(uint8_t)(_b)];                          \
+    ring[idx++ & mask] = htobe16(x & ~(pr << 15));      \
+    pr = x; })
+
+    /* Byte-wise up to a word boundary. */
+    for (; (nr != 0) && ((uint32_t)b & 3); nr--) {
+        emit(*b);
+        crc = crc16tab[0][(crc>>8)^*b++] ^ (crc<<8);
+    }
+
+    /* Encode and checksum a word at a time. */
+    for (; nr >= 4; nr -= 4) {
+        w = *(const uint32_t *)b;
+        b += 4;
+        crc = crc16_ccitt_word(w, crc);
+        for (i = 0; i < 4; i++) {
+            emit(w);
+            w >>= 8;
+        }
+    }
+
+    while (nr--) {
+        emit(*b);
+        crc = crc16tab[0][(crc>>8)^*b++] ^ (crc<<8);
+    }
+
+#undef emit
+
+    return crc;
+}
+
+ramfunc uint16_t fm_ring_encode_crc(uint16_t *ring, unsigned int mask,
+                                    unsigned int idx, const void *in,
+                                    unsigned int nr, uint16_t crc)
+{
+    const uint8_t *b = in;
+    uint32_t w;
+    unsigned int i;
+
+#define emit(_b) (ring[idx++ & mask] = htobe16(bintofm(_b)))
+
+    /* Byte-wise up to a word boundary. */
+    for (; (nr != 0) && ((uint32_t)b & 3); nr--) {
+        emit(*b);
+        crc = crc16tab[0][(crc>>8)^*b++] ^ (crc<<8);
+    }
+
+    /* Encode and checksum a word at a time. */
+    for (; nr >= 4; nr -= 4) {
+        w = *(const uint32_t *)b;
+        b += 4;
+        crc = crc16_ccitt_word(w, crc);
+        for (i = 0; i < 4; i++) {
+            emit(w);
+            w >>= 8;
+        }
+    }
+
+    while (nr--) {
+        emit(*b);
+        crc = crc16tab[0][(crc>>8)^*b++] ^ (crc<<8);
+    }
+
+#undef emit
+
+    return crc;
+}
+
+void bc_ring_fill(uint16_t *ring, unsigned int mask, unsigned int idx,
+                  uint16_t x, unsigned int nr)
+{
+    uint16_t *p;
+    uint32_t *q, w;
+    unsigned int n;
+
+    x = htobe16(x);
+    w = x | ((uint32_t)x << 16);
+
+    while (nr != 0) {
+        /* Contiguous run up to the end of the ring. */
+        idx &= mask;
+        n = min_t(unsigned int, nr, mask+1-idx);
+        p = &ring[idx];
+        idx += n;
+        nr -= n;
+        /* Word-align, then store two bitcell words at a time. */
+        if ((uint32_t)p & 2) {
+            *p++ = x;
+            n--;
+        }
+        q = (uint32_t *)p;
+        for (; n >= 2; n -= 2)
+            *q++ = w;
+        if (n)
+            *(uint16_t *)q = x;
+    }
+}
+
+uint16_t mfm_ring_fill(uint16_t *ring, unsigned int mask, unsigned int idx,
+                       uint16_t pr, uint16_t x, unsigned int nr)
 {
-    uint16_t _dat = mfmtab[dat] & 0x5555;
-    uint16_t _clk = (mfmtab[clk] & 0x5555) << 1;
-    return _clk | _dat;
+    if (nr == 0)
+        return pr;
+    /* Only the first word of the run is clocked against @pr. */
+    ring[idx++ & mask] = htobe16(x & ~(pr << 15));
+    bc_ring_fill(ring, mask, idx, x & ~(x << 15), nr - 1);
+    return x;
 }
 
-uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
+ramfunc uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf,
+                               uint16_t nr)
 {
     uint32_t ticks_per_cell = im->ticks_per_cell;
     uint32_t ticks = im->ticks_since_flux;
-    uint32_t x, y = 32, todo = nr;
+    uint32_t x, y = 32, n, todo = nr;
     struct image_buf *bc = &im->bufs.read_bc;
     uint32_t *bc_b = bc->p, bc_c = bc->cons, bc_p = bc->prod & ~31;
     unsigned int bc_mask = (bc->len / 4) - 1;
@@ -104,17 +262,22 @@ uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
         bc_c += 32 - y;
         im->cur_bc += 32 - y;
         im->cur_ticks += (32 - y) * ticks_per_cell;
-        while (y < 32) {
-            y++;
-            ticks += ticks_per_cell;
-            if ((int32_t)x < 0) {
-                *tbuf++ = (ticks >> 4) - 1;
-                ticks &= 15;
-                if (!--todo)
-                    goto out;
-            }
+        /* Step from one flux transition to the next, rather than bitwise:
+         * CLZ counts the empty cells ahead of each transition. */
+        while (x != 0) {
+            n = __builtin_clz(x) + 1;
+            x <<= n - 1;
             x <<= 1;
+            y += n;
+            ticks += n * ticks_per_cell;
+            *tbuf++ = (ticks >> 4) - 1;
+            ticks &= 15;
+            if (!--todo)
+                goto out;
         }
+        /* Empty cells to the end of the word. */
+        ticks += (32 - y) * ticks_per_cell;
+        y = 32;
     }
 
     ASSERT(y == 32);
@@ -135,6 +298,102 @@ out:
     return nr - todo;
 }
 
+void track_render_init(struct image *im, void *p, unsigned int len)
+{
+    struct track_render *r = &im->render;
+    r->p = p;
+    r->len = len / 2;
+    r->state = RENDER_invalid;
+}
+
+void track_render_invalidate(struct image *im)
+{
+    im->render.state = RENDER_invalid;
+}
+
+void track_render_capture(struct image *im, uint32_t bc_prod,
+                          bool_t track_start)
+{
+    struct track_render *r = &im->render;
+    struct image_buf *bc = &im->bufs.read_bc;
+    const uint16_t *bc_b = bc->p;
+    uint32_t bc_mask = (bc->len / 2) - 1;
+    uint32_t bc_p = bc_prod / 16, bc_end = bc->prod / 16;
+    uint32_t track_words = im->tracklen_bc / 16;
+    uint16_t w;
+
+    if ((r->p == NULL) || (r->state == RENDER_valid))
+        return;
+
+    if (track_start) {
+        if ((r->state == RENDER_capturing) && (r->pos == track_words)) {
+            /* A full revolution is captured. The first word was emitted
+             * following stale ring contents: fix up its MFM clock bit. */
+            if (im->sync == SYNC_mfm) {
+                w = be16toh(r->p[0]) & 0x7fff;
+                if (!((be16toh(r->p[track_words-1]) & 1) | (w & 0x4000)))
+                    w |= 0x8000;
+                r->p[0] = htobe16(w);
+            }
+            r->state = RENDER_valid;
+            r->pos = (bc_end - bc_p) % track_words;
+            return;
+        }
+        r->state = ((im->tracklen_bc % 16) || (track_words > r->len))
+            ? RENDER_invalid : RENDER_capturing;
+        r->pos = 0;
+    }
+
+    if (r->state != RENDER_capturing)
+        return;
+
+    if ((r->pos + bc_end - bc_p) > track_words) {
+        r->state = RENDER_invalid;
+        return;
+    }
+
+    while (bc_p != bc_end)
+        r->p[r->pos++] = bc_b[bc_p++ & bc_mask];
+}
+
+bool_t track_render_seek(struct image *im, uint32_t bc)
+{
+    struct track_render *r = &im->render;
+
+    if (r->state != RENDER_valid)
+        return FALSE;
+
+    r->pos = bc / 16;
+    return TRUE;
+}
+
+bool_t track_render_replay(struct image *im)
+{
+    struct track_render *r = &im->render;
+    struct image_buf *bc = &im->bufs.read_bc;
+    uint16_t *bc_b = bc->p;
+    uint32_t bc_len = bc->len / 2, bc_mask = bc_len - 1;
+    uint32_t bc_p = bc->prod / 16, bc_c = bc->cons / 16;
+    uint32_t bc_space = bc_len - (uint16_t)(bc_p - bc_c);
+    uint32_t track_words = im->tracklen_bc / 16, nr;
+
+    if (bc_space == 0)
+        return FALSE;
+
+    while (bc_space != 0) {
+        nr = min_t(uint32_t, bc_space, track_words - r->pos);
+        nr = min_t(uint32_t, nr, bc_len - (bc_p & bc_mask));
+        memcpy(&bc_b[bc_p & bc_mask], &r->p[r->pos], nr * 2);
+        bc_p += nr;
+        bc_space -= nr;
+        if ((r->pos += nr) >= track_words)
+            r->pos = 0;
+    }
+
+    bc->prod = bc_p * 16;
+    return TRUE;
+}
+
 /*
  * Local variables:
  * mode: C
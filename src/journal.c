@@ -0,0 +1,223 @@
+/*
+ * journal.c
+ * 
+ * Sequential write journal for image files.
+ * 
+ * Track writes are appended to a contiguous journal file, which is much
+ * quicker on many USB sticks than rewriting scattered sectors of the image
+ * in place. The journal is indexed in RAM and is replayed into the image when
+ * the image is idle, and in full on sync (ie. eject). Data not yet replayed
+ * is lost on power loss.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define JOURNAL_NAME "FFJOURNL.BIN"
+#define JNL_SECS 256 /* Power of two */
+#define JNL_IDX(x) ((x)&(JNL_SECS-1))
+#define JNL_REPLAY_SECS 4
+#define JNL_NONE 0xffff /* Unused journal sector */
+
+static struct {
+    FIL *fp; /* Journaled image file, or NULL if the journal is disabled */
+    BYTE pdrv;
+    LBA_t lba; /* Volume sector at start of the journal file */
+    /* Image sector held by each journal sector. An image sector is held by at
+     * most one journal sector, and the map is JNL_NONE outside (tail,head). */
+    uint16_t *map;
+    uint8_t *buf; /* Replay staging buffer */
+    uint16_t head, tail; /* Free-running journal sector cursors */
+    uint16_t replay_cnt; /* Sectors at tail being replayed by replay_op */
+    FOP replay_op;
+    struct {
+        uint32_t written, read, replayed, bypassed;
+    } stats;
+} jnl;
+
+void journal_init(FIL *fp, void *mem, FIL *scratch)
+{
+    FATFS *fs;
+    FRESULT fr;
+
+    memset(&jnl, 0, sizeof(jnl));
+    if ((fp == NULL) || (mem == NULL) || (f_size(fp) / 512 >= JNL_NONE))
+        return;
+
+    /* (Re)create the journal file as a single run of clusters. */
+    fr = f_open(scratch, JOURNAL_NAME, FA_CREATE_ALWAYS | FA_WRITE);
+    if (fr == FR_OK) {
+        fr = f_expand(scratch, JNL_SECS * 512, 1);
+        if (fr == FR_OK)
+            fr = f_close(scratch);
+        else
+            (void)f_close(scratch);
+    }
+    if (fr != FR_OK) {
+        printk("Journal: Unavailable (%u)\n", fr);
+        return;
+    }
+
+    fs = fp->obj.fs;
+    jnl.pdrv = fs->pdrv;
+    jnl.lba = fs->database + (LBA_t)(scratch->obj.sclust - 2) * fs->csize;
+    jnl.map = mem;
+    jnl.buf = (uint8_t *)mem + JNL_SECS * sizeof(*jnl.map);
+    memset(jnl.map, 0xff, JNL_SECS * sizeof(*jnl.map));
+    jnl.fp = fp;
+    printk("Journal: %u secs at LBA %u\n", JNL_SECS, jnl.lba);
+}
+
+/* Find the journal sector holding image sector @sec. Returns -1 if none. */
+static int lookup(uint32_t sec)
+{
+    uint16_t i;
+    for (i = jnl.tail; i != jnl.head; i++)
+        if (jnl.map[JNL_IDX(i)] == sec)
+            return JNL_IDX(i);
+    return -1;
+}
+
+/* Forget any journaled copies of image sectors @sec..@sec+@nr-1. */
+static void invalidate(uint32_t sec, unsigned int nr)
+{
+    uint16_t i;
+    for (i = jnl.tail; i != jnl.head; i++)
+        if ((uint32_t)(jnl.map[JNL_IDX(i)] - sec) < nr)
+            jnl.map[JNL_IDX(i)] = JNL_NONE;
+}
+
+bool_t journal_write_async(FIL *fp, FSIZE_t ofs, const void *buf,
+                           unsigned int nr, FOP *fop)
+{
+    uint32_t sec = ofs / 512;
+    unsigned int i, j, pad;
+
+    if (fp != jnl.fp)
+        return FALSE;
+
+    /* Older copies must never be read back, nor replayed over newer data. */
+    invalidate(sec, nr);
+
+    /* A write does not wrap: skip any space left at the end of the journal. */
+    j = JNL_IDX(jnl.head);
+    pad = (j + nr > JNL_SECS) ? JNL_SECS - j : 0;
+    if ((uint16_t)(jnl.head - jnl.tail) + pad + nr > JNL_SECS) {
+        /* Journal full: the caller writes straight to the image. Any replay
+         * already queued is ordered ahead of that write. */
+        jnl.stats.bypassed += nr;
+        return FALSE;
+    }
+    jnl.head += pad;
+    j = JNL_IDX(jnl.head);
+
+    for (i = 0; i < nr; i++)
+        jnl.map[j + i] = sec + i;
+    *fop = disk_write_async(jnl.pdrv, buf, jnl.lba + j, nr);
+    jnl.head += nr;
+    jnl.stats.written += nr;
+
+    return TRUE;
+}
+
+bool_t journal_read_async(FIL *fp, FSIZE_t ofs, void *buf,
+                          unsigned int *nr, FOP *fop)
+{
+    uint32_t sec = ofs / 512;
+    unsigned int n;
+    int j;
+
+    if ((fp != jnl.fp) || (jnl.head == jnl.tail))
+        return FALSE;
+
+    if ((j = lookup(sec)) < 0) {
+        /* Stop short of the first journaled sector. */
+        for (n = 1; (n < *nr) && (lookup(sec + n) < 0); n++)
+            continue;
+        *nr = n;
+        return FALSE;
+    }
+
+    /* Take the run of image sectors which follows on in the journal. */
+    for (n = 1; (n < *nr) && (j + n < JNL_SECS); n++)
+        if (jnl.map[j + n] != sec + n)
+            break;
+    *fop = disk_read_async(jnl.pdrv, buf, jnl.lba + j, n);
+    *nr = n;
+    jnl.stats.read += n;
+
+    return TRUE;
+}
+
+void journal_replay(void)
+{
+    unsigned int i, n, j;
+    uint16_t sec;
+
+    if (jnl.fp == NULL)
+        return;
+
+    if (jnl.replay_cnt) {
+        if (!F_async_isdone(jnl.replay_op))
+            return;
+        /* Replayed data is now read from the image. */
+        for (i = 0; i < jnl.replay_cnt; i++)
+            jnl.map[JNL_IDX(jnl.tail + i)] = JNL_NONE;
+        jnl.tail += jnl.replay_cnt;
+        jnl.stats.replayed += jnl.replay_cnt;
+        jnl.replay_cnt = 0;
+    }
+
+    /* Skip sectors superseded by later writes. */
+    while ((jnl.tail != jnl.head) && (jnl.map[JNL_IDX(jnl.tail)] == JNL_NONE))
+        jnl.tail++;
+
+    if (jnl.tail == jnl.head) {
+        /* Empty: start the next write burst at the start of the journal. */
+        jnl.head = jnl.tail = 0;
+        return;
+    }
+
+    /* Replay a run of consecutive image sectors. The image write is queued
+     * with the journal read, so a later write straight to the image cannot
+     * be overtaken by this older data. */
+    j = JNL_IDX(jnl.tail);
+    sec = jnl.map[j];
+    for (n = 1; (n < JNL_REPLAY_SECS) && (jnl.tail + n != jnl.head)
+             && (j + n < JNL_SECS) && (jnl.map[j + n] == sec + n); n++)
+        continue;
+    disk_read_async(jnl.pdrv, jnl.buf, jnl.lba + j, n);
+    F_lseek_async(jnl.fp, (FSIZE_t)sec * 512);
+    jnl.replay_op = F_write_async(jnl.fp, jnl.buf, n * 512, NULL);
+    jnl.replay_cnt = n;
+}
+
+void journal_sync(void)
+{
+    if (jnl.fp == NULL)
+        return;
+
+    while (jnl.replay_cnt || (jnl.tail != jnl.head)) {
+        journal_replay();
+        thread_yield();
+    }
+    F_async_wait(F_sync_async(jnl.fp));
+
+    if (jnl.stats.written)
+        printk("Journal: %u secs written, %u read back, %u replayed, "
+               "%u bypassed\n", jnl.stats.written, jnl.stats.read,
+               jnl.stats.replayed, jnl.stats.bypassed);
+    memset(&jnl.stats, 0, sizeof(jnl.stats));
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -3,6 +3,10 @@
  * 
  * printf-style interface to a log file.
  * 
+ * IRQ handlers may instead trace() an event: this records the format string
+ * and arguments without formatting them, which happens later in thread
+ * context.
+ * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
  * This is free and unencumbered software released into the public domain.
@@ -14,23 +18,42 @@ static char ring[2048];
 #define MASK(x) ((x)&(sizeof(ring)-1))
 static unsigned int cons, prod;
 
+/* Binary trace events, awaiting formatting into the text ring. */
+static struct trace_ent {
+    const char *fmt;
+    time_t time;
+    uint32_t arg[3];
+} trace_ring[32];
+#define TRACE_MASK(x) ((x)&(ARRAY_SIZE(trace_ring)-1))
+static unsigned int trace_cons, trace_prod;
+
 /* Shut loggers up while we are sending to the logging file. */
 static bool_t quiesce;
 
-int vprintk(const char *format, va_list ap)
-{
-    static char str[128];
-    char *p, c;
-    int n;
+/* The log file is held open between flushes, and the ring streams to it in
+ * small chunks while the drive is otherwise idle. */
+static FIL logfil;
+static bool_t logfil_open;
 
-    IRQ_global_disable();
+#define STREAM_CHUNK   256
+#define STREAM_WAIT_MS 1000 /* Max age of a partial chunk */
+#define STREAM_SYNC_MS 2000 /* Max time between syncs */
+static struct {
+    char buf[STREAM_CHUNK];
+    unsigned int nr;   /* Ring bytes in flight in buf[] */
+    bool_t busy;       /* Async write or sync in flight */
+    bool_t writing;    /* ...and it is a write */
+    bool_t unsynced;   /* Written since last sync */
+    time_t written, synced;
+} stream;
 
-    n = vsnprintf(str, sizeof(str), format, ap);
+static void trace_drain(void);
 
-    if (quiesce)
-        goto out;
+/* Append @str to the ring. Caller disables IRQs. */
+static void ring_puts(const char *p)
+{
+    char c;
 
-    p = str;
     while ((c = *p++) != '\0') {
         switch (c) {
         case '\r': /* CR: ignore as we generate our own CR/LF */
@@ -43,13 +66,79 @@ int vprintk(const char *format, va_list ap)
             break;
         }
     }
+}
+
+int vprintk(const char *format, va_list ap)
+{
+    static char str[128];
+    int n;
+
+    /* Keep trace events roughly in order with text from thread context. */
+    if (!in_exception())
+        trace_drain();
+
+    IRQ_global_disable();
+
+    n = vsnprintf(str, sizeof(str), format, ap);
+
+    if (!quiesce)
+        ring_puts(str);
 
-out:
     IRQ_global_enable();
 
     return n;
 }
 
+void trace(const char *fmt, uint32_t a, uint32_t b, uint32_t c)
+{
+    struct trace_ent *ent;
+    uint32_t oldpri;
+
+    /* Overwrites the oldest events: trace_drain() counts the loss. */
+    oldpri = IRQ_save(RESET_IRQ_PRI+1);
+    ent = &trace_ring[TRACE_MASK(trace_prod++)];
+    ent->fmt = fmt;
+    ent->time = time_now();
+    ent->arg[0] = a;
+    ent->arg[1] = b;
+    ent->arg[2] = c;
+    IRQ_restore(oldpri);
+}
+
+/* Format pending trace events into the text ring. Thread context only. */
+static void trace_drain(void)
+{
+    static char str[128];
+    struct trace_ent ent;
+    unsigned int nr;
+    uint32_t oldpri;
+    int n;
+
+    while (trace_cons != trace_prod) {
+        oldpri = IRQ_save(RESET_IRQ_PRI+1);
+        nr = trace_prod - trace_cons;
+        if (nr > ARRAY_SIZE(trace_ring)) {
+            nr -= ARRAY_SIZE(trace_ring);
+            trace_cons += nr;
+        } else {
+            nr = 0;
+        }
+        ent = trace_ring[TRACE_MASK(trace_cons++)];
+        IRQ_restore(oldpri);
+        n = 0;
+        if (nr != 0)
+            n = snprintf(str, sizeof(str), "[lost %u events]\n", nr);
+        n += snprintf(str + n, sizeof(str) - n, "@%u ",
+                      ent.time / time_ms(1));
+        snprintf(str + n, sizeof(str) - n, ent.fmt,
+                 ent.arg[0], ent.arg[1], ent.arg[2]);
+        IRQ_global_disable();
+        if (!quiesce)
+            ring_puts(str);
+        IRQ_global_enable();
+    }
+}
+
 int printk(const char *format, ...)
 {
     va_list ap;
@@ -62,33 +151,123 @@ int printk(const char *format, ...)
     return n;
 }
 
-void logfile_flush(FIL *file)
+/* Skip ring text that was overwritten before it was written out. Returns the
+ * number of bytes lost. Caller disables IRQs or quiesces the loggers. */
+static unsigned int ring_skip_lost(void)
+{
+    unsigned int nr = 0;
+
+    if ((unsigned int)(prod-cons) > sizeof(ring)) {
+        nr = prod - cons - sizeof(ring);
+        cons += nr;
+    }
+
+    return nr;
+}
+
+static void stream_write_done(FOP op, void *arg)
+{
+    cons += stream.nr;
+    stream.nr = 0;
+    stream.busy = stream.writing = FALSE;
+}
+
+static void stream_sync_done(FOP op, void *arg)
+{
+    stream.busy = FALSE;
+}
+
+void logfile_stream(void)
+{
+    unsigned int nr, lost, n = 0;
+    FOP op;
+
+    if (!logfil_open || stream.busy)
+        return;
+
+    trace_drain();
+
+    IRQ_global_disable();
+    lost = ring_skip_lost();
+    nr = prod - cons;
+    if ((nr != 0) && ((nr >= STREAM_CHUNK) || (lost != 0)
+                      || (time_since(stream.written)
+                          >= time_ms(STREAM_WAIT_MS)))) {
+        if (lost != 0)
+            n = snprintf(stream.buf, sizeof(stream.buf),
+                         "\r\n[lost %u]\r\n", lost);
+        nr = min_t(unsigned int, nr, sizeof(stream.buf) - n);
+        stream.nr = nr;
+        if (MASK(cons) + nr > sizeof(ring)) {
+            unsigned int part = sizeof(ring) - MASK(cons);
+            memcpy(&stream.buf[n], &ring[MASK(cons)], part);
+            memcpy(&stream.buf[n+part], ring, nr - part);
+        } else {
+            memcpy(&stream.buf[n], &ring[MASK(cons)], nr);
+        }
+        n += nr;
+    }
+    IRQ_global_enable();
+
+    if (n != 0) {
+        /* The ring text is consumed only once it is written: a cancelled
+         * write is retried by the next logfile_flush(). */
+        stream.busy = stream.writing = TRUE;
+        stream.unsynced = TRUE;
+        stream.written = time_now();
+        op = F_write_async(&logfil, stream.buf, n, NULL);
+        F_async_whendone(op, stream_write_done, NULL);
+    } else if (stream.unsynced
+               && (time_since(stream.synced)
+                   >= time_ms(STREAM_SYNC_MS))) {
+        stream.busy = TRUE;
+        stream.unsynced = FALSE;
+        stream.synced = time_now();
+        op = F_sync_async(&logfil);
+        F_async_whendone(op, stream_sync_done, NULL);
+    }
+}
+
+void logfile_flush(void)
 {
     unsigned int nr;
     char msg[20];
 
-    F_open(file, "FFLOG.TXT", FA_OPEN_APPEND|FA_WRITE);
+    /* Any stream op was cancelled along with the I/O thread. A cancelled
+     * write may have left the file handle inconsistent, so reopen the file,
+     * and the write's ring text is rewritten below. Otherwise keep the handle:
+     * Text written since the last sync is held only by the handle, and is
+     * committed by the F_sync() below. A handle from an earlier mount of the
+     * volume is simply discarded. */
+    if (!logfil_open || stream.writing
+        || !logfil.obj.fs->fs_type || (logfil.obj.id != logfil.obj.fs->id)) {
+        F_open(&logfil, "FFLOG.TXT", FA_OPEN_APPEND|FA_WRITE);
+        logfil_open = TRUE;
+    }
+    stream.nr = 0;
+    stream.busy = stream.writing = FALSE;
 
+    trace_drain();
     quiesce = TRUE;
     barrier();
 
-    if ((unsigned int)(prod-cons) > sizeof(ring)) {
-        nr = prod - cons - sizeof(ring);
+    if ((nr = ring_skip_lost()) != 0) {
         snprintf(msg, sizeof(msg), "\r\n[lost %u]\r\n", nr);
-        F_write(file, msg, strlen(msg), NULL);
-        cons += nr;
+        F_write(&logfil, msg, strlen(msg), NULL);
     }
 
     while (cons != prod) {
         nr = min_t(unsigned int, prod-cons, sizeof(ring)-MASK(cons));
-        F_write(file, &ring[MASK(cons)], nr, NULL);
+        F_write(&logfil, &ring[MASK(cons)], nr, NULL);
         cons += nr;
     }
 
     barrier();
     quiesce = FALSE;
 
-    F_close(file);
+    F_sync(&logfil);
+    stream.unsynced = FALSE;
+    stream.written = stream.synced = time_now();
 }
 
 /*
@@ -15,6 +15,7 @@ static const char image_a[] = "IMAGE_A.CFG";
 static const char init_image_a[] = "INIT_A.CFG";
 
 static FATFS fatfs;
+#define free_clst_valid() (fatfs.free_clst <= fatfs.n_fatent - 2)
 static struct {
     FIL file;
     DIR dp;
@@ -35,9 +36,23 @@ static struct {
     struct short_slot autoboot;
     struct short_slot hxcsdfe;
     struct short_slot imgcfg;
+    struct short_slot imgcfg_index;
     struct slot slot, clipboard;
     uint32_t cfg_cdir, cur_cdir;
     struct native_dirent **sorted;
+    /* Unsorted folders: directory offset of every DIRCKPT_GAP'th listed
+     * entry, so that a slot can be found without walking from the start. */
+#define DIRCKPT_GAP 32
+#define DIRCKPT_NR  64
+    uint32_t dir_ckpt[DIRCKPT_NR], dir_ckpt_cdir;
+    uint8_t nr_dir_ckpt;
+    /* Offsets of the entries either side of the last slot looked up, so
+     * that stepping to a neighbouring slot reads a single entry. */
+    struct {
+        uint16_t idx;
+        uint32_t ofs;
+    } dir_hint[3];
+    uint8_t nr_dir_hint;
     struct {
         uint32_t cdir;
         uint16_t slot;
@@ -53,6 +68,9 @@ static struct {
     uint8_t ffcfg_has_step_volume:1;
     uint8_t ffcfg_has_display_off_secs:1;
     uint8_t ffcfg_has_display_scroll_rate:1;
+#define FFCFG_HAS_step_volume         (1u<<0)
+#define FFCFG_HAS_display_off_secs    (1u<<1)
+#define FFCFG_HAS_display_scroll_rate (1u<<2)
 } cfg;
 
 /* If TRUE, reset to start of filename when selecting a new image. 
@@ -63,6 +81,10 @@ uint8_t board_id;
 
 #define BUTTON_SCAN_HZ 500
 #define BUTTON_SCAN_MS (1000/BUTTON_SCAN_HZ)
+/* While the controls are untouched they are scanned only every
+ * BUTTON_IDLE_TICKS scan periods. */
+#define BUTTON_IDLE_TICKS 8
+static uint8_t scan_ticks = 1; /* Scan periods since the previous scan */
 static uint32_t display_ticks;
 static uint8_t display_state;
 enum { BACKLIGHT_OFF, BACKLIGHT_SWITCHING_ON, BACKLIGHT_ON };
@@ -73,12 +95,17 @@ static void native_get_slot_map(bool_t sorted_only);
 
 /* Hack inside the guts of FatFS. */
 void flashfloppy_fill_fileinfo(FIL *fp);
+void flashfloppy_dir_seek(DIR *dp, DWORD ofs);
+FRESULT flashfloppy_dir_fingerprint(FATFS *fs, const char *skip, BYTE *buf,
+                                    UINT nr_secs, DWORD *fpr,
+                                    DWORD *skip_clust, DWORD *skip_size);
+FRESULT flashfloppy_count_free(FATFS *fs, UINT nr_secs);
 
 #ifdef LOGFILE
 /* Logfile must be written to config dir. */
-#define logfile_flush(_file) do {               \
+#define logfile_flush() do {                    \
     fatfs.cdir = cfg.cfg_cdir;                  \
-    logfile_flush(_file);                       \
+    logfile_flush();                            \
     fatfs.cdir = cfg.cur_cdir;                  \
 } while(0)
 #endif
@@ -283,11 +310,16 @@ static void lcd_write_track_info(bool_t force)
     }
 }
 
+/* Track-number updates are coalesced to at most one per this period, to
+ * limit display bus traffic during fast seeks. */
+#define LED_TRACK_REFRESH_MS 100
+
 static void led_7seg_update_track(bool_t force)
 {
     static struct track_info led_ti;
-    static bool_t showing_track;
+    static bool_t showing_track, pending;
     static uint8_t active_countdown;
+    static time_t written;
 
     bool_t changed;
     struct track_info ti;
@@ -326,19 +358,28 @@ static void led_7seg_update_track(bool_t force)
     if ((display_state != LED_TRACK) || (active_countdown == 0)) {
         if (showing_track)
             display_write_slot(FALSE);
-        showing_track = FALSE;
+        showing_track = pending = FALSE;
         active_countdown = 0;
         if (display_state == LED_TRACK)
             display_state = LED_TRACK_QUIESCENT;
         return;
     }
 
-    if (!showing_track || changed) {
+    if (changed)
+        pending = TRUE;
+
+    if (!showing_track
+        || (pending && (time_since(written)
+                        >= time_ms(LED_TRACK_REFRESH_MS)))) {
         const static char status[] = { 'k', 'm', 'v', 'w' };
-        snprintf(msg, sizeof(msg), "%2u%c", ti.cyl,
-                 status[ti.side|(ti.writing<<1)]);
-        led_7seg_write_string(msg);
-        showing_track = TRUE;
+        snprintf(msg, sizeof(msg), "%2u%c", led_ti.cyl,
+                 status[led_ti.side|(led_ti.writing<<1)]);
+        /* On failure, retry on the next update. */
+        if (led_7seg_write_string(msg)) {
+            written = time_now();
+            showing_track = TRUE;
+            pending = FALSE;
+        }
     }
 }
 
@@ -369,7 +410,8 @@ static uint8_t lcd_handle_backlight(uint8_t b)
         /* After a period with no button activity we turn the backlight off. */
         if (b)
             display_ticks = 0;
-        if (display_ticks++ >= BUTTON_SCAN_HZ*ff_cfg.display_off_secs) {
+        display_ticks += scan_ticks;
+        if (display_ticks > BUTTON_SCAN_HZ*ff_cfg.display_off_secs) {
             lcd_backlight(FALSE);
             display_state = BACKLIGHT_OFF;
         }
@@ -398,7 +440,8 @@ static uint8_t led_handle_display(uint8_t b)
         break;
     case LED_BUTTON_RELEASED:
         /* After a period with no button activity we return to track number. */
-        if (display_ticks++ >= BUTTON_SCAN_HZ*3)
+        display_ticks += scan_ticks;
+        if (display_ticks > BUTTON_SCAN_HZ*3)
             display_state = LED_TRACK;
         break;
     }
@@ -473,12 +516,39 @@ static struct timer button_timer;
 static volatile uint8_t buttons, velocity;
 static uint8_t rotary, rb;
 
+/* Rotary encoder movement, latched by IRQ_rotary() for the button timer. */
+static uint8_t rot_velocity;
+static time_t rot_prev;
+
+/* Rotary encoders are decoded on every edge, by IRQ_rotary(). Trackball and
+ * button inputs are sampled by the button timer. */
+static bool_t rotary_is_encoder(void)
+{
+    unsigned int type = ff_cfg.rotary & ROT_typemask;
+    return (type >= ROT_full) && (type <= ROT_half);
+}
+
+/* Called on each rotary edge, at TIMER_IRQ_PRI: never concurrently with
+ * button_timer_fn(). */
 void IRQ_rotary(void)
 {
-    if ((ff_cfg.rotary & ROT_typemask) != ROT_full)
+    int32_t delta;
+    uint8_t r;
+
+    if (!rotary_is_encoder())
         return;
     rotary = ((rotary << 2) | board_get_rotary()) & 15;
-    rb = read_rotary(rotary) ?: rb;
+    r = (ff_cfg.rotary & ROT_v2) ? v2_read_rotary(rotary)
+        : read_rotary(rotary);
+    if (!r)
+        return;
+
+    /* Velocity from the time since the previous detent. */
+    delta = time_since(rot_prev);
+    delta = (delta < 0) ? 0x7fff : delta / time_ms(BUTTON_SCAN_MS);
+    rot_velocity = range_t(int, (BUTTON_SCAN_HZ/10)/(delta?:1), 0, 20);
+    rot_prev = time_now();
+    rb = r;
 }
 
 static void set_rotary_exti(void)
@@ -486,7 +556,7 @@ static void set_rotary_exti(void)
     uint32_t imr;
 
     imr = exti->imr & ~FULL_ROTARY_MASK;
-    if ((ff_cfg.rotary & ROT_typemask) == ROT_full)
+    if (rotary_is_encoder())
         imr |= board_get_rotary_mask();
     exti->imr = imr;
 }
@@ -497,16 +567,13 @@ static void button_timer_fn(void *unused)
         [B_LEFT] = B_RIGHT, [B_RIGHT] = B_LEFT
     };
 
-    static uint16_t cur_time, prev_time;
     static uint32_t _b[3]; /* 0 = left, 1 = right, 2 = select */
+    static uint16_t active; /* Scan periods to remain at the full rate */
     uint8_t x, b = osd_buttons_rx;
     bool_t twobutton_rotary =
         (ff_cfg.twobutton_action & TWOBUTTON_mask) == TWOBUTTON_rotary;
     int i, twobutton_reverse = !!(ff_cfg.twobutton_action & TWOBUTTON_reverse);
 
-    cur_time++;
-    if ((uint16_t)(cur_time - prev_time) > 0x7fff)
-        prev_time = cur_time - 0x7fff;
     velocity = 0;
 
     /* Check PA5 (USBFLT, active low). */
@@ -534,7 +601,8 @@ static void button_timer_fn(void *unused)
     if (_b[2] == 0)
         b |= B_SELECT;
 
-    rotary = ((rotary << 2) | board_get_rotary()) & 15;
+    if (!rotary_is_encoder())
+        rotary = ((rotary << 2) | board_get_rotary()) & 15;
     switch (ff_cfg.rotary & ROT_typemask) {
 
     case ROT_trackball: {
@@ -571,17 +639,10 @@ static void button_timer_fn(void *unused)
     case ROT_none:
         break;
 
-    default: /* rotary encoder */ {
-        rb = (ff_cfg.rotary & ROT_v2) ? v2_read_rotary(rotary)
-            : (read_rotary(rotary) ?: rb);
-        if (rb) {
-            uint16_t delta = cur_time - prev_time;
-            velocity = (BUTTON_SCAN_HZ/10)/(delta?:1);
-            velocity = range_t(int, velocity, 0, 20);
-            prev_time = cur_time;
-        }
+    default: /* rotary encoder: rb is latched by IRQ_rotary() */
+        if (rb)
+            velocity = rot_velocity;
         break;
-    }
 
     }
     if (ff_cfg.rotary & ROT_reverse)
@@ -598,22 +659,47 @@ static void button_timer_fn(void *unused)
         break;
     }
 
+    /* Scan at the full rate while any input is active or debouncing, and
+     * for a second after. Trackballs and rotary buttons are only sampled. */
+    if (b || ((_b[0] & _b[1] & _b[2]) != ~0u)
+        || (!rotary_is_encoder()
+            && ((ff_cfg.rotary & ROT_typemask) != ROT_none)))
+        active = BUTTON_SCAN_HZ;
+    else
+        active -= min_t(unsigned int, active, scan_ticks);
+    scan_ticks = active ? 1 : BUTTON_IDLE_TICKS;
+
     /* Latch final button state and reset the timer. */
     buttons = b;
-    timer_set(&button_timer, button_timer.deadline + time_ms(BUTTON_SCAN_MS));
+    timer_set(&button_timer, button_timer.deadline
+              + time_ms(BUTTON_SCAN_MS * scan_ticks));
 }
 
 static void canary_init(void)
 {
-    _irq_stackbottom[0] = _thread_stackbottom[0] = _thread1_stackbottom[0]
-        = 0xdeadbeef;
+    stack_paint(_irq_stackbottom, _irq_stacktop);
+    stack_paint(_thread_stackbottom, _thread_stacktop);
+    stack_paint(_thread1_stackbottom, _thread1_stacktop);
 }
 
 static void canary_check(void)
 {
-    ASSERT(_irq_stackbottom[0] == 0xdeadbeef);
-    ASSERT(_thread_stackbottom[0] == 0xdeadbeef);
-    ASSERT(_thread1_stackbottom[0] == 0xdeadbeef);
+    ASSERT(_irq_stackbottom[0] == STACK_PAINT);
+    ASSERT(_thread_stackbottom[0] == STACK_PAINT);
+    ASSERT(_thread1_stackbottom[0] == STACK_PAINT);
+}
+
+/* Log peak stack usage: IRQ and main-thread stacks since boot, and the I/O
+ * thread's stack since it was last started. */
+static void stack_report(void)
+{
+    printk("Stack peak: irq %u/%u, thread0 %u/%u, thread1 %u/%u\n",
+           stack_peak(_irq_stackbottom, _irq_stacktop),
+           (_irq_stacktop - _irq_stackbottom) * 4,
+           stack_peak(_thread_stackbottom, _thread_stacktop),
+           (_thread_stacktop - _thread_stackbottom) * 4,
+           stack_peak(_thread1_stackbottom, _thread1_stacktop),
+           (_thread1_stacktop - _thread1_stackbottom) * 4);
 }
 
 static void fix_hxc_short_slot(struct short_slot *short_slot)
@@ -626,6 +712,36 @@ static void fix_hxc_short_slot(struct short_slot *short_slot)
         *dot = '\0';
 }
 
+/* HXCSDFE.CFG header, as last read from or written to the file. Browsing
+ * slots then reads only the slot records. Image I/O (eg. the HxC selector in
+ * D-A mode) may rewrite the file, so the copy is discarded whenever an image
+ * is mounted. */
+static struct {
+    struct hxcsdfe_cfg cfg;
+    bool_t valid;
+} hxc_hdr;
+
+/* Get the header of HXCSDFE.CFG, newly opened as fs->file, into @hdr. */
+static void hxc_read_hdr(struct hxcsdfe_cfg *hdr, bool_t reload)
+{
+    if (reload || !hxc_hdr.valid) {
+        F_read(&fs->file, &hxc_hdr.cfg, sizeof(hxc_hdr.cfg), NULL);
+        hxc_hdr.valid = TRUE;
+    }
+    *hdr = hxc_hdr.cfg;
+}
+
+/* Write @hdr to HXCSDFE.CFG (fs->file) if it differs from the file's. */
+static void hxc_write_hdr(const struct hxcsdfe_cfg *hdr)
+{
+    if (hxc_hdr.valid && !memcmp(hdr, &hxc_hdr.cfg, sizeof(*hdr)))
+        return;
+    F_lseek(&fs->file, 0);
+    F_write(&fs->file, hdr, sizeof(*hdr), NULL);
+    hxc_hdr.cfg = *hdr;
+    hxc_hdr.valid = TRUE;
+}
+
 static void slot_from_short_slot(
     struct slot *slot, const struct short_slot *short_slot)
 {
@@ -701,6 +817,14 @@ bool_t get_img_cfg(struct slot *slot)
     return TRUE;
 }
 
+bool_t get_img_cfg_index(struct slot *slot)
+{
+    if (!cfg.imgcfg_index.size)
+        return FALSE;
+    slot_from_short_slot(slot, &cfg.imgcfg_index);
+    return TRUE;
+}
+
 static void dump_file(void)
 {
     F_lseek(&fs->file, 0);
@@ -759,6 +883,17 @@ int strcmp_lower(const char *s1, const char *s2)
     return 0;
 }
 
+static int strncmp_lower(const char *s1, const char *s2, int n)
+{
+    for (; n; n--) {
+        int diff = __tolower(*s1) - __tolower(*s2);
+        if (diff || !*s1)
+            return diff;
+        s1++; s2++;
+    }
+    return 0;
+}
+
 static int native_dir_cmp(const void *a, const void *b)
 {
     const struct native_dirent *da = a;
@@ -774,55 +909,563 @@ static int native_dir_cmp(const void *a, const void *b)
     return strcmp_lower(da->name, db->name);
 }
 
+static struct native_dirent *native_dirent_next(struct native_dirent *ent)
+{
+    return (struct native_dirent *)(
+        ((uint32_t)ent + sizeof(*ent) + strlen(ent->name) + 1 + 3) & ~3);
+}
+
+/* Read folder entries into @start..@end, as struct native_dirent growing up
+ * from @start and an array of pointers to them growing down from @end.
+ * Returns TRUE if the whole folder was read. The number of entries is returned
+ * in *@p_nr, and the end of the last entry in *@p_lim. */
+static bool_t native_read_dir(char *start, char *end, int *p_nr, char **p_lim)
+{
+    struct native_dirent **p_ent = (struct native_dirent **)end;
+    struct native_dirent *ent = (struct native_dirent *)start;
+    bool_t complete = FALSE;
+
+    while (((char *)p_ent - (char *)ent)
+           > (FF_MAX_LFN + 1 + sizeof(*ent) + sizeof(ent))) {
+        if (!native_dir_next()) {
+            complete = TRUE;
+            break;
+        }
+        *--p_ent = ent;
+        ASSERT((unsigned int)(fs->fp.dir_ptr - fatfs.win) < 512u);
+        ent->dir_sect = fs->fp.dir_sect;
+        ent->dir_off = fs->fp.dir_ptr - fatfs.win;
+        ent->attr = fs->fp.fattrib;
+        strcpy(ent->name, fs->fp.fname);
+        ent = native_dirent_next(ent);
+    }
+
+    *p_nr = (struct native_dirent **)end - p_ent;
+    *p_lim = (char *)ent;
+    return complete;
+}
+
+/* A sorted folder listing is saved in an index file in the folder, and is
+ * reused until the folder's entries, or the options which affect the listing,
+ * are changed. Small folders are quick to read and sort, so are not indexed.
+ * 
+ * Folders too large to sort in the arena are sorted through the volume
+ * instead: arena-sized runs of entries are sorted into a scratch file, then
+ * merged into a paged index, which is read a page at a time while browsing. */
+#define DIRIDX_NAME "FFDIRIDX.DAT"
+#define DIRIDX_SFN  "FFDIRIDXDAT"
+#define DIRIDX_SIG  0x58444646 /* "FFDX" */
+#define DIRIDX_SIG_PAGED 0x59444646 /* "FFDY" */
+#define DIRIDX_MIN_NR 100
+struct diridx_hdr {
+    uint32_t sig; /* 0 if the index cannot be validated */
+    uint32_t fingerprint; /* Of the folder's entries */
+    uint32_t cdir; /* First cluster of the folder */
+    uint8_t sort_priority, host, lcd, quickdisk;
+    /* Sorted entries follow, as struct native_dirent padded to 4 bytes. In a
+     * paged index they are followed by the offset of each entry, plus the
+     * offset of the end of the last entry. */
+    uint32_t len; /* Bytes of entries */
+    uint32_t nr; /* Number of entries */
+};
+
+#define DIRENT_MIN_SZ (sizeof(struct native_dirent) + 4)
+#define DIRENT_MAX_SZ ((sizeof(struct native_dirent) + FF_MAX_LFN + 1 + 3) & ~3)
+
+#define DIRRUN_NAME "FFDIRRUN.TMP"
+#define DIRRUN_MAX  32 /* Maximum number of sorted runs to merge */
+#define DIRRUN_OFS_NR 128 /* Entry offsets buffered during the merge */
+
+#define DIRPAGE_NR 32
+static struct dirpage {
+    FIL fil;
+    uint32_t tbl; /* File offset of the entry offsets */
+    uint16_t nr; /* Number of entries */
+    uint16_t first, nr_ent; /* Entries currently paged in */
+    uint32_t ofs[DIRPAGE_NR+1];
+    struct native_dirent *ent[DIRPAGE_NR];
+    char buf[2048];
+} *dirpage;
+
+/* Return sorted entry @i, from the paged index if the folder has one. */
+static struct native_dirent *native_sorted_ent(unsigned int i)
+{
+    struct dirpage *pg = dirpage;
+    unsigned int lo, hi, a, b, k;
+    uint32_t sz;
+
+    if (pg == NULL)
+        return cfg.sorted[i];
+
+    if ((i - pg->first) < pg->nr_ent)
+        return pg->ent[i - pg->first];
+
+    /* Read the offsets of the entries surrounding @i. */
+    lo = (i > DIRPAGE_NR/2) ? i - DIRPAGE_NR/2 : 0;
+    hi = min_t(unsigned int, lo + DIRPAGE_NR, pg->nr);
+    F_lseek(&pg->fil, pg->tbl + lo * 4);
+    F_read(&pg->fil, pg->ofs, (hi + 1 - lo) * 4, NULL);
+
+    /* Page in as many of those entries as fit, working outwards from @i. The
+     * offsets were checked when the index was opened, so @i always fits. */
+#define ofs(x) pg->ofs[(x)-lo]
+    a = i;
+    b = i + 1;
+    for (;;) {
+        if ((b < hi) && ((ofs(b+1) - ofs(a)) <= sizeof(pg->buf)))
+            b++;
+        else if ((a > lo) && ((ofs(b) - ofs(a-1)) <= sizeof(pg->buf)))
+            a--;
+        else
+            break;
+    }
+    F_lseek(&pg->fil, sizeof(struct diridx_hdr) + ofs(a));
+    F_read(&pg->fil, pg->buf, ofs(b) - ofs(a), NULL);
+    for (k = a; k < b; k++) {
+        char *p = pg->buf + ofs(k) - ofs(a);
+        sz = ofs(k+1) - ofs(k);
+        p[sz-1] = '\0';
+        pg->ent[k-a] = (struct native_dirent *)p;
+    }
+#undef ofs
+    pg->first = a;
+    pg->nr_ent = b - a;
+
+    return pg->ent[i - a];
+}
+
+/* Initialise @hdr to describe the current folder, using @start..@end as a
+ * buffer. The index file's first cluster and size are returned in *@p_clust
+ * and *@p_size (0 if there is no index). Returns FALSE on error. */
+static bool_t diridx_init(struct diridx_hdr *hdr, char *start, char *end,
+                          DWORD *p_clust, DWORD *p_size)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->cdir = fatfs.cdir;
+    hdr->sort_priority = ff_cfg.sort_priority;
+    hdr->host = ff_cfg.host;
+    hdr->lcd = (display_type == DT_LCD_OLED);
+    hdr->quickdisk = is_quickdisk;
+    if (flashfloppy_dir_fingerprint(&fatfs, DIRIDX_SFN, (BYTE *)start,
+                                    (end - start) / 512,
+                                    &hdr->fingerprint, p_clust, p_size))
+        return FALSE;
+    hdr->sig = DIRIDX_SIG;
+    return TRUE;
+}
+
+/* Check the offsets of a paged index's @nr entries of @len bytes, from @fil,
+ * using @start..@end as a buffer. */
+static bool_t dirpage_check(FIL *fil, uint32_t nr, uint32_t len,
+                            char *start, char *end)
+{
+    uint32_t *ofs = (uint32_t *)start, prev = 0;
+    unsigned int i, j, n, max = (end - start) / sizeof(*ofs);
+    UINT br;
+
+    for (i = 0; i <= nr; i += n) {
+        n = min_t(unsigned int, max, nr + 1 - i);
+        if (f_read(fil, ofs, n * 4, &br) || (br != n * 4))
+            return FALSE;
+        for (j = 0; j < n; j++) {
+            if ((i + j) == 0) {
+                if (ofs[j] != 0)
+                    return FALSE;
+            } else if (((ofs[j] - prev) < DIRENT_MIN_SZ)
+                       || ((ofs[j] - prev) > DIRENT_MAX_SZ)
+                       || (ofs[j] & 3)) {
+                return FALSE;
+            }
+            prev = ofs[j];
+        }
+    }
+
+    return (prev == len);
+}
+
+/* Open the index file at cluster @clust of @size bytes. If it matches @hdr,
+ * load it into @start, and point the entry array ending at @end at its
+ * entries; or, for a paged index, set up dirpage at @start. Returns the number
+ * of entries, or -1 if the index is stale or malformed. */
+static int diridx_open(struct diridx_hdr *hdr, DWORD clust, DWORD size,
+                       char *start, char *end)
+{
+    FIL *fil = (FIL *)(((uint32_t)end - sizeof(FIL)) & ~3);
+    struct native_dirent **p_ent, *ent;
+    struct diridx_hdr ihdr;
+    UINT br;
+    int i;
+
+    if ((clust == 0) || (size < sizeof(ihdr)))
+        return -1;
+
+    /* Open the index file from its directory entry: no name lookup. */
+    memset(fil, 0, sizeof(*fil));
+    fil->obj.fs = &fatfs;
+    fil->obj.id = fatfs.id;
+    fil->obj.sclust = clust;
+    fil->obj.objsize = size;
+    fil->flag = FA_READ;
+    if (f_read(fil, &ihdr, sizeof(ihdr), &br) || (br != sizeof(ihdr))
+        || memcmp(&ihdr.fingerprint, &hdr->fingerprint,
+                  offsetof(struct diridx_hdr, len)
+                  - offsetof(struct diridx_hdr, fingerprint)))
+        return -1;
+
+    if (ihdr.sig == DIRIDX_SIG_PAGED) {
+        struct dirpage *pg = (struct dirpage *)start;
+        if ((ihdr.nr >= 0xffff) || (ihdr.len > size)
+            || (size - ihdr.len != sizeof(ihdr) + (ihdr.nr + 1) * 4)
+            || ((char *)(pg + 1) + 4 > (char *)fil)
+            || f_lseek(fil, sizeof(ihdr) + ihdr.len)
+            || !dirpage_check(fil, ihdr.nr, ihdr.len,
+                              (char *)(pg + 1), (char *)fil))
+            return -1;
+        memcpy(&pg->fil, fil, sizeof(*fil));
+        pg->tbl = sizeof(ihdr) + ihdr.len;
+        pg->nr = ihdr.nr;
+        pg->first = pg->nr_ent = 0;
+        dirpage = pg;
+        goto out;
+    }
+
+    if ((ihdr.sig != DIRIDX_SIG)
+        || (ihdr.len != size - sizeof(ihdr))
+        || (ihdr.len > (char *)fil - start)
+        || (ihdr.nr > (end - start) / sizeof(ent))
+        || (ihdr.len + ihdr.nr * sizeof(ent) > end - start)
+        || f_read(fil, start, ihdr.len, &br) || (br != ihdr.len))
+        return -1;
+
+    /* Walk the entries, checking that they exactly fill the index. */
+    p_ent = (struct native_dirent **)end - ihdr.nr;
+    ent = (struct native_dirent *)start;
+    for (i = 0; i < ihdr.nr; i++) {
+        int rem = start + ihdr.len - ent->name;
+        if ((rem <= 0) || (strnlen(ent->name, rem) == rem))
+            return -1;
+        p_ent[i] = ent;
+        ent = native_dirent_next(ent);
+    }
+    if ((char *)ent != start + ihdr.len)
+        return -1;
+
+out:
+    hdr->len = ihdr.len;
+    hdr->nr = ihdr.nr;
+    return ihdr.nr;
+}
+
+static FRESULT diridx_write(FIL *fil, const void *p, UINT sz)
+{
+    UINT bw;
+    FRESULT fr = f_write(fil, p, sz, &bw);
+    return (!fr && (bw != sz)) ? FR_DISK_FULL : fr;
+}
+
+static FRESULT diridx_read(FIL *fil, FSIZE_t ofs, void *p, UINT sz)
+{
+    UINT br;
+    FRESULT fr = f_lseek(fil, ofs);
+    if (!fr)
+        fr = f_read(fil, p, sz, &br);
+    return (!fr && (br != sz)) ? FR_DISK_ERR : fr;
+}
+
+/* Save sorted entries @p_ent[0..@nr-1] as the index described by @hdr, using
+ * @fil as a file handle. */
+static void diridx_save(struct diridx_hdr *hdr, struct native_dirent **p_ent,
+                        int nr, FIL *fil)
+{
+    FRESULT fr;
+    int i;
+
+    if (!hdr->sig || (nr < DIRIDX_MIN_NR) || volume_readonly())
+        return;
+
+    hdr->nr = nr;
+    hdr->len = 0;
+    for (i = 0; i < nr; i++)
+        hdr->len += (char *)native_dirent_next(p_ent[i]) - (char *)p_ent[i];
+
+    fr = f_open(fil, DIRIDX_NAME, FA_CREATE_ALWAYS | FA_WRITE);
+    if (fr)
+        goto out;
+    fr = diridx_write(fil, hdr, sizeof(*hdr));
+    for (i = 0; !fr && (i < nr); i++)
+        fr = diridx_write(fil, p_ent[i], (char *)native_dirent_next(p_ent[i])
+                          - (char *)p_ent[i]);
+    if (!fr)
+        fr = f_close(fil);
+    else
+        (void)f_close(fil);
+
+out:
+    printk("Folder index: %u entries: %s (%d)\n",
+           nr, fr ? "Save failed" : "Saved", fr);
+}
+
+/* Sort the current folder into a paged index described by @hdr, using arena
+ * space @start..@end. Returns the number of entries, or -1 on failure. */
+static int diridx_sort_paged(struct diridx_hdr *hdr, char *start, char *end)
+{
+    struct dirrun {
+        uint32_t pos, end; /* Unread part of the run in the scratch file */
+        char *buf, *p, *lim; /* Buffered part of the run */
+    } *run = (struct dirrun *)start, *r, *best;
+    struct native_dirent **p_ent;
+    FIL *rfil, *ofil;
+    uint32_t *ofs, tbl, tbl_end, len = 0;
+    unsigned int i, nr_runs = 0, nr_ofs = 0, bsz;
+    char *bufs, *top, *lim;
+    DWORD clust = 0, size = 0;
+    bool_t more;
+    FRESULT fr;
+    int n, nr = 0;
+
+    if (!hdr->sig || volume_readonly())
+        return -1;
+
+    /* File handles at the top of the arena, and run table at the bottom. */
+    top = (char *)(((uint32_t)end - 2*sizeof(FIL)) & ~3);
+    rfil = (FIL *)top;
+    ofil = rfil + 1;
+    memset(rfil, 0, 2*sizeof(FIL));
+    ofs = (uint32_t *)(run + DIRRUN_MAX);
+    bufs = (char *)(ofs + DIRRUN_OFS_NR);
+
+    fr = f_open(rfil, DIRRUN_NAME, FA_CREATE_ALWAYS | FA_READ | FA_WRITE);
+    if (!fr)
+        fr = f_open(ofil, DIRIDX_NAME, FA_CREATE_ALWAYS | FA_WRITE);
+    if (fr)
+        goto out;
+
+    /* Sort the folder into runs in the scratch file. */
+    F_opendir(&fs->dp, "");
+    do {
+        if (nr_runs == DIRRUN_MAX) {
+            fr = FR_NOT_ENOUGH_CORE;
+            break;
+        }
+        more = !native_read_dir(bufs, top, &n, &lim);
+        p_ent = (struct native_dirent **)top - n;
+        qsort_p(p_ent, n, native_dir_cmp);
+        r = &run[nr_runs++];
+        r->pos = f_tell(rfil);
+        for (i = 0; !fr && (i < n); i++)
+            fr = diridx_write(rfil, p_ent[i],
+                              (char *)native_dirent_next(p_ent[i])
+                              - (char *)p_ent[i]);
+        r->end = f_tell(rfil);
+        nr += n;
+    } while (!fr && more);
+    F_closedir(&fs->dp);
+    bsz = ((top - bufs) / nr_runs) & ~3;
+    if (!fr && ((nr >= 0xffff) || (bsz < DIRENT_MAX_SZ)))
+        fr = FR_NOT_ENOUGH_CORE;
+    if (fr)
+        goto out;
+
+    /* Merge the runs into the index. Entry offsets are staged at the end of
+     * the scratch file, and appended to the index when the merge is done. */
+    for (i = 0; i < nr_runs; i++) {
+        r = &run[i];
+        r->buf = r->p = r->lim = bufs + i * bsz;
+    }
+    tbl = tbl_end = f_tell(rfil);
+    memset(ofs, 0, sizeof(*hdr));
+    fr = diridx_write(ofil, ofs, sizeof(*hdr));
+    while (!fr) {
+        best = NULL;
+        for (i = 0; i < nr_runs; i++) {
+            r = &run[i];
+            if (((r->lim - r->p) < DIRENT_MAX_SZ) && (r->pos < r->end)) {
+                /* Top up the buffer, keeping any part-consumed entry. */
+                n = r->lim - r->p;
+                memmove(r->buf, r->p, n);
+                r->p = r->buf;
+                r->lim = r->buf + n;
+                n = min_t(uint32_t, bsz - n, r->end - r->pos);
+                if ((fr = diridx_read(rfil, r->pos, r->lim, n)) != FR_OK)
+                    break;
+                r->lim += n;
+                r->pos += n;
+            }
+            if ((r->p < r->lim)
+                && (!best || (native_dir_cmp(r->p, best->p) < 0)))
+                best = r;
+        }
+        if (fr)
+            break;
+        if (best != NULL) {
+            n = (char *)native_dirent_next((struct native_dirent *)best->p)
+                - best->p;
+            fr = diridx_write(ofil, best->p, n);
+            best->p += n;
+            ofs[nr_ofs++] = len;
+            len += n;
+        } else {
+            ofs[nr_ofs++] = len;
+        }
+        if ((nr_ofs == DIRRUN_OFS_NR) || (best == NULL)) {
+            if (!fr)
+                fr = f_lseek(rfil, tbl_end);
+            if (!fr)
+                fr = diridx_write(rfil, ofs, nr_ofs * 4);
+            tbl_end += nr_ofs * 4;
+            nr_ofs = 0;
+        }
+        if (best == NULL)
+            break;
+    }
+
+    /* Append the entry offsets, then write the real header. */
+    for (; !fr && (tbl < tbl_end); tbl += n) {
+        n = min_t(uint32_t, top - bufs, tbl_end - tbl);
+        fr = diridx_read(rfil, tbl, bufs, n);
+        if (!fr)
+            fr = diridx_write(ofil, bufs, n);
+    }
+    if (!fr) {
+        hdr->sig = DIRIDX_SIG_PAGED;
+        hdr->len = len;
+        hdr->nr = nr;
+        fr = f_lseek(ofil, 0);
+        if (!fr)
+            fr = diridx_write(ofil, hdr, sizeof(*hdr));
+        hdr->sig = DIRIDX_SIG;
+        clust = ofil->obj.sclust;
+        size = f_size(ofil);
+    }
+
+out:
+    if (!fr)
+        fr = f_close(ofil);
+    else
+        (void)f_close(ofil);
+    (void)f_close(rfil);
+    (void)f_unlink(DIRRUN_NAME);
+    if (fr)
+        (void)f_unlink(DIRIDX_NAME);
+    printk("Folder index: %u entries in %u runs: %s (%d)\n",
+           nr, nr_runs, fr ? "Sort failed" : "Sorted", fr);
+
+    return fr ? -1 : diridx_open(hdr, clust, size, start, end);
+}
+
 /* Returns -1 if not read & sorted. */
 static int native_read_and_sort_dir(void)
 {
     struct native_dirent **p_ent;
-    struct native_dirent *ent = arena_alloc(0);
     char *start = arena_alloc(0);
     char *end = start + arena_avail();
+    char *lim = start;
+    struct diridx_hdr hdr;
+    DWORD clust, size;
+    bool_t complete;
     int nr;
 
+    dirpage = NULL;
+
     if (ff_cfg.folder_sort == SORT_never)
         return -1;
 
     volume_cache_destroy();
 
-    F_opendir(&fs->dp, "");
-    p_ent = (struct native_dirent **)end;
-    while (((char *)p_ent - (char *)ent)
-           > (FF_MAX_LFN + 1 + sizeof(*ent) + sizeof(ent))) {
-        if (!native_dir_next())
-            goto complete;
-        *--p_ent = ent;
-        ASSERT((unsigned int)(fs->fp.dir_ptr - fatfs.win) < 512u);
-        ent->dir_sect = fs->fp.dir_sect;
-        ent->dir_off = fs->fp.dir_ptr - fatfs.win;
-        ent->attr = fs->fp.fattrib;
-        strcpy(ent->name, fs->fp.fname);
-        ent = (struct native_dirent *)(
-            ((uint32_t)ent + sizeof(*ent) + strlen(ent->name) + 1 + 3) & ~3);
+    if (diridx_init(&hdr, start, end - sizeof(FIL), &clust, &size)
+        && ((nr = diridx_open(&hdr, clust, size, start, end)) >= 0)) {
+        printk("Folder index: %u entries: Loaded\n", nr);
+        lim = start + hdr.len;
+        goto indexed;
     }
 
-    if (ff_cfg.folder_sort == SORT_always)
-        goto complete;
-
-    volume_cache_init(start, end);
-    cfg.sorted = NULL;
-    return -1;
+    F_opendir(&fs->dp, "");
+    complete = native_read_dir(start, end, &nr, &lim);
+    F_closedir(&fs->dp);
 
-complete:
-    nr = (struct native_dirent **)end - p_ent;
+    if (!complete) {
+        if (ff_cfg.folder_sort != SORT_always) {
+            arena_note(ARENA_dirents, 0);
+            arena_note(ARENA_cache, end - start);
+            volume_cache_init(start, end);
+            cfg.sorted = NULL;
+            return -1;
+        }
+        if ((nr = diridx_sort_paged(&hdr, start, end)) >= 0)
+            goto indexed;
+        /* Sort as many entries as fit, as a last resort. */
+        F_opendir(&fs->dp, "");
+        (void)native_read_dir(start, end, &nr, &lim);
+        F_closedir(&fs->dp);
+    }
 
+    p_ent = (struct native_dirent **)end - nr;
     qsort_p(p_ent, nr, native_dir_cmp);
 
-    F_closedir(&fs->dp);
+    if (complete && (((char *)p_ent - lim) >= sizeof(FIL)))
+        diridx_save(&hdr, p_ent, nr, (FIL *)lim);
 
-    volume_cache_init(ent, p_ent);
-    cfg.sorted = p_ent;
+indexed:
+    if (dirpage) {
+        lim = (char *)(dirpage + 1);
+        p_ent = (struct native_dirent **)end;
+        cfg.sorted = dirpage->ent;
+    } else {
+        p_ent = (struct native_dirent **)end - nr;
+        cfg.sorted = p_ent;
+    }
+    /* The volume cache gets whatever the sorted entries leave free. */
+    arena_note(ARENA_dirents, (end - start) - ((char *)p_ent - lim));
+    arena_note(ARENA_cache, (char *)p_ent - lim);
+    volume_cache_init(lim, p_ent);
     return nr;
 }
 
+/* Find the first of @nr sorted entries whose name matches the first @len
+ * characters of @name. Returns -1 if there is none. */
+static int native_sorted_find(const char *name, int len, int nr)
+{
+    int grp[3] = { 0, nr, nr };
+    int g, lo, hi, mid;
+    const char *s;
+
+    /* Folders and files are sorted separately, unless sort-priority=none. */
+    if (ff_cfg.sort_priority != SORTPRI_none) {
+        uint8_t first = (ff_cfg.sort_priority == SORTPRI_folders) ? AM_DIR : 0;
+        lo = 0; hi = nr;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if ((native_sorted_ent(mid)->attr & AM_DIR) == first)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        grp[1] = lo;
+    }
+
+    for (g = 0; g < 2; g++) {
+        /* Binary search for the first case-insensitive match... */
+        lo = grp[g]; hi = grp[g+1];
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (strncmp_lower(native_sorted_ent(mid)->name, name, len) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        /* ...then step through those for an exact match. */
+        for (; lo < grp[g+1]; lo++) {
+            s = native_sorted_ent(lo)->name;
+            if (strncmp_lower(s, name, len))
+                break;
+            if (!strncmp(s, name, len))
+                return lo;
+        }
+    }
+
+    return -1;
+}
+
 static void update_slot_by_name(void)
 {
     const char *name = cfg.slot.name;
@@ -834,9 +1477,8 @@ static void update_slot_by_name(void)
         max = cfg.max_slot_nr;
         if (cfg.depth)
             max--;
-        for (nr = 0; nr <= max; nr++)
-            if (!strncmp(cfg.sorted[nr]->name, name, len))
-                break;
+        if ((nr = native_sorted_find(name, len, max+1)) < 0)
+            nr = max+1;
         if (cfg.depth)
             nr++;
 
@@ -861,7 +1503,7 @@ static void update_slot_by_name(void)
         
         slot_from_short_slot(slot, &cfg.hxcsdfe);
         fatfs_from_slot(&fs->file, slot, FA_READ);
-        F_read(&fs->file, &hxc->cfg, sizeof(hxc->cfg), NULL);
+        hxc_read_hdr(&hxc->cfg, FALSE);
         if (hxc->cfg.index_mode)
             goto out;
         for (nr = 1; nr <= cfg.max_slot_nr; nr++) {
@@ -930,6 +1572,7 @@ static void read_ff_cfg(void)
 
     FRESULT fr;
     int option;
+    struct ff_cfg_src src;
     struct opts opts = {
         .file = &fs->file,
         .opts = ff_cfg_opts,
@@ -942,6 +1585,23 @@ static void read_ff_cfg(void)
     if (fr)
         return;
 
+    /* No need to parse the file if it was parsed into the Flashed config. */
+    memset(&src, 0, sizeof(src));
+    src.clust = fs->file.obj.sclust;
+    src.size = f_size(&fs->file);
+    if (f_stat("FF.CFG", &fs->fp) == FR_OK)
+        src.mtime = (fs->fp.fdate << 16) | fs->fp.ftime;
+    if (flash_ff_cfg_src_match(&src)) {
+        printk("Config: FF.CFG is unchanged\n");
+        cfg.ffcfg_has_step_volume = !!(src.flags & FFCFG_HAS_step_volume);
+        cfg.ffcfg_has_display_off_secs =
+            !!(src.flags & FFCFG_HAS_display_off_secs);
+        cfg.ffcfg_has_display_scroll_rate =
+            !!(src.flags & FFCFG_HAS_display_scroll_rate);
+        F_close(&fs->file);
+        return;
+    }
+
     while ((option = get_next_opt(&opts)) != -1) {
 
         switch (option) {
@@ -1014,6 +1674,10 @@ static void read_ff_cfg(void)
             ff_cfg.index_suppression = !strcmp(opts.arg, "yes");
             break;
 
+        case FFCFG_track_cache:
+            ff_cfg.track_cache = !strcmp(opts.arg, "yes");
+            break;
+
         case FFCFG_head_settle_ms:
             ff_cfg.head_settle_ms = strtol(opts.arg, NULL, 10);
             break;
@@ -1267,12 +1931,39 @@ static void read_ff_cfg(void)
             ff_cfg.extend_image = !strcmp(opts.arg, "yes");
             break;
 
+        case FFCFG_read_ahead:
+            ff_cfg.read_ahead = min_t(unsigned int, 16,
+                                      strtol(opts.arg, NULL, 10));
+            break;
+
+        case FFCFG_metadata_write_back:
+            ff_cfg.metadata_write_back = !strcmp(opts.arg, "yes");
+            break;
+
+        case FFCFG_write_journal:
+            ff_cfg.write_journal = !strcmp(opts.arg, "yes");
+            break;
+
+        case FFCFG_read_batch_ms:
+            ff_cfg.read_batch_ms = range_t(int, strtol(opts.arg, NULL, 10),
+                                           1, 100);
+            break;
+
+        case FFCFG_image_sync_ms:
+            ff_cfg.image_sync_ms = min_t(unsigned int, 60000,
+                                         strtol(opts.arg, NULL, 10));
+            break;
+
         }
     }
 
     F_close(&fs->file);
 
-    flash_ff_cfg_update(fs->buf);
+    src.flags = (cfg.ffcfg_has_step_volume ? FFCFG_HAS_step_volume : 0)
+        | (cfg.ffcfg_has_display_off_secs ? FFCFG_HAS_display_off_secs : 0)
+        | (cfg.ffcfg_has_display_scroll_rate
+           ? FFCFG_HAS_display_scroll_rate : 0);
+    flash_ff_cfg_update(fs->buf, &src);
 }
 
 static void process_ff_cfg_opts(const struct ff_cfg *old)
@@ -1316,15 +2007,34 @@ static void cfg_init(void)
     fr = f_chdir("FF");
     cfg.cfg_cdir = fatfs.cdir;
 
+    image_probe_cache_flush();
     memset(&cfg.imgcfg, 0, sizeof(cfg.imgcfg));
+    memset(&cfg.imgcfg_index, 0, sizeof(cfg.imgcfg_index));
     fr = F_try_open(&fs->file, "IMG.CFG", FA_READ);
     if (!fr) {
         fatfs_to_short_slot(&cfg.imgcfg, &fs->file, "IMG.CFG");
+#if !defined(QUICKDISK)
+        {
+            /* Free arena space is borrowed from the volume cache. */
+            uint8_t *p = arena_mark();
+            FIL *idx = arena_alloc(sizeof(*idx));
+            volume_cache_destroy();
+            if ((f_stat("IMG.CFG", &fs->fp) == FR_OK)
+                && img_cfg_index(&fs->file, (fs->fp.fdate << 16)
+                                 | fs->fp.ftime, idx,
+                                 fs->buf, sizeof(fs->buf)))
+                fatfs_to_short_slot(&cfg.imgcfg_index, idx,
+                                    IMG_CFG_INDEX_NAME);
+            arena_release(p);
+            volume_cache_init(p, p + arena_avail());
+        }
+#endif
         F_close(&fs->file);
     }
 
     read_ff_cfg();
     process_ff_cfg_opts(&old_ff_cfg);
+    volume_set_writeback(ff_cfg.metadata_write_back ? &fatfs : NULL);
 
     switch (ff_cfg.nav_mode) {
     case NAVMODE_native:
@@ -1418,9 +2128,7 @@ native_mode:
             F_die(FR_PATH_TOO_DEEP);
         /* Find slot nr, and stack it */
         if ((nr = native_read_and_sort_dir()) != -1) {
-            while (--nr >= 0)
-                if (!strcmp(cfg.sorted[nr]->name, fs->buf))
-                    break;
+            nr = native_sorted_find(fs->buf, strlen(fs->buf)+1, nr);
             ok = (nr >= 0);
             cfg.sorted = NULL;
         } else {
@@ -1468,10 +2176,8 @@ native_mode:
         cfg.slot_nr = cfg.depth ? 1 : 0;
         if (cfg.sorted) {
             nr = cfg.max_slot_nr + 1 - cfg.slot_nr;
-            for (i = 0; i < nr; i++)
-                if (!strcmp(cfg.sorted[i]->name, fs->buf))
-                    break;
-            ok = (i < nr);
+            i = native_sorted_find(fs->buf, strlen(fs->buf)+1, nr);
+            ok = (i >= 0);
             cfg.slot_nr += i;
         } else {
             F_opendir(&fs->dp, "");
@@ -1510,6 +2216,8 @@ static void native_get_slot_map(bool_t sorted_only)
     /* Populate slot_map[]. */
     memset(&cfg.slot_map, 0xff, sizeof(cfg.slot_map));
     cfg.max_slot_nr = cfg.depth ? 1 : 0;
+    cfg.nr_dir_ckpt = cfg.nr_dir_hint = 0;
+    cfg.dir_ckpt_cdir = fatfs.cdir;
 
     if ((i = native_read_and_sort_dir()) != -1) {
         cfg.max_slot_nr += i;
@@ -1517,9 +2225,14 @@ static void native_get_slot_map(bool_t sorted_only)
         if (sorted_only)
             return;
         F_opendir(&fs->dp, "");
-        while (native_dir_next())
-            cfg.max_slot_nr++;
+        for (i = 0; ; i++) {
+            if (!(i % DIRCKPT_GAP) && (i / DIRCKPT_GAP < DIRCKPT_NR))
+                cfg.dir_ckpt[cfg.nr_dir_ckpt++] = fs->dp.dptr;
+            if (!native_dir_next())
+                break;
+        }
         F_closedir(&fs->dp);
+        cfg.max_slot_nr += i;
     }
 
     /* Adjust max_slot_nr. Must be at least one 'slot'. */
@@ -1612,7 +2325,7 @@ static void native_update(uint8_t slot_mode)
 
     if (cfg.sorted) {
 
-        struct native_dirent *ent = cfg.sorted[cfg.slot_nr-i];
+        struct native_dirent *ent = native_sorted_ent(cfg.slot_nr-i);
         snprintf(fs->fp.fname, sizeof(fs->fp.fname), ent->name);
         fs->file.obj.fs = &fatfs;
         fs->file.dir_sect = ent->dir_sect;
@@ -1625,11 +2338,42 @@ static void native_update(uint8_t slot_mode)
 
     } else {
 
+        unsigned int n = 0, target = cfg.slot_nr - i;
+        uint32_t ofs;
         F_opendir(&fs->dp, "");
-        while (native_dir_next()) {
-            if (i >= cfg.slot_nr)
+        /* Start from the nearest checkpoint or hint at or before the slot. */
+        if (cfg.nr_dir_ckpt && (cfg.dir_ckpt_cdir == fatfs.cdir)) {
+            unsigned int k = target / DIRCKPT_GAP;
+            k = min_t(unsigned int, k, cfg.nr_dir_ckpt - 1);
+            n = k * DIRCKPT_GAP;
+            ofs = cfg.dir_ckpt[k];
+            for (k = 0; k < cfg.nr_dir_hint; k++) {
+                if ((cfg.dir_hint[k].idx <= target)
+                    && (cfg.dir_hint[k].idx > n)) {
+                    n = cfg.dir_hint[k].idx;
+                    ofs = cfg.dir_hint[k].ofs;
+                }
+            }
+            flashfloppy_dir_seek(&fs->dp, ofs);
+        }
+        cfg.nr_dir_hint = 0;
+        for (;;) {
+            ofs = fs->dp.dptr;
+            if (!native_dir_next())
+                break;
+            if (n + 1 >= target) {
+                cfg.dir_hint[cfg.nr_dir_hint].idx = n;
+                cfg.dir_hint[cfg.nr_dir_hint++].ofs = ofs;
+            }
+            if (n >= target) {
+                /* dptr is left at the final entry at end of directory. */
+                if (fs->dp.sect != 0) {
+                    cfg.dir_hint[cfg.nr_dir_hint].idx = n + 1;
+                    cfg.dir_hint[cfg.nr_dir_hint++].ofs = fs->dp.dptr;
+                }
                 break;
-            i++;
+            }
+            n++;
         }
         F_closedir(&fs->dp);
         if (fs->fp.fattrib & AM_DIR) {
@@ -1715,7 +2459,7 @@ static void hxc_cfg_update(uint8_t slot_mode)
 
     slot_from_short_slot(&cfg.slot, &cfg.hxcsdfe);
     fatfs_from_slot(&fs->file, &cfg.slot, mode);
-    F_read(&fs->file, &hxc->cfg, sizeof(hxc->cfg), NULL);
+    hxc_read_hdr(&hxc->cfg, slot_mode == CFG_READ_SLOT_NR);
     if (strncmp("HXCFECFGV", hxc->cfg.signature, 9))
         goto bad_signature;
 
@@ -1739,8 +2483,7 @@ static void hxc_cfg_update(uint8_t slot_mode)
             hxc->cfg.slot_index = cfg.slot_nr;
             if (slot_mode == CFG_WRITE_SLOT_NR) {
                 /* Update the config file with new slot number. */
-                F_lseek(&fs->file, 0);
-                F_write(&fs->file, &hxc->cfg, sizeof(hxc->cfg), NULL);
+                hxc_write_hdr(&hxc->cfg);
             }
         }
         cfg.slot_nr = hxc->cfg.slot_index;
@@ -1770,10 +2513,8 @@ static void hxc_cfg_update(uint8_t slot_mode)
     case 2:
         if (slot_mode != CFG_READ_SLOT_NR) {
             hxc->cfg.cur_slot_number = cfg.slot_nr;
-            if (slot_mode == CFG_WRITE_SLOT_NR) {
-                F_lseek(&fs->file, 0);
-                F_write(&fs->file, &hxc->cfg, sizeof(hxc->cfg), NULL);
-            }
+            if (slot_mode == CFG_WRITE_SLOT_NR)
+                hxc_write_hdr(&hxc->cfg);
         }
         cfg.slot_nr = hxc->cfg.cur_slot_number;
         if (hxc->cfg.index_mode)
@@ -2057,6 +2798,7 @@ static int run_floppy(void *_b)
     volatile uint8_t *pb = _b;
     time_t t_now, t_prev, t_diff;
     int32_t update_ticks;
+    FOP count_op = F_async_get_completed_op(), wb_op = count_op;
 
     floppy_insert(0, &cfg.slot);
 
@@ -2079,6 +2821,14 @@ static int run_floppy(void *_b)
         canary_check();
         assert_volume_connected();
         t_prev = t_now;
+        if (floppy_idle()) {
+            if (!free_clst_valid() && F_async_isdone(count_op))
+                count_op = F_count_free_async(&fatfs, 1);
+            if (volume_writeback_due() && F_async_isdone(wb_op))
+                wb_op = disk_ioctl_async(0, CTRL_SYNC, NULL, NULL);
+            logfile_stream();
+            thread_idle();
+        }
     }
 
     floppy_sync();
@@ -2100,13 +2850,17 @@ static void floppy_arena_setup(void)
     } else {
         unsigned int cache_len = arena_avail();
         uint8_t *cache_start = arena_alloc(0);
+        arena_note(ARENA_cache, cache_len);
         volume_cache_init(cache_start, cache_start + cache_len);
     }
+
+    arena_report();
 }
 
 static void floppy_arena_teardown(void)
 {
     fs = NULL;
+    hxc_hdr.valid = FALSE;
     volume_cache_destroy();
 }
 
@@ -2127,6 +2881,24 @@ static void noinline volume_space(void)
 
 }
 
+/* FSINFO does not always provide a free-cluster count. Count free clusters
+ * one FAT sector at a time while the UI is idle (or, while an image is
+ * mounted, on the I/O thread), then show the result. From then on FatFS
+ * keeps the count up to date. */
+static void volume_space_poll(void)
+{
+    FRESULT fr;
+
+    if (free_clst_valid())
+        return;
+
+    fr = flashfloppy_count_free(&fatfs, 1);
+    if (fr == FR_OK)
+        volume_space();
+    else if (fr != FR_TIMEOUT)
+        F_die(fr);
+}
+
 /* Wait 50ms for 2-button press. */
 static uint8_t wait_twobutton_press(uint8_t b)
 {
@@ -2152,6 +2924,7 @@ static uint8_t menu_wait_button(bool_t twobutton_eject, const char *led_msg)
     while ((b = buttons) == 0) {
         /* Bail if USB disconnects. */
         assert_volume_connected();
+        volume_space_poll();
         /* Update the display. */
         delay_ms(1);
         switch (display_type) {
@@ -2246,10 +3019,11 @@ static void image_copy(void)
 
 static void image_paste(const char *subfolder)
 {
-    time_t t;
-    uint32_t cur_cdir = fatfs.cdir;
-    int i, baselen, todo, idx, max_idx = -1;
-    char *p, *q;
+    time_t t, t_copy;
+    uint32_t cur_cdir = fatfs.cdir, done, ms;
+    int i, baselen, todo, idx, max_idx = -1, chunk, nr;
+    char *p, *q, msg[17];
+    FRESULT fres;
     FIL *nfil;
     bool_t use_basename = FALSE;
     const struct slot *slot = &cfg.clipboard;
@@ -2274,7 +3048,6 @@ static void image_paste(const char *subfolder)
     if (p == NULL) {
         /* Source filename is not of the form '*_000'. Does it exist at the 
          * destinaton? */
-        FRESULT fres;
         p = fs->buf + strlen(fs->buf);
         snprintf(p, sizeof(fs->buf)-(p-fs->buf), ".%s", slot->type);
         fres = f_stat(fs->buf, &fs->fp);
@@ -2333,15 +3106,34 @@ static void image_paste(const char *subfolder)
     fatfs_from_slot(&fs->file, slot, FA_READ);
     nfil = arena_alloc(sizeof(*nfil));
     F_open(nfil, fs->buf, FA_CREATE_NEW|FA_WRITE);
-    todo = f_size(&fs->file); 
-    while (todo != 0) {
-        int nr = min_t(int, todo, arena_avail());
-        void *p = arena_alloc(0);
+    todo = f_size(&fs->file);
+
+    /* Allocate the clone as one contiguous run of clusters if possible: Its
+     * FAT is then written once, and each chunk is one multi-sector write. */
+    fres = f_expand(nfil, todo, 1);
+    if ((fres != FR_OK) && (fres != FR_DENIED))
+        F_die(fres);
+
+    /* Copy in sector-aligned chunks as large as the free arena. */
+    chunk = arena_avail() & ~511;
+    ASSERT(chunk != 0);
+    p = arena_alloc(0);
+    t_copy = time_now();
+    for (done = 0; done < f_size(&fs->file); done += nr) {
+        nr = min_t(int, todo, chunk);
         F_read(&fs->file, p, nr, NULL);
         F_write(nfil, p, nr, NULL);
         todo -= nr;
+        /* Progress and throughput (bytes per ms is kB/s). */
+        ms = max_t(uint32_t, time_since(t_copy) / time_ms(1), 1);
+        snprintf(msg, sizeof(msg), "%3u%% %ukB/s",
+                 (done + nr) / ((f_size(&fs->file) + 99) / 100),
+                 (done + nr) / ms);
+        lcd_write(0, 1, -1, msg);
     }
     F_close(nfil);
+    printk("Paste: %u bytes in %u ms\n",
+           done, time_since(t_copy) / time_ms(1));
     fatfs.cdir = cfg.cur_cdir;
     floppy_arena_setup();
     if (!cfg.sorted)
@@ -2642,7 +3434,7 @@ static int floppy_main(void *unused)
         printk("Attr: %02x Clus: %08x Size: %u\n",
                cfg.slot.attributes, cfg.slot.firstCluster, cfg.slot.size);
 
-        logfile_flush(&fs->file);
+        logfile_flush();
 
         if (cfg.ejected) {
             cfg.ejected = FALSE;
@@ -2658,7 +3450,7 @@ static int floppy_main(void *unused)
                 lcd_on();
             }
             floppy_arena_setup();
-            logfile_flush(&fs->file);
+            logfile_flush();
             volume_space();
         }
 
@@ -2853,6 +3645,213 @@ static void ff_osd_configure(void)
     }
 }
 
+/* Storage benchmark: Sequential and random reads and writes of each
+ * transfer size, against a scratch file in the root folder, via the same
+ * FatFS and volume paths as the image handlers. The file is newly created,
+ * as FFBENCHn.TMP for the first free n: Existing files are never touched. */
+#define BENCH_FILE     "FFBENCH%u.TMP"
+#define BENCH_FILE_SZ  (1u << 20)
+#define BENCH_BYTES    (256u << 10) /* Bytes per test, but at least... */
+#define BENCH_MIN_OPS  100          /* ...this many operations, for p99 */
+#define BENCH_MAX_OPS  (BENCH_BYTES / 512)
+static const uint16_t bench_sz[] = { 512, 4096, 32768 };
+#define BENCH_NR       (ARRAY_SIZE(bench_sz) * 4)
+
+static struct bench {
+    FIL file;
+    bool_t created; /* The file exists, and must be removed */
+    char name[13];
+    uint8_t *buf;
+    uint32_t buf_sz;
+    struct bench_res {
+        uint16_t rate;    /* 10kB/s, or 0 if not run */
+        uint16_t avg_us, p99_us;
+    } res[BENCH_NR];
+    uint16_t lat_us[BENCH_MAX_OPS];
+} *bench;
+
+/* Test @t: bit 0 = write, bit 1 = random; size bench_sz[@t>>2]. */
+static void bench_run(unsigned int t)
+{
+    struct bench_res *res = &bench->res[t];
+    bool_t write = t & 1, random = t & 2;
+    uint32_t sz = bench_sz[t >> 2], nr_pos = BENCH_FILE_SZ / sz;
+    unsigned int i, j, k, ops, max = 0, sum = 0;
+    uint32_t us;
+    time_t t0, t1;
+
+    if (sz > bench->buf_sz)
+        return;
+
+    ops = max_t(unsigned int, BENCH_MIN_OPS, BENCH_BYTES / sz);
+    t0 = time_now();
+    for (i = 0; i < ops; i++) {
+        uint32_t pos = random ? rand() & (nr_pos - 1) : i & (nr_pos - 1);
+        t1 = time_now();
+        F_lseek(&bench->file, pos * sz);
+        if (write)
+            F_write(&bench->file, bench->buf, sz, NULL);
+        else
+            F_read(&bench->file, bench->buf, sz, NULL);
+        us = time_diff(t1, time_now()) / TIME_MHZ;
+        bench->lat_us[i] = min_t(uint32_t, us, 0xffff);
+        sum += us;
+    }
+    if (write)
+        F_sync(&bench->file);
+    us = max_t(uint32_t, time_diff(t0, time_now()) / TIME_MHZ, 1);
+
+    /* Bytes per microsecond is MB/s. */
+    res->rate = max_t(uint32_t, (ops * sz * 100) / us, 1);
+    res->avg_us = min_t(uint32_t, sum / ops, 0xffff);
+
+    /* p99: Discard the slowest 1% of operations, then take the maximum. */
+    for (k = 0; k <= ops / 100; k++) {
+        for (i = j = 0; i < ops; i++)
+            if (bench->lat_us[i] > bench->lat_us[j])
+                j = i;
+        max = bench->lat_us[j];
+        bench->lat_us[j] = 0;
+    }
+    res->p99_us = max;
+}
+
+static int bench_main(void *unused)
+{
+    char msg[17];
+    unsigned int t;
+    FRESULT fr;
+
+    if (volume_readonly())
+        F_die(FR_WRITE_PROTECTED);
+
+    /* Pre-allocate the file: Extending seeks allocate clusters. */
+    for (t = 0; ; t++) {
+        snprintf(bench->name, sizeof(bench->name), BENCH_FILE, t);
+        fr = f_open(&bench->file, bench->name,
+                    FA_CREATE_NEW|FA_READ|FA_WRITE);
+        if (fr == FR_OK)
+            break;
+        if ((fr != FR_EXIST) || (t == 9))
+            F_die(fr);
+    }
+    bench->created = TRUE;
+    F_lseek(&bench->file, BENCH_FILE_SZ);
+    if (f_tell(&bench->file) != BENCH_FILE_SZ)
+        F_die(FR_DISK_FULL);
+
+    for (t = 0; t < BENCH_NR; t++) {
+        snprintf(msg, sizeof(msg), "Bench %u/%u...", t + 1, BENCH_NR);
+        lcd_write(0, 1, -1, msg);
+        bench_run(t ^ 1); /* each write test before the matching read */
+    }
+
+    F_close(&bench->file);
+    bench->created = FALSE;
+    (void)f_unlink(bench->name);
+
+    return 0;
+}
+
+static void bench_print(unsigned int t, char *msg0, char *msg1)
+{
+    struct bench_res *res = &bench->res[t];
+    unsigned int sz = bench_sz[t >> 2];
+    char szs[4];
+
+    snprintf(szs, sizeof(szs), (sz < 1024) ? "%u" : "%uk",
+             (sz < 1024) ? sz : sz >> 10);
+    if (res->rate == 0) {
+        snprintf(msg0, 17, "%c%c%s", (t & 2) ? 'R' : 'S',
+                 (t & 1) ? 'W' : 'R', szs);
+        snprintf(msg1, 17, "Not enough RAM");
+        return;
+    }
+    snprintf(msg0, 17, "%c%c%s %u.%02uMB/s", (t & 2) ? 'R' : 'S',
+             (t & 1) ? 'W' : 'R', szs, res->rate / 100, res->rate % 100);
+    snprintf(msg1, 17, "Lat %u/%uus", res->avg_us, res->p99_us);
+}
+
+static void storage_benchmark(void)
+{
+    char msg0[17], msg1[17];
+    void *mark = arena_mark();
+    FRESULT fres;
+    int sel = 0;
+    uint8_t b;
+
+    if (!main_menu_confirm("Bench"))
+        return;
+
+    lcd_write(0, 1, -1, "Insert USB/SD...");
+    while (buttons)
+        continue;
+    while (f_mount(&fatfs, "", 1) != FR_OK) {
+        if (buttons || cfg.usb_power_fault)
+            return;
+        usbh_msc_process();
+    }
+
+    bench = arena_alloc(sizeof(*bench));
+    memset(bench->res, 0, sizeof(bench->res));
+    bench->created = FALSE;
+    bench->buf_sz = min_t(uint32_t, 32768, arena_avail() & ~511);
+    bench->buf = arena_alloc(bench->buf_sz);
+    memset(bench->buf, 0x5a, bench->buf_sz);
+
+    fres = F_call_cancellable(bench_main, NULL);
+    if (bench->created) {
+        /* Failed part way: Don't leave the scratch file on the volume. Any
+         * error is ignored, as the volume may be gone. */
+        (void)f_close(&bench->file);
+        (void)f_unlink(bench->name);
+    }
+    if (fres != FR_OK) {
+        printk("Benchmark: **Error %u\n", fres);
+        snprintf(msg1, sizeof(msg1), "*FATFS* %02u", fres);
+        lcd_write(0, 1, -1, msg1);
+        while (buttons)
+            continue;
+        while (!buttons)
+            continue;
+        goto out;
+    }
+
+    for (sel = 0; sel < BENCH_NR; sel++) {
+        bench_print(sel, msg0, msg1);
+        printk("Benchmark: %s, %s\n", msg0, msg1);
+    }
+
+    /* Step through the results. SELECT exits. */
+    sel = 0;
+    for (;;) {
+        if (sel < 0)
+            sel += BENCH_NR;
+        if (sel >= BENCH_NR)
+            sel -= BENCH_NR;
+        bench_print(sel, msg0, msg1);
+        lcd_write(0, 0, -1, msg0);
+        lcd_write(0, 1, -1, msg1);
+        while (buttons != 0)
+            continue;
+        while ((b = buttons) == 0)
+            continue;
+        b = wait_twobutton_press(b);
+        if (b & B_SELECT)
+            break;
+        if (b & B_LEFT)
+            sel--;
+        if (b & B_RIGHT)
+            sel++;
+    }
+
+out:
+    lcd_write(0, 0, -1, "FlashFloppy");
+    while (buttons)
+        continue;
+    arena_release(mark);
+}
+
 static void main_menu(void)
 {
     const static char *menu[] = {
@@ -2860,6 +3859,7 @@ static void main_menu(void)
         "Factory Reset",
         "Update Firmware",
         "Configure FF OSD",
+        "Benchmark",
         "Exit",
     };
 
@@ -2912,7 +3912,10 @@ static void main_menu(void)
             case 3: /* Configure FF OSD */
                 ff_osd_configure();
                 break;
-            case 0: case 4: /* Exit */
+            case 4: /* Benchmark */
+                storage_benchmark();
+                break;
+            case 0: case 5: /* Exit */
                 goto out;
             }
         }
@@ -3081,13 +4084,24 @@ int main(void)
     printk("Build: %s %s\n", build_date, build_time);
     printk("Board: %s\n", board_name[board_id]);
 
+    arena_init();
+    /* Hot metadata survives image mounts in a little RAM outside the arena:
+     * Just two sectors, per VOLUME_KEEP_SECS. Boards with 32kB RAM have none
+     * to spare. */
+    if (ram_kb >= 64)
+        volume_keep_init(arena_reserve(VOLUME_KEEP_SECS * 512));
+    crc16_bench(arena_alloc(3*512));
+    profile_init();
+
     speaker_init();
 
     flash_ff_cfg_read();
 
+    dma_copy_init();
     floppy_init();
 
     display_init();
+    console_enable_dma();
 
     while (floppy_ribbon_is_reversed()) {
         printk("** Error: Ribbon cable upside down?\n");
@@ -3121,12 +4135,15 @@ int main(void)
             check_buttons();
             usbh_msc_process();
         }
+        printk("Volume mounted (%ums)\n", time_now() / time_ms(1));
         usbh_msc_buffer_set((void *)0xdeadbeef);
 
         fres = F_call_cancellable(floppy_main, NULL);
         osd_buttons_tx = 0;
         floppy_cancel();
         floppy_arena_teardown();
+        stack_report();
+        profile_report();
 
         handle_errors(fres);
     }
@@ -0,0 +1,127 @@
+/*
+ * profile.c
+ * 
+ * Cycle-count profiling of IRQ handlers and image handler hooks, using the
+ * Cortex-M3 DWT cycle counter.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+static struct prof_stat {
+    uint32_t nr, min, max;
+    uint32_t units;
+    uint64_t sum;
+} stats[PROF_nr];
+
+static time_t since; /* Time of the most recent profile_clear() */
+
+static const char *const prof_name[PROF_nr] = {
+    [PROF_rdata_dma]   = "rdata_dma",
+    [PROF_wdata_dma]   = "wdata_dma",
+    [PROF_timer]       = "timer",
+    [PROF_read_track]  = "read_track",
+    [PROF_rdata_flux]  = "rdata_flux",
+    [PROF_write_track] = "write_track"
+};
+
+static void profile_clear(void)
+{
+    unsigned int i;
+    for (i = 0; i < PROF_nr; i++) {
+        stats[i].nr = stats[i].max = 0;
+        stats[i].min = ~0u;
+        stats[i].units = 0;
+        stats[i].sum = 0;
+    }
+    since = time_now();
+}
+
+void profile_init(void)
+{
+    uint32_t oldpri = IRQ_save(TIMER_IRQ_PRI);
+    profile_clear();
+    IRQ_restore(oldpri);
+    dcb->demcr |= DCB_DEMCR_TRCENA;
+    dwt->ctrl |= DWT_CTRL_CYCCNTENA;
+}
+
+void profile_end_n(unsigned int id, uint32_t start, uint32_t n)
+{
+    uint32_t cycles = dwt->cyccnt - start;
+    struct prof_stat *s = &stats[id];
+    uint32_t oldpri;
+
+    /* Some paths (eg. rdata_flux) run in both thread and IRQ context. */
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    s->nr++;
+    s->units += n;
+    s->sum += cycles;
+    s->min = min_t(uint32_t, s->min, cycles);
+    s->max = max_t(uint32_t, s->max, cycles);
+    IRQ_restore(oldpri);
+}
+
+/* @sum / @nr, scaled down to a 32-bit division: there is no libgcc. */
+static uint32_t div_sum(uint64_t sum, uint32_t nr)
+{
+    while (sum >> 32) {
+        sum >>= 1;
+        nr = (nr + 1) >> 1;
+    }
+    return (uint32_t)sum / nr;
+}
+
+void profile_get(unsigned int id, struct profile_stat *stat)
+{
+    struct prof_stat snap;
+    uint32_t oldpri;
+
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    snap = stats[id];
+    IRQ_restore(oldpri);
+
+    stat->nr = snap.nr;
+    stat->min = snap.nr ? snap.min : 0;
+    stat->avg = snap.nr ? div_sum(snap.sum, snap.nr) : 0;
+    stat->max = snap.max;
+}
+
+void profile_report(void)
+{
+    struct prof_stat snap[PROF_nr];
+    uint32_t oldpri, ms;
+    unsigned int i;
+
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    memcpy(snap, stats, sizeof(snap));
+    ms = time_diff(since, time_now()) / time_ms(1);
+    profile_clear();
+    IRQ_restore(oldpri);
+
+    printk("Profile (cycles @ %uMHz, %ums): calls min/avg/max"
+           " [units cycles/unit units/ms]\n", SYSCLK_MHZ, ms);
+    for (i = 0; i < PROF_nr; i++) {
+        struct prof_stat *s = &snap[i];
+        if (s->nr == 0)
+            continue;
+        printk(" %s: %u %u/%u/%u", prof_name[i], s->nr,
+               s->min, div_sum(s->sum, s->nr), s->max);
+        if (s->units != 0)
+            printk(" [%u %u %u]", s->units, div_sum(s->sum, s->units),
+                   s->units / max_t(uint32_t, ms, 1));
+        printk("\n");
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
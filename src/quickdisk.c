@@ -80,6 +80,8 @@ void floppy_cancel(void)
     dma_rdata.ccr = 0;
     dma_wdata.ccr = 0;
 
+    flux_stats_report();
+
     /* Clear soft state. */
     timer_cancel(&window.timer);
     timer_cancel(&index.timer);
@@ -89,6 +91,8 @@ void floppy_cancel(void)
     drv->index_suppressed = FALSE;
     drv->image = image = NULL;
     window.state = 0;
+
+    floppy_cancel_io();
 }
 
 void floppy_set_fintf_mode(void)
@@ -133,6 +137,7 @@ void floppy_insert(unsigned int unit, struct slot *slot)
     floppy_mount(slot);
 
     timer_dma_init();
+    io_thread_start(&drive);
     tim_rdata->ccr2 = sysclk_ns(1500); /* RD: 1.5us positive pulses */
 
     /* Drive is ready. Set output signals appropriately. */
@@ -186,21 +191,21 @@ static void floppy_unpause_window(struct drive *drv)
 
 static void floppy_sync_flux(void)
 {
-    const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
+    const uint16_t buf_mask = dma_rd->len - 1;
     struct drive *drv = &drive;
     uint16_t nr_to_wrap, nr_to_cons, nr;
     uint32_t oldpri;
 
     /* No DMA should occur until the timer is enabled. */
-    ASSERT(dma_rd->cons == (ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr));
+    ASSERT(dma_rd->cons == (dma_rd->len - dma_rdata.cndtr));
 
-    nr_to_wrap = ARRAY_SIZE(dma_rd->buf) - dma_rd->prod;
+    nr_to_wrap = dma_rd->len - dma_rd->prod;
     nr_to_cons = (dma_rd->cons - dma_rd->prod - 1) & buf_mask;
     nr = min(nr_to_wrap, nr_to_cons);
     if (nr) {
-        dma_rd->prod += image_rdata_flux(
-            drv->image, &dma_rd->buf[dma_rd->prod], nr);
-        dma_rd->prod &= buf_mask;
+        nr = image_rdata_flux(drv->image, &dma_rd->buf[dma_rd->prod], nr);
+        dma_rd_queued(&dma_rd->buf[dma_rd->prod], nr);
+        dma_rd->prod = (dma_rd->prod + nr) & buf_mask;
     }
 
     nr = (dma_rd->prod - dma_rd->cons) & buf_mask;
@@ -255,7 +260,8 @@ static bool_t dma_rd_handle(struct drive *drv)
         dma_rd->state = DMA_inactive;
         /* Reinitialise the circular buffer to empty. */
         dma_rd->cons = dma_rd->prod =
-            ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr;
+            dma_rd->len - dma_rdata.cndtr;
+        dma_rd->ticks = 0;
         /* Free-running index timer. */
         timer_cancel(&index.timer);
         timer_set(&index.timer, index.prev_time + drv->image->stk_per_rev);
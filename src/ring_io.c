@@ -18,13 +18,30 @@
 #define RING_INIT ~0
 
 static void enqueue_io(struct ring_io *rio);
+static void prefetch_complete(struct ring_io *rio);
+static void meta_sync_complete(struct ring_io *rio);
+
+/* Set on deselect: Owed file syncs are issued without further delay. */
+static bool_t sync_hint;
 
 void ring_io_init(struct ring_io *rio, FIL *fp, struct image_buf *read_data,
         FSIZE_t off, FSIZE_t shadow_off, uint16_t sec_len)
 {
+    struct ring_io_prefetch pf = rio->pf;
+    struct ring_io_tune tune = rio->tune;
+    struct ring_io_meta meta = rio->meta;
     ASSERT(off % 512 == 0);
     ASSERT(shadow_off == ~0 || shadow_off % 512 == 0);
+    /* Account for a prefetch completed during ring_io_shutdown(). */
+    if (rio->fop_cb == prefetch_complete && F_async_isdone(rio->fop))
+        pf.done += rio->io_cnt * 512;
+    /* Likewise a file sync. */
+    if (rio->fop_cb == meta_sync_complete && F_async_isdone(rio->fop))
+        meta.owed = FALSE;
     memset(rio, 0, sizeof(*rio));
+    rio->pf = pf;
+    rio->tune = tune;
+    rio->meta = meta;
     rio->fp = fp;
     rio->read_data = read_data;
     rio->f_off = off;
@@ -49,29 +66,172 @@ void ring_io_init(struct ring_io *rio, FIL *fp, struct image_buf *read_data,
         BIT_SET(rio->unread_bitfield, i);
 }
 
+/* If @fp is a single contiguous run of clusters, according to its fast-seek
+ * table, return the volume sector holding file offset @ofs. Else return 0.
+ * The table is { size, run length, start cluster, 0 } for a single run. */
+static LBA_t contiguous_lba(FIL *fp, FSIZE_t ofs, unsigned int nr)
+{
+    FATFS *fs = fp->obj.fs;
+    DWORD *tbl = fp->cltbl;
+
+    if ((tbl == NULL) || (tbl[0] != 4)
+        || ((ofs / 512) + nr > (FSIZE_t)tbl[1] * fs->csize))
+        return 0;
+
+    return fs->database + (LBA_t)(tbl[2] - 2) * fs->csize + ofs / 512;
+}
+
+/* Read io_cnt sectors at file offset @ofs. Sectors held in the write journal
+ * are read from there, and io_cnt is reduced if only some of them are. A
+ * contiguous file is read straight from computed volume sectors, avoiding
+ * FatFS's cluster walk. */
+static FOP read_async(struct ring_io *rio, FSIZE_t ofs, void *buf)
+{
+    unsigned int nr = rio->io_cnt;
+    LBA_t lba;
+    FOP fop;
+
+    if (journal_read_async(rio->fp, ofs, buf, &nr, &fop)) {
+        rio->io_cnt = nr;
+        return fop;
+    }
+    rio->io_cnt = nr;
+
+    lba = contiguous_lba(rio->fp, ofs, nr);
+    if (lba != 0)
+        return F_read_lba_async(rio->fp, ofs, lba, buf, nr * 512);
+
+    F_lseek_async(rio->fp, ofs);
+    return F_read_async(rio->fp, buf, nr * 512, NULL);
+}
+
+/* Write io_cnt sectors at file offset @ofs, via the write journal if it has
+ * space. */
+static FOP write_async(struct ring_io *rio, FSIZE_t ofs, const void *buf)
+{
+    struct ring_io_prefetch *pf = &rio->pf;
+    FOP fop;
+
+    /* Prefetched data from this range is now stale. Keep only what precedes
+     * it: The prefetch reads the remainder again. No prefetch read is in
+     * flight, as the ring issues one op at a time. */
+    if ((ofs < pf->off + pf->done) && (ofs + rio->io_cnt * 512 > pf->off))
+        pf->done = (ofs > pf->off) ? ofs - pf->off : 0;
+
+    if (journal_write_async(rio->fp, ofs, buf, rio->io_cnt, &fop))
+        return fop;
+
+    F_lseek_async(rio->fp, ofs);
+    return F_write_async(rio->fp, buf, rio->io_cnt * 512, NULL);
+}
+
+/* Sector @bit has been written: It must be written back. */
+static void mark_dirty(struct ring_io *rio, uint32_t bit)
+{
+    if (!rio->explicit_changes || BIT_GET(rio->changed_bitfield, bit))
+        BIT_SET(rio->dirty_bitfield, bit);
+    BIT_CLR(rio->changed_bitfield, bit);
+    rio->write_last = rio->meta.last = time_now();
+    sync_hint = FALSE;
+}
+
+/* Hold off write-back while sectors are still being written, unless the ring
+ * is being synced, or does not hold the whole file region. */
+static bool_t write_deferred(struct ring_io *rio)
+{
+    return rio->write_defer_ms && !rio->disable_reading
+        && (rio->ring_len == rio->f_len)
+        && (time_since(rio->write_last) < time_ms(rio->write_defer_ms));
+}
+
+/* Is an owed file sync due? */
+static bool_t meta_sync_due(struct ring_io *rio)
+{
+    return rio->meta.owed
+        && (rio->durable || sync_hint
+            || (time_since(rio->meta.last) >= time_ms(ff_cfg.image_sync_ms)));
+}
+
 static void progress_io(struct ring_io *rio)
 {
     thread_yield();
-    while (rio->fop_cb != NULL && F_async_isdone(rio->fop)) {
+    while (rio->fop_cb != NULL && rio->fop_done) {
         void (*fop_cb)(struct ring_io*) = rio->fop_cb;
         rio->fop_cb = NULL;
         fop_cb(rio);
     }
 }
 
+static void fop_done(FOP fop, void *arg)
+{
+    struct ring_io *rio = arg;
+    /* Ignore a stale op from before ring_io_init(). */
+    if (fop == rio->fop) {
+        rio->fop_us = time_since(rio->fop_start) / TIME_MHZ;
+        rio->fop_done = TRUE;
+    }
+}
+
 static void register_fop_whendone(
         struct ring_io *rio, FOP fop, void (*cb)(struct ring_io *))
 {
     ASSERT(rio->fop_cb == NULL);
     rio->fop = fop;
     rio->fop_cb = cb;
+    rio->fop_done = FALSE;
+    rio->fop_start = time_now();
+    F_async_whendone(fop, fop_done, rio);
     thread_yield(); /* Give fop a chance to start. */
 }
 
-static void sync_complete(struct ring_io *rio)
+uint8_t ring_io_batch_secs(uint32_t byte_ticks)
 {
-    if (!BIT_ANY(rio->dirty_bitfield))
+    uint32_t secs = sysclk_ms(ff_cfg.read_batch_ms) / (byte_ticks ?: 1);
+    return range_t(uint32_t, (secs + 511) / 512, 2, 16);
+}
+
+/* Largest read to issue: the batch chosen by read_tune(). It is capped at half
+ * the ring, which must have space to invalidate a whole batch at a time. */
+static uint8_t read_batch(struct ring_io *rio)
+{
+    unsigned int batch = rio->batch_secs << rio->tune.shift;
+    batch = min_t(unsigned int, batch, rio->ring_len / 1024);
+    batch = min_t(unsigned int, batch, 255);
+    return max_t(unsigned int, batch, rio->batch_secs);
+}
+
+/* Batch for ring reads. Fall back to the minimum batch when the consumer is
+ * close to catching up: a smaller read completes sooner. */
+static uint8_t ring_batch(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    return (rd->prod < rd->cons + rio->batch_secs * 512)
+        ? rio->batch_secs : read_batch(rio);
+}
+
+/* Dirty sectors are written back, and the file synced unless the sync is
+ * owed. */
+static void writeback_complete(struct ring_io *rio)
+{
+    if (!BIT_ANY(rio->dirty_bitfield)) {
         rio->sync_needed = FALSE;
+        if (rio->wr.cmds)
+            printk("ring_io: Wrote %u secs (%u clean) in %u commands\n",
+                   rio->wr.secs, rio->wr.gap_secs, rio->wr.cmds);
+        memset(&rio->wr, 0, sizeof(rio->wr));
+    }
+    enqueue_io(rio);
+}
+
+static void sync_complete(struct ring_io *rio)
+{
+    rio->meta.owed = FALSE;
+    writeback_complete(rio);
+}
+
+static void meta_sync_complete(struct ring_io *rio)
+{
+    rio->meta.owed = FALSE;
     enqueue_io(rio);
 }
 
@@ -80,11 +240,41 @@ static void write_complete(struct ring_io *rio)
     enqueue_io(rio);
 }
 
+/* Take a run of dirty sectors at @bit, for writing as a single command. Clean
+ * gaps of up to RING_IO_WRITE_GAP_SECS are included if a dirty sector follows,
+ * provided the gap holds valid file data: within the first @valid_cnt sectors
+ * and not awaiting a read. */
+static uint8_t write_run(struct ring_io *rio, uint32_t bit,
+                         uint32_t max_io_cnt, uint32_t valid_cnt)
+{
+    uint32_t i, n = 0, gap = 0;
+
+    for (i = 0; i < max_io_cnt; i++) {
+        if (BIT_GET(rio->dirty_bitfield, bit + i)) {
+            /* Clear eagerly to re-write a partial flush if necessary. */
+            BIT_CLR(rio->dirty_bitfield, bit + i);
+            rio->wr.gap_secs += gap;
+            n = i + 1;
+            gap = 0;
+        } else if ((n == 0) || (i >= valid_cnt)
+                   || BIT_GET(rio->unread_bitfield, bit + i)
+                   || (++gap > RING_IO_WRITE_GAP_SECS)) {
+            break;
+        }
+    }
+
+    if (n) {
+        rio->wr.secs += n;
+        rio->wr.cmds++;
+    }
+    return n;
+}
+
 static void write_start(struct ring_io *rio)
 {
     struct image_buf *rd = rio->read_data;
     FOP fop;
-    uint32_t max_io_cnt, start_bit, cons;
+    uint32_t max_io_cnt, valid_cnt, start_bit, cons;
     bool_t has_shadow = rio->f_shadow_off != ~0;
     ASSERT(rio->sync_needed);
     ASSERT(BIT_ANY(rio->dirty_bitfield));
@@ -110,23 +300,19 @@ static void write_start(struct ring_io *rio)
     max_io_cnt = min_t(uint32_t,
             (rio->ring_len - cons % rio->ring_len) / 512,
             (rio->f_len - ring_io_pos(rio, cons)) / 512);
-    max_io_cnt = min_t(uint8_t, rio->batch_secs, max_io_cnt);
+    max_io_cnt = min_t(uint8_t, read_batch(rio), max_io_cnt);
     ASSERT(max_io_cnt);
+    valid_cnt = (rio->rd_valid + rio->ring_len > cons)
+        ? (rio->rd_valid + rio->ring_len - cons) / 512 : 0;
 
     /* Check primary ring. */
 
     start_bit = (cons % rio->ring_len) / 512;
-    for (rio->io_cnt = 0; rio->io_cnt < max_io_cnt; rio->io_cnt++) {
-        if (!BIT_GET(rio->dirty_bitfield, start_bit + rio->io_cnt))
-            break;
-        /* Clear eagerly to re-write a partial flush if necessary. */
-        BIT_CLR(rio->dirty_bitfield, start_bit + rio->io_cnt);
-    }
+    rio->io_cnt = write_run(rio, start_bit, max_io_cnt, valid_cnt);
 
     if (rio->io_cnt) {
-        F_lseek_async(rio->fp, rio->f_off + ring_io_pos(rio, cons));
-        fop = F_write_async(rio->fp, rd->p + cons % rio->ring_len,
-                rio->io_cnt * 512, NULL);
+        fop = write_async(rio, rio->f_off + ring_io_pos(rio, cons),
+                rd->p + cons % rio->ring_len);
         register_fop_whendone(rio, fop, write_complete);
         return;
     }
@@ -135,24 +321,50 @@ static void write_start(struct ring_io *rio)
     /* There must be a shadow ring write necessary. */
 
     start_bit += rio->ring_len/512;
-    for (rio->io_cnt = 0; rio->io_cnt < max_io_cnt; rio->io_cnt++) {
-        if (!BIT_GET(rio->dirty_bitfield, start_bit + rio->io_cnt))
-            break;
-        /* Clear eagerly to re-write a partial flush if necessary. */
-        BIT_CLR(rio->dirty_bitfield, start_bit + rio->io_cnt);
-    }
+    rio->io_cnt = write_run(rio, start_bit, max_io_cnt, valid_cnt);
     ASSERT(rio->io_cnt);
-    F_lseek_async(rio->fp, rio->f_shadow_off + ring_io_pos(rio, cons));
-    fop = F_write_async(rio->fp,
-            rd->p + rio->ring_len + cons % rio->ring_len,
-            rio->io_cnt * 512, NULL);
+    fop = write_async(rio, rio->f_shadow_off + ring_io_pos(rio, cons),
+            rd->p + rio->ring_len + cons % rio->ring_len);
     register_fop_whendone(rio, fop, write_complete);
 }
 
+/* Account the just-completed read and adjust the read batch. Only full-batch
+ * reads are timed, as a shorter read says little about the cost of a
+ * batch. */
+static void read_tune(struct ring_io *rio)
+{
+    struct ring_io_tune *t = &rio->tune;
+    uint16_t *cost = t->us_per_sec, c;
+    uint8_t old_batch = read_batch(rio), old_shift = t->shift;
+
+    if (rio->io_cnt != old_batch)
+        return;
+
+    c = min_t(uint32_t, rio->fop_us / rio->io_cnt, 0xffff);
+    cost[t->shift] = cost[t->shift] ? (cost[t->shift] * 3 + c) / 4 : c ?: 1;
+    if (++t->nr < 8)
+        return;
+    t->nr = 0;
+
+    if (t->shift && (cost[t->shift] > cost[t->shift-1] - cost[t->shift-1]/8)) {
+        /* The larger batch does not pay for itself. */
+        t->shift--;
+    } else if ((t->shift+1 < RING_IO_TUNE_LEVELS) && !cost[t->shift+1]) {
+        /* Try the next larger batch. */
+        t->shift++;
+    }
+
+    if (read_batch(rio) != old_batch)
+        printk("ring_io: %u-sector reads take %u us/sector: "
+               "now %u-sector reads\n",
+               old_batch, cost[old_shift], read_batch(rio));
+}
+
 static void read_complete(struct ring_io *rio)
 {
     for (int i = 0; i < rio->io_cnt; i++)
         BIT_CLR(rio->unread_bitfield, rio->io_idx + i);
+    read_tune(rio);
     enqueue_io(rio);
 }
 
@@ -173,7 +385,7 @@ static void read_start(struct ring_io *rio)
             rio->f_len - ring_io_pos(rio, rd->prod)) / 512;
     max_io_cnt = min_t(uint8_t, max_io_cnt,
             (rio->rd_valid + rio->ring_len - rd->prod) / 512);
-    max_io_cnt = min_t(uint8_t, rio->batch_secs, max_io_cnt);
+    max_io_cnt = min_t(uint8_t, ring_batch(rio), max_io_cnt);
     ASSERT(max_io_cnt);
 
     /* Check primary ring. */
@@ -183,9 +395,8 @@ static void read_start(struct ring_io *rio)
             break;
     }
     if (rio->io_cnt) {
-        F_lseek_async(rio->fp, rio->f_off + ring_io_pos(rio, rd->prod));
-        fop = F_read_async(rio->fp, rd->p + rd->prod % rio->ring_len,
-                rio->io_cnt * 512, NULL);
+        fop = read_async(rio, rio->f_off + ring_io_pos(rio, rd->prod),
+                rd->p + rd->prod % rio->ring_len);
         register_fop_whendone(rio, fop, read_complete);
         return;
     }
@@ -198,13 +409,87 @@ static void read_start(struct ring_io *rio)
             break;
     }
     ASSERT(rio->io_cnt);
-    F_lseek_async(rio->fp, rio->f_shadow_off + ring_io_pos(rio, rd->prod));
-    fop = F_read_async(rio->fp,
-            rd->p + rio->ring_len + rd->prod % rio->ring_len,
-            rio->io_cnt * 512, NULL);
+    fop = read_async(rio, rio->f_shadow_off + ring_io_pos(rio, rd->prod),
+            rd->p + rio->ring_len + rd->prod % rio->ring_len);
     register_fop_whendone(rio, fop, read_complete);
 }
 
+static void prefetch_complete(struct ring_io *rio)
+{
+    rio->pf.done += rio->io_cnt * 512;
+    read_tune(rio);
+    enqueue_io(rio);
+}
+
+static void prefetch_start(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    FOP fop;
+
+    rio->io_cnt = min_t(uint32_t, read_batch(rio),
+                        (rio->pf.len - rio->pf.done) / 512);
+    fop = read_async(rio, rio->pf.off + rio->pf.done,
+            rd->p + rio->pf.base + rio->pf.done);
+    register_fop_whendone(rio, fop, prefetch_complete);
+}
+
+/* Make the requested prefetch region active, in whatever buffer space lies
+ * beyond the ring(s). */
+static void prefetch_begin(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    struct ring_io_prefetch *pf = &rio->pf;
+    bool_t has_shadow = rio->f_shadow_off != ~0;
+
+    /* Retire any in-flight read of the previous prefetch region. */
+    if (rio->fop_cb == prefetch_complete) {
+        F_async_wait(rio->fop);
+        rio->fop_cb = NULL;
+    }
+
+    pf->base = rio->ring_len << (has_shadow ? 1 : 0);
+    pf->off = pf->req_off;
+    pf->len = min_t(uint32_t, pf->req_len, rd->len - pf->base) & ~511;
+    pf->done = pf->req_len = 0;
+}
+
+/* Fill the newly-initialised ring from any overlapping prefetched data. Data
+ * which was since overwritten is already discarded, by write_async(). */
+static void prefetch_claim(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    struct ring_io_prefetch *pf = &rio->pf;
+    bool_t has_shadow = rio->f_shadow_off != ~0;
+    uint32_t i, nr_secs = rio->ring_len / 512, hits = 0;
+    FSIZE_t off;
+
+    if (pf->len == 0)
+        return;
+
+    /* Prefetch buffer must not overlap the new ring(s). */
+    if (pf->base >= (rio->ring_len << (has_shadow ? 1 : 0))) {
+        for (i = 0; i < nr_secs << (has_shadow ? 1 : 0); i++) {
+            off = (i < nr_secs) ? rio->f_off : rio->f_shadow_off;
+            off += ring_io_pos(rio, (i % nr_secs) * 512);
+            if ((off < pf->off) || (off + 512 > pf->off + pf->done))
+                continue;
+            memcpy(rd->p + i*512, rd->p + pf->base + (off - pf->off), 512);
+            BIT_CLR(rio->unread_bitfield, i);
+            hits++;
+        }
+    }
+
+    if (hits)
+        pf->hits++;
+    else
+        pf->misses++;
+    if (0) printk("Prefetch %s: %u/%u secs (%u hits, %u misses)\n",
+           hits ? "hit" : "miss", hits, nr_secs << (has_shadow ? 1 : 0),
+           pf->hits, pf->misses);
+
+    pf->len = pf->done = 0;
+}
+
 static void enqueue_io(struct ring_io *rio)
 {
     struct image_buf *rd = rio->read_data;
@@ -240,14 +525,17 @@ static void enqueue_io(struct ring_io *rio)
         rd->prod = cons;
 
     if (rio->ring_len == rio->f_len)
-        /* Fully buffered, so no need to BIT_SET unread_bitfield. */
-        rio->rd_valid = cons;
+        /* Fully buffered, so no need to BIT_SET unread_bitfield. No read
+         * overwrites a dirty sector, so a deferred write-back does not hold
+         * back the reader. */
+        rio->rd_valid = max_t(uint32_t, cons, rd->cons & ~511);
     else {
         /* Invalidate read data to open up space for new reads. Do it in
          * batches to optimize I/O throughput. */
-        if (rio->rd_valid + rio->batch_secs * 512 <= cons
+        uint8_t batch = ring_batch(rio);
+        if (rio->rd_valid + batch * 512 <= cons
                 && rio->rd_valid + rio->ring_len <= rd->prod) {
-            for (int i = 0; i < rio->batch_secs; i++) {
+            for (int i = 0; i < batch; i++) {
                 uint32_t p = (rio->rd_valid % rio->ring_len) / 512;
                 BIT_SET(rio->unread_bitfield, p);
                 if (has_shadow)
@@ -272,16 +560,38 @@ static void enqueue_io(struct ring_io *rio)
         return;
     }
 
-    if (rio->sync_needed) {
-        if (BIT_ANY(rio->dirty_bitfield))
+    if (rio->sync_needed && !write_deferred(rio)) {
+        if (BIT_ANY(rio->dirty_bitfield)) {
             write_start(rio);
-        else
+        } else if (ff_cfg.image_sync_ms && !rio->durable) {
+            /* Defer the sync: It updates the directory entry and flushes
+             * the FatFS window, which is wasted effort between tracks. */
+            rio->meta.owed = TRUE;
+            rio->meta.last = time_now();
+            writeback_complete(rio);
+        } else {
             register_fop_whendone(rio, F_sync_async(rio->fp), sync_complete);
+        }
+        return;
+    }
+
+    if (meta_sync_due(rio)) {
+        sync_hint = FALSE;
+        register_fop_whendone(rio, F_sync_async(rio->fp), meta_sync_complete);
         return;
     }
+
+    /* Ring is idle: speculatively read ahead. */
+    if (!rio->disable_reading && rio->pf.done < rio->pf.len) {
+        prefetch_start(rio);
+        return;
+    }
+
+    /* Nothing else to do: copy journaled writes into the image. */
+    journal_replay();
 }
 
-void ring_io_sync(struct ring_io *rio)
+static void writeback(struct ring_io *rio, bool_t durable)
 {
     struct image_buf *rd = rio->read_data;
     uint8_t batch_secs = rio->batch_secs;
@@ -289,15 +599,35 @@ void ring_io_sync(struct ring_io *rio)
     /* Write out as quickly as possible. Avoid lingering reads, as the caller
      * will likely call ring_io_init() just after this.  */
     rio->disable_reading = TRUE;
+    rio->durable = durable;
     rio->batch_secs = 255;
-    while (rio->sync_needed) {
+    /* Start any deferred write-back. A ring not yet initialised has none. */
+    if (rio->sync_needed || (durable && rio->meta.owed))
+        enqueue_io(rio);
+    while (rio->sync_needed || (durable && rio->meta.owed)) {
         ASSERT(rio->fop_cb != NULL);
         progress_io(rio);
     }
     rio->batch_secs = batch_secs;
+    rio->durable = FALSE;
     rio->disable_reading = FALSE;
 }
 
+void ring_io_sync(struct ring_io *rio)
+{
+    writeback(rio, TRUE);
+}
+
+void ring_io_writeback(struct ring_io *rio)
+{
+    writeback(rio, FALSE);
+}
+
+void ring_io_sync_hint(void)
+{
+    sync_hint = TRUE;
+}
+
 void ring_io_shutdown(struct ring_io *rio)
 {
     if (rio->fop_cb == NULL)
@@ -317,8 +647,19 @@ void ring_io_seek(
     rio->shadow_active = shadow;
     if (rio->ring_off == RING_INIT) {
         rd->prod = rio->rd_valid = 0;
-        rd->cons = pos % 512;
-        rio->ring_off = pos & ~511;
+        if (!shadow && (pos - rio->pre_pos < rio->pre_len)) {
+            /* The ring starts at the preloaded region, which it holds. */
+            rd->cons = pos - rio->pre_pos;
+            rio->ring_off = rio->pre_pos;
+            for (int i = 0; i < rio->pre_len / 512; i++)
+                BIT_CLR(rio->unread_bitfield, i);
+        } else {
+            rd->cons = pos % 512;
+            rio->ring_off = pos & ~511;
+        }
+        prefetch_claim(rio);
+        if (rio->pf.req_len)
+            prefetch_begin(rio);
     } else {
         uint32_t valid_pos = ring_io_pos(rio, rio->rd_valid);
         if (valid_pos > pos)
@@ -346,13 +687,33 @@ void ring_io_seek(
     enqueue_io(rio);
 }
 
+void ring_io_preload(struct ring_io *rio, uint32_t pos, uint32_t len)
+{
+    ASSERT(rio->ring_off == RING_INIT);
+    ASSERT(pos % 512 == 0);
+    rio->pre_pos = pos;
+    rio->pre_len = min_t(uint32_t, len, rio->ring_len) & ~511;
+}
+
+void ring_io_prefetch(struct ring_io *rio, FSIZE_t off, uint32_t len)
+{
+    /* Already the active region? Then keep what is read of it so far. */
+    if ((rio->ring_off != RING_INIT) && (rio->pf.req_len == 0)
+        && (rio->pf.len != 0) && (rio->pf.off == off))
+        return;
+    rio->pf.req_off = off;
+    rio->pf.req_len = len;
+    if (rio->ring_off != RING_INIT)
+        prefetch_begin(rio);
+}
+
 static void flush(struct ring_io *rio, bool_t partial)
 {
     struct image_buf *rd = rio->read_data;
     ASSERT(rio->writing);
     ASSERT(rd->cons - rio->wd_prod < 512);
     if (partial && rio->wd_prod < rd->cons) {
-        BIT_SET(rio->dirty_bitfield, ring_io_idx(rio, rd->cons - 1) / 512);
+        mark_dirty(rio, ring_io_idx(rio, rd->cons - 1) / 512);
         rio->wd_prod = rd->cons;
     }
     enqueue_io(rio);
@@ -365,7 +726,7 @@ void ring_io_progress(struct ring_io *rio)
         uint32_t saved_wd_prod = rio->wd_prod;
         bool_t doflush = FALSE;
         while (rio->wd_prod + 512 <= rd->cons) {
-            BIT_SET(rio->dirty_bitfield, ring_io_idx(rio, rio->wd_prod) / 512);
+            mark_dirty(rio, ring_io_idx(rio, rio->wd_prod) / 512);
             rio->wd_prod += 512;
             doflush = TRUE;
         }
@@ -392,6 +753,11 @@ void ring_io_progress(struct ring_io *rio)
     }
 }
 
+void ring_io_changed(struct ring_io *rio, uint32_t idx)
+{
+    BIT_SET(rio->changed_bitfield, ring_io_idx(rio, idx) / 512);
+}
+
 void ring_io_flush(struct ring_io *rio)
 {
     if (rio->writing) {
@@ -20,6 +20,12 @@
 #define SPI_PIN_SPEED _10MHz
 #endif
 
+/* Slowest clock we will fall back to after repeated transfer errors. */
+#define MIN_SPEED_DIV SPI_CR1_BR_DIV16 /* 2.25MHz */
+
+/* SPI2 is clocked from APB1 (36MHz). */
+#define spi_khz(br) (36000u >> (((br) >> 3) + 1))
+
 #if 0
 #define TRC(f, a...) printk("SD: " f, ## a)
 #else
@@ -47,9 +53,29 @@ static DSTATUS status = STA_NOINIT;
 #define CT_SDHC (CT_BLOCK | CT_SD2) /* SDHC is v2.xx and fixed-block-size */
 static uint8_t cardtype;
 
+/* Per-card speed profile: SPI_CR1_BR divisor currently in use, and the
+ * card's maximum transfer rate (kHz) as reported by CSD TRAN_SPEED. */
+static uint16_t speed_div;
+static uint32_t card_khz;
+
+/* Allocation unit (AU) size in sectors, from the SD Status register, or 0 if
+ * unknown. Cards erase and garbage-collect an AU at a time, so multi-block
+ * writes are split at AU boundaries. */
+static uint32_t au_secs;
+
 #define spi spi2
 #define PIN_CS 12
 
+/* SPI2 DMA requests are hardwired to DMA1 channels 4 (RX) and 5 (TX). These
+ * are shared with I2C2, which drives the LCD/OLED display and the OSD. */
+#define dma_rx_ch 4
+#define dma_tx_ch 5
+#define dma_rx (dma1->ch4)
+#define dma_tx (dma1->ch5)
+
+/* Clocked out on MOSI while receiving a DMA data block. */
+static const uint8_t dummy_tx = 0xff;
+
 static void spi_acquire(void)
 {
     gpio_write_pin(gpiob, PIN_CS, 0);
@@ -171,11 +197,100 @@ static uint8_t send_cmd(uint8_t cmd, uint32_t arg)
     return res;
 }
 
+/* Block transfers go via DMA unless I2C2 is in use: then the DMA channels
+ * belong to the display pipeline and we must drive the SPI by hand. */
+static bool_t dma_available(void)
+{
+    return !(rcc->apb1enr & RCC_APB1ENR_I2C2EN);
+}
+
+static void dma_stop(void)
+{
+    spi->cr2 = 0;
+    dma_rx.ccr = dma_tx.ccr = 0;
+    dma1->ifcr = DMA_IFCR_CGIF(dma_rx_ch) | DMA_IFCR_CGIF(dma_tx_ch);
+}
+
+/* Receive a data block via DMA (8-bit frames). Returns the CRC of the block,
+ * computed over each chunk as it lands so that it is ready as soon as the
+ * final byte arrives. */
+static uint16_t dma_recv(BYTE *buff, uint16_t bytes)
+{
+    uint16_t done = 0, landed, crc = 0;
+
+    spi_quiesce(spi);
+
+    dma_rx.cpar = dma_tx.cpar = (uint32_t)(unsigned long)&spi->dr;
+    dma_rx.cmar = (uint32_t)(unsigned long)buff;
+    dma_rx.cndtr = bytes;
+    dma_rx.ccr = (DMA_CCR_PL_MEDIUM |
+                  DMA_CCR_MSIZE_8BIT |
+                  DMA_CCR_PSIZE_16BIT |
+                  DMA_CCR_MINC |
+                  DMA_CCR_DIR_P2M |
+                  DMA_CCR_EN);
+    dma_tx.cmar = (uint32_t)(unsigned long)&dummy_tx;
+    dma_tx.cndtr = bytes;
+    dma_tx.ccr = (DMA_CCR_PL_LOW |
+                  DMA_CCR_MSIZE_8BIT |
+                  DMA_CCR_PSIZE_16BIT |
+                  DMA_CCR_DIR_M2P |
+                  DMA_CCR_EN);
+
+    /* Enable RX first so that no received byte can be missed. */
+    spi->cr2 = SPI_CR2_RXDMAEN;
+    spi->cr2 = SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+
+    while (done != bytes) {
+        landed = bytes - dma_rx.cndtr;
+        if (landed == done) {
+            thread_yield();
+            continue;
+        }
+        crc = crc16_ccitt(buff + done, landed - done, crc);
+        done = landed;
+    }
+
+    spi_quiesce(spi);
+    dma_stop();
+
+    return crc;
+}
+
+/* Transmit a 512-byte data block via DMA (8-bit frames). Returns the CRC of
+ * the block, computed while the block is in flight. */
+static uint16_t dma_xmit(const BYTE *buff)
+{
+    uint16_t crc;
+
+    dma_tx.cpar = (uint32_t)(unsigned long)&spi->dr;
+    dma_tx.cmar = (uint32_t)(unsigned long)buff;
+    dma_tx.cndtr = 512;
+    dma_tx.ccr = (DMA_CCR_PL_LOW |
+                  DMA_CCR_MSIZE_8BIT |
+                  DMA_CCR_PSIZE_16BIT |
+                  DMA_CCR_MINC |
+                  DMA_CCR_DIR_M2P |
+                  DMA_CCR_EN);
+    spi->cr2 = SPI_CR2_TXDMAEN;
+
+    crc = crc16_ccitt(buff, 512, 0);
+
+    while (dma_tx.cndtr != 0)
+        thread_yield();
+
+    spi_quiesce(spi);
+    dma_stop();
+
+    return crc;
+}
+
 static bool_t datablock_recv(BYTE *buff, uint16_t bytes)
 {
     uint8_t token = 0, _crc[2];
     uint32_t start = stk_now();
     uint16_t todo, w, crc;
+    BYTE *p;
 
     /* Wait 100ms for data to be ready. */
     do {
@@ -186,20 +301,31 @@ static bool_t datablock_recv(BYTE *buff, uint16_t bytes)
     if (token != 0xfe) /* valid data token? */
         return FALSE;
 
-    spi_16bit_frame(spi);
+    if (dma_available()) {
+
+        /* Grab the data. */
+        crc = dma_recv(buff, bytes);
+        spi_16bit_frame(spi);
+
+    } else {
+
+        spi_16bit_frame(spi);
+
+        /* Grab the data. */
+        for (todo = bytes, p = buff; todo != 0; todo -= 2) {
+            w = spi_recv16(spi);
+            *p++ = w >> 8;
+            *p++ = w;
+        }
+        crc = crc16_ccitt(buff, bytes, 0);
 
-    /* Grab the data. */
-    for (todo = bytes; todo != 0; todo -= 2) {
-        w = spi_recv16(spi);
-        *buff++ = w >> 8;
-        *buff++ = w;
     }
 
     /* Retrieve and check the CRC. */
     w = spi_recv16(spi);
     _crc[0] = w >> 8;
     _crc[1] = w;
-    crc = crc16_ccitt(_crc, 2, crc16_ccitt(buff-bytes, bytes, 0));
+    crc = crc16_ccitt(_crc, 2, crc);
     spi_quiesce(spi);
 
     spi_8bit_frame(spi);
@@ -210,7 +336,7 @@ static bool_t datablock_recv(BYTE *buff, uint16_t bytes)
 static bool_t datablock_xmit(const BYTE *buff, uint8_t token)
 {
     uint8_t res, wc = 0;
-    uint16_t crc = buff ? crc16_ccitt(buff, 512, 0) : 0;
+    uint16_t crc;
 
     if ((res = wait_ready()) != 0xff)
         return FALSE;
@@ -222,17 +348,28 @@ static bool_t datablock_xmit(const BYTE *buff, uint8_t token)
     if (token == 0xfd)
         return TRUE;
 
-    spi_16bit_frame(spi);
+    if (dma_available()) {
 
-    /* Send the data. */
-    do {
-        uint16_t w = (uint16_t)*buff++ << 8;
-        w |= *buff++;
-        spi_xmit16(spi, w);
-    } while (--wc);
+        /* Send the data. */
+        crc = dma_xmit(buff);
+        spi_16bit_frame(spi);
+
+    } else {
+
+        crc = crc16_ccitt(buff, 512, 0);
+        spi_16bit_frame(spi);
+
+        /* Send the data. */
+        do {
+            uint16_t w = (uint16_t)*buff++ << 8;
+            w |= *buff++;
+            spi_xmit16(spi, w);
+        } while (--wc);
+        spi_quiesce(spi);
+
+    }
 
     /* Send the CRC. */
-    spi_quiesce(spi);
     spi_xmit16(spi, crc);
 
     spi_8bit_frame(spi);
@@ -269,6 +406,72 @@ out:
     spi_release();
 }
 
+static void set_speed(uint16_t div)
+{
+    speed_div = div;
+    spi_quiesce(spi);
+    spi->cr1 = (spi->cr1 & ~SPI_CR1_BR_MASK) | div;
+}
+
+/* Read the CSD and select the fastest SPI clock not exceeding the card's
+ * TRAN_SPEED. If the CSD cannot be read, we stay at the default speed. */
+static void select_speed(void)
+{
+    /* TRAN_SPEED time value, in tenths. Rate unit is 100kbit/s << 10^n. */
+    static const uint8_t tv[16] = {
+        0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    uint8_t csd[16], unit;
+    uint16_t div;
+
+    card_khz = 0;
+
+    /* SEND_CSD */
+    if ((send_cmd(CMD(9), 0) == 0) && datablock_recv(csd, 16)) {
+        card_khz = tv[(csd[3] >> 3) & 15] * 10;
+        for (unit = csd[3] & 7; unit != 0; unit--)
+            card_khz *= 10;
+    }
+
+    spi_release();
+
+    div = DEFAULT_SPEED_DIV;
+    while (card_khz && (spi_khz(div) > card_khz) && (div < MIN_SPEED_DIV))
+        div += SPI_CR1_BR_DIV4;
+    set_speed(div);
+}
+
+/* Read the SD Status register to learn the card's AU size. */
+static void select_au_size(void)
+{
+    /* AU_SIZE, in units of 16kB. */
+    static const uint16_t au_16k[16] = {
+        0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 768, 1024, 1536, 2048, 4096 };
+    uint8_t sds[64];
+
+    au_secs = 0;
+
+    /* SD_STATUS: R2 response, then a 64-byte data block. */
+    if ((cardtype & (CT_SD1|CT_SD2))
+        && (send_cmd(ACMD(13), 0) == 0)) {
+        (void)spi_recv8(spi); /* R2 second byte */
+        if (datablock_recv(sds, 64))
+            au_secs = au_16k[sds[10] >> 4] * 32; /* bits 431:428 */
+    }
+
+    spi_release();
+}
+
+/* Called before retrying a failed transfer: step down to the next slower
+ * SPI clock. The slower clock sticks until the card is reinitialised. */
+static void slow_down(void)
+{
+    if (speed_div >= MIN_SPEED_DIV)
+        return;
+    set_speed(speed_div + SPI_CR1_BR_DIV4);
+    printk("SD Card: Transfer error, clock now %u kHz\n",
+           spi_khz(speed_div));
+}
+
 static bool_t sd_inserted(void)
 {
     return gpio_read_pin(gpioc, 9);
@@ -386,6 +589,11 @@ out:
         spi->cr1 = cr1 | DEFAULT_SPEED_DIV;
         printk("SD Card configured\n");
         dump_cid_info();
+        select_speed();
+        printk("SD Card clock: %u kHz (card max: %u kHz)\n",
+               spi_khz(speed_div), card_khz);
+        select_au_size();
+        printk("SD Card AU: %u kB\n", au_secs / 2);
     } else {
         /* Disable SPI. */
         spi->cr1 = 0;
@@ -430,6 +638,9 @@ static DRESULT sd_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
         sector <<= 9;
 
     do {
+        if (retry)
+            slow_down();
+
         todo = count;
         p = buff;
 
@@ -451,22 +662,19 @@ static DRESULT sd_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
     return handle_sd_result(todo ? RES_ERROR : RES_OK);
 }
 
-static DRESULT sd_disk_write(
-    BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+static bool_t write_blocks(const BYTE *buff, LBA_t sector, UINT count)
 {
     uint8_t retry = 0;
     UINT todo;
     const BYTE *p;
 
-    if (pdrv || !count)
-        return RES_PARERR;
-    if (status & STA_NOINIT)
-        return RES_NOTRDY;
-
     if (!(cardtype & CT_BLOCK))
         sector <<= 9;
 
     do {
+        if (retry)
+            slow_down();
+
         todo = count;
         p = buff;
 
@@ -478,7 +686,10 @@ static DRESULT sd_disk_write(
             if (datablock_xmit(p, 0xfe))
                 todo--;
         } else {
-            /* SET_WR_BLK_ERASE_COUNT */
+            /* SET_WR_BLK_ERASE_COUNT: Pre-erase exactly the blocks of this
+             * command. Pre-erased blocks which are not then written have
+             * undefined contents, and a later command of the same transfer
+             * may never be issued if the transfer errors or is abandoned. */
             if ((cardtype & (CT_SD1|CT_SD2))
                 && (send_cmd(ACMD(23), count) != 0))
                 continue;
@@ -497,7 +708,31 @@ static DRESULT sd_disk_write(
 
     } while (todo && (++retry < 3));
 
-    return handle_sd_result(todo ? RES_ERROR : RES_OK);
+    return !todo;
+}
+
+static DRESULT sd_disk_write(
+    BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+{
+    UINT nr;
+
+    if (pdrv || !count)
+        return RES_PARERR;
+    if (status & STA_NOINIT)
+        return RES_NOTRDY;
+
+    /* One command per AU spanned by the request. */
+    for (; count != 0; count -= nr) {
+        nr = count;
+        if (au_secs)
+            nr = min_t(UINT, nr, au_secs - sector % au_secs);
+        if (!write_blocks(buff, sector, nr))
+            return handle_sd_result(RES_ERROR);
+        buff += nr * 512;
+        sector += nr;
+    }
+
+    return RES_OK;
 }
 
 static DRESULT sd_disk_ioctl(BYTE pdrv, BYTE ctrl, void *buff)
@@ -113,6 +113,9 @@ static void exception_init(void)
                    SCB_SHCSR_BUSFAULTENA |
                    SCB_SHCSR_MEMFAULTENA);
 
+    /* Any IRQ becoming pending, even if masked, wakes cpu_wfe(). */
+    scb->scr |= SCB_SCR_SEVONPEND;
+
     /* SVCall/PendSV exceptions have lowest priority. */
     scb->shpr2 = 0xff<<24;
     scb->shpr3 = 0xff<<16;
@@ -183,7 +186,7 @@ static void gpio_init(GPIO gpio)
 
 static void peripheral_init(void)
 {
-    /* Enable basic GPIO and AFIO clocks, all timers, and DMA. */
+    /* Enable basic GPIO and AFIO clocks, all timers, DMA, and CRC. */
     rcc->apb1enr = (RCC_APB1ENR_TIM2EN |
                     RCC_APB1ENR_TIM3EN |
                     RCC_APB1ENR_TIM4EN);
@@ -192,7 +195,7 @@ static void peripheral_init(void)
                     RCC_APB2ENR_IOPCEN |
                     RCC_APB2ENR_AFIOEN |
                     RCC_APB2ENR_TIM1EN);
-    rcc->ahbenr = RCC_AHBENR_DMA1EN;
+    rcc->ahbenr = RCC_AHBENR_DMA1EN | RCC_AHBENR_CRCEN;
 
     /* Turn off serial-wire JTAG and reclaim the GPIOs. */
     afio->mapr = AFIO_MAPR_SWJ_CFG_DISABLED;
@@ -10,8 +10,12 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
-/* Holds stack pointer. */
-static uint32_t *waiting_thread;
+/* Threads by ID. The initial thread is ID 0. */
+static struct thread initial_thread;
+static struct thread *threads[THREAD_MAX] = { &initial_thread };
+static struct thread *current = &initial_thread;
+/* Run queue: Mask of runnable thread IDs. Threads are run round robin. */
+static volatile uint8_t runnable = 1u<<0;
 
 __attribute__((naked))
 static void _thread_yield(uint32_t *new_stack, uint32_t **save_stack_pointer) {
@@ -22,12 +26,6 @@ static void _thread_yield(uint32_t *new_stack, uint32_t **save_stack_pointer) {
         );
 }
 
-void thread_yield(void) {
-    if (!waiting_thread)
-        return;
-    _thread_yield(waiting_thread, &waiting_thread);
-}
-
 __attribute__((naked))
 static void resume(uint32_t *stack) {
     asm (
@@ -38,15 +36,96 @@ static void resume(uint32_t *stack) {
         );
 }
 
+/* Next runnable thread after @id. Called with IRQs masked at TIMER_IRQ_PRI.
+ * If no thread is runnable, sleep until an IRQ wakes one. */
+static struct thread *next_thread(unsigned int id) {
+    while (!runnable) {
+        uint32_t oldpri = read_special(basepri);
+        IRQ_restore(0);
+        /* An IRQ which wakes a thread after this check ends the sleep. */
+        if (!runnable)
+            cpu_wfe();
+        IRQ_restore(oldpri);
+    }
+    do {
+        id = (id + 1) & (THREAD_MAX - 1);
+    } while (!(runnable & (1u << id)));
+    return threads[id];
+}
+
+/* Switch to the next runnable thread, if not the current thread. Called with
+ * IRQs masked at TIMER_IRQ_PRI. */
+static void schedule(void) {
+    struct thread *prev = current;
+    current = next_thread(prev->id);
+    if (current != prev)
+        _thread_yield(current->sp, &prev->sp);
+}
+
+void thread_yield(void) {
+    uint32_t oldpri;
+    if (!(runnable & ~(1u << current->id)))
+        return;
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    schedule();
+    IRQ_restore(oldpri);
+}
+
+void thread_idle(void) {
+    if (runnable & ~(1u << current->id))
+        thread_yield();
+    else
+        cpu_wfe();
+}
+
+void thread_wait(struct waitq *wq) {
+    uint8_t mask = 1u << current->id;
+    uint32_t oldpri = IRQ_save(TIMER_IRQ_PRI);
+    wq->waiters |= mask;
+    runnable &= ~mask;
+    schedule();
+    IRQ_restore(oldpri);
+}
+
+void thread_wake_all(struct waitq *wq) {
+    uint32_t oldpri;
+    if (!wq->waiters)
+        return;
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    runnable |= wq->waiters;
+    wq->waiters = 0;
+    IRQ_restore(oldpri);
+}
+
+static void sleep_timer_fn(void *dat) {
+    thread_wake_all(dat);
+}
+
+void thread_sleep_until(time_t deadline) {
+    struct waitq wq = { 0 };
+    struct timer timer;
+    uint32_t oldpri = IRQ_save(TIMER_IRQ_PRI);
+    timer_init(&timer, sleep_timer_fn, &wq);
+    timer_set(&timer, deadline);
+    while (time_diff(time_now(), deadline) > 0)
+        thread_wait(&wq);
+    timer_cancel(&timer);
+    IRQ_restore(oldpri);
+}
+
 __attribute__((used))
 static void thread_main(struct thread *thread, void (*func)(void*), void* arg) {
-    uint32_t *other_thread;
+    /* Threads start with IRQs masked by the thread that yielded to us. */
+    IRQ_restore(0);
     func(arg);
     thread->exited = TRUE;
 
-    other_thread = waiting_thread;
-    waiting_thread = 0;
-    resume(other_thread);
+    (void)IRQ_save(TIMER_IRQ_PRI);
+    thread_wake_all(&thread->exit_wq);
+    runnable &= ~(1u << thread->id);
+    threads[thread->id] = NULL;
+    current = next_thread(thread->id);
+    resume(current->sp);
     ASSERT(0); /* unreachable */
 }
 
@@ -61,8 +140,15 @@ static void _main(void) {
 }
 
 void thread_start(struct thread *thread, uint32_t *stack, void (*func)(void*), void* arg) {
+    uint32_t oldpri;
+    unsigned int id;
     memset(thread, 0, sizeof(*thread));
-    ASSERT(!waiting_thread);
+    for (id = 1; (id < THREAD_MAX) && (threads[id] != NULL); id++)
+        continue;
+    /* Every slot is in use only by a bug: Crash, even in NDEBUG builds,
+     * rather than overrun threads[]. */
+    if (id == THREAD_MAX)
+        illegal();
     {
         /* r3 isn't special; it is just "not r4-r11,lr" */
         register uint32_t *stack_asm asm ("r3") = stack;
@@ -77,7 +163,12 @@ void thread_start(struct thread *thread, uint32_t *stack, void (*func)(void*), v
             : "memory");
         stack = stack_asm;
     }
-    waiting_thread = stack;
+    thread->sp = stack;
+    thread->id = id;
+    threads[id] = thread;
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    runnable |= 1u << id;
+    IRQ_restore(oldpri);
 }
 
 bool_t thread_tryjoin(struct thread *thread) {
@@ -88,9 +179,13 @@ bool_t thread_tryjoin(struct thread *thread) {
 
 void thread_join(struct thread *thread) {
     while (!thread->exited)
-        thread_yield();
+        thread_wait(&thread->exit_wq);
 }
 
 void thread_reset() {
-    waiting_thread = NULL;
+    uint32_t oldpri = IRQ_save(TIMER_IRQ_PRI);
+    memset(threads, 0, sizeof(threads));
+    threads[0] = current = &initial_thread;
+    runnable = 1u<<0;
+    IRQ_restore(oldpri);
 }
@@ -21,9 +21,17 @@ void IRQ_30(void) __attribute__((alias("IRQ_timer")));
  * latency incurred by reprogram_timer() and IRQ_timer(). */
 #define SLACK_TICKS 12
 
-#define TIMER_INACTIVE ((struct timer *)1ul)
-
-static struct timer *head;
+#define TIMER_INACTIVE 0xff
+
+/* Active timers, as a binary min-heap ordered by deadline: Insert and cancel
+ * take O(log n) time with timer IRQs masked. Any build has at most 12 static
+ * timers (6 in floppy.c, 2 in lcd.c, and one each in time.c, console.c,
+ * gotek/floppy.c and main.c), plus one on the stack of each thread in
+ * thread_sleep_until(). The bound leaves headroom beyond that, and overflow
+ * is a hard failure. */
+#define TIMER_MAX (16 + THREAD_MAX)
+static struct timer *heap[TIMER_MAX];
+static unsigned int heap_nr;
 
 static void reprogram_timer(int32_t delta)
 {
@@ -48,32 +56,81 @@ void timer_init(struct timer *timer, void (*cb_fn)(void *), void *cb_dat)
 {
     timer->cb_fn = cb_fn;
     timer->cb_dat = cb_dat;
-    timer->next = TIMER_INACTIVE;
+    timer->idx = TIMER_INACTIVE;
 }
 
 static bool_t timer_is_active(struct timer *timer)
 {
-    return timer->next != TIMER_INACTIVE;
+    return timer->idx != TIMER_INACTIVE;
+}
+
+/* Is timer @a due before timer @b? */
+static bool_t timer_before(struct timer *a, struct timer *b)
+{
+    return time_diff(b->deadline, a->deadline) < 0;
+}
+
+static void heap_put(unsigned int i, struct timer *t)
+{
+    heap[i] = t;
+    t->idx = i;
+}
+
+/* Place @t in the heap at or above position @i. */
+static void sift_up(unsigned int i, struct timer *t)
+{
+    unsigned int parent;
+
+    while (i != 0) {
+        parent = (i-1)/2;
+        if (!timer_before(t, heap[parent]))
+            break;
+        heap_put(i, heap[parent]);
+        i = parent;
+    }
+
+    heap_put(i, t);
+}
+
+/* Place @t in the heap at or below position @i. */
+static void sift_down(unsigned int i, struct timer *t)
+{
+    unsigned int child;
+
+    while ((child = 2*i+1) < heap_nr) {
+        if ((child+1 < heap_nr) && timer_before(heap[child+1], heap[child]))
+            child++;
+        if (!timer_before(heap[child], t))
+            break;
+        heap_put(i, heap[child]);
+        i = child;
+    }
+
+    heap_put(i, t);
 }
 
 static void _timer_cancel(struct timer *timer)
 {
-    struct timer *t, **pprev;
+    struct timer *last;
+    unsigned int i;
 
     if (!timer_is_active(timer))
         return;
 
-    for (pprev = &head; (t = *pprev) != timer; pprev = &t->next)
-        continue;
-
-    *pprev = t->next;
-    t->next = TIMER_INACTIVE;
+    /* Fill the hole with the last timer in the heap. */
+    i = timer->idx;
+    timer->idx = TIMER_INACTIVE;
+    last = heap[--heap_nr];
+    if (last == timer)
+        return;
+    if ((i != 0) && timer_before(last, heap[(i-1)/2]))
+        sift_up(i, last);
+    else
+        sift_down(i, last);
 }
 
 void timer_set(struct timer *timer, time_t deadline)
 {
-    struct timer *t, **pprev;
-    time_t now;
     int32_t delta;
     uint32_t oldpri;
 
@@ -83,16 +140,16 @@ void timer_set(struct timer *timer, time_t deadline)
 
     timer->deadline = deadline;
 
-    now = time_now();
-    delta = time_diff(now, deadline);
-    for (pprev = &head; (t = *pprev) != NULL; pprev = &t->next)
-        if (delta <= time_diff(now, t->deadline))
-            break;
-    timer->next = *pprev;
-    *pprev = timer;
+    /* TIMER_MAX is exceeded only by a bug: Crash, even in NDEBUG builds,
+     * rather than overrun the heap or silently drop the timer. */
+    if (heap_nr >= TIMER_MAX)
+        illegal();
+    sift_up(heap_nr++, timer);
 
-    if (head == timer)
+    if (heap[0] == timer) {
+        delta = time_diff(time_now(), deadline);
         reprogram_timer(delta);
+    }
 
     IRQ_restore(oldpri);
 }
@@ -113,24 +170,31 @@ void timers_init(void)
     IRQx_enable(TIMER_IRQ);
 }
 
-static void IRQ_timer(void)
+static void _IRQ_timer(void)
 {
     struct timer *t;
     int32_t delta;
 
     tim->sr = 0;
 
-    while ((t = head) != NULL) {
+    while (heap_nr != 0) {
+        t = heap[0];
         if ((delta = time_diff(time_now(), t->deadline)) > SLACK_TICKS) {
             reprogram_timer(delta);
             break;
         }
-        head = t->next;
-        t->next = TIMER_INACTIVE;
+        _timer_cancel(t);
         (*t->cb_fn)(t->cb_dat);
     }
 }
 
+static void IRQ_timer(void)
+{
+    uint32_t t = profile_start();
+    _IRQ_timer();
+    profile_end(PROF_timer, t);
+}
+
 /*
  * Local variables:
  * mode: C
@@ -225,6 +225,9 @@ typedef struct _HCD {
     __IO URB_STATE           URB_State[USB_OTG_MAX_TX_FIFOS];
     USB_OTG_HC               hc [USB_OTG_MAX_TX_FIFOS];
     uint16_t                 channel [USB_OTG_MAX_TX_FIFOS];
+    /* Use the stock, conservative enumeration sequence. Set when a device
+     * fails to enumerate with shortened delays. */
+    uint8_t                  CompatEnum;
 } HCD_DEV , *USB_OTG_USBH_PDEV;
 
 
@@ -120,6 +120,10 @@ typedef union _USBH_CSW_Block
 
 #define USBH_MSC_PAGE_LENGTH              512
 
+/* Bulk-IN packets per data-stage URB. Limited by the host channel's packet
+   counter and the 16-bit URB length (at 64-byte full-speed packets). */
+#define USBH_MSC_MAX_IN_PACKETS           256
+
 #define USB_REQ_BOT_RESET                0xFF
 #define USB_REQ_GET_MAX_LUN              0xFE
 
@@ -809,7 +809,9 @@ uint32_t USB_OTG_ReadHostAllChannels_intr (USB_OTG_CORE_HANDLE *pdev)
  * @param  pdev : Selected device
  * @retval status
  * @note : (1)The application must wait at least 10 ms (+ 10 ms security)
- *   before clearing the reset bit.
+ *   before clearing the reset bit. We use the 50 ms root-port reset time
+ *   from the USB 2.0 spec, plus 10 ms reset recovery, unless the device has
+ *   previously failed to enumerate.
  */
 uint32_t USB_OTG_ResetPort(USB_OTG_CORE_HANDLE *pdev)
 {
@@ -818,10 +820,10 @@ uint32_t USB_OTG_ResetPort(USB_OTG_CORE_HANDLE *pdev)
     hprt0.d32 = USB_OTG_ReadHPRT0(pdev);
     hprt0.b.prtrst = 1;
     USB_OTG_WRITE_REG32(pdev->regs.HPRT0, hprt0.d32);
-    USB_OTG_BSP_mDelay (100);                                /* See Note #1 */
+    USB_OTG_BSP_mDelay (pdev->host.CompatEnum ? 100 : 50);   /* See Note #1 */
     hprt0.b.prtrst = 0;
     USB_OTG_WRITE_REG32(pdev->regs.HPRT0, hprt0.d32);
-    USB_OTG_BSP_mDelay (20);
+    USB_OTG_BSP_mDelay (pdev->host.CompatEnum ? 20 : 10);
     return 1;
 }
 
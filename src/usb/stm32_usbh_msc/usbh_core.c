@@ -196,6 +196,27 @@ USBH_Status USBH_DeInit(USB_OTG_CORE_HANDLE *pdev, USBH_HOST *phost)
     return USBH_OK;
 }
 
+/* Has the current device got as far as the class driver? */
+static uint8_t class_reached;
+
+/**
+ * @brief  USBH_CheckEnum
+ *         Called when a device is lost or fails. If it never got as far as
+ *         the class driver, it may not cope with fast enumeration: Use the
+ *         stock delays, port resets and descriptor fetches from now on.
+ * @param  pdev: Selected device
+ * @retval None
+ */
+static void USBH_CheckEnum(USB_OTG_CORE_HANDLE *pdev)
+{
+    if (!class_reached && !pdev->host.CompatEnum)
+    {
+        printk("> Fast enumeration failed: Using compatible sequence\n");
+        pdev->host.CompatEnum = 1;
+    }
+    class_reached = 0;
+}
+
 /**
  * @brief  USBH_Process
  *         USB Host core main state machine process
@@ -224,7 +245,8 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
         {
             phost->gState = HOST_WAIT_PRT_ENABLED;
 
-            /*wait denounce delay */
+            /*wait denounce delay: USB 2.0 TATTDB is at least 100ms, even
+             * for the fast enumeration sequence */
             USB_OTG_BSP_mDelay(100);
 
             /* Apply a port RESET */
@@ -239,7 +261,7 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
         if (pdev->host.PortEnabled == 1)
         {
             phost->gState = HOST_DEV_ATTACHED;
-            USB_OTG_BSP_mDelay(50);
+            USB_OTG_BSP_mDelay(pdev->host.CompatEnum ? 50 : 10);
         }
         break;
 
@@ -249,8 +271,9 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
         phost->Control.hc_num_out = USBH_Alloc_Channel(pdev, 0x00);
         phost->Control.hc_num_in = USBH_Alloc_Channel(pdev, 0x80);
 
-        /* Reset USB Device */
-        if ( HCD_ResetPort(pdev) == 0)
+        /* Reset USB Device. The port was reset on connection already, so
+           a second reset is only for the compatible sequence. */
+        if (!pdev->host.CompatEnum || (HCD_ResetPort(pdev) == 0))
         {
             phost->usr_cb->ResetDevice();
 
@@ -313,6 +336,7 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
         if(status == USBH_OK)
         {
             phost->gState  = HOST_CLASS;
+            class_reached = 1;
         }
 
         else
@@ -354,6 +378,7 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
         break;
 #endif /* USE_HOST_MODE */
     case HOST_ERROR_STATE:
+        USBH_CheckEnum(pdev);
         /* Re-Initialize Host for new Enumeration */
         USBH_DeInit(pdev, phost);
         phost->usr_cb->DeInit();
@@ -364,6 +389,7 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
 
         /* Manage User disconnect operations*/
         phost->usr_cb->DeviceDisconnected();
+        USBH_CheckEnum(pdev);
 
         /* Re-Initialize Host for new Enumeration */
         USBH_DeInit(pdev, phost);
@@ -519,7 +545,10 @@ static USBH_Status USBH_HandleEnum(USB_OTG_CORE_HANDLE *pdev, USBH_HOST *phost)
                                                       phost->device_prop.Itf_Desc,
                                                       phost->device_prop.Ep_Desc[0]);
 
-            phost->EnumState = ENUM_GET_MFC_STRING_DESC;
+            /* We have no use for the string descriptors, so only fetch
+               them in the compatible sequence. */
+            phost->EnumState = pdev->host.CompatEnum
+                ? ENUM_GET_MFC_STRING_DESC : ENUM_SET_CONFIGURATION;
         }
         break;
 
@@ -76,12 +76,15 @@ void USBH_MSC_HandleBOTXfer (USB_OTG_CORE_HANDLE *pdev ,USBH_HOST *phost)
     static uint8_t error_direction;
     static struct USB_OTG_BSP_Timer timer;
     USBH_Status status;
+    uint8_t prev_state;
 
     URB_STATE URB_Status = URB_IDLE;
 
     if(HCD_IsDeviceConnected(pdev))
     {
 
+    next_state:
+        prev_state = USBH_MSC_BOTXferParam.BOTState;
         switch (USBH_MSC_BOTXferParam.BOTState)
         {
         case USBH_MSC_SEND_CBW:
@@ -169,29 +172,29 @@ void USBH_MSC_HandleBOTXfer (USB_OTG_CORE_HANDLE *pdev ,USBH_HOST *phost)
                 USBH_MSC_BOTXferParam.BOTStateBkp = USBH_MSC_BOT_DATAIN_STATE;
                 USB_OTG_BSP_InitTimer(&timer, DATA_STAGE_TIMEOUT);
 
-                if(remainingDataLength > MSC_Machine.MSBulkInEpSize)
-                {
-                    USBH_BulkReceiveData (pdev,
-                                          datapointer,
-                                          MSC_Machine.MSBulkInEpSize ,
-                                          MSC_Machine.hc_num_in);
-
-                    remainingDataLength -= MSC_Machine.MSBulkInEpSize;
-                    datapointer = datapointer + MSC_Machine.MSBulkInEpSize;
-                }
-                else if ( remainingDataLength == 0)
+                if ( remainingDataLength == 0)
                 {
                     /* If value was 0, and successful transfer, then change the state */
                     USBH_MSC_BOTXferParam.BOTState = USBH_MSC_RECEIVE_CSW_STATE;
                 }
                 else
                 {
+                    /* Receive a burst of packets per URB: the host channel
+                       re-arms itself from the RxFIFO interrupt for each
+                       packet, without a round trip through this state
+                       machine. */
+                    uint32_t len = MSC_Machine.MSBulkInEpSize
+                        * USBH_MSC_MAX_IN_PACKETS;
+                    if (len > remainingDataLength)
+                        len = remainingDataLength;
+
                     USBH_BulkReceiveData (pdev,
                                           datapointer,
-                                          remainingDataLength ,
+                                          len ,
                                           MSC_Machine.hc_num_in);
 
-                    remainingDataLength = 0; /* Reset this value and keep in same state */
+                    remainingDataLength -= len;
+                    datapointer = datapointer + len;
                 }
             }
             else if(URB_Status == URB_STALL)
@@ -434,6 +437,19 @@ void USBH_MSC_HandleBOTXfer (USB_OTG_CORE_HANDLE *pdev ,USBH_HOST *phost)
         default:
             break;
         }
+
+        /* Entering a data or status phase posts its first URB without
+           waiting on the bus. Do that now rather than on the next poll, so
+           the data phase follows the CBW, and the CSW follows the last data
+           packet, back to back with no caller round trip in between. */
+        if ((USBH_MSC_BOTXferParam.BOTState != prev_state)
+            && (USBH_MSC_BOTXferParam.BOTXferStatus == USBH_MSC_BUSY)
+            && ((USBH_MSC_BOTXferParam.BOTState == USBH_MSC_BOT_DATAIN_STATE)
+                || (USBH_MSC_BOTXferParam.BOTState == USBH_MSC_BOT_DATAOUT_STATE)
+                || (USBH_MSC_BOTXferParam.BOTState == USBH_MSC_RECEIVE_CSW_STATE)))
+        {
+            goto next_state;
+        }
     }
 }
 
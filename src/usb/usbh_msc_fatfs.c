@@ -17,6 +17,9 @@ static bool_t msc_device_connected;
 extern USB_OTG_CORE_HANDLE USB_OTG_Core;
 USBH_HOST USB_Host;
 
+/* Milliseconds since power-on, for timing the attach/enumerate/ready phases. */
+#define boot_ms() (time_now() / time_ms(1))
+
 static void USBH_USR_Init(void)
 {
     printk("> %s\n", __FUNCTION__);
@@ -26,11 +29,12 @@ static void USBH_USR_DeInit(void)
 {
     printk("> %s\n", __FUNCTION__);
     msc_device_connected = FALSE;
+    volume_readonly_update();
 }
 
 static void USBH_USR_DeviceAttached(void)
 {
-    printk("> %s\n", __FUNCTION__);
+    printk("> %s (%ums)\n", __FUNCTION__, boot_ms());
 }
 
 static void USBH_USR_ResetDevice(void)
@@ -42,6 +46,7 @@ static void USBH_USR_DeviceDisconnected (void)
 {
     printk("> %s\n", __FUNCTION__);
     msc_device_connected = FALSE;
+    volume_readonly_update();
 }
 
 static void USBH_USR_OverCurrentDetected (void)
@@ -102,7 +107,7 @@ static void USBH_USR_SerialNumString(void *SerialNumString)
 
 static void USBH_USR_EnumerationDone(void)
 {
-    printk("> %s\n", __FUNCTION__);
+    printk("> %s (%ums)\n", __FUNCTION__, boot_ms());
 }
 
 static USBH_USR_Status USBH_USR_UserInput(void)
@@ -113,7 +118,12 @@ static USBH_USR_Status USBH_USR_UserInput(void)
 
 static int USBH_USR_UserApplication(void)
 {
-    msc_device_connected = TRUE;
+    if (!msc_device_connected) {
+        printk("> LUN ready (%ums)\n", boot_ms());
+        msc_device_connected = TRUE;
+        /* MODE SENSE has reported write protection. */
+        volume_readonly_update();
+    }
     /* 1 forces reset, 0 okay */
     return 0;
 }
@@ -127,6 +137,7 @@ static void USBH_USR_UnrecoveredError (void)
 {
     printk("> %s\n", __FUNCTION__);
     msc_device_connected = FALSE;
+    volume_readonly_update();
 }
 
 static USBH_Usr_cb_TypeDef USR_cb = {
@@ -220,6 +231,16 @@ static DRESULT handle_usb_status(BYTE status)
     return RES_OK;
 }
 
+/* Advance the BOT state machine. Yield only while a bus transfer is still in
+ * flight: once the CSW is decoded, the caller collects the command status
+ * immediately, without a wasted round trip through the other thread. */
+static void bot_progress(void)
+{
+    USBH_MSC_HandleBOTXfer(&USB_OTG_Core, &USB_Host);
+    if (USBH_MSC_BOTXferParam.BOTXferStatus == USBH_MSC_BUSY)
+        thread_yield();
+}
+
 static DRESULT usb_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
 {
     BYTE status;
@@ -229,14 +250,14 @@ static DRESULT usb_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
     if (dstatus & STA_NOINIT)
         return RES_NOTRDY;
 
-    do {
+    for (;;) {
         if (!HCD_IsDeviceConnected(&USB_OTG_Core))
             return handle_usb_status(USBH_MSC_FAIL);
         status = USBH_MSC_Read10(&USB_OTG_Core, buff, sector, 512 * count);
-        USBH_MSC_HandleBOTXfer(&USB_OTG_Core, &USB_Host);
-        if (status == USBH_MSC_BUSY)
-            thread_yield();
-    } while (status == USBH_MSC_BUSY);
+        if (status != USBH_MSC_BUSY)
+            break;
+        bot_progress();
+    }
 
     return handle_usb_status(status);
 }
@@ -253,15 +274,15 @@ static DRESULT usb_disk_write(
     if (dstatus & STA_PROTECT)
         return RES_WRPRT;
 
-    do {
+    for (;;) {
         if (!HCD_IsDeviceConnected(&USB_OTG_Core))
             return handle_usb_status(USBH_MSC_FAIL);
         status = USBH_MSC_Write10(
             &USB_OTG_Core, (BYTE *)buff, sector, 512 * count);
-        USBH_MSC_HandleBOTXfer(&USB_OTG_Core, &USB_Host);
-        if (status == USBH_MSC_BUSY)
-            thread_yield();
-    } while (status == USBH_MSC_BUSY);
+        if (status != USBH_MSC_BUSY)
+            break;
+        bot_progress();
+    }
 
     return handle_usb_status(status);
 }
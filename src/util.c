@@ -328,6 +328,27 @@ uint32_t rand(void)
     return x;
 }
 
+void stack_paint(uint32_t *bottom, uint32_t *top)
+{
+    volatile uint32_t *p;
+    uint32_t here;
+
+    /* Do not paint over the live part of the current stack. */
+    if ((&here >= bottom) && (&here < top))
+        top = &here - 16;
+
+    for (p = bottom; p < top; p++)
+        *p = STACK_PAINT;
+}
+
+unsigned int stack_peak(uint32_t *bottom, uint32_t *top)
+{
+    uint32_t *p = bottom;
+    while ((p < top) && (*p == STACK_PAINT))
+        p++;
+    return (top - p) * 4;
+}
+
 unsigned int popcount(uint32_t x)
 {
     x = x - ((x >> 1) & 0x55555555);
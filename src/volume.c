@@ -17,22 +17,220 @@ static struct volume_ops *vol_ops = &usb_ops;
 static struct cache *cache;
 static bool_t interrupt;
 static bool_t inprogress;
+static bool_t readonly; /* vol_ops->readonly(), per volume_readonly_update() */
 static void *metadata_addr;
 #define SECSZ 512
 
+/* Sequential read-ahead into the cache, via a staging buffer of @nr sectors
+ * carved from the cache memory. */
+static struct {
+    uint8_t *buf;
+    uint8_t nr;
+    LBA_t next; /* Sector following the previous read */
+} ra;
+
+/* Most recently used clean sectors of the last cache, held across image
+ * mounts (which reuse the cache memory). Once seeded into the next cache,
+ * the ids remain listed until each is first read or written, so that reads
+ * they serve are counted. */
+static struct {
+    uint8_t *buf; /* NULL if there is no memory to keep sectors in */
+    uint8_t nr;
+    uint16_t hits; /* Reads served by kept sectors, since the last report */
+    uint32_t id[VOLUME_KEEP_SECS];
+} keep;
+
+static int keep_find(LBA_t sector, UINT count)
+{
+    int i;
+    for (i = 0; i < keep.nr; i++)
+        if ((keep.id[i] - sector) < count)
+            return i;
+    return -1;
+}
+
+static void keep_drop(int i)
+{
+    keep.nr--;
+    keep.id[i] = keep.id[keep.nr];
+    memcpy(keep.buf + i * SECSZ, keep.buf + keep.nr * SECSZ, SECSZ);
+}
+
+static inline void start_op(void)
+{
+    ASSERT(!inprogress);
+    inprogress = TRUE;
+}
+
+static inline void end_op(void)
+{
+    ASSERT(inprogress);
+    inprogress = FALSE;
+    if (interrupt) {
+        thread_yield();
+        interrupt = FALSE;
+    }
+}
+
+/* Large transfers are split into commands of at most this many sectors. The
+ * volume is consistent between commands, so volume_interrupt() need wait for
+ * only one command to complete, rather than the whole transfer. */
+#define XFER_SECS 32
+
+/* Between the commands of a split transfer: If interrupted, yield as if the
+ * operation had ended. The interrupter may then discard this thread. */
+static void xfer_interrupt_point(void)
+{
+    if (!interrupt)
+        return;
+    end_op();
+    start_op();
+}
+
+static DRESULT xfer_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count,
+                         struct cache *c)
+{
+    DRESULT res = RES_OK;
+    UINT nr;
+
+    while (count) {
+        nr = min_t(UINT, count, XFER_SECS);
+        if ((res = vol_ops->read(pdrv, buff, sector, nr)) != RES_OK)
+            break;
+        if (c != NULL)
+            cache_fill_N(c, sector, buff, nr);
+        buff += nr * SECSZ;
+        sector += nr;
+        if ((count -= nr) != 0)
+            xfer_interrupt_point();
+    }
+
+    return res;
+}
+
+static DRESULT xfer_write(BYTE pdrv, const BYTE *buff, LBA_t sector,
+                          UINT count, struct cache *c)
+{
+    DRESULT res = RES_OK;
+    UINT nr;
+
+    while (count) {
+        nr = min_t(UINT, count, XFER_SECS);
+        if ((res = vol_ops->write(pdrv, buff, sector, nr)) != RES_OK)
+            break;
+        /* Keep the cache coherent with each command, as the transfer may
+         * be abandoned at the next interrupt point. */
+        if (c != NULL)
+            cache_update_N(c, sector, buff, nr);
+        buff += nr * SECSZ;
+        sector += nr;
+        if ((count -= nr) != 0)
+            xfer_interrupt_point();
+    }
+
+    return res;
+}
+
+/* Write-back of filesystem metadata: single-sector writes from the FatFS
+ * sector window are held dirty in the cache. They are written back, in
+ * order: on sync, on cache teardown, and by the first operation at least a
+ * second after the cache became dirty. An idle caller issues that operation
+ * per volume_writeback_due(). */
+static struct {
+    const BYTE *win; /* NULL if write-back is disabled */
+    bool_t dirty;
+    BYTE pdrv;       /* Drive of the dirty sectors */
+    time_t since;    /* Time the cache last became dirty */
+} wb;
+#define WB_TIMEOUT time_ms(1000)
+
+static bool_t wb_write(uint32_t sector, const void *dat)
+{
+    return vol_ops->write(wb.pdrv, dat, sector, 1) == RES_OK;
+}
+
+/* Write back all dirty metadata. Called within an operation. */
+static DRESULT wb_flush(void)
+{
+    if (!wb.dirty)
+        return RES_OK;
+    if (!cache_writeback(cache, wb_write))
+        return RES_ERROR;
+    wb.dirty = FALSE;
+    return RES_OK;
+}
+
+bool_t volume_writeback_due(void)
+{
+    return wb.dirty && (time_since(wb.since) >= WB_TIMEOUT);
+}
+
+static void wb_poll(void)
+{
+    if (volume_writeback_due())
+        (void)wb_flush();
+}
+
 #if !defined(BOOTLOADER)
+void volume_keep_init(void *mem)
+{
+    keep.buf = mem;
+    keep.nr = 0;
+}
+
 void volume_cache_init(void *start, void *end)
 {
+    uint8_t *s = (uint8_t *)(((uint32_t)start + 3) & ~3);
+    unsigned int nr = ff_cfg.read_ahead;
+    int i;
+
     volume_cache_destroy();
+
+    /* Read-ahead only if the cache remains at least twice the window. */
+    if ((nr > 1) && ((uint8_t *)end - s >= 3 * nr * (SECSZ + 32))) {
+        ra.buf = s;
+        ra.nr = nr;
+        start = s + nr * SECSZ;
+    }
+
     cache = cache_init(start, end, SECSZ);
+    if (cache == NULL) {
+        ra.buf = NULL;
+    } else {
+        /* Seed the new cache with the kept sectors, most recent last. */
+        for (i = keep.nr - 1; i >= 0; i--)
+            cache_update(cache, keep.id[i], keep.buf + i * SECSZ);
+    }
     interrupt = FALSE;
     inprogress = FALSE;
 }
 
 void volume_cache_destroy(void)
 {
+    struct cache_stats stats;
+
+    if (wb.dirty) {
+        start_op();
+        if (wb_flush() != RES_OK)
+            printk("Cache: Metadata write-back failed\n");
+        end_op();
+        wb.dirty = FALSE;
+    }
+
+    if (cache != NULL) {
+        cache_get_stats(&stats);
+        printk("Cache: %u hits, %u misses, %u evictions, %u kept\n",
+               stats.hits, stats.misses, stats.evictions, keep.hits);
+        keep.hits = 0;
+        if (keep.buf != NULL)
+            keep.nr = cache_export(cache, keep.id, keep.buf,
+                                   VOLUME_KEEP_SECS);
+    }
+
     cache = NULL;
     metadata_addr = NULL;
+    ra.buf = NULL;
+    ra.next = ~0;
 }
 
 void volume_cache_metadata_only(FIL *fp)
@@ -40,10 +238,24 @@ void volume_cache_metadata_only(FIL *fp)
     /* All metadata is accessed via the per-filesystem "sector window". */
     metadata_addr = fp->obj.fs->win;
 }
+
+void volume_set_writeback(FATFS *fs)
+{
+    if (wb.dirty) {
+        start_op();
+        (void)wb_flush();
+        end_op();
+    }
+    wb.win = fs ? fs->win : NULL;
+    wb.dirty = FALSE;
+}
 #endif
 
 DSTATUS disk_initialize(BYTE pdrv)
 {
+    /* Kept sectors may belong to a different volume. */
+    keep.nr = 0;
+
     /* Default to USB if inserted. */
     vol_ops = &usb_ops;
     if (!(usb_ops.initialize(pdrv) & STA_NOINIT))
@@ -58,25 +270,10 @@ DSTATUS disk_initialize(BYTE pdrv)
     }
 
 out:
+    volume_readonly_update();
     return disk_status(pdrv);
 }
 
-static inline void start_op(void)
-{
-    ASSERT(!inprogress);
-    inprogress = TRUE;
-}
-
-static inline void end_op(void)
-{
-    ASSERT(inprogress);
-    inprogress = FALSE;
-    if (interrupt) {
-        thread_yield();
-        interrupt = FALSE;
-    }
-}
-
 DSTATUS disk_status(BYTE pdrv)
 {
     DSTATUS status;
@@ -91,18 +288,35 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
     DRESULT res;
     const void *p;
     struct cache *c;
+    bool_t sequential;
+    int i;
+
+    if ((cache == NULL) && (count == 1)
+        && ((i = keep_find(sector, 1)) >= 0)) {
+        memcpy(buff, keep.buf + i * SECSZ, SECSZ);
+        keep.hits++;
+        return RES_OK;
+    }
 
     if (((c = cache) == NULL)
         || (metadata_addr && (buff != metadata_addr))) {
         start_op();
-        res = vol_ops->read(pdrv, buff, sector, count);
+        res = xfer_read(pdrv, buff, sector, count, NULL);
         end_op();
         return res;
     }
 
+    sequential = (sector == ra.next);
+    ra.next = sector + count;
+
     while (count) {
         if ((p = cache_lookup(c, sector)) == NULL)
             goto read_tail;
+        if (keep.nr && ((i = keep_find(sector, 1)) >= 0)) {
+            /* First read of a seeded sector. */
+            keep.hits++;
+            keep_drop(i);
+        }
         memcpy(buff, p, SECSZ);
         sector++;
         count--;
@@ -112,9 +326,20 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
 
 read_tail:
     start_op();
-    res = vol_ops->read(pdrv, buff, sector, count);
-    if (res == RES_OK)
-        cache_update_N(c, sector, buff, count);
+    wb_poll();
+    res = RES_ERROR;
+    if ((ra.buf != NULL) && !metadata_addr
+        && sequential && (count < ra.nr)) {
+        /* Sequential: fill the whole window. Retry without read-ahead on
+         * error, in case the window ran off the end of the volume. */
+        res = vol_ops->read(pdrv, ra.buf, sector, ra.nr);
+        if (res == RES_OK) {
+            cache_fill_N(c, sector, ra.buf, ra.nr);
+            memcpy(buff, ra.buf, count * SECSZ);
+        }
+    }
+    if (res != RES_OK)
+        res = xfer_read(pdrv, buff, sector, count, c);
     end_op();
     return res;
 }
@@ -122,12 +347,37 @@ read_tail:
 DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
 {
     DRESULT res;
-    struct cache *c;
+    struct cache *c = cache;
+    int i;
+
+    /* Kept sectors must not go stale. */
+    while ((i = keep_find(sector, count)) >= 0)
+        keep_drop(i);
+
     start_op();
-    res = vol_ops->write(pdrv, buff, sector, count);
-    if ((res == RES_OK) && ((c = cache) != NULL)
-        && (!metadata_addr || (buff == metadata_addr)))
-        cache_update_N(c, sector, buff, count);
+    wb_poll();
+    if ((c != NULL) && (buff == wb.win)) {
+        if (count == 1) {
+            /* Metadata sector: hold it dirty in the cache. If too many
+             * sectors are dirty already, write those back first. */
+            res = RES_OK;
+            if (!cache_write(c, sector, buff)
+                && ((res = wb_flush()) == RES_OK))
+                (void)cache_write(c, sector, buff);
+            if ((res == RES_OK) && !wb.dirty) {
+                wb.dirty = TRUE;
+                wb.pdrv = pdrv;
+                wb.since = time_now();
+            }
+            goto out;
+        }
+        /* Multi-sector metadata write: Must follow older dirty metadata. */
+        if ((res = wb_flush()) != RES_OK)
+            goto out;
+    }
+    res = xfer_write(pdrv, buff, sector, count,
+                     (!metadata_addr || (buff == metadata_addr)) ? c : NULL);
+out:
     end_op();
     return res;
 }
@@ -136,7 +386,9 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE ctrl, void *buff)
 {
     DRESULT res;
     start_op();
-    res = vol_ops->ioctl(pdrv, ctrl, buff);
+    res = ((ctrl == CTRL_SYNC) && wb.dirty) ? wb_flush() : RES_OK;
+    if (res == RES_OK)
+        res = vol_ops->ioctl(pdrv, ctrl, buff);
     end_op();
     return res;
 }
@@ -151,11 +403,12 @@ bool_t volume_connected(void)
 
 bool_t volume_readonly(void)
 {
-    bool_t ret;
-    start_op();
-    ret = vol_ops->readonly();
-    end_op();
-    return ret;
+    return readonly;
+}
+
+void volume_readonly_update(void)
+{
+    readonly = vol_ops->readonly();
 }
 
 bool_t volume_interrupt(void)